@@ -0,0 +1,18 @@
+# Compares two result files of bench/run.rb or bench/micro.rb.
+#
+#   ruby bench/compare.rb before.json after.json
+
+require 'json'
+
+abort 'Usage: ruby bench/compare.rb before.json after.json' unless ARGV.size == 2
+before, after = ARGV.map { |path| JSON.parse(File.read(path)) }
+
+puts format('%-32s %12s %12s %8s %12s %12s', 'scenario', 'ops/s', 'ops/s', 'change', 'allocs/row', 'allocs/row')
+after['scenarios'].each do |name, b|
+  a = before['scenarios'][name]
+  next unless a
+  change = 100.0 * (b['ops_per_sec'] - a['ops_per_sec']) / a['ops_per_sec']
+  noise = [a['spread_pct'], b['spread_pct']].max
+  puts format('%-32s %12.1f %12.1f %+7.1f%% %12s %12s%s', name, a['ops_per_sec'], b['ops_per_sec'], change,
+              a['allocations_per_row'], b['allocations_per_row'], change.abs < noise ? '  (within noise)' : '')
+end
@@ -0,0 +1,123 @@
+require 'json'
+require 'optparse'
+require 'time'
+
+module FbBench
+  # Parses the options shared by the benchmark scripts; the block adds more.
+  def self.options(script, defaults = {})
+    options = { time: 5.0, samples: 5, only: nil, out: nil }.merge(defaults)
+    OptionParser.new do |o|
+      o.banner = "Usage: ruby bench/#{script} [options]"
+      o.on('--out FILE', 'write JSON results to FILE') { |v| options[:out] = v }
+      o.on('--only REGEXP', 'run scenarios whose name or group matches') { |v| options[:only] = v }
+      o.on('--time SECONDS', Float, "measuring time per scenario (#{options[:time]})") { |v| options[:time] = v }
+      o.on('--samples N', Integer, "samples per scenario, the median is reported (#{options[:samples]})") { |v| options[:samples] = v }
+      yield o, options if block_given?
+    end.parse!
+    options
+  end
+
+  # Writes the results and a description of the run as JSON to
+  # options[:out], or to stdout.
+  def self.report(results, options, **meta)
+    commit = `git -C #{File.join(File.dirname(__FILE__), '..')} rev-parse HEAD 2>/dev/null`.strip
+    report = {
+      commit: commit.empty? ? nil : commit,
+      ruby: RUBY_DESCRIPTION,
+      **meta,
+      time: Time.now.utc.iso8601,
+      options: options.reject { |k, _| k == :out },
+      scenarios: results
+    }
+    json = JSON.pretty_generate(report)
+    if options[:out]
+      File.write(options[:out], json + "\n")
+    else
+      puts json
+    end
+  end
+
+  # Runs each scenario for a fixed time, split into samples, and reports the
+  # median sample. A scenario block performs one operation and returns the
+  # number of rows it handled.
+  class Harness
+    Scenario = Struct.new(:name, :group, :block)
+
+    def initialize(time: 5.0, samples: 5, only: nil, out: $stderr)
+      @time = time
+      @samples = samples
+      @only = only && Regexp.new(only)
+      @out = out
+      @scenarios = []
+      GC::Profiler.enable unless GC.stat.key?(:time)
+    end
+
+    def scenario(name, group, &block)
+      @scenarios << Scenario.new(name, group, block)
+    end
+
+    def run
+      results = {}
+      @scenarios.each do |s|
+        next if @only && s.name !~ @only && s.group !~ @only
+        results[s.name] = measure(s).merge(group: s.group)
+        @out.puts format('%-32s %12.1f ops/s %14.1f rows/s %8.1f allocs/row',
+                         s.name, results[s.name][:ops_per_sec], results[s.name][:rows_per_sec],
+                         results[s.name][:allocations_per_row])
+      end
+      results
+    end
+
+    private
+
+    def clock
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    def gc_time_ms
+      GC.stat.key?(:time) ? GC.stat(:time) : GC::Profiler.total_time * 1000
+    end
+
+    def measure(scenario)
+      scenario.block.call # warm up caches and the statement cache
+      samples = Array.new(@samples) { sample(scenario.block, @time / @samples) }
+      median = samples.sort_by { |s| s[:ops] / s[:seconds] }[samples.size / 2]
+      ops = samples.sum { |s| s[:ops] }
+      rows = samples.sum { |s| s[:rows] }
+      rates = samples.map { |s| s[:ops] / s[:seconds] }
+      {
+        ops_per_sec: (median[:ops] / median[:seconds]).round(1),
+        rows_per_sec: (median[:rows] / median[:seconds]).round(1),
+        allocations_per_op: (samples.sum { |s| s[:allocations] }.fdiv(ops)).round(2),
+        allocations_per_row: rows.zero? ? nil : (samples.sum { |s| s[:allocations] }.fdiv(rows)).round(2),
+        gc_time_ms: samples.sum { |s| s[:gc_ms] }.round(1),
+        gc_runs: samples.sum { |s| s[:gc_runs] },
+        spread_pct: (100.0 * (rates.max - rates.min) / rates.max).round(1),
+        ops: ops,
+        rows: rows,
+        seconds: samples.sum { |s| s[:seconds] }.round(3)
+      }
+    end
+
+    def sample(block, seconds)
+      GC.start
+      gc_ms = gc_time_ms
+      gc_runs = GC.count
+      allocations = GC.stat(:total_allocated_objects)
+      ops = rows = 0
+      started = clock
+      deadline = started + seconds
+      loop do
+        rows += block.call
+        ops += 1
+        break if clock >= deadline
+      end
+      elapsed = clock - started
+      {
+        ops: ops, rows: rows, seconds: elapsed,
+        allocations: GC.stat(:total_allocated_objects) - allocations,
+        gc_ms: gc_time_ms - gc_ms, gc_runs: GC.count - gc_runs
+      }
+    end
+  end
+end
@@ -0,0 +1,103 @@
+# Server-free microbenchmarks of row decoding and parameter binding.
+#
+#   rake bench:micro
+#   LD_LIBRARY_PATH=tmp/stub ruby -Itmp/stub bench/micro.rb [--out results.json] [--only REGEXP] [--time SECONDS] [--rows N]
+#
+# Needs fb built against bench/stub/fbclient_stub.c, which rake bench:stub
+# does in tmp/stub. Rows come from memory, so the numbers measure the
+# extension alone and repeat from run to run. Each statement sets the shape
+# of its result or parameters with a leading /*stub ...*/ comment.
+
+$: << File.join(File.dirname(__FILE__), '..')
+$: << File.dirname(__FILE__)
+
+require 'bigdecimal'
+require 'date'
+require 'fb'
+require 'harness'
+
+options = FbBench.options('micro.rb', time: 2.0, rows: 10_000) do |o, opts|
+  o.on('--rows N', Integer, 'rows per fetch scenario (10000)') { |v| opts[:rows] = v }
+end
+
+begin
+  conn = Fb::Database.new(database: 'stub:', username: 'sysdba', password: 'masterkey').connect
+rescue Fb::Error => e
+  abort "bench/micro.rb needs fb built against the stub client library (rake bench:stub): #{e.message.strip}"
+end
+
+ROWS = options[:rows]
+WIDE = (1..4).map { 'int,varchar(40),double,bigint,numeric(18,4)' }.join(',')
+TYPES = %w[smallint int bigint double numeric(9,2) numeric(18,4) char(20) varchar(40) date time timestamp boolean]
+
+def select(shape, rows = ROWS)
+  "/*stub rows=#{rows} #{shape} */ SELECT * FROM stub"
+end
+
+def insert(params)
+  "/*stub params=#{params} */ INSERT INTO stub VALUES (#{params.split(/,(?![^(]*\))/).map { '?' }.join(', ')})"
+end
+
+bench = FbBench::Harness.new(time: options[:time], samples: options[:samples], only: options[:only])
+
+# fetch: fb_cursor_fetch and the row containers
+narrow = select('cols=int,int')
+wide = select("cols=#{WIDE}", ROWS / 5)
+bench.scenario('fetchall_narrow', 'fetch') { conn.query(narrow).size }
+bench.scenario('fetchall_wide', 'fetch') { conn.query(wide).size }
+bench.scenario('fetchall_hash_narrow', 'fetch') { conn.query(:hash, narrow).size }
+bench.scenario('fetchall_hash_wide', 'fetch') { conn.query(:hash, wide).size }
+bench.scenario('each_reuse_narrow', 'fetch') do
+  rows = 0
+  conn.execute(narrow) { |cursor| cursor.each_reuse { rows += 1 } }
+  rows
+end
+bench.scenario('fetchall_nulls', 'fetch') { conn.query(select("cols=#{WIDE} nulls=2", ROWS / 5)).size }
+
+# decode: one column of each type, so its conversion dominates
+TYPES.each do |type|
+  sql = select("cols=#{type}")
+  bench.scenario("decode_#{type.tr('(,)', '_')}".chomp('_'), 'decode') { conn.query(sql).size }
+end
+blob_small = select('cols=blob blob=100', ROWS / 10)
+blob_large = select('cols=blob blob=65536', 100)
+bench.scenario('decode_blob_100', 'decode') { conn.query(blob_small).size }
+bench.scenario('decode_blob_64k', 'decode') { conn.query(blob_large).size }
+
+# bind: fb_cursor_set_inputparams, one statement per row or one batch of 100
+now = Time.at(1_700_000_000)
+{
+  'int' => ['int', 1], 'bigint' => ['bigint', 2**40], 'double' => ['double', 1.25],
+  'numeric' => ['numeric(18,4)', BigDecimal('12345.6789')], 'numeric_float' => ['numeric(18,4)', 12345.6789],
+  'varchar' => ['varchar(40)', 'a short string'], 'date' => ['date', Date.new(2024, 1, 1)],
+  'timestamp' => ['timestamp', now], 'blob_64k' => ['blob', Random.new(1).bytes(64 * 1024)],
+  'mixed' => ['int,varchar(40),numeric(18,2),timestamp', 1, 'name', BigDecimal('10.25'), now]
+}.each do |name, (params, *row)|
+  sql = insert(params)
+  bench.scenario("bind_#{name}", 'bind') do
+    conn.execute(sql, *row)
+    1
+  end
+end
+batch_sql = insert('int,varchar(40),numeric(18,2),timestamp')
+batch = (1..100).map { |i| [i, "name #{i}", BigDecimal("#{i}.25"), now + i] }
+bench.scenario('bind_mixed_batch_100', 'bind') do
+  conn.execute(batch_sql, batch)
+  batch.size
+end
+
+# statement: the per-call cost of prepare, execute and the transaction around them
+one_row = select('cols=int', 1)
+bench.scenario('query_one_row', 'statement') { conn.query(one_row).size }
+bench.scenario('execute_no_params', 'statement') do
+  conn.execute('UPDATE stub SET n = 1')
+  1
+end
+bench.scenario('transaction_one_row', 'statement') do
+  conn.transaction { conn.query(one_row).size }
+end
+
+results = bench.run
+conn.close
+
+FbBench.report(results, options, database: 'stub')
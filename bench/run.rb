@@ -0,0 +1,126 @@
+# Benchmarks of the fetch, bind, blob and transaction paths.
+#
+#   ruby bench/run.rb [--out results.json] [--only REGEXP] [--time SECONDS] [--rows N]
+#
+# Runs against a scratch database on FIREBIRD_HOST (localhost) in
+# FIREBIRD_DATA_DIR (/tmp), or the database named by FB_BENCH_DATABASE, e.g.
+# an embedded path. Results are written as JSON to --out, or to stdout.
+
+$: << File.join(File.dirname(__FILE__), '..')
+$: << File.dirname(__FILE__)
+
+require 'bigdecimal'
+require 'date'
+require 'time'
+require 'fb'
+require 'harness'
+
+options = FbBench.options('run.rb', rows: 10_000) do |o, opts|
+  o.on('--rows N', Integer, 'rows in the fetch tables (10000)') { |v| opts[:rows] = v }
+end
+
+data_dir = ENV['FIREBIRD_DATA_DIR'] || '/tmp'
+host = ENV['FIREBIRD_HOST'] || 'localhost'
+parms = {
+  database: ENV['FB_BENCH_DATABASE'] || "#{host}:#{File.join(data_dir, 'fb_bench.fdb')}",
+  username: ENV['FIREBIRD_USER'] || 'sysdba',
+  password: ENV['FIREBIRD_PASSWORD'] || 'masterkey',
+  charset: 'UTF8'
+}
+
+begin
+  Fb::Database.new(parms).drop
+rescue Fb::Error
+  nil
+end
+conn = Fb::Database.create(parms).connect
+
+ROWS = options[:rows]
+WIDE_ROWS = ROWS / 5
+BLOB_ROWS = 100
+BLOB = Random.new(1).bytes(64 * 1024)
+
+conn.execute('CREATE TABLE bench_narrow (id INTEGER NOT NULL PRIMARY KEY, n INTEGER)')
+conn.execute('CREATE TABLE bench_wide (id INTEGER NOT NULL PRIMARY KEY, ' +
+             (1..5).map { |i| "s#{i} VARCHAR(40), i#{i} INTEGER, f#{i} DOUBLE PRECISION, b#{i} BIGINT" }.join(', ') + ')')
+conn.execute('CREATE TABLE bench_decode (id INTEGER NOT NULL PRIMARY KEY, amount NUMERIC(18,4), ts TIMESTAMP, d DATE)')
+conn.execute('CREATE TABLE bench_blob (id INTEGER NOT NULL PRIMARY KEY, data BLOB SUB_TYPE 0)')
+conn.execute('CREATE TABLE bench_insert (id INTEGER, name VARCHAR(40), amount NUMERIC(18,2), ts TIMESTAMP)')
+conn.execute('CREATE TABLE bench_blob_insert (id INTEGER, data BLOB SUB_TYPE 0)')
+
+now = Time.at(1_700_000_000)
+conn.transaction do
+  conn.execute('INSERT INTO bench_narrow VALUES (?, ?)', (1..ROWS).map { |i| [i, i * 7] })
+  conn.execute("INSERT INTO bench_wide VALUES (?#{', ?' * 20})",
+               (1..WIDE_ROWS).map { |i| [i] + (1..5).flat_map { |j| ["value #{i}-#{j}", i * j, i / (j + 0.5), i * 1_000_003 * j] } })
+  conn.execute('INSERT INTO bench_decode VALUES (?, ?, ?, ?)',
+               (1..ROWS).map { |i| [i, BigDecimal("#{i}.1234"), now + i, Date.new(2024, 1, 1) + i % 365] })
+  conn.execute('INSERT INTO bench_blob VALUES (?, ?)', (1..BLOB_ROWS).map { |i| [i, BLOB] })
+end
+
+bench = FbBench::Harness.new(time: options[:time], samples: options[:samples], only: options[:only])
+
+# fetch: narrow vs wide rows, and the ways of reading a result set
+bench.scenario('fetchall_narrow', 'fetch') { conn.query('SELECT id, n FROM bench_narrow').size }
+bench.scenario('fetchall_wide', 'fetch') { conn.query('SELECT * FROM bench_wide').size }
+bench.scenario('fetch_loop_narrow', 'fetch') do
+  rows = 0
+  conn.execute('SELECT id, n FROM bench_narrow') { |cursor| rows += 1 while cursor.fetch }
+  rows
+end
+bench.scenario('each_narrow', 'fetch') do
+  rows = 0
+  conn.execute('SELECT id, n FROM bench_narrow') { |cursor| cursor.each { rows += 1 } }
+  rows
+end
+bench.scenario('each_reuse_narrow', 'fetch') do
+  rows = 0
+  conn.execute('SELECT id, n FROM bench_narrow') { |cursor| cursor.each_reuse { rows += 1 } }
+  rows
+end
+bench.scenario('fetchall_hash_narrow', 'fetch') { conn.query(:hash, 'SELECT id, n FROM bench_narrow').size }
+bench.scenario('fetchall_hash_wide', 'fetch') { conn.query(:hash, 'SELECT * FROM bench_wide').size }
+
+# decode: column types with costly conversions
+bench.scenario('decode_numeric', 'decode') { conn.query('SELECT amount FROM bench_decode').size }
+bench.scenario('decode_timestamp', 'decode') { conn.query('SELECT ts FROM bench_decode').size }
+bench.scenario('decode_date', 'decode') { conn.query('SELECT d FROM bench_decode').size }
+
+# bind: one row per statement, so parameter conversion and round trips dominate
+id = 0
+bench.scenario('bind_integer', 'bind') do
+  id = id % ROWS + 1
+  conn.query('SELECT n FROM bench_narrow WHERE id = ?', id).size
+end
+bench.scenario('bind_mixed', 'bind') do
+  id = id % ROWS + 1
+  conn.query('SELECT id FROM bench_decode WHERE id = ? AND amount > ? AND ts > ? AND d >= ?',
+             id, BigDecimal('0.5'), now, Date.new(2024, 1, 1)).size
+end
+
+# insert: autocommit vs explicit transactions vs batches
+insert_sql = 'INSERT INTO bench_insert VALUES (?, ?, ?, ?)'
+insert_rows = (1..100).map { |i| [i, "name #{i}", BigDecimal("#{i}.25"), now + i] }
+bench.scenario('insert_autocommit', 'transaction') { conn.execute(insert_sql, *insert_rows[0]) }
+bench.scenario('insert_transaction_each', 'transaction') do
+  conn.transaction { conn.execute(insert_sql, *insert_rows[0]) }
+  1
+end
+bench.scenario('insert_transaction_100', 'transaction') do
+  conn.transaction { insert_rows.each { |row| conn.execute(insert_sql, *row) } }
+  insert_rows.size
+end
+bench.scenario('insert_batch_100', 'transaction') do
+  conn.transaction { conn.execute(insert_sql, insert_rows) }
+  insert_rows.size
+end
+
+# blob: 64 KB values
+bench.scenario('blob_read', 'blob') { conn.query('SELECT data FROM bench_blob').size }
+bench.scenario('blob_write', 'blob') { conn.execute('INSERT INTO bench_blob_insert VALUES (?, ?)', 1, BLOB) }
+
+results = bench.run
+version = conn.query("SELECT rdb$get_context('SYSTEM', 'ENGINE_VERSION') FROM rdb$database")[0][0] rescue nil
+conn.drop
+
+FbBench.report(results, options, server: version, database: parms[:database])
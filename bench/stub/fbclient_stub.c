@@ -0,0 +1,1217 @@
+/*
+ * fbclient_stub.c
+ * An in-memory stand-in for the Firebird client library, for benchmarking
+ * and profiling the fb extension without a server. Built as libfbclient.so
+ * and linked in place of the real library by rake bench:micro.
+ *
+ * Result sets are synthetic and deterministic. Their shape comes from the
+ * database string given to Fb::Database (everything after "stub:"), and can
+ * be overridden per statement with a leading comment that starts with
+ * "stub", e.g.
+ *
+ *   Fb::Database.new(database: "stub:rows=100000;cols=int,varchar(40),numeric(18,2)")
+ *   conn.query("/" "*stub rows=10 cols=timestamp,blob blob=8192 *" "/ SELECT ...")
+ *
+ * Settings:
+ *   rows=N        rows returned by every SELECT (default 10)
+ *   cols=LIST     column types: smallint, int, bigint, int128, float, double,
+ *                 numeric(p,s), char(n), varchar(n), date, time, timestamp,
+ *                 boolean, blob (default int,varchar(32))
+ *   params=LIST   parameter types; default is one varchar(255) per '?'
+ *   blob=N        bytes in each BLOB value (default 100)
+ *   nulls=K       every K-th row has NULL in every column (default 0, never)
+ *   affected=N    rows affected reported for INSERT/UPDATE/DELETE (default 1)
+ *   latency=US    simulated round trip, in microseconds, added to attach,
+ *                 prepare, execute and commit (default 0)
+ *
+ * Events, trace sessions, limbo transactions and generators are answered
+ * with canned data. Handles are allocated under a lock, since the driver
+ * calls the client from its worker threads.
+ */
+
+#include <ibase.h>
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	STUB_MAX_HANDLES	4096
+#define	STUB_MAX_COLS		64
+#define	STUB_SQL_MAX		4096
+#define	STUB_SEGMENT		4096
+#define	STUB_ERROR		335544321L	/* isc_arith_except, any code will do */
+
+typedef struct {
+	short sqltype;
+	short sqlsubtype;
+	short sqlscale;
+	short sqllen;
+	char name[32];
+} stub_col;
+
+typedef struct {
+	long rows;
+	long blob_size;
+	long nulls;
+	long affected;
+	long latency;
+	int ncols;
+	stub_col cols[STUB_MAX_COLS];
+	int nparams;
+	stub_col params[STUB_MAX_COLS];
+} stub_config;
+
+typedef struct {
+	int used;
+	isc_db_handle db;
+	int type;
+	long row;
+	int open;
+	long gen_increment;	/* GEN_ID(g, n) statement: n */
+	stub_config config;
+} stub_stmt;
+
+typedef struct {
+	int used;
+	long remaining;
+	long offset;
+	long size;
+} stub_blob;
+
+static stub_config stub_db_config[STUB_MAX_HANDLES];
+static int stub_db_used[STUB_MAX_HANDLES];
+static stub_stmt stub_stmts[STUB_MAX_HANDLES];
+static stub_blob stub_blobs[STUB_MAX_HANDLES];
+static unsigned int stub_next_tr = 1;
+static pthread_mutex_t stub_handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void stub_ok(ISC_STATUS *status)
+{
+	status[0] = isc_arg_gds;
+	status[1] = 0;
+	status[2] = isc_arg_end;
+}
+
+static ISC_STATUS stub_fail(ISC_STATUS *status, const char *msg)
+{
+	status[0] = isc_arg_gds;
+	status[1] = STUB_ERROR;
+	status[2] = isc_arg_string;
+	status[3] = (ISC_STATUS)msg;
+	status[4] = isc_arg_end;
+	return status[1];
+}
+
+static unsigned int stub_alloc(int *used, int size)
+{
+	int i;
+	pthread_mutex_lock(&stub_handle_lock);
+	for (i = 1; i < size; i++) {
+		if (!used[i]) {
+			used[i] = 1;
+			pthread_mutex_unlock(&stub_handle_lock);
+			return (unsigned int)i;
+		}
+	}
+	pthread_mutex_unlock(&stub_handle_lock);
+	return 0;
+}
+
+static unsigned int stub_next_transaction(void)
+{
+	return __sync_fetch_and_add(&stub_next_tr, 1);
+}
+
+static void stub_round_trip(long latency)
+{
+	if (latency > 0) usleep((useconds_t)latency);
+}
+
+/* configuration parsing */
+
+static int stub_parse_type(const char *s, int len, stub_col *col)
+{
+	char word[32];
+	int a = 0, b = 0, n = 0;
+
+	while (n < len && n < 31 && isalnum((unsigned char)s[n])) {
+		word[n] = (char)tolower((unsigned char)s[n]);
+		n++;
+	}
+	word[n] = '\0';
+	if (n < len && s[n] == '(') {
+		sscanf(s + n, "(%d,%d)", &a, &b);
+	}
+	memset(col, 0, sizeof(*col));
+	if (!strcmp(word, "smallint")) {
+		col->sqltype = SQL_SHORT; col->sqllen = sizeof(ISC_SHORT);
+	} else if (!strcmp(word, "int") || !strcmp(word, "integer")) {
+		col->sqltype = SQL_LONG; col->sqllen = sizeof(ISC_LONG);
+	} else if (!strcmp(word, "bigint")) {
+		col->sqltype = SQL_INT64; col->sqllen = sizeof(ISC_INT64);
+#ifdef SQL_INT128
+	} else if (!strcmp(word, "int128")) {
+		col->sqltype = SQL_INT128; col->sqllen = 16;
+#endif
+	} else if (!strcmp(word, "float")) {
+		col->sqltype = SQL_FLOAT; col->sqllen = sizeof(float);
+	} else if (!strcmp(word, "double")) {
+		col->sqltype = SQL_DOUBLE; col->sqllen = sizeof(double);
+	} else if (!strcmp(word, "numeric") || !strcmp(word, "decimal")) {
+		if (a == 0) a = 18;
+		col->sqltype = a > 9 ? SQL_INT64 : SQL_LONG;
+		col->sqllen = a > 9 ? sizeof(ISC_INT64) : sizeof(ISC_LONG);
+		col->sqlsubtype = 1;
+		col->sqlscale = (short)-b;
+	} else if (!strcmp(word, "char")) {
+		col->sqltype = SQL_TEXT; col->sqllen = (short)(a ? a : 1);
+	} else if (!strcmp(word, "varchar")) {
+		col->sqltype = SQL_VARYING; col->sqllen = (short)(a ? a : 255);
+	} else if (!strcmp(word, "date")) {
+		col->sqltype = SQL_TYPE_DATE; col->sqllen = sizeof(ISC_DATE);
+	} else if (!strcmp(word, "time")) {
+		col->sqltype = SQL_TYPE_TIME; col->sqllen = sizeof(ISC_TIME);
+	} else if (!strcmp(word, "timestamp")) {
+		col->sqltype = SQL_TIMESTAMP; col->sqllen = sizeof(ISC_TIMESTAMP);
+#ifdef SQL_BOOLEAN
+	} else if (!strcmp(word, "boolean")) {
+		col->sqltype = SQL_BOOLEAN; col->sqllen = 1;
+#endif
+	} else if (!strcmp(word, "blob")) {
+		col->sqltype = SQL_BLOB; col->sqllen = sizeof(ISC_QUAD); col->sqlsubtype = 1;
+	} else {
+		return 0;
+	}
+	col->sqltype |= 1;
+	return 1;
+}
+
+static int stub_parse_types(const char *s, stub_col *cols)
+{
+	int n = 0;
+	while (*s && n < STUB_MAX_COLS) {
+		const char *end = s;
+		int depth = 0;
+		while (*end && !(depth == 0 && (*end == ',' || *end == ';' || isspace((unsigned char)*end)))) {
+			if (*end == '(') depth++;
+			if (*end == ')') depth--;
+			end++;
+		}
+		if (stub_parse_type(s, (int)(end - s), &cols[n])) {
+			snprintf(cols[n].name, sizeof(cols[n].name), "C%d", n + 1);
+			n++;
+		}
+		if (*end != ',') break;
+		s = end + 1;
+	}
+	return n;
+}
+
+static void stub_parse_config(stub_config *config, const char *s, const char *end)
+{
+	while (s < end && *s) {
+		char key[16];
+		int n = 0;
+		while (s < end && (isspace((unsigned char)*s) || *s == ';')) s++;
+		while (s < end && n < 15 && isalpha((unsigned char)*s)) key[n++] = *s++;
+		key[n] = '\0';
+		if (s >= end || *s != '=') {
+			while (s < end && *s && !isspace((unsigned char)*s) && *s != ';') s++;
+			continue;
+		}
+		s++;
+		if (!strcmp(key, "rows")) config->rows = strtol(s, NULL, 10);
+		else if (!strcmp(key, "blob")) config->blob_size = strtol(s, NULL, 10);
+		else if (!strcmp(key, "nulls")) config->nulls = strtol(s, NULL, 10);
+		else if (!strcmp(key, "affected")) config->affected = strtol(s, NULL, 10);
+		else if (!strcmp(key, "latency")) config->latency = strtol(s, NULL, 10);
+		else if (!strcmp(key, "cols")) config->ncols = stub_parse_types(s, config->cols);
+		else if (!strcmp(key, "params")) config->nparams = stub_parse_types(s, config->params);
+		while (s < end && *s && !isspace((unsigned char)*s) && *s != ';') {
+			if (*s == '(') {
+				while (s < end && *s && *s != ')') s++;
+			}
+			s++;
+		}
+	}
+}
+
+static void stub_default_config(stub_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->rows = 10;
+	config->blob_size = 100;
+	config->affected = 1;
+	config->ncols = stub_parse_types("int,varchar(32)", config->cols);
+	config->nparams = -1;
+}
+
+/* attachments */
+
+ISC_STATUS ISC_EXPORT isc_attach_database(ISC_STATUS *status, short length, const ISC_SCHAR *name,
+	isc_db_handle *db, short dpb_length, const ISC_SCHAR *dpb)
+{
+	unsigned int h;
+	const char *s = name;
+	h = stub_alloc(stub_db_used, STUB_MAX_HANDLES);
+	if (!h) return stub_fail(status, "stub: too many attachments");
+	stub_default_config(&stub_db_config[h]);
+	if (!strncmp(s, "stub:", 5)) s += 5;
+	stub_parse_config(&stub_db_config[h], s, s + strlen(s));
+	stub_round_trip(stub_db_config[h].latency);
+	*db = h;
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_detach_database(ISC_STATUS *status, isc_db_handle *db)
+{
+	if (*db && *db < STUB_MAX_HANDLES) stub_db_used[*db] = 0;
+	*db = 0;
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_drop_database(ISC_STATUS *status, isc_db_handle *db)
+{
+	return isc_detach_database(status, db);
+}
+
+static char *stub_put_int(char *p, char item, ISC_LONG value)
+{
+	*p++ = item;
+	*p++ = 4;
+	*p++ = 0;
+	*p++ = (char)(value & 0xff);
+	*p++ = (char)((value >> 8) & 0xff);
+	*p++ = (char)((value >> 16) & 0xff);
+	*p++ = (char)((value >> 24) & 0xff);
+	return p;
+}
+
+/* per-attachment table counters (isc_info_read_seq_count ..), all charged to relation 1 */
+static long stub_io[STUB_MAX_HANDLES][8];
+
+ISC_STATUS ISC_EXPORT isc_database_info(ISC_STATUS *status, isc_db_handle *db, short item_length,
+	const ISC_SCHAR *items, short buffer_length, ISC_SCHAR *buffer)
+{
+	char *p = buffer;
+	short i;
+	for (i = 0; i < item_length && p + 8 < buffer + buffer_length; i++) {
+		switch (items[i]) {
+			case isc_info_db_sql_dialect:
+				*p++ = isc_info_db_sql_dialect;
+				*p++ = 1;
+				*p++ = 0;
+				*p++ = 3;
+				break;
+			case isc_info_end:
+				break;
+			case isc_info_read_seq_count: case isc_info_read_idx_count: case isc_info_insert_count:
+			case isc_info_update_count: case isc_info_delete_count: case isc_info_backout_count:
+			case isc_info_purge_count: case isc_info_expunge_count: {
+				long n = stub_io[*db < STUB_MAX_HANDLES ? *db : 0][items[i] - isc_info_read_seq_count];
+				*p++ = items[i];
+				if (!n) { *p++ = 0; *p++ = 0; break; }
+				*p++ = 6; *p++ = 0;
+				*p++ = 1; *p++ = 0;
+				*p++ = (char)(n & 0xff); *p++ = (char)((n >> 8) & 0xff);
+				*p++ = (char)((n >> 16) & 0xff); *p++ = (char)((n >> 24) & 0xff);
+				break;
+			}
+			case isc_info_limbo:
+				/* two transactions in limbo: 7 and 2^32 + 1 */
+				p = stub_put_int(p, isc_info_limbo, 7);
+				*p++ = isc_info_limbo; *p++ = 8; *p++ = 0;
+				*p++ = 1; *p++ = 0; *p++ = 0; *p++ = 0; *p++ = 1; *p++ = 0; *p++ = 0; *p++ = 0;
+				break;
+			default:
+				p = stub_put_int(p, items[i], 0);
+				break;
+		}
+	}
+	*p = isc_info_end;
+	stub_ok(status);
+	return 0;
+}
+
+/* transactions */
+
+static long long stub_generator;	/* the generator behind every GEN_ID */
+
+ISC_STATUS ISC_EXPORT_VARARG isc_start_transaction(ISC_STATUS *status, isc_tr_handle *tr, short count, ...)
+{
+	*tr = stub_next_transaction();
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_start_multiple(ISC_STATUS *status, isc_tr_handle *tr, short count, void *teb)
+{
+	*tr = stub_next_transaction();
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_commit_transaction(ISC_STATUS *status, isc_tr_handle *tr)
+{
+	*tr = 0;
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_commit_retaining(ISC_STATUS *status, isc_tr_handle *tr)
+{
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_rollback_transaction(ISC_STATUS *status, isc_tr_handle *tr)
+{
+	*tr = 0;
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_reconnect_transaction(ISC_STATUS *status, isc_db_handle *db, isc_tr_handle *tr,
+	short length, const ISC_SCHAR *id)
+{
+	if (isc_portable_integer((const ISC_UCHAR *)id, length) != 7) return stub_fail(status, "transaction is not in limbo");
+	*tr = stub_next_transaction();
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_prepare_transaction(ISC_STATUS *status, isc_tr_handle *tr)
+{
+	stub_ok(status);
+	return 0;
+}
+
+/* statements */
+
+static stub_stmt *stub_get_stmt(isc_stmt_handle *stmt)
+{
+	if (!stmt || *stmt == 0 || *stmt >= STUB_MAX_HANDLES || !stub_stmts[*stmt].used) return NULL;
+	return &stub_stmts[*stmt];
+}
+
+ISC_STATUS ISC_EXPORT isc_dsql_alloc_statement2(ISC_STATUS *status, isc_db_handle *db, isc_stmt_handle *stmt)
+{
+	int i;
+	pthread_mutex_lock(&stub_handle_lock);
+	for (i = 1; i < STUB_MAX_HANDLES; i++) {
+		if (!stub_stmts[i].used) {
+			memset(&stub_stmts[i], 0, sizeof(stub_stmt));
+			stub_stmts[i].used = 1;
+			stub_stmts[i].db = *db;
+			pthread_mutex_unlock(&stub_handle_lock);
+			*stmt = i;
+			stub_ok(status);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&stub_handle_lock);
+	return stub_fail(status, "stub: too many statements");
+}
+
+ISC_STATUS ISC_EXPORT isc_dsql_free_statement(ISC_STATUS *status, isc_stmt_handle *stmt, unsigned short option)
+{
+	stub_stmt *st = stub_get_stmt(stmt);
+	if (st) {
+		st->open = 0;
+		if (option == DSQL_drop) {
+			st->used = 0;
+			*stmt = 0;
+		}
+	}
+	stub_ok(status);
+	return 0;
+}
+
+static int stub_starts_with(const char *s, const char *word)
+{
+	size_t n = strlen(word);
+	return !strncasecmp(s, word, n) && !isalnum((unsigned char)s[n]);
+}
+
+static void stub_describe(XSQLDA *sqlda, const stub_col *cols, int n)
+{
+	int i;
+	sqlda->sqld = (short)n;
+	for (i = 0; i < n && i < sqlda->sqln; i++) {
+		XSQLVAR *var = &sqlda->sqlvar[i];
+		var->sqltype = cols[i].sqltype;
+		var->sqlsubtype = cols[i].sqlsubtype;
+		var->sqlscale = cols[i].sqlscale;
+		var->sqllen = cols[i].sqllen;
+		var->sqlname_length = (short)strlen(cols[i].name);
+		memcpy(var->sqlname, cols[i].name, var->sqlname_length + 1);
+		var->aliasname_length = var->sqlname_length;
+		memcpy(var->aliasname, cols[i].name, var->aliasname_length + 1);
+		var->relname_length = 4;
+		memcpy(var->relname, "STUB", 5);
+		var->ownname_length = 0;
+	}
+}
+
+ISC_STATUS ISC_EXPORT isc_dsql_prepare(ISC_STATUS *status, isc_tr_handle *tr, isc_stmt_handle *stmt,
+	unsigned short length, const ISC_SCHAR *sql, unsigned short dialect, XSQLDA *sqlda)
+{
+	stub_stmt *st = stub_get_stmt(stmt);
+	const char *p = sql;
+	const char *q;
+
+	if (!st) return stub_fail(status, "stub: invalid statement handle");
+	st->config = stub_db_config[st->db < STUB_MAX_HANDLES ? st->db : 0];
+	st->row = 0;
+	st->open = 0;
+
+	while (isspace((unsigned char)*p)) p++;
+	if (!strncmp(p, "/*stub", 6)) {
+		const char *end = strstr(p, "*/");
+		if (end) {
+			stub_parse_config(&st->config, p + 6, end);
+			p = end + 2;
+			while (isspace((unsigned char)*p)) p++;
+		}
+	}
+	if (st->config.nparams < 0) {
+		int n = 0;
+		for (q = p; *q && n < STUB_MAX_COLS; q++) {
+			if (*q == '?') {
+				stub_parse_type("varchar(255)", 12, &st->config.params[n]);
+				snprintf(st->config.params[n].name, sizeof(st->config.params[n].name), "P%d", n + 1);
+				n++;
+			}
+		}
+		st->config.nparams = n;
+	}
+
+	st->gen_increment = 0;
+	if ((q = strstr(p, "GEN_ID(")) != NULL && (q = strchr(q, ',')) != NULL) {
+		/* a generator shared by all connections; one BIGINT row */
+		st->gen_increment = strtol(q + 1, NULL, 10);
+		st->config.rows = 1;
+		st->config.ncols = 1;
+		stub_parse_type("bigint", 6, &st->config.cols[0]);
+		strcpy(st->config.cols[0].name, "GEN_ID");
+	}
+	if (stub_starts_with(p, "select") || stub_starts_with(p, "with")) {
+		st->type = isc_info_sql_stmt_select;
+	} else if (stub_starts_with(p, "insert")) {
+		st->type = isc_info_sql_stmt_insert;
+	} else if (stub_starts_with(p, "update")) {
+		st->type = isc_info_sql_stmt_update;
+	} else if (stub_starts_with(p, "delete")) {
+		st->type = isc_info_sql_stmt_delete;
+	} else if (stub_starts_with(p, "savepoint") || stub_starts_with(p, "release") ||
+		(stub_starts_with(p, "rollback") && strstr(p, " TO ")) ) {
+		st->type = isc_info_sql_stmt_savepoint;
+	} else {
+		st->type = isc_info_sql_stmt_ddl;
+	}
+	stub_round_trip(st->config.latency);
+	if (sqlda) {
+		if (st->type == isc_info_sql_stmt_select) {
+			stub_describe(sqlda, st->config.cols, st->config.ncols);
+		} else {
+			sqlda->sqld = 0;
+		}
+	}
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_dsql_describe(ISC_STATUS *status, isc_stmt_handle *stmt, unsigned short dialect, XSQLDA *sqlda)
+{
+	stub_stmt *st = stub_get_stmt(stmt);
+	if (!st) return stub_fail(status, "stub: invalid statement handle");
+	if (st->type == isc_info_sql_stmt_select) {
+		stub_describe(sqlda, st->config.cols, st->config.ncols);
+	} else {
+		sqlda->sqld = 0;
+	}
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_dsql_describe_bind(ISC_STATUS *status, isc_stmt_handle *stmt, unsigned short dialect, XSQLDA *sqlda)
+{
+	stub_stmt *st = stub_get_stmt(stmt);
+	if (!st) return stub_fail(status, "stub: invalid statement handle");
+	stub_describe(sqlda, st->config.params, st->config.nparams);
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_dsql_execute2(ISC_STATUS *status, isc_tr_handle *tr, isc_stmt_handle *stmt,
+	unsigned short dialect, const XSQLDA *in_sqlda, const XSQLDA *out_sqlda)
+{
+	stub_stmt *st = stub_get_stmt(stmt);
+	if (!st) return stub_fail(status, "stub: invalid statement handle");
+	stub_round_trip(st->config.latency);
+	st->row = 0;
+	st->open = (st->type == isc_info_sql_stmt_select);
+	if (st->db < STUB_MAX_HANDLES && st->type >= isc_info_sql_stmt_insert && st->type <= isc_info_sql_stmt_delete) {
+		/* insert 2, update 3, delete 4 */
+		stub_io[st->db][st->type - isc_info_sql_stmt_insert + 2] += st->config.affected;
+	}
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_dsql_execute_immediate(ISC_STATUS *status, isc_db_handle *db, isc_tr_handle *tr,
+	unsigned short length, const ISC_SCHAR *sql, unsigned short dialect, const XSQLDA *sqlda)
+{
+	if (*db == 0 && (stub_starts_with(sql, "create") || stub_starts_with(sql, "CREATE"))) {
+		const char *q = strchr(sql, '\'');
+		char name[STUB_SQL_MAX];
+		size_t n = 0;
+		if (q) {
+			for (q++; *q && *q != '\'' && n < sizeof(name) - 1; q++) name[n++] = *q;
+		}
+		name[n] = '\0';
+		return isc_attach_database(status, 0, name, db, 0, NULL);
+	}
+	stub_ok(status);
+	return 0;
+}
+
+static long stub_days_from_civil(int y, int m, int d)
+{
+	/* days since 1858-11-17, the Firebird epoch */
+	y -= m <= 2;
+	{
+		long era = (y >= 0 ? y : y - 399) / 400;
+		long yoe = y - era * 400;
+		long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+		long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+		return era * 146097 + doe - 719468 + 40587;
+	}
+}
+
+static void stub_civil_from_days(long z, int *y, int *m, int *d)
+{
+	long era, doe, yoe, doy, mp;
+	z += 719468 - 40587;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	*d = (int)(doy - (153 * mp + 2) / 5 + 1);
+	*m = (int)(mp < 10 ? mp + 3 : mp - 9);
+	*y = (int)(yoe + era * 400 + (*m <= 2));
+}
+
+static void stub_fill_value(stub_stmt *st, XSQLVAR *var, long row, int col)
+{
+	short dtp = var->sqltype & ~1;
+	long v = row + 1;
+	if (st->gen_increment) {
+		*(ISC_INT64 *)var->sqldata = __sync_add_and_fetch(&stub_generator, st->gen_increment);
+		return;
+	}
+	switch (dtp) {
+		case SQL_SHORT:
+			*(ISC_SHORT *)var->sqldata = (ISC_SHORT)(v % 32768);
+			break;
+		case SQL_LONG:
+			*(ISC_LONG *)var->sqldata = var->sqlscale ? (ISC_LONG)(v * 101) : (ISC_LONG)v;
+			break;
+		case SQL_INT64:
+			*(ISC_INT64 *)var->sqldata = var->sqlscale ? (ISC_INT64)v * 123457 : (ISC_INT64)v * 1000003;
+			break;
+#ifdef SQL_INT128
+		case SQL_INT128:
+			memset(var->sqldata, 0, 16);
+			*(ISC_INT64 *)var->sqldata = (ISC_INT64)v * 1000003;
+			break;
+#endif
+		case SQL_FLOAT:
+			*(float *)var->sqldata = (float)v * 0.5f;
+			break;
+		case SQL_DOUBLE:
+			*(double *)var->sqldata = (double)v * 0.25;
+			break;
+		case SQL_TEXT: {
+			char buf[64];
+			int n = snprintf(buf, sizeof(buf), "row%ld_col%d", v, col + 1);
+			if (n > var->sqllen) n = var->sqllen;
+			memset(var->sqldata, ' ', var->sqllen);
+			memcpy(var->sqldata, buf, n);
+			break;
+		}
+		case SQL_VARYING: {
+			char buf[64];
+			int n = snprintf(buf, sizeof(buf), "row%ld_col%d", v, col + 1);
+			if (n > var->sqllen) n = var->sqllen;
+			*(short *)var->sqldata = (short)n;
+			memcpy(var->sqldata + sizeof(short), buf, n);
+			break;
+		}
+		case SQL_TYPE_DATE:
+			*(ISC_DATE *)var->sqldata = (ISC_DATE)(stub_days_from_civil(2020, 1, 1) + v % 3650);
+			break;
+		case SQL_TYPE_TIME:
+			*(ISC_TIME *)var->sqldata = (ISC_TIME)((v % 86400) * 10000);
+			break;
+		case SQL_TIMESTAMP:
+			((ISC_TIMESTAMP *)var->sqldata)->timestamp_date = (ISC_DATE)(stub_days_from_civil(2020, 1, 1) + v % 3650);
+			((ISC_TIMESTAMP *)var->sqldata)->timestamp_time = (ISC_TIME)((v % 86400) * 10000);
+			break;
+#ifdef SQL_BOOLEAN
+		case SQL_BOOLEAN:
+			*(char *)var->sqldata = (char)(v & 1);
+			break;
+#endif
+		case SQL_BLOB:
+			((ISC_QUAD *)var->sqldata)->gds_quad_high = (ISC_LONG)v;
+			((ISC_QUAD *)var->sqldata)->gds_quad_low = (ISC_ULONG)st->config.blob_size;
+			break;
+	}
+}
+
+ISC_STATUS ISC_EXPORT isc_dsql_fetch(ISC_STATUS *status, isc_stmt_handle *stmt, unsigned short dialect, const XSQLDA *sqlda)
+{
+	stub_stmt *st = stub_get_stmt(stmt);
+	int i;
+	if (!st || !st->open) return stub_fail(status, "stub: cursor is not open");
+	if (st->row >= st->config.rows) {
+		stub_ok(status);
+		return 100;
+	}
+	if (st->db < STUB_MAX_HANDLES) stub_io[st->db][0]++;
+	for (i = 0; i < sqlda->sqld; i++) {
+		XSQLVAR *var = (XSQLVAR *)&sqlda->sqlvar[i];
+		int null = st->config.nulls > 0 && (st->row % st->config.nulls) == st->config.nulls - 1;
+		if (var->sqlind) *var->sqlind = null ? -1 : 0;
+		if (!null) stub_fill_value(st, var, st->row, i);
+	}
+	st->row++;
+	stub_ok(status);
+	return 0;
+}
+
+static char *stub_put_count(char *p, char item, ISC_LONG value)
+{
+	return stub_put_int(p, item, value);
+}
+
+ISC_STATUS ISC_EXPORT isc_dsql_sql_info(ISC_STATUS *status, isc_stmt_handle *stmt, short item_length,
+	const ISC_SCHAR *items, short buffer_length, ISC_SCHAR *buffer)
+{
+	stub_stmt *st = stub_get_stmt(stmt);
+	char *p = buffer;
+	short i;
+	if (!st) return stub_fail(status, "stub: invalid statement handle");
+	for (i = 0; i < item_length; i++) {
+		switch (items[i]) {
+			case isc_info_sql_stmt_type:
+				p = stub_put_int(p, isc_info_sql_stmt_type, st->type);
+				break;
+			case isc_info_sql_records: {
+				char *start = p;
+				long affected = st->config.affected;
+				*p++ = isc_info_sql_records;
+				p += 2;
+				p = stub_put_count(p, isc_info_req_select_count, st->type == isc_info_sql_stmt_select ? st->row : 0);
+				p = stub_put_count(p, isc_info_req_insert_count, st->type == isc_info_sql_stmt_insert ? affected : 0);
+				p = stub_put_count(p, isc_info_req_update_count, st->type == isc_info_sql_stmt_update ? affected : 0);
+				p = stub_put_count(p, isc_info_req_delete_count, st->type == isc_info_sql_stmt_delete ? affected : 0);
+				*p++ = isc_info_end;
+				start[1] = (char)((p - start - 3) & 0xff);
+				start[2] = (char)(((p - start - 3) >> 8) & 0xff);
+				break;
+			}
+#ifdef isc_info_sql_get_plan
+			case isc_info_sql_get_plan:
+#endif
+#ifdef isc_info_sql_explain_plan
+			case isc_info_sql_explain_plan:
+#endif
+			{
+				static const char plan[] = "\nPLAN (STUB NATURAL)";
+				*p++ = items[i];
+				*p++ = (char)(sizeof(plan) - 1);
+				*p++ = 0;
+				memcpy(p, plan, sizeof(plan) - 1);
+				p += sizeof(plan) - 1;
+				break;
+			}
+		}
+	}
+	*p = isc_info_end;
+	stub_ok(status);
+	return 0;
+}
+
+/* blobs */
+
+ISC_STATUS ISC_EXPORT isc_create_blob2(ISC_STATUS *status, isc_db_handle *db, isc_tr_handle *tr,
+	isc_blob_handle *blob, ISC_QUAD *id, short bpb_length, const ISC_SCHAR *bpb)
+{
+	int i;
+	pthread_mutex_lock(&stub_handle_lock);
+	for (i = 1; i < STUB_MAX_HANDLES; i++) {
+		if (!stub_blobs[i].used) {
+			memset(&stub_blobs[i], 0, sizeof(stub_blob));
+			stub_blobs[i].used = 1;
+			pthread_mutex_unlock(&stub_handle_lock);
+			*blob = i;
+			id->gds_quad_high = 0;
+			id->gds_quad_low = 0;
+			stub_ok(status);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&stub_handle_lock);
+	return stub_fail(status, "stub: too many blobs");
+}
+
+ISC_STATUS ISC_EXPORT isc_open_blob2(ISC_STATUS *status, isc_db_handle *db, isc_tr_handle *tr,
+	isc_blob_handle *blob, ISC_QUAD *id, ISC_USHORT bpb_length, const ISC_UCHAR *bpb)
+{
+	ISC_QUAD saved = *id;
+	ISC_STATUS result = isc_create_blob2(status, db, tr, blob, id, 0, NULL);
+	*id = saved;
+	if (result == 0) {
+		stub_blobs[*blob].size = stub_blobs[*blob].remaining = (long)saved.gds_quad_low;
+	}
+	return result;
+}
+
+ISC_STATUS ISC_EXPORT isc_blob_info(ISC_STATUS *status, isc_blob_handle *blob, short item_length,
+	const ISC_SCHAR *items, short buffer_length, ISC_SCHAR *buffer)
+{
+	stub_blob *b = &stub_blobs[*blob];
+	char *p = buffer;
+	short i;
+	for (i = 0; i < item_length; i++) {
+		switch (items[i]) {
+			case isc_info_blob_max_segment:
+				p = stub_put_int(p, items[i], STUB_SEGMENT);
+				break;
+			case isc_info_blob_num_segments:
+				p = stub_put_int(p, items[i], (ISC_LONG)((b->size + STUB_SEGMENT - 1) / STUB_SEGMENT));
+				break;
+			case isc_info_blob_total_length:
+				p = stub_put_int(p, items[i], (ISC_LONG)b->size);
+				break;
+		}
+	}
+	*p = isc_info_end;
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_get_segment(ISC_STATUS *status, isc_blob_handle *blob, unsigned short *actual,
+	unsigned short length, ISC_SCHAR *buffer)
+{
+	stub_blob *b = &stub_blobs[*blob];
+	long n = b->remaining < length ? b->remaining : length;
+	long i;
+	for (i = 0; i < n; i++) buffer[i] = (char)('a' + (b->offset + i) % 26);
+	b->offset += n;
+	b->remaining -= n;
+	*actual = (unsigned short)n;
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_put_segment(ISC_STATUS *status, isc_blob_handle *blob, unsigned short length, const ISC_SCHAR *buffer)
+{
+	stub_blobs[*blob].size += length;
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_close_blob(ISC_STATUS *status, isc_blob_handle *blob)
+{
+	if (*blob && *blob < STUB_MAX_HANDLES) stub_blobs[*blob].used = 0;
+	*blob = 0;
+	stub_ok(status);
+	return 0;
+}
+
+/* utilities */
+
+ISC_LONG ISC_EXPORT isc_vax_integer(const ISC_SCHAR *p, short length)
+{
+	ISC_LONG value = 0;
+	int shift = 0;
+	while (length-- > 0) {
+		value += ((ISC_LONG)(unsigned char)*p++) << shift;
+		shift += 8;
+	}
+	if (shift > 0 && shift < 32 && (value & (1L << (shift - 1)))) {
+		value -= 1L << shift;
+	}
+	return value;
+}
+
+ISC_INT64 ISC_EXPORT isc_portable_integer(const ISC_UCHAR *p, short length)
+{
+	ISC_INT64 value = 0;
+	int shift = 0;
+	while (length-- > 0) {
+		value += ((ISC_INT64)*p++) << shift;
+		shift += 8;
+	}
+	return value;
+}
+
+ISC_LONG ISC_EXPORT isc_sqlcode(const ISC_STATUS *status)
+{
+	return status[1] ? -901 : 0;
+}
+
+void ISC_EXPORT isc_sql_interprete(short code, ISC_SCHAR *buffer, short length)
+{
+	snprintf(buffer, length, "stub SQL error code = %d", code);
+}
+
+ISC_LONG ISC_EXPORT fb_interpret(ISC_SCHAR *buffer, unsigned int length, const ISC_STATUS **vector)
+{
+	const ISC_STATUS *v = *vector;
+	if (v[0] != isc_arg_gds || v[1] == 0) return 0;
+	snprintf(buffer, length, "%s", v[2] == isc_arg_string ? (const char *)v[3] : "stub error");
+	*vector = v + (v[2] == isc_arg_string ? 4 : 2);
+	return (ISC_LONG)strlen(buffer);
+}
+
+ISC_STATUS ISC_EXPORT isc_interprete(ISC_SCHAR *buffer, const ISC_STATUS **vector)
+{
+	return fb_interpret(buffer, 128, vector);
+}
+
+void ISC_EXPORT isc_decode_sql_date(const ISC_DATE *date, void *times_arg)
+{
+	struct tm *times = times_arg;
+	int y, m, d;
+	stub_civil_from_days(*date, &y, &m, &d);
+	memset(times, 0, sizeof(*times));
+	times->tm_year = y - 1900;
+	times->tm_mon = m - 1;
+	times->tm_mday = d;
+}
+
+void ISC_EXPORT isc_encode_sql_date(const void *times_arg, ISC_DATE *date)
+{
+	const struct tm *times = times_arg;
+	*date = (ISC_DATE)stub_days_from_civil(times->tm_year + 1900, times->tm_mon + 1, times->tm_mday);
+}
+
+void ISC_EXPORT isc_decode_sql_time(const ISC_TIME *t, void *times_arg)
+{
+	struct tm *times = times_arg;
+	ISC_TIME seconds = *t / 10000;
+	memset(times, 0, sizeof(*times));
+	times->tm_hour = seconds / 3600;
+	times->tm_min = (seconds / 60) % 60;
+	times->tm_sec = seconds % 60;
+}
+
+void ISC_EXPORT isc_encode_sql_time(const void *times_arg, ISC_TIME *t)
+{
+	const struct tm *times = times_arg;
+	*t = (ISC_TIME)(((times->tm_hour * 60 + times->tm_min) * 60 + times->tm_sec) * 10000);
+}
+
+void ISC_EXPORT isc_decode_timestamp(const ISC_TIMESTAMP *ts, void *times_arg)
+{
+	struct tm *times = times_arg;
+	struct tm t;
+	isc_decode_sql_time(&ts->timestamp_time, &t);
+	isc_decode_sql_date(&ts->timestamp_date, times);
+	times->tm_hour = t.tm_hour;
+	times->tm_min = t.tm_min;
+	times->tm_sec = t.tm_sec;
+}
+
+void ISC_EXPORT isc_encode_timestamp(const void *times_arg, ISC_TIMESTAMP *ts)
+{
+	isc_encode_sql_date(times_arg, &ts->timestamp_date);
+	isc_encode_sql_time(times_arg, &ts->timestamp_time);
+}
+
+/* events: counts per name start at 1, as a fresh request (all zero) always fires once */
+
+#define STUB_MAX_EVENTS 64
+#define STUB_MAX_REQUESTS 64
+
+typedef struct {
+	char name[32];
+	ISC_ULONG count;
+} stub_event;
+
+typedef struct {
+	int used;
+	isc_db_handle db;
+	ISC_LONG id;
+	ISC_EVENT_CALLBACK ast;
+	void *arg;
+	short length;
+	ISC_UCHAR buffer[512];
+} stub_request;
+
+static pthread_mutex_t stub_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static stub_event stub_events[STUB_MAX_EVENTS];
+static stub_request stub_requests[STUB_MAX_REQUESTS];
+static ISC_LONG stub_next_event_id = 1;
+
+static stub_event *stub_find_event(const char *name, int len)
+{
+	int i;
+	for (i = 0; i < STUB_MAX_EVENTS; i++) {
+		if (stub_events[i].name[0] && (int)strlen(stub_events[i].name) == len && !memcmp(stub_events[i].name, name, len)) {
+			return &stub_events[i];
+		}
+	}
+	for (i = 0; i < STUB_MAX_EVENTS; i++) {
+		if (!stub_events[i].name[0]) {
+			memcpy(stub_events[i].name, name, len);
+			stub_events[i].name[len] = 0;
+			stub_events[i].count = 1;
+			return &stub_events[i];
+		}
+	}
+	return NULL;
+}
+
+static ISC_ULONG stub_get_count(const ISC_UCHAR *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((ISC_ULONG)p[3] << 24);
+}
+
+static void stub_put_count4(ISC_UCHAR *p, ISC_ULONG v)
+{
+	p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = (v >> 24) & 0xff;
+}
+
+ISC_LONG ISC_EXPORT_VARARG isc_event_block(ISC_UCHAR **event_buffer, ISC_UCHAR **result_buffer, ISC_USHORT count, ...)
+{
+	va_list ap;
+	int i;
+	long length = 1;
+	const char *names[15];
+	ISC_UCHAR *p;
+
+	va_start(ap, count);
+	for (i = 0; i < count && i < 15; i++) {
+		names[i] = va_arg(ap, const char *);
+		length += 1 + strlen(names[i]) + 4;
+	}
+	va_end(ap);
+	*event_buffer = malloc(length);
+	*result_buffer = malloc(length);
+	p = *event_buffer;
+	*p++ = 1;
+	for (i = 0; i < count && i < 15; i++) {
+		int n = strlen(names[i]);
+		*p++ = n;
+		memcpy(p, names[i], n);
+		p += n;
+		stub_put_count4(p, 0);
+		p += 4;
+	}
+	memcpy(*result_buffer, *event_buffer, length);
+	return length;
+}
+
+void ISC_EXPORT isc_event_counts(ISC_ULONG *counts, short length, ISC_UCHAR *event_buffer, const ISC_UCHAR *result_buffer)
+{
+	const ISC_UCHAR *p = event_buffer + 1;
+	int i = 0;
+	while (p < event_buffer + length) {
+		int n = *p++;
+		ISC_ULONG old = stub_get_count(p + n), now = stub_get_count(result_buffer + (p + n - event_buffer));
+		counts[i++] = now > old ? now - old : 0;
+		p += n + 4;
+	}
+	memcpy(event_buffer, result_buffer, length);
+}
+
+ISC_LONG ISC_EXPORT isc_free(ISC_SCHAR *p)
+{
+	free(p);
+	return 0;
+}
+
+typedef struct {
+	ISC_EVENT_CALLBACK ast;
+	void *arg;
+	short length;
+	ISC_UCHAR buffer[512];
+} stub_delivery;
+
+static void *stub_deliver(void *arg)
+{
+	stub_delivery *d = arg;
+	usleep(1000);
+	d->ast(d->arg, d->length, d->buffer);
+	free(d);
+	return NULL;
+}
+
+/* fires the request if any count moved past the one it waits on; called locked */
+static void stub_check_request(stub_request *r)
+{
+	ISC_UCHAR *p = r->buffer + 1;
+	int fire = 0;
+	stub_delivery *d;
+	pthread_t t;
+
+	while (p < r->buffer + r->length) {
+		int n = *p++;
+		stub_event *e = stub_find_event((const char *)p, n);
+		ISC_ULONG waited = stub_get_count(p + n);
+		if (e && e->count > waited) {
+			stub_put_count4(p + n, e->count);
+			fire = 1;
+		}
+		p += n + 4;
+	}
+	if (!fire) return;
+	d = malloc(sizeof(*d));
+	d->ast = r->ast;
+	d->arg = r->arg;
+	d->length = r->length;
+	memcpy(d->buffer, r->buffer, r->length);
+	r->used = 0;
+	pthread_create(&t, NULL, stub_deliver, d);
+	pthread_detach(t);
+}
+
+ISC_STATUS ISC_EXPORT isc_que_events(ISC_STATUS *status, isc_db_handle *db, ISC_LONG *id, short length,
+	const ISC_UCHAR *event_buffer, ISC_EVENT_CALLBACK ast, void *arg)
+{
+	int i;
+	pthread_mutex_lock(&stub_event_lock);
+	for (i = 0; i < STUB_MAX_REQUESTS && stub_requests[i].used; i++);
+	if (i == STUB_MAX_REQUESTS || length > 512) {
+		pthread_mutex_unlock(&stub_event_lock);
+		return stub_fail(status, "stub: too many event requests");
+	}
+	stub_requests[i].used = 1;
+	stub_requests[i].db = *db;
+	stub_requests[i].id = *id = stub_next_event_id++;
+	stub_requests[i].ast = ast;
+	stub_requests[i].arg = arg;
+	stub_requests[i].length = length;
+	memcpy(stub_requests[i].buffer, event_buffer, length);
+	stub_check_request(&stub_requests[i]);
+	pthread_mutex_unlock(&stub_event_lock);
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_cancel_events(ISC_STATUS *status, isc_db_handle *db, ISC_LONG *id)
+{
+	int i;
+	pthread_mutex_lock(&stub_event_lock);
+	for (i = 0; i < STUB_MAX_REQUESTS; i++) {
+		if (stub_requests[i].used && stub_requests[i].id == *id) stub_requests[i].used = 0;
+	}
+	pthread_mutex_unlock(&stub_event_lock);
+	stub_ok(status);
+	return 0;
+}
+
+/* services: a trace session that starts and waits until it is stopped */
+
+#define STUB_MAX_SERVICES 16
+
+typedef struct {
+	int used;
+	int tracing;
+	char out[4096];
+	int len, pos;
+} stub_service;
+
+static stub_service stub_services[STUB_MAX_SERVICES];
+static int stub_trace_stopped;
+
+ISC_STATUS ISC_EXPORT isc_service_attach(ISC_STATUS *status, unsigned short length, const ISC_SCHAR *name,
+	isc_svc_handle *handle, unsigned short spb_length, const ISC_SCHAR *spb)
+{
+	int i;
+	if (!strstr(name, "service_mgr")) {
+		return stub_fail(status, "bad service name");
+	}
+	pthread_mutex_lock(&stub_handle_lock);
+	for (i = 1; i < STUB_MAX_SERVICES; i++) {
+		if (!stub_services[i].used) {
+			memset(&stub_services[i], 0, sizeof(stub_service));
+			stub_services[i].used = 1;
+			pthread_mutex_unlock(&stub_handle_lock);
+			*handle = i;
+			stub_ok(status);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&stub_handle_lock);
+	return stub_fail(status, "too many services");
+}
+
+ISC_STATUS ISC_EXPORT isc_service_detach(ISC_STATUS *status, isc_svc_handle *handle)
+{
+	if (*handle > 0 && *handle < STUB_MAX_SERVICES) {
+		if (stub_services[*handle].tracing) {
+			stub_trace_stopped = 1;
+		}
+		stub_services[*handle].used = 0;
+	}
+	*handle = 0;
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_service_start(ISC_STATUS *status, isc_svc_handle *handle, isc_resv_handle *reserved,
+	unsigned short spb_length, const ISC_SCHAR *spb)
+{
+	stub_service *svc = &stub_services[*handle];
+	if (spb[0] == isc_action_svc_trace_start) {
+		svc->tracing = 1;
+		stub_trace_stopped = 0;
+		svc->len = snprintf(svc->out, sizeof(svc->out), "Trace session ID 7 started\n\n");
+	} else if (spb[0] == isc_action_svc_trace_stop) {
+		stub_trace_stopped = 1;
+		svc->len = snprintf(svc->out, sizeof(svc->out), "Trace session ID %d stopped\n", (int)isc_vax_integer(spb + 2, 4));
+	}
+	svc->pos = 0;
+	stub_ok(status);
+	return 0;
+}
+
+ISC_STATUS ISC_EXPORT isc_service_query(ISC_STATUS *status, isc_svc_handle *handle, isc_resv_handle *reserved,
+	unsigned short send_length, const ISC_SCHAR *send, unsigned short request_length, const ISC_SCHAR *request,
+	unsigned short buffer_length, ISC_SCHAR *buffer)
+{
+	stub_service *svc = &stub_services[*handle];
+	int n = svc->len - svc->pos;
+	char *p = buffer;
+	if (n > 100) n = 100;
+	if (n == 0 && svc->tracing && !stub_trace_stopped) {
+		usleep(20000);
+	}
+	*p++ = isc_info_svc_stdout;
+	*p++ = n & 0xff;
+	*p++ = n >> 8;
+	memcpy(p, svc->out + svc->pos, n);
+	p += n;
+	svc->pos += n;
+	if (n == 0 && svc->tracing && !stub_trace_stopped) {
+		*p++ = isc_info_svc_timeout;
+	}
+	*p++ = isc_info_end;
+	stub_ok(status);
+	return 0;
+}
@@ -82,6 +82,16 @@ end
 
 dir_config("firebird")
 
+# Fiber scheduler support: blocking client calls run on native worker threads
+have_header("pthread.h")
+have_func("rb_fiber_scheduler_current", "ruby/fiber/scheduler.h")
+
+# Ractor support: the extension keeps no mutable shared Ruby state
+have_func("rb_ext_ractor_safe", "ruby.h")
+
+# USDT probes for bpftrace and SystemTap, where the SystemTap SDT header is installed
+have_header("sys/sdt.h")
+
 test_func = "isc_attach_database"
 
 case RUBY_PLATFORM
@@ -21,6 +21,7 @@
   */
 
 #include "ruby.h"
+#include "ruby/encoding.h"
 
 #include <ctype.h>
 
@@ -44,6 +45,75 @@
 #include <float.h>
 #include <time.h>
 #include <stdbool.h>
+#include "ruby/thread.h"
+
+/* Blocking client calls are offloaded to native workers under a Fiber scheduler */
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT) && defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+#define FB_FIBER_OFFLOAD 1
+#include "ruby/io.h"
+#include "ruby/fiber/scheduler.h"
+#include "ruby/ractor.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+/* Event notifications arrive on a client library thread */
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+#define FB_EVENTS 1
+#include <pthread.h>
+#include <errno.h>
+#endif
+
+/*
+ * USDT probes for bpftrace and SystemTap, e.g. usdt:fb.so:fb:execute_done.
+ * Durations are in microseconds; +status+ is the gds code, 0 on success.
+ * The probes are nops; the clock is read only while a tracer has set the
+ * semaphore of the probe that reports the duration.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define FB_PROBES 1
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define FB_SEMAPHORE(name) \
+	__extension__ unsigned short fb_##name##_semaphore \
+		__attribute__((unused, section(".probes"), visibility("hidden")));
+FB_SEMAPHORE(attach_start) FB_SEMAPHORE(attach_done)
+FB_SEMAPHORE(detach_start) FB_SEMAPHORE(detach_done)
+FB_SEMAPHORE(begin_start) FB_SEMAPHORE(begin_done)
+FB_SEMAPHORE(commit_start) FB_SEMAPHORE(commit_done)
+FB_SEMAPHORE(rollback_start) FB_SEMAPHORE(rollback_done)
+FB_SEMAPHORE(prepare_start) FB_SEMAPHORE(prepare_done)
+FB_SEMAPHORE(execute_start) FB_SEMAPHORE(execute_done)
+FB_SEMAPHORE(rows_affected)
+FB_SEMAPHORE(fetch_start) FB_SEMAPHORE(fetch_done)
+FB_SEMAPHORE(blob_open) FB_SEMAPHORE(blob_read)
+#undef FB_SEMAPHORE
+#define FB_PROBE_ENABLED(name) __builtin_expect(fb_##name##_semaphore != 0, 0)
+#define FB_PROBE2(name, a, b) DTRACE_PROBE2(fb, name, a, b)
+#define FB_PROBE3(name, a, b, c) DTRACE_PROBE3(fb, name, a, b, c)
+#define FB_PROBE4(name, a, b, c, d) DTRACE_PROBE4(fb, name, a, b, c, d)
+/*
+ * Runs +call+ between the +start+ and +done+ probes; +done+ sees fb_probe_us,
+ * timed only while probe +timed+ is enabled and 0 otherwise.
+ */
+#define FB_PROBED(timed, start, call, done) do { \
+		int fb_probe_on = FB_PROBE_ENABLED(timed); \
+		double fb_probe_t0 = fb_probe_on ? fb_monotonic_time() : 0; \
+		LONG_LONG fb_probe_us = 0; \
+		start; \
+		call; \
+		if (fb_probe_on) { \
+			fb_probe_us = (LONG_LONG)((fb_monotonic_time() - fb_probe_t0) * 1e6); \
+		} \
+		done; \
+	} while (0)
+#else
+#define FB_PROBE2(name, a, b) do { } while (0)
+#define FB_PROBE3(name, a, b, c) do { } while (0)
+#define FB_PROBE4(name, a, b, c, d) do { } while (0)
+#define FB_PROBED(timed, start, call, done) do { call; } while (0)
+#endif
 
 
 #define	SQLDA_COLSINIT	50
@@ -65,21 +135,38 @@ static VALUE rb_mFb;
 static VALUE rb_cFbDatabase;
 static VALUE rb_cFbConnection;
 static VALUE rb_cFbCursor;
+static VALUE rb_cFbTransaction;
+static VALUE rb_cFbTransactionOptions;
+static VALUE rb_cFbPool;
+static VALUE rb_cFbIdAllocator;
+static VALUE rb_cFbServices;
+static VALUE rb_cFbStats;
+static VALUE rb_eFbPoolTimeout;
+static VALUE rb_cConditionVariable;
 static VALUE rb_cFbSqlType;
 static VALUE rb_eFbError;
 static VALUE rb_sFbField;
 static VALUE rb_sFbIndex;
 static VALUE rb_sFbColumn;
+static VALUE rb_sFbMonSnapshot;
+static VALUE rb_sFbMonAttachment;
+static VALUE rb_sFbMonTransaction;
+static VALUE rb_sFbMonStatement;
+static VALUE rb_sFbMonIO;
+static VALUE rb_sFbMonRecords;
+static VALUE rb_sFbMonMemory;
+static VALUE rb_sFbTraceEvent;
 static VALUE rb_cDate;
 
-static ID id_matches;
 static ID id_downcase_bang;
-static VALUE re_lowercase;
 static ID id_rstrip_bang;
 static ID id_sub_bang;
 static ID id_force_encoding;
 static ID id_mul;
 static ID id_div;
+static ID id_wait;
+static ID id_signal;
+static ID id_broadcast;
 
 static VALUE object_to_unscaled_bigdecimal(VALUE object, int scale);
 
@@ -105,6 +192,18 @@ typedef	struct
 	char  vary_string[1];
 } VARY;
 
+/*
+ * Handle storage for Fb::Transaction objects. Slots belong to the connection
+ * and never move, so a handle pointer stays valid during a call; the serial
+ * tells a reused slot apart from the one a Transaction object started in.
+ */
+struct fb_tr_slot {
+	isc_tr_handle handle;
+	unsigned long serial;
+	int distributed;	/* handle spans several attachments */
+	struct fb_tr_slot *next;
+};
+
 struct FbConnection {
 	isc_db_handle db;		/* DB handle */
 	isc_tr_handle transact; /* transaction handle */
@@ -115,6 +214,82 @@ struct FbConnection {
 	VALUE encoding;
 	int dropped;
 	ISC_STATUS isc_status[20];
+	/* auto-reconnect */
+	VALUE path;		/* database string used to attach */
+	char *dpb;		/* DPB kept from connection_create_dbp */
+	long dpb_length;
+	int auto_reconnect;
+	int reconnect_attempts;
+	double reconnect_backoff;
+	int reconnect_pending;	/* attachment lost and not yet restored */
+	unsigned long epoch;	/* bumped on every reattach */
+	struct fb_tr_slot *tr_slots;	/* transactions started with start_transaction */
+	unsigned long tr_serial;
+	/* autocommit reads */
+	int autocommit_read;
+	double read_refresh;	/* seconds before the read transaction is renewed */
+	isc_tr_handle read_transact;	/* shared read-only transaction for plain SELECTs */
+	double read_started;
+	long read_cursors;	/* open cursors running in read_transact */
+	/* autocommit writes */
+	int autocommit_write;	/* FB_WRITE_* */
+	long write_batch;	/* statements per commit retaining */
+	double write_interval;	/* seconds between commit retaining */
+	double write_idle;	/* seconds before an unused transaction is committed */
+	isc_tr_handle write_transact;	/* shared transaction for DML outside a transaction */
+	long write_pending;	/* statements not yet committed */
+	double write_since;	/* first pending statement */
+	double write_last;	/* last statement run in write_transact */
+	long write_busy;	/* statements or commits using write_transact right now */
+	VALUE write_timer;	/* thread committing write_transact once idle, or nil */
+	VALUE write_lock;	/* held by that thread while it commits */
+	int write_committing;	/* the idle commit is running without the GVL */
+	VALUE tpb_cache;	/* option string => TransactionOptions */
+	/* savepoints */
+	isc_stmt_handle *sp_stmts;	/* FB_SP_COMMANDS prepared statements per nesting level */
+	long sp_levels;
+	long sp_depth;
+	unsigned long sp_epoch;
+	/* events */
+	struct fb_events *events;
+	VALUE event_names;	/* in the order of the event block */
+	VALUE event_handlers;	/* name => [Proc or Queue, ...] */
+	/* query result cache */
+	VALUE cache;		/* [format, sql, *args] => [rows, tables, expires], least recently used first */
+	long cache_max_entries;
+	long cache_max_rows;
+	long cache_rows;
+	double cache_ttl;	/* seconds, negative for none */
+	int cache_events;	/* invalidate on POST_EVENT of a table name */
+	long cache_hits;
+	long cache_misses;
+	long cache_evictions;
+	long cache_invalidations;
+	VALUE stats;		/* Fb::Stats or nil */
+	/* slow query log */
+	double slow_threshold;	/* seconds, negative when off */
+	VALUE slow_log;		/* callable, IO or file name */
+	VALUE slow_log_file;	/* File opened for a slow_log file name, or nil */
+	int slow_redact;	/* leave parameter values out */
+	/* table I/O counters */
+	int io_stats;		/* diff the counters around every statement */
+	int io_loading;		/* reading RDB$RELATIONS; don't count that */
+	VALUE io_last;		/* per-table I/O of the last statement done */
+	VALUE relation_names;	/* relation id => name, or nil until needed */
+};
+
+#define FB_WRITE_NONE		0
+#define FB_WRITE_TPB		1	/* isc_tpb_autocommit: the server commits every statement */
+#define FB_WRITE_RETAINING	2	/* isc_commit_retaining every batch or interval */
+
+/* where a statement spends its time */
+enum {
+	FB_PHASE_PREPARE,
+	FB_PHASE_EXECUTE,
+	FB_PHASE_FETCH,
+	FB_PHASE_CONVERT,
+	FB_PHASE_BLOB,
+	FB_PHASES
 };
 
 struct FbCursor {
@@ -122,6 +297,7 @@ struct FbCursor {
 	int eof;
 	isc_tr_handle auto_transact;
 	isc_stmt_handle stmt;
+	int prepared;		/* stmt holds a prepared statement */
 	XSQLDA *i_sqlda;
 	XSQLDA *o_sqlda;
 	char *i_buffer;
@@ -131,6 +307,79 @@ struct FbCursor {
 	VALUE fields_ary;
 	VALUE fields_hash;
 	VALUE connection;
+	unsigned long epoch;	/* connection epoch the statement was allocated in */
+	VALUE transaction;	/* Fb::Transaction the cursor runs in, or nil */
+	int read_only;		/* runs in the connection's read transaction */
+	int read_open;		/* counted in read_cursors */
+	int write_auto;		/* runs in the connection's write transaction */
+	int internal;		/* the driver's own query, kept out of stats and the slow log */
+	VALUE stats;		/* Fb::Stats the statement is counted in, or nil */
+	struct fb_stats_entry *stats_entry;	/* NULL unless counted */
+	int timed;		/* the running statement is timed, for stats or the slow query log */
+	double phase_time[FB_PHASES];	/* seconds it spent so far */
+	long phase_count[FB_PHASES];
+	long timed_rows;	/* rows it fetched or affected */
+	VALUE timed_sql;	/* its SQL and parameters, for the slow query log */
+	VALUE timed_params;
+	VALUE io_before;	/* table counters when the running statement started, or nil */
+	VALUE io_stats;		/* per-table I/O of the last statement once it is done */
+};
+
+struct FbTransactionOptions {
+	char *tpb;
+	long tpb_len;
+	VALUE source;		/* frozen option string the TPB was compiled from */
+};
+
+struct FbTransaction {
+	VALUE connection;
+	struct fb_tr_slot *slot;
+	unsigned long serial;
+	VALUE cursors;		/* cursors opened by #execute and #query */
+};
+
+struct FbPool {
+	VALUE database;
+	VALUE idle;		/* idle connections, oldest first */
+	VALUE idle_since;	/* checkin times, parallel to idle */
+	VALUE busy;		/* checked-out connections */
+	VALUE mutex;
+	VALUE cond;
+	long min;
+	long max;
+	double timeout;
+	double idle_timeout;
+	double validate_after;	/* negative disables pings */
+	int shutdown;
+	long size;		/* connections attached or being attached */
+	long created;
+	long checkouts;
+	long waits;
+	double wait_time;
+	double max_wait_time;
+	long timeouts;
+	long reaped;
+	long discarded;
+};
+
+struct FbIdAllocator {
+	VALUE connection;
+	VALUE generator;	/* name as stored in RDB$GENERATORS */
+	VALUE sql;		/* SELECT GEN_ID(generator, block) */
+	VALUE mutex;		/* held while a block is reserved */
+	long block;
+	long refill_at;		/* reserve the next block when this few IDs are left */
+	LONG_LONG next;		/* current range is next ... limit - 1 */
+	LONG_LONG limit;
+	LONG_LONG spare_next;	/* block reserved ahead */
+	LONG_LONG spare_limit;
+	long refills;
+};
+
+struct FbServices {
+	isc_svc_handle handle;
+	VALUE service;		/* host:service_mgr */
+	VALUE spb;		/* attach parameters, kept to open a second attachment */
 };
 
 typedef struct trans_opts
@@ -563,6 +812,45 @@ static VALUE sql_type_from_code(VALUE self, VALUE code, VALUE subtype)
 	return fb_sql_type_from_code(NUM2INT(code), NUM2INT(subtype));
 }
 
+/* Conflicts that can succeed when the transaction is simply run again. */
+static int fb_gdscode_is_retryable(long code)
+{
+	switch (code) {
+	case isc_deadlock:
+	case isc_lock_conflict:
+	case isc_update_conflict:
+#ifdef isc_lock_timeout
+	case isc_lock_timeout:
+#endif
+#ifdef isc_concurrent_transaction
+	case isc_concurrent_transaction:
+#endif
+		return 1;
+	}
+	return 0;
+}
+
+/* Keeps the gds codes and SQLSTATE of the status vector on the exception. */
+static void fb_error_set_status(VALUE exc, const ISC_STATUS *isc_status)
+{
+	VALUE codes = rb_ary_new();
+	VALUE sql_state = Qnil;
+	int i = 0;
+
+	while (i < 19 && isc_status[i] != isc_arg_end) {
+		if (isc_status[i] == isc_arg_gds) {
+			rb_ary_push(codes, LONG2NUM(isc_status[i + 1]));
+#ifdef isc_arg_sql_state
+		} else if (isc_status[i] == isc_arg_sql_state) {
+			sql_state = rb_str_new_cstr((const char *)isc_status[i + 1]);
+#endif
+		}
+		i += (isc_status[i] == isc_arg_cstring) ? 3 : 2;
+	}
+	rb_iv_set(exc, "gds_codes", rb_ary_freeze(codes));
+	rb_iv_set(exc, "sql_state", sql_state);
+}
+
 static void fb_error_check(ISC_STATUS *isc_status)
 {
 	if (isc_status[0] == 1 && isc_status[1]) {
@@ -578,6 +866,7 @@ static void fb_error_check(ISC_STATUS *isc_status)
 
 		exc = rb_exc_new3(rb_eFbError, msg);
 		rb_iv_set(exc, "error_code", INT2FIX(code));
+		fb_error_set_status(exc, isc_status);
 		rb_exc_raise(exc);
 	}
 }
@@ -592,2836 +881,8773 @@ static void fb_error_check_warn(ISC_STATUS *isc_status)
 	}
 }
 
-static XSQLDA* sqlda_alloc(long cols)
+static double fb_monotonic_time(void)
 {
-	XSQLDA *sqlda;
-
-	sqlda = (XSQLDA*)xmalloc(XSQLDA_LENGTH(cols));
-#ifdef SQLDA_CURRENT_VERSION
-	sqlda->version = SQLDA_CURRENT_VERSION;
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ts.tv_nsec / 1e9;
 #else
-	sqlda->version = SQLDA_VERSION1;
+	return (double)time(NULL);
 #endif
-	sqlda->sqln = cols;
-	sqlda->sqld = 0;
-	return sqlda;
 }
 
-static VALUE cursor_close _((VALUE));
-static VALUE cursor_drop _((VALUE));
-static VALUE cursor_execute _((int, VALUE*, VALUE));
-static VALUE cursor_fetchall _((int, VALUE*, VALUE));
+/* blocking client calls */
 
-static void fb_cursor_mark(struct FbCursor *fb_cursor);
-static void fb_cursor_free(struct FbCursor *fb_cursor);
-static void fb_connection_mark(struct FbConnection *fb_connection);
-static void fb_connection_free(struct FbConnection *fb_connection);
+typedef ISC_STATUS (*fb_blocking_func)(void *);
 
-/* ruby data types */
+#ifdef FB_FIBER_OFFLOAD
 
-static const rb_data_type_t fbdatabase_data_type = {
-    "FBDB",
-    {
-        NULL,
-        NULL,
-        NULL,
-        NULL,
-    },
-    0, 0, 0
+#define	FB_WORKERS_DEFAULT	4
+
+struct fb_blocking_job {
+	fb_blocking_func func;
+	void *data;
+	ISC_STATUS result;
+	int notify_fd;
+	struct fb_blocking_job *next;
+	ISC_STATUS *isc_status;		/* of the connection the call is made for */
+	struct fb_blocking_job *flight_next;
 };
 
-static const rb_data_type_t fbconnection_data_type = {
-    "fbdb/connection",
-    {
-        (void (*)(void *))fb_connection_mark,
-        (void (*)(void *))fb_connection_free,
-        NULL,
-    },
-    0, 0, 0
+/*
+ * A pipe the worker writes one byte to when a job is done, and the IO the
+ * fiber waits on. Kept for reuse, so offloading a call costs no new
+ * descriptors; a job consumes its byte even when the fiber is interrupted.
+ */
+struct fb_notifier {
+	int fds[2];
+	VALUE io;
+	pid_t pid;		/* a child must not share its parent's pipes */
+	struct fb_notifier *next;
 };
 
-static const rb_data_type_t fbcursor_data_type = {
-    "fbdb/cursor",
-    {
-        (void (*)(void *))fb_cursor_mark,
-        (void (*)(void *))fb_cursor_free,
-        NULL,
-    },
-    0, 0, 0
+/* Per Ractor, so neither the lists nor the IOs are shared between Ractors. */
+struct fb_offload_local {
+	struct fb_notifier *notifiers;	/* idle, for reuse */
+	struct fb_blocking_job *flight;	/* offloaded calls not yet done */
 };
 
-/* connection utilities */
-static void fb_connection_check(struct FbConnection *fb_connection)
+static rb_ractor_local_key_t fb_offload_key;
+
+static pthread_mutex_t fb_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fb_workers_cond = PTHREAD_COND_INITIALIZER;
+static struct fb_blocking_job *fb_jobs_head;
+static struct fb_blocking_job *fb_jobs_tail;
+static int fb_workers_started;
+static int fb_workers_idle;
+static int fb_workers_max = FB_WORKERS_DEFAULT;
+
+static void *fb_worker_main(void *arg)
 {
-	if (fb_connection->db == 0) {
-		rb_raise(rb_eFbError, "closed db connection");
+	struct fb_blocking_job *job;
+	int fd;
+
+	for (;;) {
+		pthread_mutex_lock(&fb_workers_lock);
+		fb_workers_idle++;
+		while (!fb_jobs_head) {
+			pthread_cond_wait(&fb_workers_cond, &fb_workers_lock);
+		}
+		fb_workers_idle--;
+		job = fb_jobs_head;
+		fb_jobs_head = job->next;
+		if (!fb_jobs_head) fb_jobs_tail = NULL;
+		pthread_mutex_unlock(&fb_workers_lock);
+
+		job->result = job->func(job->data);
+		/* the waiting fiber may release the job as soon as the byte arrives */
+		fd = job->notify_fd;
+		while (write(fd, "!", 1) < 0 && errno == EINTR);
 	}
+	return NULL;
 }
 
-static void fb_connection_close_cursors(struct FbConnection *fb_connection)
+static void fb_workers_atfork_child(void)
 {
-	int i;
-	long len = RARRAY_LEN(fb_connection->cursor);
-	for (i = 0; i < len; i++) {
-		cursor_close(RARRAY_PTR(fb_connection->cursor)[i]);
-	}
+	/* worker threads do not survive fork; start over in the child */
+	pthread_mutex_init(&fb_workers_lock, NULL);
+	pthread_cond_init(&fb_workers_cond, NULL);
+	fb_jobs_head = fb_jobs_tail = NULL;
+	fb_workers_started = 0;
+	fb_workers_idle = 0;
 }
 
-static void fb_connection_drop_cursors(struct FbConnection *fb_connection)
+static int fb_workers_submit(struct fb_blocking_job *job)
 {
-	int i;
-	long len = RARRAY_LEN(fb_connection->cursor);
-	for (i = 0; i < len; i++) {
-		cursor_drop(RARRAY_PTR(fb_connection->cursor)[i]);
+	pthread_t thread;
+
+	pthread_mutex_lock(&fb_workers_lock);
+	job->next = NULL;
+	if (fb_jobs_tail) {
+		fb_jobs_tail->next = job;
+	} else {
+		fb_jobs_head = job;
 	}
-  rb_ary_clear(fb_connection->cursor);
+	fb_jobs_tail = job;
+	if (fb_workers_idle == 0 && fb_workers_started < fb_workers_max) {
+		if (fb_workers_started == 0) {
+			pthread_atfork(NULL, NULL, fb_workers_atfork_child);
+		}
+		if (pthread_create(&thread, NULL, fb_worker_main, NULL) == 0) {
+			pthread_detach(thread);
+			fb_workers_started++;
+		}
+	}
+	if (fb_workers_started == 0) {
+		/* no worker could be started: the caller runs the job inline */
+		fb_jobs_head = fb_jobs_tail = NULL;
+		pthread_mutex_unlock(&fb_workers_lock);
+		return 0;
+	}
+	pthread_cond_signal(&fb_workers_cond);
+	pthread_mutex_unlock(&fb_workers_lock);
+	return 1;
 }
 
-static void fb_connection_disconnect(struct FbConnection *fb_connection)
+static void fb_offload_local_mark(void *ptr)
 {
-	if (fb_connection->transact) {
-		isc_commit_transaction(fb_connection->isc_status, &fb_connection->transact);
-		fb_error_check(fb_connection->isc_status);
+	struct fb_offload_local *local = ptr;
+	struct fb_notifier *notifier;
+
+	for (notifier = local->notifiers; notifier; notifier = notifier->next) {
+		rb_gc_mark(notifier->io);
 	}
-	if (fb_connection->dropped) {
-		isc_drop_database(fb_connection->isc_status, &fb_connection->db);
-	} else {
-		isc_detach_database(fb_connection->isc_status, &fb_connection->db);
+}
+
+static void fb_offload_local_free(void *ptr)
+{
+	struct fb_offload_local *local = ptr;
+	struct fb_notifier *notifier;
+
+	/* the IOs close the read ends when they are collected */
+	while ((notifier = local->notifiers)) {
+		local->notifiers = notifier->next;
+		close(notifier->fds[1]);
+		xfree(notifier);
 	}
-	fb_error_check(fb_connection->isc_status);
+	xfree(local);
 }
 
-static void fb_connection_disconnect_warn(struct FbConnection *fb_connection)
+static const struct rb_ractor_local_storage_type fb_offload_local_type = {
+	fb_offload_local_mark,
+	fb_offload_local_free,
+};
+
+static struct fb_offload_local *fb_offload_local(void)
 {
-	if (fb_connection->transact) {
-		isc_commit_transaction(fb_connection->isc_status, &fb_connection->transact);
-		fb_error_check_warn(fb_connection->isc_status);
+	struct fb_offload_local *local = rb_ractor_local_storage_ptr(fb_offload_key);
+
+	if (!local) {
+		local = ZALLOC(struct fb_offload_local);
+		rb_ractor_local_storage_ptr_set(fb_offload_key, local);
 	}
-	isc_detach_database(fb_connection->isc_status, &fb_connection->db);
-	fb_error_check_warn(fb_connection->isc_status);
+	return local;
 }
 
-static void fb_connection_mark(struct FbConnection *fb_connection)
+static void fb_notifier_destroy(struct fb_notifier *notifier)
 {
-	rb_gc_mark(fb_connection->cursor);
+	rb_io_close(notifier->io);
+	close(notifier->fds[1]);
+	xfree(notifier);
 }
 
-static void fb_connection_free(struct FbConnection *fb_connection)
+static struct fb_notifier *fb_notifier_acquire(struct fb_offload_local *local)
 {
-	if (fb_connection->db) {
-		fb_connection_disconnect_warn(fb_connection);
+	struct fb_notifier *notifier;
+
+	while ((notifier = local->notifiers)) {
+		local->notifiers = notifier->next;
+		if (notifier->pid == getpid()) return notifier;
+		fb_notifier_destroy(notifier);
 	}
-	xfree(fb_connection);
+	notifier = ALLOC(struct fb_notifier);
+	if (pipe(notifier->fds) != 0) {
+		xfree(notifier);
+		rb_sys_fail("pipe");
+	}
+	notifier->pid = getpid();
+	notifier->io = rb_funcall(rb_cIO, rb_intern("for_fd"), 1, INT2NUM(notifier->fds[0]));
+	return notifier;
 }
 
-static unsigned short fb_connection_db_SQL_Dialect(struct FbConnection *fb_connection)
+/* Back on the idle list, where the Ractor's mark function keeps its IO alive. */
+static void fb_notifier_release(struct fb_offload_local *local, struct fb_notifier *notifier)
 {
-	long dialect;
-	long length;
-	char db_info_command = isc_info_db_sql_dialect;
-	char isc_info_buff[16];
+	notifier->next = local->notifiers;
+	local->notifiers = notifier;
+}
 
-	/* Get the db SQL Dialect */
-	isc_database_info(fb_connection->isc_status, &fb_connection->db,
-			1, &db_info_command,
-			sizeof(isc_info_buff), isc_info_buff);
-	fb_error_check(fb_connection->isc_status);
+static void fb_jobs_flight_remove(struct fb_offload_local *local, struct fb_blocking_job *job)
+{
+	struct fb_blocking_job **p;
 
-	if (isc_info_buff[0] == isc_info_db_sql_dialect) {
-		length = isc_vax_integer(&isc_info_buff[1], 2);
-		dialect = isc_vax_integer(&isc_info_buff[3], (short)length);
-	} else {
-		dialect = 1;
+	for (p = &local->flight; *p; p = &(*p)->flight_next) {
+		if (*p == job) {
+			*p = job->flight_next;
+			return;
+		}
 	}
-	return dialect;
 }
 
-static unsigned short fb_connection_dialect(struct FbConnection *fb_connection)
+static void *fb_blocking_job_drain(void *arg)
 {
-	return fb_connection->dialect;
+	char c;
+	int fd = *(int *)arg;
+	while (read(fd, &c, 1) < 0 && errno == EINTR);
+	return NULL;
 }
 
-/* Transaction option list */
+static VALUE fb_blocking_job_wait(VALUE args)
+{
+	VALUE *wait = (VALUE *)args;
+	return rb_fiber_scheduler_io_wait(wait[0], wait[1], INT2NUM(RUBY_IO_READABLE), Qnil);
+}
 
-static trans_opts	rcom_opt_S[] =
+/*
+ * Run +func+ on a native worker while the current fiber yields to its
+ * scheduler. The job must finish before we return, even if the fiber is
+ * interrupted, since it points into this stack frame. Two fibers may not
+ * have calls in flight on the same connection, told apart by its status
+ * vector.
+ */
+static ISC_STATUS fb_blocking_offload(VALUE scheduler, ISC_STATUS *isc_status, fb_blocking_func func, void *data)
 {
-	{"NO",			"RECORD_VERSION",	isc_tpb_no_rec_version,	-1,	0},
-	{"RECORD_VERSION",	0,			isc_tpb_rec_version,	-1,	0},
-	{"*",			0,			isc_tpb_no_rec_version,	-1,	0},
-	{0,			0,			0,			0,	0}
+	struct fb_offload_local *local = fb_offload_local();
+	struct fb_blocking_job job;
+	struct fb_blocking_job *other;
+	struct fb_notifier *notifier;
+	int state = 0;
+	char c;
+	VALUE wait[2];
+
+	for (other = local->flight; other; other = other->flight_next) {
+		if (other->isc_status == isc_status) {
+			rb_raise(rb_eFbError, "connection is in use by another fiber");
+		}
+	}
+	notifier = fb_notifier_acquire(local);
+	job.isc_status = isc_status;
+	job.func = func;
+	job.data = data;
+	job.notify_fd = notifier->fds[1];
+	wait[0] = scheduler;
+	wait[1] = notifier->io;
+	if (!fb_workers_submit(&job)) {
+		fb_notifier_release(local, notifier);
+		return func(data);
+	}
+	job.flight_next = local->flight;
+	local->flight = &job;
+
+	for (;;) {
+		ssize_t n;
+		rb_protect(fb_blocking_job_wait, (VALUE)wait, &state);
+		if (state) {
+			rb_thread_call_without_gvl(fb_blocking_job_drain, &notifier->fds[0], NULL, NULL);
+			break;
+		}
+		n = read(notifier->fds[0], &c, 1);
+		if (n == 1 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+			break;
+		}
+	}
+	fb_jobs_flight_remove(local, &job);
+	fb_notifier_release(local, notifier);
+	if (state) {
+		rb_jump_tag(state);
+	}
+	return job.result;
+}
+
+#endif
+
+/*
+ * Run a blocking client call. Under a Fiber scheduler the call is handed to
+ * a native worker so other fibers keep running; otherwise it runs inline.
+ */
+static ISC_STATUS fb_blocking_call(ISC_STATUS *isc_status, fb_blocking_func func, void *data)
+{
+#ifdef FB_FIBER_OFFLOAD
+	VALUE scheduler = rb_fiber_scheduler_current();
+	if (!NIL_P(scheduler)) {
+		return fb_blocking_offload(scheduler, isc_status, func, data);
+	}
+#endif
+	return func(data);
+}
+
+struct fb_nogvl_call {
+	fb_blocking_func func;
+	void *data;
+	ISC_STATUS result;
 };
 
+static void *fb_nogvl_trampoline(void *arg)
+{
+	struct fb_nogvl_call *call = arg;
+	call->result = call->func(call->data);
+	return NULL;
+}
 
-static trans_opts	read_opt_S[] =
+/*
+ * Like fb_blocking_call, but without a scheduler the GVL is released for the
+ * duration of the call so other threads keep running. Meant for network round
+ * trips that are slow compared to the cost of giving up the lock.
+ */
+static ISC_STATUS fb_blocking_call_nogvl(ISC_STATUS *isc_status, fb_blocking_func func, void *data)
 {
-	{"WRITE",	0,	isc_tpb_write,		1,	0},
-	{"ONLY",		0,	isc_tpb_read,		1,	0},
-	{"COMMITTED",	0,	isc_tpb_read_committed,	2,	rcom_opt_S},
-	{0,		0,	0,			0,	0}
+	struct fb_nogvl_call call;
+#ifdef FB_FIBER_OFFLOAD
+	VALUE scheduler = rb_fiber_scheduler_current();
+	if (!NIL_P(scheduler)) {
+		return fb_blocking_offload(scheduler, isc_status, func, data);
+	}
+#endif
+	call.func = func;
+	call.data = data;
+	call.result = 0;
+	rb_thread_call_without_gvl(fb_nogvl_trampoline, &call, NULL, NULL);
+	return call.result;
+}
+
+struct fb_attach_args {
+	ISC_STATUS *isc_status;
+	const char *database;
+	isc_db_handle *db;
+	short dpb_length;
+	const char *dpb;
 };
 
+static ISC_STATUS fb_attach_call(void *data)
+{
+	struct fb_attach_args *a = data;
+	return isc_attach_database(a->isc_status, 0, a->database, a->db, a->dpb_length, a->dpb);
+}
 
-static trans_opts	snap_opt_S[] =
+static ISC_STATUS fb_attach_database(ISC_STATUS *isc_status, const char *database, isc_db_handle *db, long dpb_length, const char *dpb)
 {
-	{"TABLE",	"STABILITY",	isc_tpb_consistency,	2,	0},
-	{"*",		0,		isc_tpb_concurrency,	2,	0},
-	{0,			0,	0,			0,	0}
+	struct fb_attach_args args = { isc_status, database, db, (short)dpb_length, dpb };
+	ISC_STATUS result;
+	FB_PROBED(attach_done, FB_PROBE2(attach_start, database, dpb_length),
+		result = fb_blocking_call_nogvl(isc_status, fb_attach_call, &args),
+		FB_PROBE3(attach_done, database, fb_probe_us, isc_status[1]));
+	return result;
+}
+
+struct fb_database_info_args {
+	ISC_STATUS *isc_status;
+	isc_db_handle *db;
+	short items_length;
+	const char *items;
+	short buffer_length;
+	char *buffer;
 };
 
+static ISC_STATUS fb_database_info_call(void *data)
+{
+	struct fb_database_info_args *a = data;
+	return isc_database_info(a->isc_status, a->db, a->items_length, a->items, a->buffer_length, a->buffer);
+}
 
-static trans_opts	isol_opt_S[] =
+static ISC_STATUS fb_database_info(ISC_STATUS *isc_status, isc_db_handle *db, short items_length, const char *items, short buffer_length, char *buffer)
 {
-	{"SNAPSHOT",	0,		0,			0,	snap_opt_S},
-	{"READ",		"COMMITTED",	isc_tpb_read_committed,	2,	rcom_opt_S},
-	{0,		0,		0,			0,	0}
+	struct fb_database_info_args args = { isc_status, db, items_length, items, buffer_length, buffer };
+	return fb_blocking_call_nogvl(isc_status, fb_database_info_call, &args);
+}
+
+struct fb_prepare_args {
+	ISC_STATUS *isc_status;
+	isc_tr_handle *transact;
+	isc_stmt_handle *stmt;
+	const char *sql;
+	unsigned short dialect;
+	XSQLDA *sqlda;
 };
 
+static ISC_STATUS fb_prepare_call(void *data)
+{
+	struct fb_prepare_args *a = data;
+	return isc_dsql_prepare(a->isc_status, a->transact, a->stmt, 0, a->sql, a->dialect, a->sqlda);
+}
 
-static trans_opts	trans_opt_S[] =
+static ISC_STATUS fb_dsql_prepare(ISC_STATUS *isc_status, isc_tr_handle *transact, isc_stmt_handle *stmt, const char *sql, unsigned short dialect, XSQLDA *sqlda)
 {
-	{"READ",		0,		0,		0,	read_opt_S},
-	{"WAIT",		0,		isc_tpb_wait,	3,	0},
-	{"NO",		"WAIT",		isc_tpb_nowait,	3,	0},
-	{"ISOLATION",	"LEVEL",	0,		0,	isol_opt_S},
-	{"SNAPSHOT",	0,		0,		0,	snap_opt_S},
-	{"RESERVING",	0,		-1,		0,	0},
-	{0,		0,		0,		0,	0}
+	struct fb_prepare_args args = { isc_status, transact, stmt, sql, dialect, sqlda };
+	return fb_blocking_call(isc_status, fb_prepare_call, &args);
+}
+
+struct fb_execute_args {
+	ISC_STATUS *isc_status;
+	isc_tr_handle *transact;
+	isc_stmt_handle *stmt;
+	XSQLDA *in_sqlda;
+	XSQLDA *out_sqlda;
 };
 
-/* Name1	Name2		Option value	    Position	Sub-option */
+static ISC_STATUS fb_execute_call(void *data)
+{
+	struct fb_execute_args *a = data;
+	return isc_dsql_execute2(a->isc_status, a->transact, a->stmt, SQLDA_VERSION1, a->in_sqlda, a->out_sqlda);
+}
 
-#define	RESV_TABLEEND	"FOR"
-#define	RESV_SHARED	"SHARED"
-#define	RESV_PROTECTD	"PROTECTED"
-#define	RESV_READ	"READ"
-#define	RESV_WRITE	"WRITE"
-#define	RESV_CONTINUE	','
+static ISC_STATUS fb_dsql_execute2(ISC_STATUS *isc_status, isc_tr_handle *transact, isc_stmt_handle *stmt, XSQLDA *in_sqlda, XSQLDA *out_sqlda)
+{
+	struct fb_execute_args args = { isc_status, transact, stmt, in_sqlda, out_sqlda };
+	return fb_blocking_call(isc_status, fb_execute_call, &args);
+}
 
-static char* trans_parseopts(VALUE opt, long *tpb_len)
+struct fb_fetch_args {
+	ISC_STATUS *isc_status;
+	isc_stmt_handle *stmt;
+	XSQLDA *sqlda;
+};
+
+static ISC_STATUS fb_fetch_call(void *data)
 {
-	char *s, *trans;
-	long used;
-	long size;
-	char *tpb;
-	trans_opts *curr_p;
-	trans_opts *target_p;
-	char *check1_p;
-	char *check2_p;
-	int count;
-	int next_c;
-	char check_f[4];
-	char *resv_p;
-	char *resend_p;
-	char *tblend_p = 0;
-	long tbl_len;
-	long res_first;
-	int res_count;
-	long ofs;
-	char sp_prm;
-	char rw_prm;
-	int cont_f;
-	const char *desc = 0;
+	struct fb_fetch_args *a = data;
+	return isc_dsql_fetch(a->isc_status, a->stmt, 1, a->sqlda);
+}
 
-	/* Initialize */
-	s = StringValuePtr(opt);
-	trans = ALLOCA_N(char, strlen(s)+1);
-	strcpy(trans, s);
-	s = trans;
-	while (*s) {
-		*s = UPPER(*s);
-		s++;
+static ISC_STATUS fb_dsql_fetch(ISC_STATUS *isc_status, isc_stmt_handle *stmt, XSQLDA *sqlda)
+{
+	struct fb_fetch_args args = { isc_status, stmt, sqlda };
+	return fb_blocking_call(isc_status, fb_fetch_call, &args);
+}
+
+struct fb_commit_args {
+	ISC_STATUS *isc_status;
+	isc_tr_handle *transact;
+};
+
+static ISC_STATUS fb_commit_call(void *data)
+{
+	struct fb_commit_args *a = data;
+	return isc_commit_transaction(a->isc_status, a->transact);
+}
+
+static ISC_STATUS fb_commit_transaction(ISC_STATUS *isc_status, isc_tr_handle *transact)
+{
+	struct fb_commit_args args = { isc_status, transact };
+	return fb_blocking_call(isc_status, fb_commit_call, &args);
+}
+
+/* call-seq:
+ *   Fb.worker_threads -> Integer
+ *
+ * Maximum number of native threads used to run client calls for fibers
+ * under a Fiber scheduler. Zero when offloading is not supported.
+ */
+static VALUE fb_s_worker_threads(VALUE self)
+{
+#ifdef FB_FIBER_OFFLOAD
+	return INT2FIX(fb_workers_max);
+#else
+	return INT2FIX(0);
+#endif
+}
+
+/* call-seq:
+ *   Fb.worker_threads = Integer
+ *
+ * Sets the maximum number of native worker threads. Threads already started
+ * are kept.
+ */
+static VALUE fb_s_set_worker_threads(VALUE self, VALUE count)
+{
+	int n = NUM2INT(count);
+	if (n < 1) {
+		rb_raise(rb_eArgError, "worker_threads must be positive");
 	}
+#ifdef FB_FIBER_OFFLOAD
+	pthread_mutex_lock(&fb_workers_lock);
+	fb_workers_max = n;
+	pthread_mutex_unlock(&fb_workers_lock);
+#endif
+	return count;
+}
 
-	used = 0;
-	size = 0;
-	tpb = NULL;
-	memset((void *)check_f, 0, sizeof(check_f));
+/* statement statistics */
 
-	/* Set the default transaction option */
-	tpb = (char*)xmalloc(TPBBUFF_ALLOC);
-	size = TPBBUFF_ALLOC;
-	memcpy((void*)tpb, (void*)isc_tpb_0, sizeof(isc_tpb_0));
-	used = sizeof(isc_tpb_0);
+#define	FB_STATS_SUB		4	/* histogram buckets per power of two */
+#define	FB_STATS_BUCKETS	(FB_STATS_SUB + FB_STATS_SUB * 38)	/* 1 microsecond to 2^40 */
+#define	FB_STATS_EXPORT_MAX	26	/* highest Prometheus bucket: 2^26 microseconds */
 
-	/* Analize the transaction option strings */
-	curr_p = trans_opt_S;
-	check1_p = strtok(trans, CMND_DELIMIT);
-	if (check1_p) {
-		check2_p = strtok(0, CMND_DELIMIT);
-	} else {
-		check2_p = 0;
+static const char *fb_phase_names[FB_PHASES] = { "prepare", "execute", "fetch", "convert", "blob" };
+
+struct fb_stats_phase {
+	long count;
+	double sum;
+	double max;
+	long buckets[FB_STATS_BUCKETS];	/* log-linear, in microseconds */
+};
+
+struct fb_stats_entry {
+	VALUE fingerprint;
+	long executions;
+	long calls;		/* client library calls */
+	long rows;		/* rows fetched or affected */
+	struct fb_stats_phase phases[FB_PHASES];
+};
+
+struct FbStats {
+	int enabled;
+	VALUE fingerprints;	/* fingerprint => index into entries */
+	VALUE statements;	/* SQL as given => index into entries */
+	struct fb_stats_entry **entries;
+	long count;
+	long capa;
+	long max_fingerprints;	/* later statements count as "(other)" */
+};
+
+static void fb_stats_mark(struct FbStats *fb_stats)
+{
+	long i;
+
+	rb_gc_mark(fb_stats->fingerprints);
+	rb_gc_mark(fb_stats->statements);
+	/* pinned: the entries hold them outside any Ruby object */
+	for (i = 0; i < fb_stats->count; i++) {
+		rb_gc_mark(fb_stats->entries[i]->fingerprint);
 	}
-	while (curr_p) {
-		target_p = 0;
-		next_c = 0;
-		for (count = 0; curr_p[count].option1; count++) {
-			if (!strcmp(curr_p[count].option1, "*")) {
-				target_p = &curr_p[count];
-				break;
-			} else if (check1_p && !strcmp(check1_p, curr_p[count].option1)) {
-				if (!curr_p[count].option2) {
-					next_c = 1;
-					target_p = &curr_p[count];
-					break;
-				} else if (check2_p && !strcmp(check2_p, curr_p[count].option2)) {
-					next_c = 2;
-					target_p = &curr_p[count];
-					break;
-				}
-			}
-		}
+}
 
-		if (!target_p) {
-			desc = "Illegal transaction option was specified";
-			goto error;
-		}
+static void fb_stats_free(struct FbStats *fb_stats)
+{
+	long i;
 
-		/* Set the transaction option */
-		if (target_p->optval > '\0') {
-			if (target_p->position > 0) {
-				if (check_f[target_p->position]) {
-					desc = "Duplicate transaction option was specified";
-					goto error;
+	for (i = 0; i < fb_stats->count; i++) {
+		xfree(fb_stats->entries[i]);
+	}
+	xfree(fb_stats->entries);
+	xfree(fb_stats);
+}
+
+static const rb_data_type_t fbstats_data_type = {
+    "fbdb/stats",
+    {
+        (void (*)(void *))fb_stats_mark,
+        (void (*)(void *))fb_stats_free,
+        NULL,
+    },
+    0, 0, 0
+};
+
+static VALUE stats_allocate_instance(VALUE klass)
+{
+	struct FbStats *fb_stats;
+	VALUE obj = TypedData_Make_Struct(klass, struct FbStats, &fbstats_data_type, fb_stats);
+	fb_stats->enabled = 1;
+	fb_stats->fingerprints = rb_hash_new();
+	fb_stats->statements = rb_hash_new();
+	fb_stats->max_fingerprints = 1000;
+	return obj;
+}
+
+static struct FbStats *fb_stats_get(VALUE self)
+{
+	struct FbStats *fb_stats;
+	TypedData_Get_Struct(self, struct FbStats, &fbstats_data_type, fb_stats);
+	return fb_stats;
+}
+
+static int fb_is_ident_char(int c)
+{
+	return isalnum(c) || c == '_' || c == '$';
+}
+
+/*
+ * Normalizes SQL so that statements differing only in literals, comments,
+ * whitespace, keyword case or the length of a parameter list share a
+ * fingerprint.
+ */
+static VALUE fb_sql_fingerprint(VALUE sql)
+{
+	const char *p = RSTRING_PTR(sql), *e = RSTRING_END(sql);
+	VALUE fp = rb_str_buf_new(RSTRING_LEN(sql));
+	char last = ' ';	/* last character written */
+	int pending_space = 0;
+
+#define FP_PUT(c) do { \
+		if (pending_space && last != ' ' && last != '(') { rb_str_buf_cat(fp, " ", 1); } \
+		pending_space = 0; last = (c); { char ch = (c); rb_str_buf_cat(fp, &ch, 1); } \
+	} while (0)
+
+	while (p < e) {
+		if (isspace((unsigned char)*p)) {
+			pending_space = 1;
+			p++;
+		} else if (p[0] == '-' && p + 1 < e && p[1] == '-') {
+			while (p < e && *p != '\n') p++;
+			pending_space = 1;
+		} else if (p[0] == '/' && p + 1 < e && p[1] == '*') {
+			for (p += 2; p + 1 < e && !(p[0] == '*' && p[1] == '/'); p++);
+			p = p + 2 < e ? p + 2 : e;
+			pending_space = 1;
+		} else if (*p == '\'' || (isdigit((unsigned char)*p) && (pending_space || !fb_is_ident_char((unsigned char)last)))) {
+			if (*p == '\'') {
+				for (p++; p < e; p++) {
+					if (*p == '\'') {
+						if (p + 1 < e && p[1] == '\'') p++;
+						else { p++; break; }
+					}
 				}
-				tpb[target_p->position] = target_p->optval;
-				check_f[target_p->position] = 1;
 			} else {
-				if (used + 1 > size) {
-					tpb = (char *)realloc(tpb, size + TPBBUFF_ALLOC);
-					size += TPBBUFF_ALLOC;
-				}
-				tpb[used] = target_p->optval;
-				used++;
+				while (p < e && (isalnum((unsigned char)*p) || *p == '.' ||
+						((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E')))) p++;
 			}
-		} else if (target_p->optval) {		/* RESERVING ... FOR */
-			if (check_f[0]) {
-				desc = "Duplicate transaction option was specified";
-				goto error;
+			if (last == '?') {
+				continue;
 			}
-			resv_p = check2_p;
-			if (!resv_p || !strcmp(resv_p, RESV_TABLEEND)) {
-				desc = "RESERVING needs table name list";
-				goto error;
+			/* "?, ?, ?" becomes "?" */
+			if (last == ',' && RSTRING_LEN(fp) >= 2 && RSTRING_PTR(fp)[RSTRING_LEN(fp) - 2] == '?') {
+				rb_str_set_len(fp, RSTRING_LEN(fp) - 1);
+				last = '?';
+				pending_space = 0;
+				continue;
 			}
-			while (resv_p) {
-				res_first = used;
-				res_count = 0;
-				resend_p = strtok(0, CMND_DELIMIT);
-				while (resend_p) {
-					if (!strcmp(resend_p, RESV_TABLEEND)) {
-						break;
-					}
-					resend_p = strtok(0, CMND_DELIMIT);
-				}
+			FP_PUT('?');
+		} else if (*p == '?') {
+			p++;
+			if (last == ',' && RSTRING_LEN(fp) >= 2 && RSTRING_PTR(fp)[RSTRING_LEN(fp) - 2] == '?') {
+				rb_str_set_len(fp, RSTRING_LEN(fp) - 1);
+				last = '?';
+				pending_space = 0;
+				continue;
+			}
+			FP_PUT('?');
+		} else if (*p == '"') {
+			FP_PUT('"');
+			for (p++; p < e; p++) {
+				rb_str_buf_cat(fp, p, 1);
+				if (*p == '"') { p++; break; }
+			}
+			last = '"';
+		} else if (*p == ',' || *p == ')') {
+			pending_space = 0;
+			FP_PUT(*p);
+			p++;
+		} else {
+			FP_PUT(toupper((unsigned char)*p));
+			p++;
+		}
+	}
+#undef FP_PUT
+	return rb_str_freeze(fp);
+}
 
-				if (!resend_p) {
-					desc = "Illegal transaction option was specified";
-					goto error;
-				}
+static struct fb_stats_entry *fb_stats_entry_new(struct FbStats *fb_stats, VALUE fingerprint)
+{
+	struct fb_stats_entry *entry;
 
-				while (resv_p < resend_p) {
-					if (*resv_p == '\0' || (ofs = strspn(resv_p, LIST_DELIMIT)) < 0) {
-						resv_p++;
-					} else {
-						resv_p = &resv_p[ofs];
-						tblend_p = strpbrk(resv_p, LIST_DELIMIT);
-						if (tblend_p) {
-							tbl_len = tblend_p - resv_p;
-						} else {
-							tbl_len = strlen(resv_p);
-						}
-						if (tbl_len > META_NAME_MAX) {
-							desc = "Illegal table name was specified";
-							goto error;
-						}
+	if (fb_stats->count == fb_stats->capa) {
+		fb_stats->capa = fb_stats->capa ? fb_stats->capa * 2 : 16;
+		REALLOC_N(fb_stats->entries, struct fb_stats_entry *, fb_stats->capa);
+	}
+	entry = ALLOC(struct fb_stats_entry);
+	MEMZERO(entry, struct fb_stats_entry, 1);
+	entry->fingerprint = fingerprint;
+	rb_hash_aset(fb_stats->fingerprints, fingerprint, LONG2NUM(fb_stats->count));
+	fb_stats->entries[fb_stats->count++] = entry;
+	return entry;
+}
 
-						if (tbl_len > 0) {
-							if (used + tbl_len + 3 > size) {
-								tpb = (char*)xrealloc(tpb, size+TPBBUFF_ALLOC);
-								size += TPBBUFF_ALLOC;
-							}
-							tpb[used+1] = (char)tbl_len;
-							memcpy((void *)&tpb[used+2],resv_p, tbl_len);
-							used += tbl_len + 3;
-							res_count++;
-						}
-						resv_p += tbl_len;
-					}
-				}
+/* The entry a statement is counted in, or NULL while collection is off. */
+static struct fb_stats_entry *fb_stats_entry_for(VALUE stats, VALUE sql)
+{
+	struct FbStats *fb_stats;
+	VALUE index, fingerprint;
+
+	if (NIL_P(stats)) return NULL;
+	fb_stats = fb_stats_get(stats);
+	if (!fb_stats->enabled) return NULL;
+
+	index = rb_hash_lookup(fb_stats->statements, sql);
+	if (NIL_P(index)) {
+		fingerprint = fb_sql_fingerprint(sql);
+		index = rb_hash_lookup(fb_stats->fingerprints, fingerprint);
+		if (NIL_P(index)) {
+			if (fb_stats->count >= fb_stats->max_fingerprints) {
+				fingerprint = rb_str_freeze(rb_str_new_cstr("(other)"));
+				index = rb_hash_lookup(fb_stats->fingerprints, fingerprint);
+			}
+			if (NIL_P(index)) {
+				fb_stats_entry_new(fb_stats, fingerprint);
+				index = LONG2NUM(fb_stats->count - 1);
+			}
+		}
+		if (RHASH_SIZE(fb_stats->statements) >= (size_t)fb_stats->max_fingerprints * 4) {
+			rb_hash_clear(fb_stats->statements);
+		}
+		rb_hash_aset(fb_stats->statements, rb_str_new_frozen(sql), index);
+	}
+	return fb_stats->entries[NUM2LONG(index)];
+}
 
-				resv_p = strtok(0, CMND_DELIMIT);
-				if (resv_p && !strcmp(resv_p, RESV_SHARED)) {
-					sp_prm = isc_tpb_shared;
-				} else if (resv_p && !strcmp(resv_p, RESV_PROTECTD)) {
-					sp_prm = isc_tpb_protected;
-				} else {
-					desc = "RESERVING needs {SHARED|PROTECTED} {READ|WRITE}";
-					goto error;
-				}
+static int fb_stats_bucket(double seconds)
+{
+	unsigned LONG_LONG us = seconds > 0 ? (unsigned LONG_LONG)(seconds * 1e6) : 0;
+	int exp = 0, bucket;
+
+	if (us < FB_STATS_SUB) return (int)us;
+	while ((us >> exp) >= 2 * FB_STATS_SUB) exp++;
+	/* us is in [FB_STATS_SUB << exp, FB_STATS_SUB << (exp + 1)) */
+	bucket = FB_STATS_SUB + exp * FB_STATS_SUB + (int)((us >> exp) - FB_STATS_SUB);
+	return bucket < FB_STATS_BUCKETS ? bucket : FB_STATS_BUCKETS - 1;
+}
 
-				cont_f = 0;
-				resv_p = strtok(0, CMND_DELIMIT);
-				if (resv_p) {
-					if (resv_p[strlen(resv_p)-1] == RESV_CONTINUE) {
-						cont_f = 1;
-						resv_p[strlen(resv_p)-1] = '\0';
-					} else {
-						tblend_p = strpbrk(resv_p, LIST_DELIMIT);
-						if (tblend_p) {
-							cont_f = 2;
-							*tblend_p = '\0';
-						}
-					}
-				}
+/* Upper bound of a bucket, in microseconds. */
+static double fb_stats_bucket_limit(int bucket)
+{
+	int exp;
 
-				if (resv_p && !strcmp(resv_p, RESV_READ)) {
-					rw_prm = isc_tpb_lock_read;
-				} else if (resv_p && !strcmp(resv_p, RESV_WRITE)) {
-					rw_prm = isc_tpb_lock_write;
-				} else {
-					desc = "RESERVING needs {SHARED|PROTECTED} {READ|WRITE}";
-					goto error;
-				}
+	if (bucket < FB_STATS_SUB) return bucket + 1;
+	exp = (bucket - FB_STATS_SUB) / FB_STATS_SUB;
+	return (double)((unsigned LONG_LONG)(FB_STATS_SUB + (bucket - FB_STATS_SUB) % FB_STATS_SUB + 1) << exp);
+}
 
-				ofs = res_first;
-				for (count = 0; count < res_count; count++) {
-					tpb[ofs++] = rw_prm;
-					ofs += tpb[ofs] + 1;
-					tpb[ofs++] = sp_prm;
-				}
-
-				if (cont_f == 1) {
-					resv_p = strtok(0, CMND_DELIMIT);
-					if (!resv_p) {
-						desc = "Unexpected end of command";
-						goto error;
-					}
-				}
-				if (cont_f == 2) {
-					resv_p = tblend_p + 1;
-				} else {
-					resv_p = strtok(0, CMND_DELIMIT);
-					if (resv_p) {
-						if ((int)strlen(resv_p) == 1 && resv_p[0] == RESV_CONTINUE) {
-							resv_p = strtok(0, CMND_DELIMIT);
-							if (!resv_p) {
-								desc = "Unexpected end of command";
-								goto error;
-							}
-						} else if (resv_p[0] == RESV_CONTINUE) {
-							resv_p++;
-						} else {
-							next_c = 1;
-							check2_p = resv_p;
-							resv_p = 0;
-						}
-					} else {
-						next_c = 0;
-						check1_p = check2_p = 0;
-					}
-				}
-			}
-
-			check_f[0] = 1;
-		}
+static void fb_stats_record(struct fb_stats_entry *entry, int phase, double seconds, long calls)
+{
+	struct fb_stats_phase *ph = &entry->phases[phase];
 
+	ph->count++;
+	ph->sum += seconds;
+	if (seconds > ph->max) ph->max = seconds;
+	ph->buckets[fb_stats_bucket(seconds)]++;
+	entry->calls += calls;
+}
 
-		/* Set the next check list */
-		curr_p = target_p->sub_opts;
+static void fb_slow_query_check(struct FbCursor *fb_cursor);
+static void fb_cursor_io_finish(struct FbCursor *fb_cursor);
 
-		for (count = 0; count < next_c; count++) {
-			check1_p = check2_p;
-			if (check2_p) {
-				check2_p = strtok(0, CMND_DELIMIT);
+/*
+ * Called once the running statement is done: records its phases, one
+ * sample each, so the histograms are per execution rather than per row,
+ * and hands it to the slow query log.
+ */
+static void fb_cursor_timing_flush(struct FbCursor *fb_cursor)
+{
+	struct fb_stats_entry *entry = fb_cursor->stats_entry;
+	int phase;
+
+	fb_cursor_io_finish(fb_cursor);
+	if (!fb_cursor->timed) return;
+	fb_cursor->timed = 0;
+	if (entry) {
+		for (phase = 0; phase < FB_PHASES; phase++) {
+			if (fb_cursor->phase_count[phase]) {
+				fb_stats_record(entry, phase, fb_cursor->phase_time[phase], 0);
 			}
 		}
-
-		if (check1_p && !curr_p) {
-			curr_p = trans_opt_S;
-		}
-	}
-
-	/* Set the results */
-	*tpb_len = used;
-	return tpb;
-
-error:
-	xfree(tpb);
-	rb_raise(rb_eFbError, "%s", desc);
-}
-
-static void fb_connection_transaction_start(struct FbConnection *fb_connection, VALUE opt)
-{
-	char *tpb = 0;
-	long tpb_len;
-
-	if (fb_connection->transact) {
-		rb_raise(rb_eFbError, "A transaction has been already started");
-	}
-
-	if (!NIL_P(opt)) {
-		tpb = trans_parseopts(opt, &tpb_len);
-	} else {
-		tpb_len = 0;
-		tpb = NULL;
 	}
-
-	isc_start_transaction(fb_connection->isc_status, &fb_connection->transact, 1, &fb_connection->db, tpb_len, tpb);
-	xfree(tpb);
-	fb_error_check(fb_connection->isc_status);
-}
-
-static void fb_connection_commit(struct FbConnection *fb_connection)
-{
-	if (fb_connection->transact) {
-		fb_connection_close_cursors(fb_connection);
-		isc_commit_transaction(fb_connection->isc_status, &fb_connection->transact);
-		fb_error_check(fb_connection->isc_status);
+	if (!NIL_P(fb_cursor->timed_sql)) {
+		fb_slow_query_check(fb_cursor);
+		fb_cursor->timed_sql = fb_cursor->timed_params = Qnil;
 	}
 }
 
-static void fb_connection_rollback(struct FbConnection *fb_connection)
-{
-	if (fb_connection->transact) {
-		fb_connection_close_cursors(fb_connection);
-		isc_rollback_transaction(fb_connection->isc_status, &fb_connection->transact);
-		fb_error_check(fb_connection->isc_status);
-	}
-}
+/* Adds to the running statement's time in +phase+, when it is timed. */
+#define FB_CURSOR_TIME(fb_cursor, phase, ncalls, call) do { \
+		if ((fb_cursor)->timed) { \
+			double fb_time_t0 = fb_monotonic_time(); \
+			call; \
+			(fb_cursor)->phase_time[phase] += fb_monotonic_time() - fb_time_t0; \
+			(fb_cursor)->phase_count[phase]++; \
+			if ((fb_cursor)->stats_entry) (fb_cursor)->stats_entry->calls += (ncalls); \
+		} else { \
+			call; \
+		} \
+	} while (0)
 
 /* call-seq:
- *   transaction(options) -> true
- *   transaction(options) { } -> block result
+ *   Stats.new(max_fingerprints: 1000) -> Stats
  *
- * Start a transaction for this connection.
+ * Collects timings of the statements run on the connections it is given
+ * to, with the +stats+ option of Database or Connection#stats=. Statements
+ * are grouped by fingerprint: the SQL without literals, comments and
+ * spacing. Beyond +max_fingerprints+, new statements count as "(other)".
  */
-static VALUE connection_transaction(int argc, VALUE *argv, VALUE self)
+static VALUE stats_initialize(int argc, VALUE *argv, VALUE self)
 {
-	struct FbConnection *fb_connection;
-	VALUE opt = Qnil;
-
-	rb_scan_args(argc, argv, "01", &opt);
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
-
-	fb_connection_transaction_start(fb_connection, opt);
-
-	if (rb_block_given_p()) {
-		int state;
-		VALUE result = rb_protect(rb_yield, 0, &state);
-		if (state) {
-			fb_connection_rollback(fb_connection);
-			return rb_funcall(rb_mKernel, rb_intern("raise"), 0);
-		} else {
-			fb_connection_commit(fb_connection);
-			return result;
+	struct FbStats *fb_stats = fb_stats_get(self);
+	VALUE kw, max = Qundef;
+	ID max_id;
+
+	rb_scan_args(argc, argv, ":", &kw);
+	if (!NIL_P(kw)) {
+		max_id = rb_intern("max_fingerprints");
+		rb_get_kwargs(kw, &max_id, 0, 1, &max);
+	}
+	if (max != Qundef) {
+		fb_stats->max_fingerprints = NUM2LONG(max);
+		if (fb_stats->max_fingerprints < 1) {
+			rb_raise(rb_eArgError, "max_fingerprints must be positive");
 		}
-	} else {
-		return Qtrue;
-   	}
+	}
+	return self;
 }
 
 /* call-seq:
- *   transaction_started()? -> true or false
+ *   enabled = true or false
  *
- * Returns true if a transaction is currently active.
+ * Pauses or resumes collection. While paused, statements are not timed.
  */
-static VALUE connection_transaction_started(VALUE self)
+static VALUE stats_set_enabled(VALUE self, VALUE enabled)
 {
-	struct FbConnection *fb_connection;
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
-
-	return fb_connection->transact ? Qtrue : Qfalse;
+	fb_stats_get(self)->enabled = RTEST(enabled);
+	return enabled;
 }
 
 /* call-seq:
- *   commit() -> nil
- *
- * Commit the current transaction.
+ *   enabled?() -> true or false
  */
-static VALUE connection_commit(VALUE self)
+static VALUE stats_is_enabled(VALUE self)
 {
-	struct FbConnection *fb_connection;
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
-
-	fb_connection_commit(fb_connection);
-	return Qnil;
+	return fb_stats_get(self)->enabled ? Qtrue : Qfalse;
 }
 
 /* call-seq:
- *   rollback() -> nil
+ *   reset() -> nil
  *
- * Rollback the current transaction.
+ * Zeroes all counters and histograms.
  */
-static VALUE connection_rollback(VALUE self)
+static VALUE stats_reset(VALUE self)
 {
-	struct FbConnection *fb_connection;
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	struct FbStats *fb_stats = fb_stats_get(self);
+	long i;
 
-	fb_connection_rollback(fb_connection);
+	for (i = 0; i < fb_stats->count; i++) {
+		VALUE fingerprint = fb_stats->entries[i]->fingerprint;
+		MEMZERO(fb_stats->entries[i], struct fb_stats_entry, 1);
+		fb_stats->entries[i]->fingerprint = fingerprint;
+	}
 	return Qnil;
 }
 
-/*
- * call-seq:
- *   open?() -> true or false
- *
- * Current connection status.
- */
-static VALUE connection_is_open(VALUE self)
+/* Upper bound, in seconds, below which +quantile+ of the timings fall. */
+static double fb_stats_quantile(struct fb_stats_phase *ph, double quantile)
 {
-	struct FbConnection *fb_connection;
+	long seen = 0, rank = (long)(quantile * ph->count + 0.5);
+	double limit;
+	int i;
 
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
-	return (fb_connection->db == 0) ? Qfalse : Qtrue;
+	if (rank < 1) rank = 1;
+	for (i = 0; i < FB_STATS_BUCKETS; i++) {
+		seen += ph->buckets[i];
+		if (seen >= rank) break;
+	}
+	limit = fb_stats_bucket_limit(i < FB_STATS_BUCKETS ? i : FB_STATS_BUCKETS - 1) / 1e6;
+	return limit < ph->max ? limit : ph->max;
 }
 
-/* call-seq:
- *   to_s() -> String
- *
- * Return current database connection string and either (OPEN) or (CLOSED).
- */
-static VALUE connection_to_s(VALUE self)
-{
-	VALUE is_open = connection_is_open(self);
-	VALUE status = (is_open == Qtrue) ? rb_str_new2(" (OPEN)") : rb_str_new2(" (CLOSED)");
-	VALUE database = rb_iv_get(self, "@database");
-	VALUE s = rb_str_dup(database);
-	return rb_str_concat(s, status);
-}
+#define STATS_SET(hash, name, value) rb_hash_aset(hash, ID2SYM(rb_intern(name)), value)
 
 /* call-seq:
- *   cursor() -> Cursor
+ *   to_h() -> Hash
  *
- * Creates a +Cursor+ for the +Connection+ and allocates a statement.
+ * Returns, by fingerprint, the number of +executions+, client library
+ * +calls+ and +rows+, and for each phase that ran (:prepare, :execute,
+ * :fetch, :convert and :blob) its +count+, +sum+ and +max+ seconds and the
+ * +p50+, +p90+ and +p99+ latencies, accurate to a quarter of a power of two.
  */
-static VALUE connection_cursor(VALUE self)
+static VALUE stats_to_h(VALUE self)
 {
-	VALUE c;
-	struct FbConnection *fb_connection;
-	struct FbCursor *fb_cursor;
-
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
-	fb_connection_check(fb_connection);
-
-	c = TypedData_Make_Struct(rb_cFbCursor, struct FbCursor, &fbcursor_data_type, fb_cursor);
-	fb_cursor->connection = self;
-	fb_cursor->fields_ary = Qnil;
-	fb_cursor->fields_hash = Qnil;
-	fb_cursor->open = Qfalse;
-	fb_cursor->eof = Qfalse;
-	fb_cursor->stmt = 0;
-	fb_cursor->i_sqlda = sqlda_alloc(SQLDA_COLSINIT);
-	fb_cursor->o_sqlda = sqlda_alloc(SQLDA_COLSINIT);
-	fb_cursor->i_buffer = NULL;
-	fb_cursor->i_buffer_size = 0;
-	fb_cursor->o_buffer = NULL;
-	fb_cursor->o_buffer_size = 0;
-	isc_dsql_alloc_statement2(fb_connection->isc_status, &fb_connection->db, &fb_cursor->stmt);
-	fb_error_check(fb_connection->isc_status);
-
-	return c;
+	struct FbStats *fb_stats = fb_stats_get(self);
+	VALUE result = rb_hash_new();
+	long i;
+	int phase;
+
+	for (i = 0; i < fb_stats->count; i++) {
+		struct fb_stats_entry *entry = fb_stats->entries[i];
+		VALUE h = rb_hash_new();
+		if (!entry->executions && !entry->calls) continue;
+		STATS_SET(h, "executions", LONG2NUM(entry->executions));
+		STATS_SET(h, "calls", LONG2NUM(entry->calls));
+		STATS_SET(h, "rows", LONG2NUM(entry->rows));
+		for (phase = 0; phase < FB_PHASES; phase++) {
+			struct fb_stats_phase *ph = &entry->phases[phase];
+			VALUE p;
+			if (!ph->count) continue;
+			p = rb_hash_new();
+			STATS_SET(p, "count", LONG2NUM(ph->count));
+			STATS_SET(p, "sum", DBL2NUM(ph->sum));
+			STATS_SET(p, "max", DBL2NUM(ph->max));
+			STATS_SET(p, "p50", DBL2NUM(fb_stats_quantile(ph, 0.5)));
+			STATS_SET(p, "p90", DBL2NUM(fb_stats_quantile(ph, 0.9)));
+			STATS_SET(p, "p99", DBL2NUM(fb_stats_quantile(ph, 0.99)));
+			STATS_SET(h, fb_phase_names[phase], p);
+		}
+		rb_hash_aset(result, entry->fingerprint, h);
+	}
+	return result;
 }
 
-/* call-seq:
- *   execute(sql, *args) -> Cursor or rows affected
- *   execute(sql, *args) {|cursor| } -> block result
- *
- * Allocates a +Cursor+ and executes the +sql+ statement.
- *
- * For DML with RETURNING clause, returns a Hash with keys:
- *   :returning => Array of returned values
- *   :rows_affected => Integer
- *
- * For other DML (INSERT/UPDATE/DELETE), returns the number of rows affected.
- * For SELECT, returns a Cursor (or yields it to a block).
- */
-static VALUE connection_execute(int argc, VALUE *argv, VALUE self)
+#undef STATS_SET
+
+static VALUE fb_prometheus_label(VALUE fingerprint)
 {
-	VALUE cursor = connection_cursor(self);
-	VALUE val = cursor_execute(argc, argv, cursor);
+	VALUE label = rb_str_buf_new(RSTRING_LEN(fingerprint));
+	const char *p;
 
-	if (NIL_P(val)) {
-		if (rb_block_given_p()) {
-			return rb_ensure(rb_yield,cursor,cursor_close,cursor);
-   		} else {
-				HERE("connection_execute Y");
-				return cursor;
-   		}
-	} else {
-		cursor_drop(cursor);
+	for (p = RSTRING_PTR(fingerprint); p < RSTRING_END(fingerprint); p++) {
+		if (*p == '\\' || *p == '"') {
+			rb_str_buf_cat(label, "\\", 1);
+			rb_str_buf_cat(label, p, 1);
+		} else if (*p == '\n') {
+			rb_str_buf_cat(label, "\\n", 2);
+		} else {
+			rb_str_buf_cat(label, p, 1);
+		}
 	}
-	return val;
+	return label;
 }
 
 /* call-seq:
- *   query(:array, sql, *arg) -> Array of Arrays or nil
- *   query(:hash, sql, *arg) -> Array of Hashes or nil
- *   query(sql, *args) -> Array of Arrays or nil
- *
- * For queries returning a result set, returns an array containing
- * either a list of Arrays or Hashes, one for each row.
+ *   to_prometheus(prefix = "fb") -> String
  *
- * For DML, returns rows affected (or a Hash for RETURNING).
+ * Renders the statistics in the Prometheus text exposition format: a
+ * <tt>_statement_seconds</tt> histogram by fingerprint and phase, with
+ * buckets at powers of two from 1 microsecond to 67 seconds, and
+ * <tt>_statement_executions_total</tt>, <tt>_statement_calls_total</tt> and
+ * <tt>_statement_rows_total</tt> counters.
  */
-static VALUE connection_query(int argc, VALUE *argv, VALUE self)
+static VALUE stats_to_prometheus(int argc, VALUE *argv, VALUE self)
 {
-	VALUE format;
-	VALUE cursor;
-	VALUE result;
+	struct FbStats *fb_stats = fb_stats_get(self);
+	VALUE prefix, out = rb_str_buf_new(4096), labels;
+	const char *pre;
+	static const char *counters[] = { "executions", "calls", "rows" };
+	long i, c;
+	int phase, exp, bucket;
+
+	rb_scan_args(argc, argv, "01", &prefix);
+	pre = NIL_P(prefix) ? "fb" : StringValueCStr(prefix);
+	labels = rb_ary_new_capa(fb_stats->count);
+	for (i = 0; i < fb_stats->count; i++) {
+		rb_ary_push(labels, fb_prometheus_label(fb_stats->entries[i]->fingerprint));
+	}
 
-	if (argc >= 1 && TYPE(argv[0]) == T_SYMBOL) {
-		format = argv[0];
-		argc--; argv++;
-	} else {
-		format = ID2SYM(rb_intern("array"));
+	rb_str_catf(out, "# HELP %s_statement_seconds Time spent in client calls, by statement fingerprint and phase.\n", pre);
+	rb_str_catf(out, "# TYPE %s_statement_seconds histogram\n", pre);
+	for (i = 0; i < fb_stats->count; i++) {
+		struct fb_stats_entry *entry = fb_stats->entries[i];
+		const char *label = RSTRING_PTR(RARRAY_AREF(labels, i));
+		for (phase = 0; phase < FB_PHASES; phase++) {
+			struct fb_stats_phase *ph = &entry->phases[phase];
+			long seen = 0;
+			if (!ph->count) continue;
+			bucket = 0;
+			for (exp = 0; exp <= FB_STATS_EXPORT_MAX; exp++) {
+				/* buckets below 2^exp microseconds */
+				int end = exp < 2 ? (1 << exp) : FB_STATS_SUB + (exp - 2) * FB_STATS_SUB;
+				for (; bucket < end; bucket++) seen += ph->buckets[bucket];
+				rb_str_catf(out, "%s_statement_seconds_bucket{fingerprint=\"%s\",phase=\"%s\",le=\"%.9g\"} %ld\n",
+						pre, label, fb_phase_names[phase], (double)(1L << exp) / 1e6, seen);
+			}
+			rb_str_catf(out, "%s_statement_seconds_bucket{fingerprint=\"%s\",phase=\"%s\",le=\"+Inf\"} %ld\n",
+					pre, label, fb_phase_names[phase], ph->count);
+			rb_str_catf(out, "%s_statement_seconds_sum{fingerprint=\"%s\",phase=\"%s\"} %.9g\n",
+					pre, label, fb_phase_names[phase], ph->sum);
+			rb_str_catf(out, "%s_statement_seconds_count{fingerprint=\"%s\",phase=\"%s\"} %ld\n",
+					pre, label, fb_phase_names[phase], ph->count);
+		}
 	}
-	cursor = connection_cursor(self);
-	result = cursor_execute(argc, argv, cursor);
-	if (NIL_P(result)) {
-		result = cursor_fetchall(1, &format, cursor);
-		cursor_close(cursor);
+	for (c = 0; c < 3; c++) {
+		rb_str_catf(out, "# TYPE %s_statement_%s_total counter\n", pre, counters[c]);
+		for (i = 0; i < fb_stats->count; i++) {
+			struct fb_stats_entry *entry = fb_stats->entries[i];
+			long value = c == 0 ? entry->executions : c == 1 ? entry->calls : entry->rows;
+			rb_str_catf(out, "%s_statement_%s_total{fingerprint=\"%s\"} %ld\n",
+					pre, counters[c], RSTRING_PTR(RARRAY_AREF(labels, i)), value);
+		}
 	}
-
-	return result;
+	return out;
 }
 
 /* call-seq:
- *   close() -> nil
+ *   Stats.fingerprint(sql) -> String
  *
- * Closes connection to database.
+ * The fingerprint statements are grouped by.
  */
-static VALUE connection_close(VALUE self)
+static VALUE stats_s_fingerprint(VALUE klass, VALUE sql)
 {
-	struct FbConnection *fb_connection;
-
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
-
-	if (fb_connection->dropped) return Qnil;
-
-	fb_connection_check(fb_connection);
-	fb_connection_disconnect(fb_connection);
-	fb_connection_drop_cursors(fb_connection);
-
-	return Qnil;
+	return fb_sql_fingerprint(StringValue(sql));
 }
 
-/* call-seq:
- *   drop() -> nil
- *
- * Drops connected database.
- */
-static VALUE connection_drop(VALUE self)
+static XSQLDA* sqlda_alloc(long cols)
 {
-	struct FbConnection *fb_connection;
+	XSQLDA *sqlda;
 
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
-	fb_connection->dropped = 1;
-	fb_connection_disconnect(fb_connection);
-	fb_connection_drop_cursors(fb_connection);
-
-	return Qnil;
+	sqlda = (XSQLDA*)xmalloc(XSQLDA_LENGTH(cols));
+#ifdef SQLDA_CURRENT_VERSION
+	sqlda->version = SQLDA_CURRENT_VERSION;
+#else
+	sqlda->version = SQLDA_VERSION1;
+#endif
+	sqlda->sqln = cols;
+	sqlda->sqld = 0;
+	return sqlda;
 }
 
-/* call-seq:
- *   dialect() -> int
- *
- * Returns dialect of connection.
- */
-static VALUE connection_dialect(VALUE self)
-{
-	struct FbConnection *fb_connection;
+static VALUE cursor_close _((VALUE));
+static VALUE cursor_drop _((VALUE));
+static VALUE cursor_execute _((int, VALUE*, VALUE));
+static VALUE error_is_retryable _((VALUE));
+static VALUE fb_cursor_execute_new(VALUE cursor, int argc, VALUE *argv);
+static VALUE fb_cursor_query_new(VALUE connection, VALUE transaction, int argc, VALUE *argv);
+static VALUE cursor_fetchall _((int, VALUE*, VALUE));
+static VALUE cursor_execute2(VALUE args);
+static VALUE cursor_fetch(int argc, VALUE* argv, VALUE self);
+static VALUE connection_cursor(VALUE self);
+static VALUE fb_transaction_cursor(VALUE transaction);
+static void fb_connection_read_start(struct FbConnection *fb_connection);
+static int no_lowercase(VALUE value);
 
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
-	fb_connection_check(fb_connection);
+static void fb_cursor_mark(struct FbCursor *fb_cursor);
+static void fb_cursor_free(struct FbCursor *fb_cursor);
+static void fb_connection_mark(struct FbConnection *fb_connection);
+static void fb_connection_free(struct FbConnection *fb_connection);
+static void fb_events_free(struct fb_events *events);
+static void fb_events_cancel(struct FbConnection *fb_connection);
+static void fb_cache_invalidate(struct FbConnection *fb_connection, VALUE table);
+static void fb_transaction_mark(struct FbTransaction *fb_transaction);
 
-	return INT2FIX(fb_connection->dialect);
-}
+/* ruby data types */
 
-/* call-seq:
- *   db_dialect() -> int
- *
- * Returns database dialect.
+static const rb_data_type_t fbdatabase_data_type = {
+    "FBDB",
+    {
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+    },
+    0, 0, 0
+};
+
+static const rb_data_type_t fbconnection_data_type = {
+    "fbdb/connection",
+    {
+        (void (*)(void *))fb_connection_mark,
+        (void (*)(void *))fb_connection_free,
+        NULL,
+    },
+    0, 0, 0
+};
+
+static const rb_data_type_t fbcursor_data_type = {
+    "fbdb/cursor",
+    {
+        (void (*)(void *))fb_cursor_mark,
+        (void (*)(void *))fb_cursor_free,
+        NULL,
+    },
+    0, 0, 0
+};
+
+static const rb_data_type_t fbtransaction_data_type = {
+    "fbdb/transaction",
+    {
+        (void (*)(void *))fb_transaction_mark,
+        RUBY_TYPED_DEFAULT_FREE,
+        NULL,
+    },
+    0, 0, 0
+};
+
+/* slow query log */
+
+#ifndef isc_info_sql_explain_plan
+/* clients before 3.0 lack the item; older servers just leave it unanswered */
+#define isc_info_sql_explain_plan 26
+#endif
+
+/*
+ * The access plan of a prepared statement, or nil if the server gives none.
+ * +item+ is isc_info_sql_get_plan for the one-line legacy plan or
+ * isc_info_sql_explain_plan for the detailed tree of Firebird 3 and later.
+ * Errors are left in +isc_status+ for the caller to check or ignore.
  */
-static VALUE connection_db_dialect(VALUE self)
+static VALUE fb_statement_plan(ISC_STATUS *isc_status, isc_stmt_handle *stmt, char item)
 {
-	struct FbConnection *fb_connection;
-
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
-	fb_connection_check(fb_connection);
+	VALUE plan = Qnil;
+	short size;
+	char *buffer;
+	long length;
 
-	return INT2FIX(fb_connection->db_dialect);
+	for (size = 1024; ; size = size * 4 > 32767 ? 32767 : size * 4) {
+		buffer = ALLOC_N(char, size);
+		isc_dsql_sql_info(isc_status, stmt, 1, &item, size, buffer);
+		if (isc_status[0] == 1 && isc_status[1]) {
+			break;
+		}
+		if (buffer[0] == isc_info_truncated && size < 32767) {
+			xfree(buffer);
+			continue;
+		}
+		if (buffer[0] == item) {
+			length = isc_vax_integer(buffer + 1, 2);
+			plan = rb_str_new(buffer + 3, length);
+			rb_funcall(plan, rb_intern("strip!"), 0);
+		}
+		break;
+	}
+	xfree(buffer);
+	return plan;
 }
 
-static void fb_cursor_check(struct FbCursor *fb_cursor)
+/* Strings to_json would choke on are replaced by their inspect output. */
+static VALUE fb_json_safe(VALUE value)
 {
-	if (fb_cursor->stmt == 0) {
-		rb_raise(rb_eFbError, "dropped db cursor");
+	long i;
+
+	if (TYPE(value) == T_STRING) {
+		if (rb_enc_str_asciionly_p(value)) {
+			return value;
+		}
+		value = rb_enc_associate(rb_str_dup(value), rb_utf8_encoding());
+		return rb_enc_str_coderange(value) == ENC_CODERANGE_BROKEN ? rb_inspect(value) : value;
 	}
-	if (!fb_cursor->open) {
-		rb_raise(rb_eFbError, "closed db cursor");
+	if (TYPE(value) == T_ARRAY) {
+		value = rb_ary_dup(value);
+		for (i = 0; i < RARRAY_LEN(value); i++) {
+			rb_ary_store(value, i, fb_json_safe(RARRAY_AREF(value, i)));
+		}
 	}
+	return value;
 }
 
-static void fb_cursor_drop(struct FbCursor *fb_cursor)
+#define SLOW_SET(hash, name, value) rb_hash_aset(hash, ID2SYM(rb_intern(name)), value)
+
+struct fb_slow_query_args {
+	struct FbConnection *fb_connection;
+	struct FbCursor *fb_cursor;
+	double elapsed;
+};
+
+static VALUE fb_slow_query_log(VALUE arg)
 {
+	struct fb_slow_query_args *args = (struct fb_slow_query_args *)arg;
+	struct FbConnection *fb_connection = args->fb_connection;
+	struct FbCursor *fb_cursor = args->fb_cursor;
 	ISC_STATUS isc_status[20];
-	if (fb_cursor->open) {
-		isc_dsql_free_statement(isc_status, &fb_cursor->stmt, DSQL_close);
-		fb_error_check(isc_status);
+	VALUE record, phases, params, log, line;
+	long i;
+	int phase;
+
+	phases = rb_hash_new();
+	for (phase = 0; phase < FB_PHASES; phase++) {
+		if (fb_cursor->phase_count[phase]) {
+			SLOW_SET(phases, fb_phase_names[phase], DBL2NUM(fb_cursor->phase_time[phase]));
+		}
 	}
-	isc_dsql_free_statement(isc_status, &fb_cursor->stmt, DSQL_drop);
-	fb_error_check(isc_status);
-}
+	params = fb_cursor->timed_params;
+	if (fb_connection->slow_redact) {
+		params = rb_ary_new_capa(RARRAY_LEN(params));
+		for (i = 0; i < RARRAY_LEN(fb_cursor->timed_params); i++) {
+			rb_ary_push(params, rb_str_new_cstr("[FILTERED]"));
+		}
+	}
+	record = rb_hash_new();
+	SLOW_SET(record, "sql", fb_cursor->timed_sql);
+	SLOW_SET(record, "params", params);
+	SLOW_SET(record, "elapsed", DBL2NUM(args->elapsed));
+	SLOW_SET(record, "phases", phases);
+	SLOW_SET(record, "rows", LONG2NUM(fb_cursor->timed_rows));
+	if (!NIL_P(fb_cursor->io_stats)) {
+		SLOW_SET(record, "io", fb_cursor->io_stats);
+	}
+	SLOW_SET(record, "plan", fb_cursor->stmt ? fb_statement_plan(isc_status, &fb_cursor->stmt, isc_info_sql_get_plan) : Qnil);
+	SLOW_SET(record, "at", rb_funcall(rb_cTime, rb_intern("now"), 0));
 
-static void fb_cursor_drop_warn(struct FbCursor *fb_cursor)
-{
-	ISC_STATUS isc_status[20];
-	if (fb_cursor->open) {
-		isc_dsql_free_statement(isc_status, &fb_cursor->stmt, DSQL_close);
-		fb_error_check_warn(isc_status);
+	log = fb_connection->slow_log;
+	if (rb_respond_to(log, rb_intern("call"))) {
+		rb_funcall(log, rb_intern("call"), 1, record);
+		return Qnil;
 	}
-	isc_dsql_free_statement(isc_status, &fb_cursor->stmt, DSQL_drop);
-	fb_error_check_warn(isc_status);
+	if (TYPE(log) == T_STRING) {
+		/* a file name: append JSON lines to it until the connection closes */
+		if (NIL_P(fb_connection->slow_log_file)) {
+			VALUE file = rb_funcall(rb_cFile, rb_intern("open"), 2, log, rb_str_new_cstr("a"));
+			rb_funcall(file, rb_intern("sync="), 1, Qtrue);
+			fb_connection->slow_log_file = file;
+		}
+		log = fb_connection->slow_log_file;
+	}
+	rb_require("json");
+	SLOW_SET(record, "sql", fb_json_safe(fb_cursor->timed_sql));
+	SLOW_SET(record, "params", fb_json_safe(params));
+	SLOW_SET(record, "plan", fb_json_safe(rb_hash_aref(record, ID2SYM(rb_intern("plan")))));
+	SLOW_SET(record, "at", rb_funcall(rb_funcall(rb_hash_aref(record, ID2SYM(rb_intern("at"))), rb_intern("utc"), 0),
+			rb_intern("strftime"), 1, rb_str_new_cstr("%Y-%m-%dT%H:%M:%S.%6NZ")));
+	line = rb_funcall(record, rb_intern("to_json"), 0);
+	rb_str_cat(line, "\n", 1);
+	rb_funcall(log, rb_intern("write"), 1, line);
+	return Qnil;
 }
 
-static void fb_cursor_mark(struct FbCursor *fb_cursor)
+/*
+ * Logs the statement just done if it took longer than the threshold. A
+ * failing log only warns: it must not fail the statement it reports on.
+ */
+static void fb_slow_query_check(struct FbCursor *fb_cursor)
 {
-	rb_gc_mark(fb_cursor->connection);
-	rb_gc_mark(fb_cursor->fields_ary);
-	rb_gc_mark(fb_cursor->fields_hash);
+	struct fb_slow_query_args args;
+	int phase;
+	int state;
+
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, args.fb_connection);
+	if (NIL_P(args.fb_connection->slow_log)) {
+		return;
+	}
+	args.fb_cursor = fb_cursor;
+	args.elapsed = 0;
+	for (phase = 0; phase < FB_PHASES; phase++) {
+		args.elapsed += fb_cursor->phase_time[phase];
+	}
+	if (args.fb_connection->slow_threshold < 0 || args.elapsed < args.fb_connection->slow_threshold) {
+		return;
+	}
+	rb_protect(fb_slow_query_log, (VALUE)&args, &state);
+	if (state) {
+		VALUE errinfo = rb_errinfo();
+		/* throw, break and interrupts are not the log's to swallow */
+		if (!RB_TYPE_P(errinfo, T_OBJECT) || !rb_obj_is_kind_of(errinfo, rb_eStandardError)) {
+			rb_jump_tag(state);
+		}
+		rb_set_errinfo(Qnil);
+		rb_warn("slow query log failed: %"PRIsVALUE, errinfo);
+	}
 }
 
-static void fb_cursor_free(struct FbCursor *fb_cursor)
+/* Closes the file the slow query log opened for a file name. */
+static void fb_connection_close_slow_log(struct FbConnection *fb_connection)
 {
-	if (fb_cursor->stmt) {
-		fb_cursor_drop_warn(fb_cursor);
+	VALUE file = fb_connection->slow_log_file;
+
+	fb_connection->slow_log_file = Qnil;
+	if (!NIL_P(file)) {
+		rb_io_close(file);
 	}
-	xfree(fb_cursor->i_sqlda);
-	xfree(fb_cursor->o_sqlda);
-	xfree(fb_cursor->i_buffer);
-	xfree(fb_cursor->o_buffer);
-	xfree(fb_cursor);
 }
 
-static VALUE sql_decimal_to_bigdecimal(long long sql_data, int scale)
+#undef SLOW_SET
+
+/* per-table I/O counters */
+
+static const char *fb_io_names[] = {
+	"seq_reads", "idx_reads", "inserts", "updates", "deletes", "backouts", "purges", "expunges"
+};
+#define FB_IO_COUNTERS 8
+
+/*
+ * The attachment's cumulative table counters as relation id => Array of
+ * FB_IO_COUNTERS Integers, in the order of fb_io_names. Each item answers
+ * with (2-byte relation id, 4-byte count) pairs for the tables it touched.
+ */
+static VALUE fb_io_counters(struct FbConnection *fb_connection)
 {
-	char bigdecimal_buffer[128];
-	int is_negative = 0;
-	unsigned long long abs_data;
-	int len, decimal_places, dot_pos;
+	static char items[FB_IO_COUNTERS] = {
+		isc_info_read_seq_count, isc_info_read_idx_count, isc_info_insert_count, isc_info_update_count,
+		isc_info_delete_count, isc_info_backout_count, isc_info_purge_count, isc_info_expunge_count
+	};
+	VALUE counters = rb_hash_new();
+	VALUE row, relation;
+	short size;
+	char *buffer, *p, *end, *q;
+	long length;
+	int item, i;
 
-	/* Handle negative numbers */
-	if (sql_data < 0) {
-		is_negative = 1;
-		abs_data = (unsigned long long)(-sql_data);
-	} else {
-		abs_data = (unsigned long long)sql_data;
+	for (size = 1024; ; size = size * 4 > 32767 ? 32767 : size * 4) {
+		buffer = ALLOC_N(char, size);
+		isc_database_info(fb_connection->isc_status, &fb_connection->db, sizeof(items), items, size, buffer);
+		if (fb_connection->isc_status[0] == 1 && fb_connection->isc_status[1]) {
+			xfree(buffer);
+			fb_error_check(fb_connection->isc_status);
+		}
+		for (p = buffer, end = buffer + size; p < end && *p != isc_info_end && *p != isc_info_truncated; p += length) {
+			item = *p++ - isc_info_read_seq_count;
+			length = isc_vax_integer(p, 2);
+			p += 2;
+			if (item < 0 || item >= FB_IO_COUNTERS) continue;
+			for (q = p; q + 6 <= p + length; q += 6) {
+				relation = INT2FIX(isc_vax_integer(q, 2));
+				row = rb_hash_lookup2(counters, relation, Qnil);
+				if (NIL_P(row)) {
+					row = rb_ary_new_capa(FB_IO_COUNTERS);
+					for (i = 0; i < FB_IO_COUNTERS; i++) {
+						rb_ary_push(row, INT2FIX(0));
+					}
+					rb_hash_aset(counters, relation, row);
+				}
+				rb_ary_store(row, item, LONG2NUM((unsigned long)(ISC_ULONG)isc_vax_integer(q + 2, 4)));
+			}
+		}
+		if (p < end && *p == isc_info_truncated && size < 32767) {
+			xfree(buffer);
+			counters = rb_hash_new();
+			continue;
+		}
+		break;
 	}
+	xfree(buffer);
+	return counters;
+}
 
-	/* Convert to string */
-	int wrote = snprintf(bigdecimal_buffer, sizeof(bigdecimal_buffer), "%llu", abs_data);
-	if (wrote < 0 || wrote >= (int)sizeof(bigdecimal_buffer)) {
-		rb_raise(rb_eRuntimeError, "Buffer overflow in decimal conversion");
-	}
-	len = wrote;
+static VALUE fb_relation_names_fetch(VALUE cursor)
+{
+	struct FbCursor *fb_cursor;
+	struct FbConnection *fb_connection;
+	VALUE row, name;
+	VALUE names = rb_hash_new();
 
-	/* Add decimal point if scale != 0 */
-	if (scale != 0) {
-		decimal_places = (scale < 0) ? -scale : scale;
-		dot_pos = len - decimal_places;
+	TypedData_Get_Struct(cursor, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	cursor_execute2(rb_ary_new3(2, rb_str_new_cstr("SELECT RDB$RELATION_ID, RDB$RELATION_NAME FROM RDB$RELATIONS"), cursor));
+	while ((row = cursor_fetch(0, NULL, cursor)) != Qnil) {
+		name = rb_ary_entry(row, 1);
+		rb_funcall(name, id_rstrip_bang, 0);
+		if (fb_connection->downcase_names && no_lowercase(name)) {
+			rb_funcall(name, id_downcase_bang, 0);
+		}
+		rb_hash_aset(names, rb_ary_entry(row, 0), rb_str_freeze(name));
+	}
+	fb_connection->relation_names = names;
+	return Qnil;
+}
 
-		if (dot_pos <= 0) {
-			int leading_zeros = 1 - dot_pos;
+static VALUE fb_relation_names_body(VALUE connection)
+{
+	struct FbConnection *fb_connection;
+	struct FbCursor *fb_cursor;
+	VALUE cursor;
 
-			if (len + leading_zeros + 1 >= (int)sizeof(bigdecimal_buffer)) {
-				rb_raise(rb_eRuntimeError, "Buffer overflow in decimal conversion");
-			}
+	TypedData_Get_Struct(connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	cursor = connection_cursor(connection);
+	TypedData_Get_Struct(cursor, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	fb_connection_read_start(fb_connection);
+	fb_cursor->read_only = 1;
+	fb_cursor->internal = 1;
+	return rb_ensure(fb_relation_names_fetch, cursor, cursor_drop, cursor);
+}
 
-			memmove(bigdecimal_buffer + leading_zeros, bigdecimal_buffer, len + 1);
-			memset(bigdecimal_buffer, '0', leading_zeros);
+/* Reads relation id => name from RDB$RELATIONS, in the shared read transaction. */
+static void fb_connection_load_relations(VALUE connection, struct FbConnection *fb_connection)
+{
+	int state;
+
+	/* counted as a reader so a statement prepared in the read transaction keeps it */
+	fb_connection->io_loading = 1;
+	fb_connection->read_cursors++;
+	rb_protect(fb_relation_names_body, connection, &state);
+	if (fb_connection->read_cursors > 0) {
+		fb_connection->read_cursors--;
+	}
+	fb_connection->io_loading = 0;
+	if (state) {
+		rb_jump_tag(state);
+	}
+}
 
-			len += leading_zeros;
-			dot_pos = len - decimal_places;
+/* Per-table difference between two fb_io_counters snapshots, keyed by table name. */
+static VALUE fb_io_diff(VALUE connection, struct FbConnection *fb_connection, VALUE before, VALUE after)
+{
+	VALUE result = rb_hash_new();
+	VALUE relations = rb_funcall(after, rb_intern("keys"), 0);
+	VALUE relation, counts, prev, table, name;
+	long i, delta[FB_IO_COUNTERS];
+	int item, changed, loaded = 0;
+
+	for (i = 0; i < RARRAY_LEN(relations); i++) {
+		relation = RARRAY_AREF(relations, i);
+		counts = rb_hash_aref(after, relation);
+		prev = rb_hash_lookup2(before, relation, Qnil);
+		changed = 0;
+		for (item = 0; item < FB_IO_COUNTERS; item++) {
+			delta[item] = NUM2LONG(RARRAY_AREF(counts, item)) - (NIL_P(prev) ? 0 : NUM2LONG(RARRAY_AREF(prev, item)));
+			changed |= delta[item] != 0;
 		}
+		if (!changed) continue;
 
-		if (len + 1 >= (int)sizeof(bigdecimal_buffer)) {
-			rb_raise(rb_eRuntimeError, "Buffer overflow in decimal conversion");
+		table = rb_hash_new();
+		for (item = 0; item < FB_IO_COUNTERS; item++) {
+			rb_hash_aset(table, ID2SYM(rb_intern(fb_io_names[item])), LONG2NUM(delta[item]));
 		}
 
-		memmove(bigdecimal_buffer + dot_pos + 1, bigdecimal_buffer + dot_pos, len - dot_pos);
-		bigdecimal_buffer[dot_pos] = '.';
-		bigdecimal_buffer[len + 1] = '\0';
+		name = NIL_P(fb_connection->relation_names) ? Qundef : rb_hash_lookup2(fb_connection->relation_names, relation, Qundef);
+		if (name == Qundef && !loaded) {
+			/* new tables since the last lookup */
+			fb_connection_load_relations(connection, fb_connection);
+			loaded = 1;
+			name = rb_hash_lookup2(fb_connection->relation_names, relation, Qundef);
+		}
+		rb_hash_aset(result, name == Qundef ? relation : name, table);
 	}
+	return result;
+}
 
-	/* Add minus sign after decimal point placement */
-	if (is_negative) {
-		len = (int)strlen(bigdecimal_buffer);
-		memmove(bigdecimal_buffer + 1, bigdecimal_buffer, len + 1);
-		bigdecimal_buffer[0] = '-';
-		bigdecimal_buffer[len + 1] = '\0';
+/* Takes the "before" snapshot for the statement about to run, if counting. */
+static void fb_cursor_io_start(struct FbCursor *fb_cursor, struct FbConnection *fb_connection)
+{
+	fb_cursor->io_stats = Qnil;
+	fb_cursor->io_before = Qnil;
+	if (!fb_connection->io_stats || fb_connection->io_loading) return;
+	if (NIL_P(fb_connection->relation_names)) {
+		/* before the snapshot, so the lookup isn't counted against the statement */
+		fb_connection_load_relations(fb_cursor->connection, fb_connection);
 	}
+	fb_cursor->io_before = fb_io_counters(fb_connection);
+}
 
-	return rb_funcall(rb_cObject, rb_intern("BigDecimal"), 1, rb_str_new2(bigdecimal_buffer));
+/* Called once the running statement is done: keeps what it read and wrote. */
+static void fb_cursor_io_finish(struct FbCursor *fb_cursor)
+{
+	struct FbConnection *fb_connection;
+	VALUE before = fb_cursor->io_before;
+
+	if (NIL_P(before)) return;
+	fb_cursor->io_before = Qnil;
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	if (fb_cursor->epoch != fb_connection->epoch || !fb_connection->db) return;
+	fb_cursor->io_stats = fb_io_diff(fb_cursor->connection, fb_connection, before, fb_io_counters(fb_connection));
+	fb_connection->io_last = fb_cursor->io_stats;
 }
 
-static VALUE object_to_unscaled_bigdecimal(VALUE object, int scale)
+/* Handle of a Transaction object, or NULL once it has ended. */
+static isc_tr_handle *fb_transaction_handle(struct FbTransaction *fb_transaction)
 {
-	int i;
-	long ratio = 1;
-	for (i = 0; i > scale; i--)
-		ratio *= 10;
-	if (TYPE(object) == T_FLOAT)
-		object = rb_funcall(object, rb_intern("to_s"), 0);
-	object = rb_funcall(rb_cObject, rb_intern("BigDecimal"), 1, object);
-	object = rb_funcall(object, rb_intern("*"), 1, LONG2NUM(ratio));
-	return rb_funcall(object, rb_intern("round"), 0);
+	struct fb_tr_slot *slot = fb_transaction->slot;
+	if (slot->serial != fb_transaction->serial || slot->handle == 0) {
+		return NULL;
+	}
+	return &slot->handle;
 }
 
-static void fb_cursor_set_inputparams(struct FbCursor *fb_cursor, long argc, VALUE *argv)
+/* The transaction a cursor runs in: its Fb::Transaction if any, else the connection's. */
+static isc_tr_handle *fb_cursor_transact(struct FbCursor *fb_cursor, struct FbConnection *fb_connection)
 {
-	struct FbConnection *fb_connection;
-	long count;
-	long offset;
-	short dtp;
-	VALUE obj;
-	long lvalue;
-	ISC_INT64 llvalue;
-	long alignment;
-	double dvalue;
-	double dcheck;
-	VARY *vary;
-	XSQLVAR *var;
-
-	isc_blob_handle blob_handle;
-	ISC_QUAD blob_id;
-	char *p;
-	long length;
-	struct tm tms;
+	struct FbTransaction *fb_transaction;
+	isc_tr_handle *handle;
 
-	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	if (fb_cursor->read_only) {
+		return &fb_connection->read_transact;
+	}
+	if (fb_cursor->write_auto) {
+		return &fb_connection->write_transact;
+	}
+	if (NIL_P(fb_cursor->transaction)) {
+		return &fb_connection->transact;
+	}
+	TypedData_Get_Struct(fb_cursor->transaction, struct FbTransaction, &fbtransaction_data_type, fb_transaction);
+	handle = fb_transaction_handle(fb_transaction);
+	if (!handle) {
+		rb_raise(rb_eFbError, "transaction is no longer active");
+	}
+	return handle;
+}
 
-	/* Check the number of parameters */
-	if (fb_cursor->i_sqlda->sqld != argc) {
-		rb_raise(rb_eFbError, "statement requires %d items; %ld given", fb_cursor->i_sqlda->sqld, argc);
+/* connection utilities */
+static void fb_connection_check(struct FbConnection *fb_connection)
+{
+	if (fb_connection->db == 0) {
+		rb_raise(rb_eFbError, "closed db connection");
 	}
+}
 
-	/* Get the parameters */
-	for (count = 0,offset = 0; count < argc; count++) {
-		obj = argv[count];
+static void fb_connection_close_cursors(struct FbConnection *fb_connection)
+{
+	int i;
+	long len = RARRAY_LEN(fb_connection->cursor);
+	for (i = 0; i < len; i++) {
+		cursor_close(RARRAY_PTR(fb_connection->cursor)[i]);
+	}
+}
 
-		var = &fb_cursor->i_sqlda->sqlvar[count];
-		if (!NIL_P(obj)) {
-			dtp = var->sqltype & ~1;
-			alignment = var->sqllen;
+static void fb_connection_drop_cursors(struct FbConnection *fb_connection)
+{
+	int i;
+	long len = RARRAY_LEN(fb_connection->cursor);
+	for (i = 0; i < len; i++) {
+		cursor_drop(RARRAY_PTR(fb_connection->cursor)[i]);
+	}
+  rb_ary_clear(fb_connection->cursor);
+}
 
-			switch (dtp) {
-				case SQL_TEXT :
-					alignment = 1;
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-					obj = rb_obj_as_string(obj);
-					if (RSTRING_LEN(obj) > var->sqllen) {
-						rb_raise(rb_eRangeError, "CHAR overflow: %ld bytes exceeds %d byte(s) allowed.",
-							RSTRING_LEN(obj), var->sqllen);
-					}
-					memcpy(var->sqldata, RSTRING_PTR(obj), RSTRING_LEN(obj));
-					var->sqllen = RSTRING_LEN(obj);
-					offset += var->sqllen + 1;
-					break;
+/* Rolls back Transaction objects and the autocommit transactions, ignoring errors. */
+static void fb_connection_end_transactions(struct FbConnection *fb_connection)
+{
+	ISC_STATUS isc_status[20];
+	struct fb_tr_slot *slot;
 
-				case SQL_VARYING :
-					alignment = sizeof(short);
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-					vary = (VARY *)var->sqldata;
-					obj = rb_obj_as_string(obj);
-					if (RSTRING_LEN(obj) > var->sqllen) {
-						rb_raise(rb_eRangeError, "VARCHAR overflow: %ld bytes exceeds %d byte(s) allowed.",
-							RSTRING_LEN(obj), var->sqllen);
-					}
-					memcpy(vary->vary_string, RSTRING_PTR(obj), RSTRING_LEN(obj));
-					vary->vary_length = RSTRING_LEN(obj);
-					offset += vary->vary_length + sizeof(short);
-					break;
+	for (slot = fb_connection->tr_slots; slot; slot = slot->next) {
+		if (slot->handle) {
+			isc_rollback_transaction(isc_status, &slot->handle);
+			slot->handle = 0;
+		}
+	}
+	if (fb_connection->read_transact) {
+		isc_rollback_transaction(isc_status, &fb_connection->read_transact);
+		fb_connection->read_transact = 0;
+	}
+	fb_connection->read_cursors = 0;
+	if (fb_connection->write_transact) {
+		isc_rollback_transaction(isc_status, &fb_connection->write_transact);
+		fb_connection->write_transact = 0;
+	}
+	fb_connection->write_pending = 0;
+}
 
-				case SQL_SHORT :
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-					if (var->sqlscale < 0) {
-						lvalue = NUM2LONG(object_to_unscaled_bigdecimal(obj, var->sqlscale));
-					} else {
-						lvalue = NUM2LONG(object_to_fixnum(obj));
-					}
-					if (lvalue < -32768 || lvalue > 32767) {
-						rb_raise(rb_eRangeError, "short integer overflow");
-					}
-					*(short *)var->sqldata = lvalue;
-					offset += alignment;
-					break;
+/* Waits until the idle commit, if one is running, is done with write_transact. */
+static void fb_connection_write_wait(struct FbConnection *fb_connection)
+{
+	while (fb_connection->write_committing) {
+		rb_mutex_lock(fb_connection->write_lock);
+		rb_mutex_unlock(fb_connection->write_lock);
+	}
+}
 
-				case SQL_LONG :
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-					if (var->sqlscale < 0) {
-						lvalue = NUM2LONG(object_to_unscaled_bigdecimal(obj, var->sqlscale));
-					} else {
-						lvalue = NUM2LONG(object_to_fixnum(obj));
-					}
-					if (lvalue < -2147483648LL || lvalue > 2147483647LL) {
-						rb_raise(rb_eRangeError, "integer overflow");
-					}
-					*(ISC_LONG *)var->sqldata = (ISC_LONG)lvalue;
-					offset += alignment;
-					break;
+/*
+ * Commits the autocommit write transaction and everything pending in it.
+ * With +quiet+, errors are left in the status vector for the caller.
+ */
+static void fb_connection_write_commit(struct FbConnection *fb_connection, int quiet)
+{
+	fb_connection_write_wait(fb_connection);
+	if (fb_connection->write_transact) {
+		fb_connection->write_busy++;
+		FB_PROBED(commit_done, FB_PROBE2(commit_start, fb_connection, "write"),
+			fb_commit_transaction(fb_connection->isc_status, &fb_connection->write_transact),
+			FB_PROBE4(commit_done, fb_connection, "write", fb_probe_us, fb_connection->isc_status[1]));
+		fb_connection->write_busy--;
+		if (fb_connection->isc_status[0] == 1 && fb_connection->isc_status[1]) {
+			if (quiet) return;
+			fb_error_check(fb_connection->isc_status);
+		}
+	}
+	fb_connection->write_pending = 0;
+}
 
-				case SQL_FLOAT :
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-					obj = double_from_obj(obj);
-					dvalue = NUM2DBL(obj);
-					if (dvalue >= 0.0) {
-						dcheck = dvalue;
-					} else {
-						dcheck = dvalue * -1;
-					}
-					if (dcheck != 0.0 && (dcheck < FLT_MIN || dcheck > FLT_MAX)) {
-						rb_raise(rb_eRangeError, "float overflow");
-					}
-					*(float *)var->sqldata = (float)dvalue;
-					offset += alignment;
-					break;
+static void fb_connection_disconnect(struct FbConnection *fb_connection)
+{
+	fb_events_cancel(fb_connection);
+	fb_connection_write_commit(fb_connection, 0);
+	fb_connection_end_transactions(fb_connection);
+	if (fb_connection->transact) {
+		isc_commit_transaction(fb_connection->isc_status, &fb_connection->transact);
+		fb_error_check(fb_connection->isc_status);
+	}
+	if (fb_connection->dropped) {
+		isc_drop_database(fb_connection->isc_status, &fb_connection->db);
+	} else {
+		FB_PROBED(detach_done, FB_PROBE2(detach_start, fb_connection, RSTRING_PTR(fb_connection->path)),
+			isc_detach_database(fb_connection->isc_status, &fb_connection->db),
+			FB_PROBE3(detach_done, fb_connection, fb_probe_us, fb_connection->isc_status[1]));
+	}
+	fb_error_check(fb_connection->isc_status);
+}
 
-				case SQL_DOUBLE :
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-					obj = double_from_obj(obj);
-					dvalue = NUM2DBL(obj);
-					*(double *)var->sqldata = dvalue;
-					offset += alignment;
-					break;
+static void fb_connection_disconnect_warn(struct FbConnection *fb_connection)
+{
+	fb_events_cancel(fb_connection);
+	fb_connection_write_commit(fb_connection, 1);
+	fb_connection_end_transactions(fb_connection);
+	if (fb_connection->transact) {
+		isc_commit_transaction(fb_connection->isc_status, &fb_connection->transact);
+		fb_error_check_warn(fb_connection->isc_status);
+	}
+	FB_PROBED(detach_done, FB_PROBE2(detach_start, fb_connection, RSTRING_PTR(fb_connection->path)),
+		isc_detach_database(fb_connection->isc_status, &fb_connection->db),
+		FB_PROBE3(detach_done, fb_connection, fb_probe_us, fb_connection->isc_status[1]));
+	fb_error_check_warn(fb_connection->isc_status);
+}
 
-				case SQL_INT64 :
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+static void fb_connection_mark(struct FbConnection *fb_connection)
+{
+	rb_gc_mark(fb_connection->cursor);
+	rb_gc_mark(fb_connection->path);
+	rb_gc_mark(fb_connection->tpb_cache);
+	rb_gc_mark(fb_connection->event_names);
+	rb_gc_mark(fb_connection->event_handlers);
+	rb_gc_mark(fb_connection->cache);
+	rb_gc_mark(fb_connection->stats);
+	rb_gc_mark(fb_connection->slow_log);
+	rb_gc_mark(fb_connection->slow_log_file);
+	rb_gc_mark(fb_connection->io_last);
+	rb_gc_mark(fb_connection->relation_names);
+	rb_gc_mark(fb_connection->write_timer);
+	rb_gc_mark(fb_connection->write_lock);
+}
 
-					if (var->sqlscale < 0) {
-						llvalue = NUM2LL(object_to_unscaled_bigdecimal(obj, var->sqlscale));
-					} else {
-						llvalue = NUM2LL(object_to_fixnum(obj));
-					}
+static void fb_connection_free(struct FbConnection *fb_connection)
+{
+	struct fb_tr_slot *slot;
 
-					*(ISC_INT64 *)var->sqldata = llvalue;
-					offset += alignment;
-					break;
+	if (fb_connection->db) {
+		fb_connection_disconnect_warn(fb_connection);
+	}
+	while ((slot = fb_connection->tr_slots)) {
+		fb_connection->tr_slots = slot->next;
+		xfree(slot);
+	}
+	fb_events_free(fb_connection->events);
+	xfree(fb_connection->dpb);
+	xfree(fb_connection->sp_stmts);
+	xfree(fb_connection);
+}
 
-				case SQL_BLOB :
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-					obj = rb_obj_as_string(obj);
+/* isc_database_info items answered with a single integer, by Connection#info name */
+static const struct {
+	const char *name;
+	char item;
+} fb_info_items[] = {
+	{"page_reads",		isc_info_reads},
+	{"page_writes",		isc_info_writes},
+	{"page_fetches",	isc_info_fetches},
+	{"page_marks",		isc_info_marks},
+	{"page_size",		isc_info_page_size},
+	{"page_buffers",	isc_info_num_buffers},
+	{"current_memory",	isc_info_current_memory},
+	{"max_memory",		isc_info_max_memory},
+	{"oldest_transaction",	isc_info_oldest_transaction},
+	{"oldest_active",	isc_info_oldest_active},
+	{"oldest_snapshot",	isc_info_oldest_snapshot},
+	{"next_transaction",	isc_info_next_transaction},
+	{"ods_version",		isc_info_ods_version},
+	{"ods_minor_version",	isc_info_ods_minor_version},
+	{"attachment_id",	isc_info_attachment_id},
+	{"sql_dialect",		isc_info_db_sql_dialect},
+};
+#define FB_INFO_ITEMS (int)(sizeof(fb_info_items) / sizeof(fb_info_items[0]))
 
-					blob_handle = 0;
-					isc_create_blob2(
-						fb_connection->isc_status,&fb_connection->db,&fb_connection->transact,
-						&blob_handle,&blob_id,0,NULL);
-					fb_error_check(fb_connection->isc_status);
-					length = RSTRING_LEN(obj);
-					p = RSTRING_PTR(obj);
-					while (length >= 4096) {
-						isc_put_segment(fb_connection->isc_status,&blob_handle,4096,p);
-						fb_error_check(fb_connection->isc_status);
-						p += 4096;
-						length -= 4096;
-					}
-					if (length) {
-						isc_put_segment(fb_connection->isc_status,&blob_handle,length,p);
-						fb_error_check(fb_connection->isc_status);
-					}
-					isc_close_blob(fb_connection->isc_status,&blob_handle);
-					fb_error_check(fb_connection->isc_status);
+/*
+ * Decodes an info answer. They are all counters, ids or sizes, so 4-byte
+ * ones are unsigned: isc_portable_integer would sign-extend them past 2^31.
+ */
+static LONG_LONG fb_info_integer(const char *p, short length)
+{
+	if (length <= 4) return (LONG_LONG)(ISC_ULONG)isc_vax_integer(p, length);
+	return isc_portable_integer((const ISC_UCHAR *)p, length);
+}
 
-					*(ISC_QUAD *)var->sqldata = blob_id;
-					offset += alignment;
-					break;
+/*
+ * Asks for +count+ integer items in one round trip. values[i] is left
+ * alone when the server does not answer items[i]; otherwise answered[i],
+ * unless +answered+ is NULL, is set. Errors are left in +isc_status+.
+ */
+static void fb_database_info_integers(ISC_STATUS *isc_status, isc_db_handle *db,
+		const char *items, int count, LONG_LONG *values, char *answered)
+{
+	char buffer[512];
+	char *p, *end = buffer + sizeof(buffer);
+	short length;
+	int i;
 
-				case SQL_TIMESTAMP :
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-					tm_from_timestamp(&tms, obj);
-					isc_encode_timestamp(&tms, (ISC_TIMESTAMP *)var->sqldata);
-					offset += alignment;
-					break;
+	fb_database_info(isc_status, db, (short)count, items, sizeof(buffer), buffer);
+	if (isc_status[0] == 1 && isc_status[1]) return;
+	for (p = buffer; p + 3 <= end && *p != isc_info_end && *p != isc_info_truncated; p += 3 + length) {
+		length = (short)isc_vax_integer(p + 1, 2);
+		if (p + 3 + length > end) break;
+		for (i = 0; i < count; i++) {
+			if (items[i] == *p && length <= 8) {
+				values[i] = fb_info_integer(p + 3, length);
+				if (answered) answered[i] = 1;
+			}
+		}
+	}
+}
 
-				case SQL_TYPE_TIME :
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-					tm_from_timestamp(&tms, obj);
-					isc_encode_sql_time(&tms, (ISC_TIME *)var->sqldata);
-					offset += alignment;
-					break;
+static unsigned short fb_connection_db_SQL_Dialect(struct FbConnection *fb_connection)
+{
+	char item = isc_info_db_sql_dialect;
+	LONG_LONG dialect = 1;
 
-				case SQL_TYPE_DATE :
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-					tm_from_date(&tms, obj);
-					isc_encode_sql_date(&tms, (ISC_DATE *)var->sqldata);
-					offset += alignment;
-					break;
+	fb_database_info_integers(fb_connection->isc_status, &fb_connection->db, &item, 1, &dialect, NULL);
+	fb_error_check(fb_connection->isc_status);
+	return (unsigned short)dialect;
+}
 
-#if (FB_API_VER >= 30)
-				case SQL_BOOLEAN:
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-					*(bool *)var->sqldata = RTEST(obj);
-					offset += alignment;
-					break;
-#endif
+/*
+ * Cheap liveness check: one isc_database_info round trip, no statement or
+ * transaction involved. Returns 0 if the attachment is unusable.
+ */
+static int fb_connection_ping(struct FbConnection *fb_connection)
+{
+	ISC_STATUS isc_status[20];
+	char db_info_command = isc_info_attachment_id;
+	char isc_info_buff[16];
 
-#if (FB_API_VER >= 40)
-				case SQL_INT128:
-					offset = FB_ALIGN(offset, alignment);
-					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
-#if defined(__SIZEOF_INT128__)
-					value_to_fb_int128(obj, var->sqlscale, var->sqldata);
-#else
-					rb_raise(rb_eFbError, "INT128 requires compiler support for __int128");
-#endif
-					offset += alignment;
-					break;
-#endif
+	if (fb_connection->db == 0) return 0;
+	fb_database_info(isc_status, &fb_connection->db,
+			1, &db_info_command,
+			sizeof(isc_info_buff), isc_info_buff);
+	return !(isc_status[0] == 1 && isc_status[1]);
+}
 
-				default:
-					rb_raise(rb_eFbError, "Specified table includes unsupported datatype (%d)", dtp);
-			}
+/* Releases the attachment without raising; for connections being thrown away. */
+static void fb_connection_discard(struct FbConnection *fb_connection)
+{
+	ISC_STATUS isc_status[20];
 
-			if (var->sqltype & 1) {
-				offset = FB_ALIGN(offset, sizeof(short));
-				var->sqlind = (short *)(fb_cursor->i_buffer + offset);
-				*var->sqlind = 0;
-				offset += sizeof(short);
+	fb_connection_end_transactions(fb_connection);
+	if (fb_connection->transact) {
+		isc_rollback_transaction(isc_status, &fb_connection->transact);
+		fb_connection->transact = 0;
+	}
+	if (fb_connection->db) {
+		isc_detach_database(isc_status, &fb_connection->db);
+		fb_connection->db = 0;
+	}
+}
+
+/* Status codes meaning the attachment itself is gone, not just the request. */
+static int fb_status_is_network(const ISC_STATUS *isc_status)
+{
+	int i = 0;
+
+	if (isc_status[0] != 1 || !isc_status[1]) return 0;
+	while (i < 19 && isc_status[i] != isc_arg_end) {
+		if (isc_status[i] == isc_arg_gds) {
+			switch (isc_status[i + 1]) {
+			case isc_network_error:
+			case isc_net_read_err:
+			case isc_net_write_err:
+			case isc_shutdown:
+#ifdef isc_lost_db_connection
+			case isc_lost_db_connection:
+#endif
+#ifdef isc_att_shutdown
+			case isc_att_shutdown:
+#endif
+				return 1;
 			}
-		} else if (var->sqltype & 1) {
-			var->sqldata = 0;
-			offset = FB_ALIGN(offset, sizeof(short));
-			var->sqlind = (short *)(fb_cursor->i_buffer + offset);
-			*var->sqlind = -1;
-			offset += sizeof(short);
-		} else {
-			rb_raise(rb_eFbError, "specified column is not permitted to be null");
 		}
+		i += (isc_status[i] == isc_arg_cstring) ? 3 : 2;
 	}
+	return 0;
 }
 
 /*
- * Setup output SQLDA buffer pointers. Must be called after o_sqlda is populated
- * and o_buffer is allocated/reallocated to sufficient size.
+ * Throws away a lost attachment and attaches again with the stored DPB,
+ * backing off exponentially between attempts. Cursors notice the new epoch
+ * and allocate fresh statement handles. Returns 1 once attached.
  */
-static void fb_cursor_setup_output_buffer(struct FbCursor *fb_cursor)
+static int fb_connection_reattach(struct FbConnection *fb_connection)
 {
-	long cols = fb_cursor->o_sqlda->sqld;
-	long count;
-	long offset = 0;
-	long length;
-	long alignment;
-	XSQLVAR *var;
-	short dtp;
-
-	for (var = fb_cursor->o_sqlda->sqlvar, count = 0; count < cols; var++, count++) {
-		length = alignment = var->sqllen;
-		dtp = var->sqltype & ~1;
-
-		if (dtp == SQL_TEXT) {
-			alignment = 1;
-		} else if (dtp == SQL_VARYING) {
-			length += sizeof(short);
-			alignment = sizeof(short);
+	ISC_STATUS *isc_status = fb_connection->isc_status;
+	int attempt;
+
+	fb_connection_discard(fb_connection);
+	fb_connection->reconnect_pending = 1;
+	for (attempt = 0; attempt == 0 || attempt < fb_connection->reconnect_attempts; attempt++) {
+		if (attempt > 0) {
+			double delay = fb_connection->reconnect_backoff * (1 << (attempt - 1));
+			rb_funcall(rb_mKernel, rb_intern("sleep"), 1, DBL2NUM(delay));
 		}
-
-		offset = FB_ALIGN(offset, alignment);
-		var->sqldata = (char*)(fb_cursor->o_buffer + offset);
-		offset += length;
-		offset = FB_ALIGN(offset, sizeof(short));
-		var->sqlind = (short*)(fb_cursor->o_buffer + offset);
-		offset += sizeof(short);
+		fb_attach_database(isc_status, RSTRING_PTR(fb_connection->path), &fb_connection->db,
+				fb_connection->dpb_length, fb_connection->dpb);
+		if (!(isc_status[0] == 1 && isc_status[1])) {
+			fb_connection->reconnect_pending = 0;
+			fb_connection->epoch++;
+			return 1;
+		}
+		fb_connection->db = 0;
 	}
+	return 0;
 }
 
-static VALUE precision_from_sqlvar(XSQLVAR *sqlvar)
+/* True when the last call on this connection failed because the attachment was lost. */
+static int fb_connection_lost(struct FbConnection *fb_connection)
 {
-	switch(sqlvar->sqltype & ~1) {
-		case SQL_TEXT:		return Qnil;
-		case SQL_VARYING:	return Qnil;
-		case SQL_SHORT:
-			switch (sqlvar->sqlsubtype) {
-				case 0:		return INT2FIX(0);
-				case 1:		return INT2FIX(4);
-				case 2:		return INT2FIX(4);
-			}
-			break;
-		case SQL_LONG:
-			switch (sqlvar->sqlsubtype) {
-				case 0:		return INT2FIX(0);
-				case 1:		return INT2FIX(9);
-				case 2:		return INT2FIX(9);
-			}
-			break;
-		case SQL_FLOAT:		return Qnil;
-		case SQL_DOUBLE:
-		case SQL_D_FLOAT:
-			switch (sqlvar->sqlsubtype) {
-				case 0:		return Qnil;
-				case 1:		return INT2FIX(15);
-				case 2:		return INT2FIX(15);
-			}
-			break;
-		case SQL_TIMESTAMP:	return Qnil;
-		case SQL_BLOB:		return Qnil;
-		case SQL_ARRAY:		return Qnil;
-#if (FB_API_VER >= 30)
-		case SQL_BOOLEAN: return Qnil;
-#endif
-		case SQL_QUAD:		return Qnil;
-		case SQL_TYPE_TIME:	return Qnil;
-		case SQL_TYPE_DATE:	return Qnil;
-		case SQL_INT64:
-			switch (sqlvar->sqlsubtype) {
-				case 0:		return INT2FIX(0);
-				case 1:		return INT2FIX(18);
-				case 2:		return INT2FIX(18);
-			}
-			break;
-#if (FB_API_VER >= 40)
-		case SQL_INT128:
-			switch (sqlvar->sqlsubtype) {
-				case 0:		return INT2FIX(0);
-				case 1:		return INT2FIX(38);
-				case 2:		return INT2FIX(38);
-			}
-			break;
-#endif
-	}
-	return Qnil;
+	return fb_connection->auto_reconnect && fb_connection->dpb &&
+		fb_status_is_network(fb_connection->isc_status);
 }
 
-static int no_lowercase(VALUE value)
+static unsigned short fb_connection_dialect(struct FbConnection *fb_connection)
 {
-	VALUE local_value = StringValue(value);
-	int result = rb_funcall(re_lowercase, id_matches, 1, local_value) == Qnil;
-	return result;
+	return fb_connection->dialect;
 }
 
-static VALUE fb_cursor_fields_ary(XSQLDA *sqlda, short downcase_names)
+/* Transaction option list */
+
+static trans_opts	rcom_opt_S[] =
 {
-	long cols;
-	long count;
-	XSQLVAR *var;
-	short dtp;
-	VALUE ary;
+	{"NO",			"RECORD_VERSION",	isc_tpb_no_rec_version,	-1,	0},
+	{"RECORD_VERSION",	0,			isc_tpb_rec_version,	-1,	0},
+#ifdef isc_tpb_read_consistency
+	{"READ",		"CONSISTENCY",		isc_tpb_read_consistency,	-1,	0},
+#endif
+	{"*",			0,			isc_tpb_no_rec_version,	-1,	0},
+	{0,			0,			0,			0,	0}
+};
 
-	cols = sqlda->sqld;
-	if (cols == 0) {
-		return Qnil;
-	}
 
-	ary = rb_ary_new();
-	for (count = 0; count < cols; count++) {
-		VALUE field;
-		VALUE name, type_code, sql_type, sql_subtype, display_size, internal_size, precision, scale, nullable;
+static trans_opts	read_opt_S[] =
+{
+	{"WRITE",	0,	isc_tpb_write,		1,	0},
+	{"ONLY",		0,	isc_tpb_read,		1,	0},
+	{"COMMITTED",	0,	isc_tpb_read_committed,	2,	rcom_opt_S},
+	{0,		0,	0,			0,	0}
+};
 
-		var = &sqlda->sqlvar[count];
-		dtp = var->sqltype & ~1;
 
-		if (var->aliasname_length) {
-			name = rb_str_new(var->aliasname, var->aliasname_length);
-		} else {
-			name = rb_str_new(var->sqlname, var->sqlname_length);
-		}
-		if (downcase_names && no_lowercase(name)) {
-			rb_funcall(name, id_downcase_bang, 0);
-		}
-		rb_str_freeze(name);
-		type_code = INT2NUM((int)(var->sqltype & ~1));
-		sql_type = fb_sql_type_from_code(dtp, var->sqlsubtype);
-		sql_subtype = INT2FIX(var->sqlsubtype);
-		display_size = INT2NUM((int)var->sqllen);
-		if (dtp == SQL_VARYING) {
-			internal_size = INT2NUM((int)(var->sqllen + sizeof(short)));
-		} else {
-			internal_size = INT2NUM((int)var->sqllen);
-		}
-		precision = precision_from_sqlvar(var);
-		scale = INT2NUM((int)var->sqlscale);
-		nullable = (var->sqltype & 1) ? Qtrue : Qfalse;
+static trans_opts	snap_opt_S[] =
+{
+	{"TABLE",	"STABILITY",	isc_tpb_consistency,	2,	0},
+	{"*",		0,		isc_tpb_concurrency,	2,	0},
+	{0,			0,	0,			0,	0}
+};
 
-		field = rb_struct_new(rb_sFbField, name, sql_type, sql_subtype, display_size, internal_size, precision, scale, nullable, type_code);
-		rb_ary_push(ary, field);
-	}
-	rb_ary_freeze(ary);
-	return ary;
-}
 
-static VALUE fb_cursor_fields_hash(VALUE fields_ary)
+static trans_opts	isol_opt_S[] =
 {
-	int i;
-	VALUE hash = rb_hash_new();
-
-	for (i = 0; i < RARRAY_LEN(fields_ary); i++) {
-		VALUE field = rb_ary_entry(fields_ary, i);
-		VALUE name = rb_struct_aref(field, LONG2NUM(0));
-		rb_hash_aset(hash, name, field);
-	}
+	{"SNAPSHOT",	0,		0,			0,	snap_opt_S},
+	{"READ",		"COMMITTED",	isc_tpb_read_committed,	2,	rcom_opt_S},
+	{0,		0,		0,			0,	0}
+};
 
-	return hash;
-}
 
-static void fb_cursor_fetch_prep(struct FbCursor *fb_cursor)
+static trans_opts	undo_opt_S[] =
 {
-	struct FbConnection *fb_connection;
-	long cols;
-	long count;
-	XSQLVAR *var;
-	short dtp;
-	long length;
-	long alignment;
-	long offset;
+	{"UNDO",	0,	0,	0,	0},
+	{0,		0,	0,	0,	0}
+};
 
-	fb_cursor_check(fb_cursor);
 
-	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
-	fb_connection_check(fb_connection);
+/* options followed by a number */
+#define	TPB_OPT_RESERVING	-1
+#define	TPB_OPT_LOCK_TIMEOUT	-2
+#define	TPB_OPT_SNAPSHOT_NUMBER	-3
 
-	/* Check if open cursor */
-	if (!fb_cursor->open) {
-		rb_raise(rb_eFbError, "The cursor has not been opened. Use execute(query)");
-	}
-	/* Describe output SQLDA */
-	isc_dsql_describe(fb_connection->isc_status, &fb_cursor->stmt, 1, fb_cursor->o_sqlda);
-	fb_error_check(fb_connection->isc_status);
+static trans_opts	trans_opt_S[] =
+{
+	{"READ",		0,		0,		0,	read_opt_S},
+	{"WAIT",		0,		isc_tpb_wait,	3,	0},
+	{"NO",		"WAIT",		isc_tpb_nowait,	3,	0},
+	{"NO",		"AUTO",		isc_tpb_no_auto_undo,	-1,	undo_opt_S},
+	{"AUTO",		"COMMIT",	isc_tpb_autocommit,	-1,	0},
+	{"LOCK",		"TIMEOUT",	TPB_OPT_LOCK_TIMEOUT,	0,	0},
+#ifdef isc_tpb_at_snapshot_number
+	{"AT",		"NUMBER",	TPB_OPT_SNAPSHOT_NUMBER,	0,	0},
+	{"AT",		"SNAPSHOT",	TPB_OPT_SNAPSHOT_NUMBER,	0,	0},	/* earlier spelling, still accepted */
+#endif
+	{"ISOLATION",	"LEVEL",	0,		0,	isol_opt_S},
+	{"SNAPSHOT",	0,		0,		0,	snap_opt_S},
+	{"RESERVING",	0,		TPB_OPT_RESERVING,	0,	0},
+	{0,		0,		0,		0,	0}
+};
 
-	/* Set the output SQLDA */
-	cols = fb_cursor->o_sqlda->sqld;
-	for (var = fb_cursor->o_sqlda->sqlvar, offset = 0, count = 0; count < cols; var++, count++) {
-		length = alignment = var->sqllen;
-		dtp = var->sqltype & ~1;
+/* Name1	Name2		Option value	    Position	Sub-option */
 
-		if (dtp == SQL_TEXT) {
-			alignment = 1;
-		} else if (dtp == SQL_VARYING) {
-			length += sizeof(short);
-			alignment = sizeof(short);
-		}
-		offset = FB_ALIGN(offset, alignment);
-		var->sqldata = (char*)(fb_cursor->o_buffer + offset);
-		offset += length;
-		offset = FB_ALIGN(offset, sizeof(short));
-		var->sqlind = (short*)(fb_cursor->o_buffer + offset);
-		offset += sizeof(short);
-	}
-}
+#define	RESV_TABLEEND	"FOR"
+#define	RESV_SHARED	"SHARED"
+#define	RESV_PROTECTD	"PROTECTED"
+#define	RESV_READ	"READ"
+#define	RESV_WRITE	"WRITE"
+#define	RESV_CONTINUE	','
 
-static VALUE fb_cursor_fetch(struct FbCursor *fb_cursor)
+static char* trans_parseopts(VALUE opt, long *tpb_len)
 {
-	struct FbConnection *fb_connection;
-	long cols;
-	VALUE ary;
-	long count;
-	XSQLVAR *var;
-	long dtp;
-	VALUE val;
-	VARY *vary;
-	struct tm tms;
-
-	isc_blob_handle blob_handle;
-	ISC_QUAD blob_id;
-	unsigned short actual_seg_len;
-	static char blob_items[] = {
-		isc_info_blob_max_segment,
-		isc_info_blob_num_segments,
-		isc_info_blob_total_length
-	};
-	char blob_info[32];
-	char *p, item;
-	short length;
-	unsigned short max_segment = 0;
-	ISC_LONG num_segments = 0;
-	ISC_LONG total_length = 0;
-
-	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
-	fb_connection_check(fb_connection);
+	char *s, *trans;
+	long used;
+	long size;
+	char *tpb;
+	trans_opts *curr_p;
+	trans_opts *target_p;
+	char *check1_p;
+	char *check2_p;
+	int count;
+	int next_c;
+	char check_f[4];
+	char *resv_p;
+	char *resend_p;
+	char *tblend_p = 0;
+	long tbl_len;
+	long res_first;
+	int res_count;
+	long ofs;
+	char sp_prm;
+	char rw_prm;
+	int cont_f;
+	char value_opt = 0;
+	LONG_LONG number;
+	char *number_end;
+	const char *desc = 0;
 
-	if (fb_cursor->eof) {
-		rb_raise(rb_eFbError, "Cursor is past end of data.");
-	}
-	/* Fetch one row */
-	if (isc_dsql_fetch(fb_connection->isc_status, &fb_cursor->stmt, 1, fb_cursor->o_sqlda) == SQLCODE_NOMORE) {
-		fb_cursor->eof = Qtrue;
-		return Qnil;
+	/* Initialize */
+	s = StringValuePtr(opt);
+	trans = ALLOCA_N(char, strlen(s)+1);
+	strcpy(trans, s);
+	s = trans;
+	while (*s) {
+		*s = UPPER(*s);
+		s++;
 	}
-	fb_error_check(fb_connection->isc_status);
 
-	/* Create the result tuple object */
-	cols = fb_cursor->o_sqlda->sqld;
-	ary = rb_ary_new2(cols);
+	used = 0;
+	size = 0;
+	tpb = NULL;
+	memset((void *)check_f, 0, sizeof(check_f));
 
-	/* Create the result objects for each column */
-	for (count = 0; count < cols; count++) {
-		var = &fb_cursor->o_sqlda->sqlvar[count];
-		dtp = var->sqltype & ~1;
+	/* Set the default transaction option */
+	tpb = (char*)xmalloc(TPBBUFF_ALLOC);
+	size = TPBBUFF_ALLOC;
+	memcpy((void*)tpb, (void*)isc_tpb_0, sizeof(isc_tpb_0));
+	used = sizeof(isc_tpb_0);
 
-		/* Check if column is null */
-		if ((var->sqltype & 1) && (*var->sqlind < 0)) {
-			val = Qnil;
-		} else {
-			switch (dtp) {
-				case SQL_TEXT:
-					val = rb_str_new(var->sqldata, var->sqllen);
+	/* Analize the transaction option strings */
+	curr_p = trans_opt_S;
+	check1_p = strtok(trans, CMND_DELIMIT);
+	if (check1_p) {
+		check2_p = strtok(0, CMND_DELIMIT);
+	} else {
+		check2_p = 0;
+	}
+	while (curr_p) {
+		target_p = 0;
+		next_c = 0;
+		for (count = 0; curr_p[count].option1; count++) {
+			if (!strcmp(curr_p[count].option1, "*")) {
+				target_p = &curr_p[count];
+				break;
+			} else if (check1_p && !strcmp(check1_p, curr_p[count].option1)) {
+				if (!curr_p[count].option2) {
+					next_c = 1;
+					target_p = &curr_p[count];
 					break;
-
-				case SQL_VARYING:
-					vary = (VARY*)var->sqldata;
-					val = rb_str_new(vary->vary_string, vary->vary_length);
-					#if HAVE_RUBY_ENCODING_H
-					rb_funcall(val, id_force_encoding, 1, fb_connection->encoding);
-					#endif
+				} else if (check2_p && !strcmp(check2_p, curr_p[count].option2)) {
+					next_c = 2;
+					target_p = &curr_p[count];
 					break;
+				}
+			}
+		}
 
-				case SQL_SHORT:
-					if (var->sqlscale < 0) {
-						val = sql_decimal_to_bigdecimal((long long)*(ISC_SHORT*)var->sqldata, var->sqlscale);
-					} else {
-						val = INT2NUM((int)*(short*)var->sqldata);
-					}
-					break;
+		if (!target_p) {
+			desc = "Illegal transaction option was specified";
+			goto error;
+		}
 
-				case SQL_LONG:
-					if (var->sqlscale < 0) {
-						val = sql_decimal_to_bigdecimal((long long)*(ISC_LONG*)var->sqldata, var->sqlscale);
-					} else {
-						val = INT2NUM(*(ISC_LONG*)var->sqldata);
+		/* Set the transaction option */
+		if (target_p->optval > '\0') {
+			if (target_p->position > 0) {
+				if (check_f[target_p->position]) {
+					desc = "Duplicate transaction option was specified";
+					goto error;
+				}
+				tpb[target_p->position] = target_p->optval;
+				check_f[target_p->position] = 1;
+			} else {
+				if (used + 1 > size) {
+					tpb = (char *)xrealloc(tpb, size + TPBBUFF_ALLOC);
+					size += TPBBUFF_ALLOC;
+				}
+				tpb[used] = target_p->optval;
+				used++;
+			}
+		} else if (target_p->optval < TPB_OPT_RESERVING) {	/* LOCK TIMEOUT n, AT NUMBER n */
+			value_opt = target_p->optval;
+		} else if (target_p->optval) {		/* RESERVING ... FOR */
+			if (check_f[0]) {
+				desc = "Duplicate transaction option was specified";
+				goto error;
+			}
+			resv_p = check2_p;
+			if (!resv_p || !strcmp(resv_p, RESV_TABLEEND)) {
+				desc = "RESERVING needs table name list";
+				goto error;
+			}
+			while (resv_p) {
+				res_first = used;
+				res_count = 0;
+				resend_p = strtok(0, CMND_DELIMIT);
+				while (resend_p) {
+					if (!strcmp(resend_p, RESV_TABLEEND)) {
+						break;
 					}
-					break;
-
-				case SQL_FLOAT:
-					val = rb_float_new((double)*(float*)var->sqldata);
-					break;
+					resend_p = strtok(0, CMND_DELIMIT);
+				}
 
-				case SQL_DOUBLE:
-					val = rb_float_new(*(double*)var->sqldata);
-					break;
+				if (!resend_p) {
+					desc = "Illegal transaction option was specified";
+					goto error;
+				}
 
-				case SQL_INT64:
-					if (var->sqlscale < 0) {
-						val = sql_decimal_to_bigdecimal(*(ISC_INT64*)var->sqldata, var->sqlscale);
+				while (resv_p < resend_p) {
+					if (*resv_p == '\0' || (ofs = strspn(resv_p, LIST_DELIMIT)) < 0) {
+						resv_p++;
 					} else {
-						val = LL2NUM(*(ISC_INT64*)var->sqldata);
+						resv_p = &resv_p[ofs];
+						tblend_p = strpbrk(resv_p, LIST_DELIMIT);
+						if (tblend_p) {
+							tbl_len = tblend_p - resv_p;
+						} else {
+							tbl_len = strlen(resv_p);
+						}
+						if (tbl_len > META_NAME_MAX) {
+							desc = "Illegal table name was specified";
+							goto error;
+						}
+
+						if (tbl_len > 0) {
+							if (used + tbl_len + 3 > size) {
+								tpb = (char*)xrealloc(tpb, size+TPBBUFF_ALLOC);
+								size += TPBBUFF_ALLOC;
+							}
+							tpb[used+1] = (char)tbl_len;
+							memcpy((void *)&tpb[used+2],resv_p, tbl_len);
+							used += tbl_len + 3;
+							res_count++;
+						}
+						resv_p += tbl_len;
 					}
-					break;
+				}
 
-				case SQL_TIMESTAMP:
-					isc_decode_timestamp((ISC_TIMESTAMP *)var->sqldata, &tms);
-					val = fb_mktime(&tms, "local");
-					break;
+				resv_p = strtok(0, CMND_DELIMIT);
+				if (resv_p && !strcmp(resv_p, RESV_SHARED)) {
+					sp_prm = isc_tpb_shared;
+				} else if (resv_p && !strcmp(resv_p, RESV_PROTECTD)) {
+					sp_prm = isc_tpb_protected;
+				} else {
+					desc = "RESERVING needs {SHARED|PROTECTED} {READ|WRITE}";
+					goto error;
+				}
 
-				case SQL_TYPE_TIME:
-					isc_decode_sql_time((ISC_TIME *)var->sqldata, &tms);
-					tms.tm_year = 100;
-					tms.tm_mon = 0;
-					tms.tm_mday = 1;
-					val = fb_mktime(&tms, "utc");
-					break;
-
-				case SQL_TYPE_DATE:
-					isc_decode_sql_date((ISC_DATE *)var->sqldata, &tms);
-					val = fb_mkdate(&tms);
-					break;
-
-				case SQL_BLOB:
-					blob_handle = 0;
-					blob_id = *(ISC_QUAD *)var->sqldata;
-					isc_open_blob2(fb_connection->isc_status, &fb_connection->db, &fb_connection->transact, &blob_handle, &blob_id, 0, NULL);
-					fb_error_check(fb_connection->isc_status);
-					isc_blob_info(
-						fb_connection->isc_status, &blob_handle,
-						sizeof(blob_items), blob_items,
-						sizeof(blob_info), blob_info);
-					fb_error_check(fb_connection->isc_status);
-					for (p = blob_info; *p != isc_info_end; p += length) {
-						item = *p++;
-						length = (short) isc_vax_integer(p,2);
-						p += 2;
-						switch (item) {
-							case isc_info_blob_max_segment:
-								max_segment = isc_vax_integer(p,length);
-								break;
-							case isc_info_blob_num_segments:
-								num_segments = isc_vax_integer(p,length);
-								break;
-							case isc_info_blob_total_length:
-								total_length = isc_vax_integer(p,length);
-								break;
+				cont_f = 0;
+				resv_p = strtok(0, CMND_DELIMIT);
+				if (resv_p) {
+					if (resv_p[strlen(resv_p)-1] == RESV_CONTINUE) {
+						cont_f = 1;
+						resv_p[strlen(resv_p)-1] = '\0';
+					} else {
+						tblend_p = strpbrk(resv_p, LIST_DELIMIT);
+						if (tblend_p) {
+							cont_f = 2;
+							*tblend_p = '\0';
 						}
 					}
-					val = rb_str_new(NULL,total_length);
-					for (p = RSTRING_PTR(val); num_segments > 0; num_segments--, p += actual_seg_len) {
-						isc_get_segment(fb_connection->isc_status, &blob_handle, &actual_seg_len, max_segment, p);
-						fb_error_check(fb_connection->isc_status);
+				}
+
+				if (resv_p && !strcmp(resv_p, RESV_READ)) {
+					rw_prm = isc_tpb_lock_read;
+				} else if (resv_p && !strcmp(resv_p, RESV_WRITE)) {
+					rw_prm = isc_tpb_lock_write;
+				} else {
+					desc = "RESERVING needs {SHARED|PROTECTED} {READ|WRITE}";
+					goto error;
+				}
+
+				ofs = res_first;
+				for (count = 0; count < res_count; count++) {
+					tpb[ofs++] = rw_prm;
+					ofs += tpb[ofs] + 1;
+					tpb[ofs++] = sp_prm;
+				}
+
+				if (cont_f == 1) {
+					resv_p = strtok(0, CMND_DELIMIT);
+					if (!resv_p) {
+						desc = "Unexpected end of command";
+						goto error;
 					}
-					/* Only apply encoding for text blobs (subtype 1), not for binary */
-					#if HAVE_RUBY_ENCODING_H
-					if (var->sqlsubtype == 1) {
-						rb_funcall(val, id_force_encoding, 1, fb_connection->encoding);
+				}
+				if (cont_f == 2) {
+					resv_p = tblend_p + 1;
+				} else {
+					resv_p = strtok(0, CMND_DELIMIT);
+					if (resv_p) {
+						if ((int)strlen(resv_p) == 1 && resv_p[0] == RESV_CONTINUE) {
+							resv_p = strtok(0, CMND_DELIMIT);
+							if (!resv_p) {
+								desc = "Unexpected end of command";
+								goto error;
+							}
+						} else if (resv_p[0] == RESV_CONTINUE) {
+							resv_p++;
+						} else {
+							next_c = 1;
+							check2_p = resv_p;
+							resv_p = 0;
+						}
+					} else {
+						next_c = 0;
+						check1_p = check2_p = 0;
 					}
-					#endif
-					isc_close_blob(fb_connection->isc_status, &blob_handle);
-					fb_error_check(fb_connection->isc_status);
-					break;
-				case SQL_ARRAY:
-					rb_warn("ARRAY not supported (yet)");
-					val = Qnil;
-					break;
+				}
+			}
 
-#if (FB_API_VER >= 40)
-				case SQL_INT128:
-#if defined(__SIZEOF_INT128__)
-					val = fb_int128_to_value(var->sqldata, var->sqlscale);
+			check_f[0] = 1;
+		}
+
+
+		/* Set the next check list */
+		curr_p = target_p->sub_opts;
+
+		for (count = 0; count < next_c; count++) {
+			check1_p = check2_p;
+			if (check2_p) {
+				check2_p = strtok(0, CMND_DELIMIT);
+			}
+		}
+
+		if (value_opt) {
+			if (!strcmp(target_p->option2, "SNAPSHOT")) {
+				if (!check1_p || strcmp(check1_p, "NUMBER")) {
+					desc = "AT SNAPSHOT needs NUMBER n";
+					goto error;
+				}
+				check1_p = check2_p;
+				if (check2_p) {
+					check2_p = strtok(0, CMND_DELIMIT);
+				}
+			}
+			number = check1_p ? strtoll(check1_p, &number_end, 10) : -1;
+			if (number < 0 || *number_end || number_end == check1_p ||
+					(value_opt == TPB_OPT_LOCK_TIMEOUT && number > 0x7fffffff)) {
+				desc = "Illegal number was specified in transaction option";
+				goto error;
+			}
+			if (value_opt == TPB_OPT_LOCK_TIMEOUT) {
+				/* a lock timeout only makes sense when waiting */
+				if (check_f[3] && tpb[3] != isc_tpb_wait) {
+					desc = "LOCK TIMEOUT conflicts with NO WAIT";
+					goto error;
+				}
+				tpb[3] = isc_tpb_wait;
+				check_f[3] = 1;
+			}
+			if (used + 10 > size) {
+				tpb = (char *)xrealloc(tpb, size + TPBBUFF_ALLOC);
+				size += TPBBUFF_ALLOC;
+			}
+#ifdef isc_tpb_at_snapshot_number
+			tpb[used++] = (value_opt == TPB_OPT_LOCK_TIMEOUT) ? isc_tpb_lock_timeout : isc_tpb_at_snapshot_number;
 #else
-					rb_raise(rb_eFbError, "INT128 requires compiler support for __int128");
-#endif
-					break;
+			tpb[used++] = isc_tpb_lock_timeout;
 #endif
+			/* little-endian, as isc_portable_integer reads it back */
+			tpb[used++] = (value_opt == TPB_OPT_LOCK_TIMEOUT) ? 4 : 8;
+			for (count = 0; count < tpb[used - 1]; count++) {
+				tpb[used + count] = (char)((number >> (8 * count)) & 0xff);
+			}
+			used += tpb[used - 1];
+			value_opt = 0;
 
-#if (FB_API_VER >= 30)
-				case SQL_BOOLEAN:
-					val = (*(bool*)var->sqldata) ? Qtrue : Qfalse;
-					break;
+			check1_p = check2_p;
+			if (check2_p) {
+				check2_p = strtok(0, CMND_DELIMIT);
+			}
+		}
+
+		if (check1_p && !curr_p) {
+			curr_p = trans_opt_S;
+		}
+	}
+
+	/* Set the results */
+	*tpb_len = used;
+	return tpb;
+
+error:
+	xfree(tpb);
+	rb_raise(rb_eFbError, "%s", desc);
+}
+
+/* compiled transaction options */
+
+static void fb_transaction_options_mark(struct FbTransactionOptions *fb_options)
+{
+	rb_gc_mark(fb_options->source);
+}
+
+static void fb_transaction_options_free(struct FbTransactionOptions *fb_options)
+{
+	xfree(fb_options->tpb);
+	xfree(fb_options);
+}
+
+static const rb_data_type_t fbtransaction_options_data_type = {
+    "fbdb/transaction_options",
+    {
+        (void (*)(void *))fb_transaction_options_mark,
+        (void (*)(void *))fb_transaction_options_free,
+        NULL,
+    },
+    0, 0,
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+    RUBY_TYPED_FROZEN_SHAREABLE
+#else
+    0
 #endif
+};
+
+static VALUE transaction_options_allocate_instance(VALUE klass)
+{
+	struct FbTransactionOptions *fb_options;
+	VALUE obj = TypedData_Make_Struct(klass, struct FbTransactionOptions, &fbtransaction_options_data_type, fb_options);
+	fb_options->source = Qnil;
+	return obj;
+}
+
+static void fb_options_append(VALUE str, const char *option)
+{
+	if (RSTRING_LEN(str) > 0) {
+		rb_str_cat2(str, " ");
+	}
+	rb_str_cat2(str, option);
+}
+
+static VALUE fb_options_fetch(VALUE hash, const char *key, long *found)
+{
+	VALUE value = rb_hash_lookup2(hash, ID2SYM(rb_intern(key)), Qundef);
+	if (value == Qundef) {
+		return Qnil;
+	}
+	(*found)++;
+	return value;
+}
+
+/* Spells out a Hash of transaction options as an option string. */
+static VALUE fb_transaction_options_string(VALUE hash)
+{
+	VALUE str = rb_str_new(0, 0);
+	VALUE access, isolation, wait, lock_timeout, rec_version, read_consistency;
+	VALUE no_auto_undo, auto_commit, snapshot_number, reserving;
+	long found = 0;
+
+	access = fb_options_fetch(hash, "access", &found);
+	isolation = fb_options_fetch(hash, "isolation", &found);
+	rec_version = fb_options_fetch(hash, "rec_version", &found);
+	read_consistency = fb_options_fetch(hash, "read_consistency", &found);
+	wait = fb_options_fetch(hash, "wait", &found);
+	lock_timeout = fb_options_fetch(hash, "lock_timeout", &found);
+	no_auto_undo = fb_options_fetch(hash, "no_auto_undo", &found);
+	auto_commit = fb_options_fetch(hash, "auto_commit", &found);
+	snapshot_number = fb_options_fetch(hash, "snapshot_number", &found);
+	reserving = fb_options_fetch(hash, "reserving", &found);
+	if ((size_t)found != RHASH_SIZE(hash)) {
+		rb_raise(rb_eArgError, "unknown transaction option in %"PRIsVALUE, rb_inspect(hash));
+	}
+
+	if (access == ID2SYM(rb_intern("read"))) {
+		fb_options_append(str, "READ ONLY");
+	} else if (access == ID2SYM(rb_intern("write"))) {
+		fb_options_append(str, "READ WRITE");
+	} else if (!NIL_P(access)) {
+		rb_raise(rb_eArgError, "access must be :read or :write");
+	}
+
+	if (isolation == ID2SYM(rb_intern("snapshot"))) {
+		fb_options_append(str, "SNAPSHOT");
+	} else if (isolation == ID2SYM(rb_intern("table_stability"))) {
+		fb_options_append(str, "SNAPSHOT TABLE STABILITY");
+	} else if (isolation == ID2SYM(rb_intern("read_committed"))) {
+		fb_options_append(str, "READ COMMITTED");
+		if (RTEST(read_consistency)) {
+			fb_options_append(str, "READ CONSISTENCY");
+		} else if (RTEST(rec_version)) {
+			fb_options_append(str, "RECORD_VERSION");
+		}
+	} else if (!NIL_P(isolation)) {
+		rb_raise(rb_eArgError, "isolation must be :snapshot, :table_stability or :read_committed");
+	}
+	if (!NIL_P(snapshot_number)) {
+		fb_options_append(str, "AT NUMBER");
+		rb_str_append(str, rb_sprintf(" %"PRIsVALUE, rb_Integer(snapshot_number)));
+	}
+
+	if (!NIL_P(wait)) {
+		fb_options_append(str, RTEST(wait) ? "WAIT" : "NO WAIT");
+	}
+	if (!NIL_P(lock_timeout)) {
+		fb_options_append(str, "LOCK TIMEOUT");
+		rb_str_append(str, rb_sprintf(" %ld", NUM2LONG(rb_Integer(lock_timeout))));
+	}
+	if (RTEST(no_auto_undo)) {
+		fb_options_append(str, "NO AUTO UNDO");
+	}
+	if (RTEST(auto_commit)) {
+		fb_options_append(str, "AUTO COMMIT");
+	}
+	if (!NIL_P(reserving)) {
+		fb_options_append(str, "RESERVING");
+		fb_options_append(str, StringValueCStr(reserving));
+	}
+	return str;
+}
+
+/* call-seq:
+ *   TransactionOptions.new(options) -> TransactionOptions
+ *
+ * Compiles transaction options, given as a String (<tt>"READ COMMITTED NO WAIT"</tt>)
+ * or a Hash (<tt>isolation: :read_committed, wait: false</tt>), into a frozen
+ * transaction parameter block that can be passed to Connection#transaction
+ * and Connection#start_transaction any number of times.
+ *
+ * Hash keys: +access+ (:read, :write), +isolation+ (:snapshot,
+ * :table_stability, :read_committed), +rec_version+, +read_consistency+,
+ * +wait+, +lock_timeout+ (seconds), +no_auto_undo+, +auto_commit+,
+ * +snapshot_number+ and +reserving+.
+ */
+static VALUE transaction_options_initialize(VALUE self, VALUE opt)
+{
+	struct FbTransactionOptions *fb_options;
+	VALUE source;
+
+	TypedData_Get_Struct(self, struct FbTransactionOptions, &fbtransaction_options_data_type, fb_options);
+	if (fb_options->tpb) {
+		rb_raise(rb_eFbError, "transaction options are already compiled");
+	}
+	source = RB_TYPE_P(opt, T_HASH) ? fb_transaction_options_string(opt) : rb_str_dup(StringValue(opt));
+	fb_options->tpb = trans_parseopts(source, &fb_options->tpb_len);
+	fb_options->source = rb_str_freeze(source);
+	rb_obj_freeze(self);
+	return self;
+}
+
+/* call-seq:
+ *   to_s() -> String
+ *
+ * The option string the options were compiled from.
+ */
+static VALUE transaction_options_to_s(VALUE self)
+{
+	struct FbTransactionOptions *fb_options;
+	TypedData_Get_Struct(self, struct FbTransactionOptions, &fbtransaction_options_data_type, fb_options);
+	return fb_options->source;
+}
+
+/* call-seq:
+ *   tpb() -> String
+ *
+ * The compiled transaction parameter block, as a binary String.
+ */
+static VALUE transaction_options_tpb(VALUE self)
+{
+	struct FbTransactionOptions *fb_options;
+	TypedData_Get_Struct(self, struct FbTransactionOptions, &fbtransaction_options_data_type, fb_options);
+	return rb_str_new(fb_options->tpb, fb_options->tpb_len);
+}
+
+/*
+ * Returns compiled TransactionOptions for +opt+, or nil for the default
+ * transaction. Strings and Hashes are compiled once per connection.
+ */
+static VALUE fb_connection_tpb(struct FbConnection *fb_connection, VALUE opt)
+{
+	VALUE options;
+
+	if (NIL_P(opt) || rb_obj_is_kind_of(opt, rb_cFbTransactionOptions)) {
+		return opt;
+	}
+	if (RB_TYPE_P(opt, T_HASH)) {
+		opt = fb_transaction_options_string(opt);
+	}
+	StringValue(opt);
+	options = rb_hash_aref(fb_connection->tpb_cache, opt);
+	if (NIL_P(options)) {
+		options = rb_class_new_instance(1, &opt, rb_cFbTransactionOptions);
+		if (RHASH_SIZE(fb_connection->tpb_cache) >= 64) {
+			/* option strings built on the fly; don't let them pile up */
+			rb_hash_clear(fb_connection->tpb_cache);
+		}
+		rb_hash_aset(fb_connection->tpb_cache, opt, options);
+	}
+	return options;
+}
+
+static struct FbTransactionOptions *fb_transaction_options_get(VALUE options)
+{
+	struct FbTransactionOptions *fb_options;
+	TypedData_Get_Struct(options, struct FbTransactionOptions, &fbtransaction_options_data_type, fb_options);
+	return fb_options;
+}
+
+static void fb_connection_transaction_start(struct FbConnection *fb_connection, VALUE opt)
+{
+	char *tpb = NULL;
+	long tpb_len = 0;
+	VALUE options;
+
+	if (fb_connection->transact) {
+		rb_raise(rb_eFbError, "A transaction has been already started");
+	}
+	/* statements run before the transaction must not wait for it */
+	fb_connection_write_commit(fb_connection, 0);
+
+	options = fb_connection_tpb(fb_connection, opt);
+	if (!NIL_P(options)) {
+		tpb = fb_transaction_options_get(options)->tpb;
+		tpb_len = fb_transaction_options_get(options)->tpb_len;
+	}
+
+	FB_PROBED(begin_done, FB_PROBE2(begin_start, fb_connection, "user"),
+		isc_start_transaction(fb_connection->isc_status, &fb_connection->transact, 1, &fb_connection->db, tpb_len, tpb),
+		FB_PROBE4(begin_done, fb_connection, "user", fb_probe_us, fb_connection->isc_status[1]));
+	if (fb_connection_lost(fb_connection) && fb_connection_reattach(fb_connection)) {
+		/* nothing has run yet, so starting over on the new attachment is safe */
+		isc_start_transaction(fb_connection->isc_status, &fb_connection->transact, 1, &fb_connection->db, tpb_len, tpb);
+	}
+	RB_GC_GUARD(options);
+	fb_error_check(fb_connection->isc_status);
+}
+
+/*
+ * Makes sure the shared read-only READ COMMITTED transaction is running.
+ * Read-only read committed transactions are pre-committed by the server,
+ * so keeping one open does not hold back garbage collection. It is still
+ * renewed every +read_refresh+ seconds, once no cursor is reading from it,
+ * so that it never pins metadata for long.
+ */
+static void fb_connection_read_start(struct FbConnection *fb_connection)
+{
+	static char tpb[] = {
+		isc_tpb_version3, isc_tpb_read, isc_tpb_read_committed, isc_tpb_rec_version, isc_tpb_nowait
+	};
+	double now = fb_monotonic_time();
+
+	if (fb_connection->read_transact) {
+		if (fb_connection->read_cursors > 0 || now - fb_connection->read_started < fb_connection->read_refresh) {
+			return;
+		}
+		fb_commit_transaction(fb_connection->isc_status, &fb_connection->read_transact);
+		if (fb_connection->isc_status[0] == 1 && fb_connection->isc_status[1]) {
+			/* the handle is useless either way; start over */
+			fb_connection->read_transact = 0;
+		}
+	}
+
+	FB_PROBED(begin_done, FB_PROBE2(begin_start, fb_connection, "read"),
+		isc_start_transaction(fb_connection->isc_status, &fb_connection->read_transact, 1, &fb_connection->db, sizeof(tpb), tpb),
+		FB_PROBE4(begin_done, fb_connection, "read", fb_probe_us, fb_connection->isc_status[1]));
+	if (fb_connection_lost(fb_connection) && fb_connection_reattach(fb_connection)) {
+		isc_start_transaction(fb_connection->isc_status, &fb_connection->read_transact, 1, &fb_connection->db, sizeof(tpb), tpb);
+	}
+	fb_error_check(fb_connection->isc_status);
+	fb_connection->read_started = now;
+}
+
+/*
+ * Body of the thread that commits the autocommit write transaction once
+ * nobody has used it for +write_idle+ seconds. The thread holds on to the
+ * connection, so a connection dropped with writes pending still commits
+ * them; it ends with the transaction.
+ */
+static VALUE fb_connection_write_timer(void *arg)
+{
+	volatile VALUE self = (VALUE)arg;
+	struct FbConnection *fb_connection;
+	ISC_STATUS isc_status[20];
+	double wait;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	while (fb_connection->write_transact && fb_connection->db) {
+		wait = fb_connection->write_last + fb_connection->write_idle - fb_monotonic_time();
+		if (wait <= 0 && !fb_connection->write_busy) {
+			/*
+			 * Statements and commits wait on write_lock while the round trip
+			 * runs without the GVL. Our own status vector: another thread may
+			 * be in a call on this connection.
+			 */
+			struct fb_commit_args args = { isc_status, &fb_connection->write_transact };
+
+			rb_mutex_lock(fb_connection->write_lock);
+			fb_connection->write_committing = 1;
+			fb_blocking_call_nogvl(isc_status, fb_commit_call, &args);
+			fb_connection->write_committing = 0;
+			rb_mutex_unlock(fb_connection->write_lock);
+			if (isc_status[0] == 1 && isc_status[1]) {
+				/* left open: the next statement commits it again and raises */
+				rb_warn("fb: idle commit of the autocommit write transaction failed: %"PRIsVALUE,
+					fb_error_msg(isc_status));
+			} else {
+				fb_connection->write_pending = 0;
+			}
+			break;
+		}
+		rb_thread_wait_for(rb_time_interval(DBL2NUM(wait > 0.01 ? wait : 0.01)));
+	}
+	fb_connection->write_timer = Qnil;
+	RB_GC_GUARD(self);
+	return Qnil;
+}
+
+/*
+ * Makes sure the shared autocommit write transaction is running. A
+ * transaction nobody has used for +write_idle+ seconds is committed by
+ * fb_connection_write_timer, or here if that thread did not get to it.
+ */
+static void fb_connection_write_start(struct FbConnection *fb_connection, VALUE connection)
+{
+	static char tpb_autocommit[] = {
+		isc_tpb_version3, isc_tpb_write, isc_tpb_read_committed, isc_tpb_rec_version, isc_tpb_wait,
+		isc_tpb_autocommit
+	};
+	char *tpb = tpb_autocommit;
+	short tpb_len = sizeof(tpb_autocommit);
+	double now = fb_monotonic_time();
+
+	if (fb_connection->write_transact) {
+		if (now - fb_connection->write_last < fb_connection->write_idle) {
+			return;
+		}
+		fb_connection_write_commit(fb_connection, 0);
+	}
+
+	if (fb_connection->autocommit_write == FB_WRITE_RETAINING) {
+		tpb_len--;	/* commits are ours to make */
+	}
+	FB_PROBED(begin_done, FB_PROBE2(begin_start, fb_connection, "write"),
+		isc_start_transaction(fb_connection->isc_status, &fb_connection->write_transact, 1, &fb_connection->db, tpb_len, tpb),
+		FB_PROBE4(begin_done, fb_connection, "write", fb_probe_us, fb_connection->isc_status[1]));
+	if (fb_connection_lost(fb_connection) && fb_connection_reattach(fb_connection)) {
+		isc_start_transaction(fb_connection->isc_status, &fb_connection->write_transact, 1, &fb_connection->db, tpb_len, tpb);
+	}
+	fb_error_check(fb_connection->isc_status);
+	fb_connection->write_pending = 0;
+	fb_connection->write_last = now;
+	if (NIL_P(fb_connection->write_timer) || !RTEST(rb_funcall(fb_connection->write_timer, rb_intern("alive?"), 0))) {
+		fb_connection->write_timer = rb_thread_create(fb_connection_write_timer, (void *)connection);
+		rb_funcall(fb_connection->write_timer, rb_intern("name="), 1, rb_str_new_cstr("fb autocommit idle"));
+	}
+}
+
+static void fb_connection_commit(struct FbConnection *fb_connection)
+{
+	if (fb_connection->transact) {
+		fb_connection_close_cursors(fb_connection);
+		FB_PROBED(commit_done, FB_PROBE2(commit_start, fb_connection, "user"),
+			fb_commit_transaction(fb_connection->isc_status, &fb_connection->transact),
+			FB_PROBE4(commit_done, fb_connection, "user", fb_probe_us, fb_connection->isc_status[1]));
+		fb_error_check(fb_connection->isc_status);
+	}
+}
+
+static void fb_connection_rollback(struct FbConnection *fb_connection)
+{
+	if (fb_connection->transact) {
+		fb_connection_close_cursors(fb_connection);
+		FB_PROBED(rollback_done, FB_PROBE2(rollback_start, fb_connection, "user"),
+			isc_rollback_transaction(fb_connection->isc_status, &fb_connection->transact),
+			FB_PROBE4(rollback_done, fb_connection, "user", fb_probe_us, fb_connection->isc_status[1]));
+		fb_error_check(fb_connection->isc_status);
+	}
+}
+
+/* True when the pending exception is a conflict worth another attempt. */
+static int fb_errinfo_is_retryable(void)
+{
+	VALUE exc = rb_errinfo();
+	return RTEST(rb_obj_is_kind_of(exc, rb_eFbError)) && RTEST(error_is_retryable(exc));
+}
+
+/* call-seq:
+ *   transaction(options) -> true
+ *   transaction(options) { } -> block result
+ *   transaction(options, retry: n, backoff: seconds) {|attempt| } -> block result
+ *
+ * Start a transaction for this connection.
+ *
+ * With +retry+, a block that fails with a deadlock, update conflict or lock
+ * timeout (see Error#retryable?) is rolled back and run again in a new
+ * transaction, up to +retry+ more times. Before each attempt it waits a
+ * random part of +backoff+ (default 0.05) seconds, doubled every attempt.
+ * The block receives the number of the attempt, starting at 0.
+ */
+static VALUE connection_transaction(int argc, VALUE *argv, VALUE self)
+{
+	struct FbConnection *fb_connection;
+	VALUE opt = Qnil;
+	VALUE kw = Qnil;
+	VALUE retry = Qnil;
+	VALUE backoff = Qnil;
+	long retries = 0;
+	long attempt;
+
+	rb_scan_args(argc, argv, "01:", &opt, &kw);
+	if (!NIL_P(kw)) {
+		kw = rb_hash_dup(kw);
+		retry = rb_hash_delete(kw, ID2SYM(rb_intern("retry")));
+		backoff = rb_hash_delete(kw, ID2SYM(rb_intern("backoff")));
+		if (RHASH_SIZE(kw) > 0) {
+			/* the rest are transaction options given as a Hash */
+			if (!NIL_P(opt)) {
+				rb_raise(rb_eArgError, "unknown keywords %"PRIsVALUE, rb_funcall(kw, rb_intern("keys"), 0));
+			}
+			opt = kw;
+		}
+		retries = NIL_P(retry) ? 0 : NUM2LONG(rb_Integer(retry));
+	}
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	if (!NIL_P(retry) && !rb_block_given_p()) {
+		rb_raise(rb_eArgError, "retry needs a block");
+	}
+
+	for (attempt = 0; ; attempt++) {
+		fb_connection_transaction_start(fb_connection, opt);
+
+		if (rb_block_given_p()) {
+			int state;
+			VALUE result = rb_protect(rb_yield, NIL_P(retry) ? 0 : LONG2NUM(attempt), &state);
+			if (state) {
+				fb_connection_rollback(fb_connection);
+				if (attempt < retries && fb_errinfo_is_retryable()) {
+					double delay = (NIL_P(backoff) ? 0.05 : NUM2DBL(rb_Float(backoff))) * (1 << (attempt < 16 ? attempt : 16));
+					rb_set_errinfo(Qnil);
+					rb_funcall(rb_mKernel, rb_intern("sleep"), 1,
+						DBL2NUM(delay * NUM2DBL(rb_funcall(rb_mKernel, rb_intern("rand"), 0))));
+					continue;
+				}
+				return rb_funcall(rb_mKernel, rb_intern("raise"), 0);
+			} else {
+				fb_connection_commit(fb_connection);
+				return result;
+			}
+		} else {
+			return Qtrue;
+		}
+	}
+}
+
+/* call-seq:
+ *   transaction_started()? -> true or false
+ *
+ * Returns true if a transaction is currently active.
+ */
+static VALUE connection_transaction_started(VALUE self)
+{
+	struct FbConnection *fb_connection;
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	return fb_connection->transact ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+ *   commit() -> nil
+ *
+ * Commit the current transaction.
+ */
+static VALUE connection_commit(VALUE self)
+{
+	struct FbConnection *fb_connection;
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	fb_connection_commit(fb_connection);
+	return Qnil;
+}
+
+/* call-seq:
+ *   flush() -> nil
+ *
+ * Commits statements still pending in the autocommit write transaction
+ * (see +autocommit_write+) and ends it.
+ */
+static VALUE connection_flush(VALUE self)
+{
+	struct FbConnection *fb_connection;
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	fb_connection_write_commit(fb_connection, 0);
+	return Qnil;
+}
+
+/* call-seq:
+ *   rollback() -> nil
+ *
+ * Rollback the current transaction.
+ */
+static VALUE connection_rollback(VALUE self)
+{
+	struct FbConnection *fb_connection;
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	fb_connection_rollback(fb_connection);
+	return Qnil;
+}
+
+/* savepoints */
+
+#define	FB_SP_SET	0
+#define	FB_SP_RELEASE	1
+#define	FB_SP_UNDO	2
+#define	FB_SP_COMMANDS	3
+
+static const char *fb_sp_sql[FB_SP_COMMANDS] = {
+	"SAVEPOINT FB_SP_%ld",
+	"RELEASE SAVEPOINT FB_SP_%ld",
+	"ROLLBACK TO SAVEPOINT FB_SP_%ld"
+};
+
+/*
+ * Runs a savepoint command for nesting level +depth+. Each command and level
+ * has its own statement handle, prepared on first use and reused after that.
+ */
+static void fb_connection_savepoint_exec(struct FbConnection *fb_connection, int command, long depth, int quiet)
+{
+	ISC_STATUS *isc_status = fb_connection->isc_status;
+	isc_stmt_handle *stmt;
+	char sql[64];
+
+	if (fb_connection->sp_epoch != fb_connection->epoch) {
+		/* statement handles died with the old attachment */
+		MEMZERO(fb_connection->sp_stmts, isc_stmt_handle, fb_connection->sp_levels * FB_SP_COMMANDS);
+		fb_connection->sp_epoch = fb_connection->epoch;
+	}
+	if (depth > fb_connection->sp_levels) {
+		REALLOC_N(fb_connection->sp_stmts, isc_stmt_handle, depth * FB_SP_COMMANDS);
+		MEMZERO(fb_connection->sp_stmts + fb_connection->sp_levels * FB_SP_COMMANDS, isc_stmt_handle,
+				(depth - fb_connection->sp_levels) * FB_SP_COMMANDS);
+		fb_connection->sp_levels = depth;
+	}
+
+	stmt = &fb_connection->sp_stmts[(depth - 1) * FB_SP_COMMANDS + command];
+	if (!*stmt) {
+		isc_dsql_alloc_statement2(isc_status, &fb_connection->db, stmt);
+		if (!(isc_status[0] == 1 && isc_status[1])) {
+			snprintf(sql, sizeof(sql), fb_sp_sql[command], depth);
+			fb_dsql_prepare(isc_status, &fb_connection->transact, stmt, sql, fb_connection->dialect, NULL);
+			if (isc_status[0] == 1 && isc_status[1]) {
+				ISC_STATUS free_status[20];
+				isc_dsql_free_statement(free_status, stmt, DSQL_drop);
+				*stmt = 0;
+			}
+		}
+	}
+	if (*stmt) {
+		fb_dsql_execute2(isc_status, &fb_connection->transact, stmt, NULL, NULL);
+	}
+	if (!quiet) {
+		fb_error_check(isc_status);
+	}
+}
+
+struct fb_savepoint {
+	struct FbConnection *fb_connection;
+	isc_tr_handle transact;
+	long depth;
+};
+
+static VALUE fb_savepoint_leave(VALUE arg)
+{
+	struct fb_savepoint *sp = (struct fb_savepoint *)arg;
+	sp->fb_connection->sp_depth = sp->depth - 1;
+	return Qnil;
+}
+
+static VALUE fb_savepoint_body(VALUE arg)
+{
+	struct fb_savepoint *sp = (struct fb_savepoint *)arg;
+	struct FbConnection *fb_connection = sp->fb_connection;
+	VALUE result;
+	int state;
+
+	result = rb_protect(rb_yield, Qnil, &state);
+	/* the block may have ended the transaction itself */
+	if (fb_connection->transact && fb_connection->transact == sp->transact) {
+		if (state) {
+			fb_connection_savepoint_exec(fb_connection, FB_SP_UNDO, sp->depth, 1);
+			fb_connection_savepoint_exec(fb_connection, FB_SP_RELEASE, sp->depth, 1);
+		} else {
+			fb_connection_savepoint_exec(fb_connection, FB_SP_RELEASE, sp->depth, 0);
+		}
+	}
+	if (state) {
+		rb_jump_tag(state);
+	}
+	return result;
+}
+
+/* call-seq:
+ *   savepoint { } -> block result
+ *
+ * Runs the block under a savepoint inside the current transaction. If the
+ * block raises, only its changes are rolled back and the exception is
+ * re-raised; the transaction itself stays active. Savepoints nest.
+ *
+ *   conn.transaction do
+ *     rows.each do |row|
+ *       begin
+ *         conn.savepoint { conn.execute(sql_insert, *row) }
+ *       rescue Fb::Error
+ *         rejected << row
+ *       end
+ *     end
+ *   end
+ */
+static VALUE connection_savepoint(VALUE self)
+{
+	struct FbConnection *fb_connection;
+	struct fb_savepoint sp;
+
+	rb_need_block();
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+	if (!fb_connection->transact) {
+		rb_raise(rb_eFbError, "savepoint requires a transaction");
+	}
+
+	sp.fb_connection = fb_connection;
+	sp.transact = fb_connection->transact;
+	sp.depth = fb_connection->sp_depth + 1;
+	fb_connection_savepoint_exec(fb_connection, FB_SP_SET, sp.depth, 0);
+	fb_connection->sp_depth = sp.depth;
+	return rb_ensure(fb_savepoint_body, (VALUE)&sp, fb_savepoint_leave, (VALUE)&sp);
+}
+
+/*
+ * call-seq:
+ *   open?() -> true or false
+ *
+ * Current connection status.
+ */
+static VALUE connection_is_open(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	return (fb_connection->db == 0) ? Qfalse : Qtrue;
+}
+
+/* call-seq:
+ *   reconnect() -> self
+ *
+ * Detaches (ignoring errors) and attaches again with the original
+ * parameters. Any open transaction is lost and existing cursors must be
+ * executed again.
+ */
+static VALUE connection_reconnect(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	if (!fb_connection->dpb) {
+		rb_raise(rb_eFbError, "connection was not opened with connect and cannot be reattached");
+	}
+	if (!fb_connection_reattach(fb_connection)) {
+		fb_error_check(fb_connection->isc_status);
+		rb_raise(rb_eFbError, "could not reattach to database");
+	}
+	return self;
+}
+
+/* call-seq:
+ *   ping() -> true or false
+ *
+ * Checks that the server still answers on this attachment, using a database
+ * info request rather than a query.
+ */
+static VALUE connection_ping(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	return fb_connection_ping(fb_connection) ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+ *   to_s() -> String
+ *
+ * Return current database connection string and either (OPEN) or (CLOSED).
+ */
+static VALUE connection_to_s(VALUE self)
+{
+	VALUE is_open = connection_is_open(self);
+	VALUE status = (is_open == Qtrue) ? rb_str_new2(" (OPEN)") : rb_str_new2(" (CLOSED)");
+	VALUE database = rb_iv_get(self, "@database");
+	VALUE s = rb_str_dup(database);
+	return rb_str_concat(s, status);
+}
+
+/* call-seq:
+ *   cursor() -> Cursor
+ *
+ * Creates a +Cursor+ for the +Connection+ and allocates a statement.
+ */
+static VALUE connection_cursor(VALUE self)
+{
+	VALUE c;
+	struct FbConnection *fb_connection;
+	struct FbCursor *fb_cursor;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	if (fb_connection->reconnect_pending) {
+		fb_connection_reattach(fb_connection);
+	}
+	fb_connection_check(fb_connection);
+
+	c = TypedData_Make_Struct(rb_cFbCursor, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	fb_cursor->connection = self;
+	fb_cursor->epoch = fb_connection->epoch;
+	fb_cursor->transaction = Qnil;
+	fb_cursor->stats = Qnil;
+	fb_cursor->timed_sql = Qnil;
+	fb_cursor->timed_params = Qnil;
+	fb_cursor->io_before = Qnil;
+	fb_cursor->io_stats = Qnil;
+	fb_cursor->fields_ary = Qnil;
+	fb_cursor->fields_hash = Qnil;
+	fb_cursor->open = Qfalse;
+	fb_cursor->eof = Qfalse;
+	fb_cursor->stmt = 0;
+	fb_cursor->i_sqlda = sqlda_alloc(SQLDA_COLSINIT);
+	fb_cursor->o_sqlda = sqlda_alloc(SQLDA_COLSINIT);
+	fb_cursor->i_buffer = NULL;
+	fb_cursor->i_buffer_size = 0;
+	fb_cursor->o_buffer = NULL;
+	fb_cursor->o_buffer_size = 0;
+	isc_dsql_alloc_statement2(fb_connection->isc_status, &fb_connection->db, &fb_cursor->stmt);
+	if (fb_connection_lost(fb_connection)) {
+		ISC_STATUS lost_status[20];
+		int in_transaction = fb_connection->transact != 0;
+
+		memcpy(lost_status, fb_connection->isc_status, sizeof(lost_status));
+		if (!fb_connection_reattach(fb_connection) || in_transaction) {
+			/* an explicit transaction does not survive the reconnect */
+			fb_error_check(lost_status);
+		}
+		fb_cursor->epoch = fb_connection->epoch;
+		isc_dsql_alloc_statement2(fb_connection->isc_status, &fb_connection->db, &fb_cursor->stmt);
+	}
+	fb_error_check(fb_connection->isc_status);
+
+	return c;
+}
+
+/* call-seq:
+ *   execute(sql, *args) -> Cursor or rows affected
+ *   execute(sql, *args) {|cursor| } -> block result
+ *
+ * Allocates a +Cursor+ and executes the +sql+ statement.
+ *
+ * For DML with RETURNING clause, returns a Hash with keys:
+ *   :returning => Array of returned values
+ *   :rows_affected => Integer
+ *
+ * For other DML (INSERT/UPDATE/DELETE), returns the number of rows affected.
+ * For SELECT, returns a Cursor (or yields it to a block).
+ */
+static VALUE connection_execute(int argc, VALUE *argv, VALUE self)
+{
+	return fb_cursor_execute_new(connection_cursor(self), argc, argv);
+}
+
+/* Runs +sql+ on a freshly allocated cursor; shared by Connection and Transaction. */
+static VALUE fb_cursor_execute_new(VALUE cursor, int argc, VALUE *argv)
+{
+	VALUE val = cursor_execute(argc, argv, cursor);
+
+	if (NIL_P(val)) {
+		if (rb_block_given_p()) {
+			return rb_ensure(rb_yield,cursor,cursor_close,cursor);
+   		} else {
+				HERE("connection_execute Y");
+				return cursor;
+   		}
+	} else {
+		cursor_drop(cursor);
+	}
+	return val;
+}
+
+/* call-seq:
+ *   query(:array, sql, *arg) -> Array of Arrays or nil
+ *   query(:hash, sql, *arg) -> Array of Hashes or nil
+ *   query(sql, *args) -> Array of Arrays or nil
+ *
+ * For queries returning a result set, returns an array containing
+ * either a list of Arrays or Hashes, one for each row.
+ *
+ * For DML, returns rows affected (or a Hash for RETURNING).
+ */
+static VALUE connection_query(int argc, VALUE *argv, VALUE self)
+{
+	return fb_cursor_query_new(self, Qnil, argc, argv);
+}
+
+static VALUE fb_cursor_query_new(VALUE connection, VALUE transaction, int argc, VALUE *argv)
+{
+	VALUE format;
+	VALUE cursor;
+	VALUE result;
+
+	if (argc >= 1 && TYPE(argv[0]) == T_SYMBOL) {
+		format = argv[0];
+		argc--; argv++;
+	} else {
+		format = ID2SYM(rb_intern("array"));
+	}
+	cursor = NIL_P(transaction) ? connection_cursor(connection) : fb_transaction_cursor(transaction);
+	result = cursor_execute(argc, argv, cursor);
+	if (NIL_P(result)) {
+		result = cursor_fetchall(1, &format, cursor);
+		cursor_close(cursor);
+	}
+
+	return result;
+}
+
+/* Prepares +sql+ without running it and returns the plan for +item+. */
+static VALUE fb_connection_plan(VALUE self, VALUE sql, char item)
+{
+	static char tpb[] = {
+		isc_tpb_version3, isc_tpb_read, isc_tpb_read_committed, isc_tpb_rec_version, isc_tpb_nowait
+	};
+	struct FbConnection *fb_connection;
+	ISC_STATUS *isc_status;
+	ISC_STATUS free_status[20];
+	isc_stmt_handle stmt = 0;
+	isc_tr_handle temp = 0;
+	isc_tr_handle *transact;
+	const char *text = StringValueCStr(sql);
+	VALUE plan = Qnil;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	if (fb_connection->reconnect_pending) {
+		fb_connection_reattach(fb_connection);
+	}
+	fb_connection_check(fb_connection);
+	isc_status = fb_connection->isc_status;
+
+	/* outside a transaction a throwaway read-only one does for the prepare */
+	transact = &fb_connection->transact;
+	if (!fb_connection->transact) {
+		isc_start_transaction(isc_status, &temp, 1, &fb_connection->db, sizeof(tpb), tpb);
+		fb_error_check(isc_status);
+		transact = &temp;
+	}
+
+	isc_dsql_alloc_statement2(isc_status, &fb_connection->db, &stmt);
+	if (!(isc_status[0] == 1 && isc_status[1])) {
+		fb_dsql_prepare(isc_status, transact, &stmt, text, fb_connection_dialect(fb_connection), NULL);
+		if (!(isc_status[0] == 1 && isc_status[1])) {
+			plan = fb_statement_plan(isc_status, &stmt, item);
+		}
+	}
+	if (stmt) {
+		isc_dsql_free_statement(free_status, &stmt, DSQL_drop);
+	}
+	if (temp) {
+		isc_rollback_transaction(free_status, &temp);
+	}
+	fb_error_check(isc_status);
+	return plan;
+}
+
+/* call-seq:
+ *   plan(sql) -> String or nil
+ *
+ * Prepares +sql+ without executing it and returns its access plan as the
+ * server prints it, e.g. "PLAN (RDB$RELATIONS INDEX (RDB$INDEX_0))".
+ * Runs in the current transaction if there is one.
+ */
+static VALUE connection_plan(VALUE self, VALUE sql)
+{
+	return fb_connection_plan(self, sql, isc_info_sql_get_plan);
+}
+
+/* call-seq:
+ *   explain_plan(sql) -> String or nil
+ *
+ * Like plan, but returns the detailed, indented plan of Firebird 3 and
+ * later, which names every access method, sort and join. Older servers
+ * return nil.
+ */
+static VALUE connection_explain_plan(VALUE self, VALUE sql)
+{
+	return fb_connection_plan(self, sql, isc_info_sql_explain_plan);
+}
+
+/* transactions */
+
+static void fb_transaction_mark(struct FbTransaction *fb_transaction)
+{
+	rb_gc_mark(fb_transaction->connection);
+	rb_gc_mark(fb_transaction->cursors);
+}
+
+static struct FbTransaction *fb_transaction_get(VALUE self)
+{
+	struct FbTransaction *fb_transaction;
+	TypedData_Get_Struct(self, struct FbTransaction, &fbtransaction_data_type, fb_transaction);
+	return fb_transaction;
+}
+
+static isc_tr_handle *fb_transaction_check(struct FbTransaction *fb_transaction)
+{
+	isc_tr_handle *handle = fb_transaction_handle(fb_transaction);
+	if (!handle) {
+		rb_raise(rb_eFbError, "transaction is no longer active");
+	}
+	return handle;
+}
+
+static struct fb_tr_slot *fb_connection_tr_slot(struct FbConnection *fb_connection)
+{
+	struct fb_tr_slot *slot;
+
+	for (slot = fb_connection->tr_slots; slot; slot = slot->next) {
+		if (slot->handle == 0) return slot;
+	}
+	slot = ZALLOC(struct fb_tr_slot);
+	slot->next = fb_connection->tr_slots;
+	fb_connection->tr_slots = slot;
+	return slot;
+}
+
+static VALUE transaction_commit(VALUE self);
+static VALUE transaction_rollback(VALUE self);
+
+/* A new cursor that runs in +transaction+, closed when the transaction ends. */
+static VALUE fb_transaction_cursor(VALUE transaction)
+{
+	struct FbTransaction *fb_transaction = fb_transaction_get(transaction);
+	struct FbCursor *fb_cursor;
+	VALUE cursor;
+	long i, j;
+
+	/* forget the cursors already dropped */
+	for (i = j = 0; i < RARRAY_LEN(fb_transaction->cursors); i++) {
+		VALUE c = RARRAY_AREF(fb_transaction->cursors, i);
+		TypedData_Get_Struct(c, struct FbCursor, &fbcursor_data_type, fb_cursor);
+		if (fb_cursor->stmt) {
+			rb_ary_store(fb_transaction->cursors, j++, c);
+		}
+	}
+	rb_ary_resize(fb_transaction->cursors, j);
+
+	cursor = connection_cursor(fb_transaction->connection);
+	TypedData_Get_Struct(cursor, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	fb_cursor->transaction = transaction;
+	rb_ary_push(fb_transaction->cursors, cursor);
+	return cursor;
+}
+
+/* Closes the cursors opened by Transaction#execute and #query before it ends. */
+static VALUE fb_transaction_close_cursors(VALUE transaction)
+{
+	struct FbTransaction *fb_transaction = fb_transaction_get(transaction);
+	VALUE cursors = fb_transaction->cursors;
+
+	fb_transaction->cursors = rb_ary_new();
+	while (RARRAY_LEN(cursors) > 0) {
+		cursor_close(rb_ary_shift(cursors));
+	}
+	return Qnil;
+}
+
+/* call-seq:
+ *   start_transaction(options = nil) -> Transaction
+ *   start_transaction(options = nil) {|transaction| } -> block result
+ *
+ * Starts a transaction that runs alongside the connection's own one and any
+ * other Transaction on the same attachment. +options+ are the same as for
+ * #transaction. With a block, the transaction is committed when the block
+ * returns and rolled back if it raises.
+ */
+static VALUE connection_start_transaction(int argc, VALUE *argv, VALUE self)
+{
+	struct FbConnection *fb_connection;
+	struct FbTransaction *fb_transaction;
+	struct fb_tr_slot *slot;
+	VALUE opt = Qnil;
+	VALUE transaction;
+	VALUE options;
+	char *tpb = NULL;
+	long tpb_len = 0;
+
+	rb_scan_args(argc, argv, "01", &opt);
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+	fb_connection_write_commit(fb_connection, 0);
+
+	options = fb_connection_tpb(fb_connection, opt);
+	if (!NIL_P(options)) {
+		tpb = fb_transaction_options_get(options)->tpb;
+		tpb_len = fb_transaction_options_get(options)->tpb_len;
+	}
+	slot = fb_connection_tr_slot(fb_connection);
+	isc_start_transaction(fb_connection->isc_status, &slot->handle, 1, &fb_connection->db, tpb_len, tpb);
+	RB_GC_GUARD(options);
+	fb_error_check(fb_connection->isc_status);
+	slot->serial = ++fb_connection->tr_serial;
+
+	transaction = TypedData_Make_Struct(rb_cFbTransaction, struct FbTransaction, &fbtransaction_data_type, fb_transaction);
+	fb_transaction->connection = self;
+	fb_transaction->slot = slot;
+	fb_transaction->serial = slot->serial;
+	fb_transaction->cursors = rb_ary_new();
+
+	if (rb_block_given_p()) {
+		int state;
+		VALUE result = rb_protect(rb_yield, transaction, &state);
+		if (state) {
+			if (fb_transaction_handle(fb_transaction)) {
+				ISC_STATUS isc_status[20];
+				VALUE errinfo = rb_errinfo();
+				int ignored;
+				rb_protect(fb_transaction_close_cursors, transaction, &ignored);
+				rb_set_errinfo(errinfo);
+				isc_rollback_transaction(isc_status, &slot->handle);
+			}
+			rb_jump_tag(state);
+		}
+		if (fb_transaction_handle(fb_transaction)) {
+			transaction_commit(transaction);
+		}
+		return result;
+	}
+	return transaction;
+}
+
+/* call-seq:
+ *   execute(sql, *args) -> Cursor or rows affected
+ *   execute(sql, *args) {|cursor| } -> block result
+ *
+ * Like Connection#execute, but runs in this transaction.
+ */
+static VALUE transaction_execute(int argc, VALUE *argv, VALUE self)
+{
+	fb_transaction_check(fb_transaction_get(self));
+	return fb_cursor_execute_new(fb_transaction_cursor(self), argc, argv);
+}
+
+/* call-seq:
+ *   query(:array, sql, *arg) -> Array of Arrays or nil
+ *   query(:hash, sql, *arg) -> Array of Hashes or nil
+ *   query(sql, *args) -> Array of Arrays or nil
+ *
+ * Like Connection#query, but runs in this transaction.
+ */
+static VALUE transaction_query(int argc, VALUE *argv, VALUE self)
+{
+	struct FbTransaction *fb_transaction = fb_transaction_get(self);
+
+	fb_transaction_check(fb_transaction);
+	return fb_cursor_query_new(fb_transaction->connection, self, argc, argv);
+}
+
+/* call-seq:
+ *   commit() -> nil
+ */
+static VALUE transaction_commit(VALUE self)
+{
+	struct FbTransaction *fb_transaction = fb_transaction_get(self);
+	struct FbConnection *fb_connection;
+	isc_tr_handle *handle = fb_transaction_check(fb_transaction);
+
+	if (fb_transaction->slot->distributed) {
+		rb_raise(rb_eFbError, "a distributed transaction ends with its block");
+	}
+	fb_transaction_close_cursors(self);
+	TypedData_Get_Struct(fb_transaction->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_commit_transaction(fb_connection->isc_status, handle);
+	fb_error_check(fb_connection->isc_status);
+	return Qnil;
+}
+
+/* call-seq:
+ *   rollback() -> nil
+ */
+static VALUE transaction_rollback(VALUE self)
+{
+	struct FbTransaction *fb_transaction = fb_transaction_get(self);
+	struct FbConnection *fb_connection;
+	isc_tr_handle *handle = fb_transaction_check(fb_transaction);
+
+	if (fb_transaction->slot->distributed) {
+		rb_raise(rb_eFbError, "a distributed transaction ends with its block");
+	}
+	fb_transaction_close_cursors(self);
+	TypedData_Get_Struct(fb_transaction->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	isc_rollback_transaction(fb_connection->isc_status, handle);
+	fb_error_check(fb_connection->isc_status);
+	return Qnil;
+}
+
+/* call-seq:
+ *   active?() -> true or false
+ *
+ * False once the transaction has been committed or rolled back, or lost
+ * with its attachment.
+ */
+static VALUE transaction_is_active(VALUE self)
+{
+	return fb_transaction_handle(fb_transaction_get(self)) ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+ *   connection() -> Connection
+ */
+static VALUE transaction_connection(VALUE self)
+{
+	return fb_transaction_get(self)->connection;
+}
+
+/* distributed transactions */
+
+/*
+ * call-seq:
+ *   Fb.distributed_transaction(connection, ..., options: nil) {|transaction, ...| } -> block result
+ *
+ * Runs the block in one transaction spanning all the given connections,
+ * started with isc_start_multiple. The block receives a Transaction for
+ * each connection. When it returns, every database is prepared
+ * (the first phase of a two-phase commit) and then committed; when it
+ * raises, everything is rolled back.
+ *
+ * +options+ is one set of transaction options for all connections, or an
+ * Array with options per connection.
+ *
+ * If the commit phase fails after the prepare, some databases may keep the
+ * transaction in limbo; see Connection#limbo_transactions.
+ */
+static VALUE fb_s_distributed_transaction(int argc, VALUE *argv, VALUE self)
+{
+	ISC_STATUS isc_status[20];
+	ISC_STATUS quiet_status[20];
+	VALUE connections, kw, options = Qnil;
+	VALUE tpbs, transactions, result;
+	ID option_ids[1];
+	ISC_TEB *teb;
+	struct fb_tr_slot **slots;
+	isc_tr_handle handle = 0;
+	long count, i, j;
+	int state;
+
+	rb_scan_args(argc, argv, "*:", &connections, &kw);
+	rb_need_block();
+	if (!NIL_P(kw)) {
+		option_ids[0] = rb_intern("options");
+		rb_get_kwargs(kw, option_ids, 0, 1, &options);
+		if (options == Qundef) options = Qnil;
+	}
+	count = RARRAY_LEN(connections);
+	if (count == 0) {
+		rb_raise(rb_eArgError, "at least one connection is required");
+	}
+	if (RB_TYPE_P(options, T_ARRAY) && RARRAY_LEN(options) != count) {
+		rb_raise(rb_eArgError, "options must be given for each connection");
+	}
+
+	teb = ALLOCA_N(ISC_TEB, count);
+	slots = ALLOCA_N(struct fb_tr_slot *, count);
+	tpbs = rb_ary_new2(count);
+	for (i = 0; i < count; i++) {
+		struct FbConnection *fb_connection;
+		VALUE opt, tpb;
+
+		TypedData_Get_Struct(RARRAY_AREF(connections, i), struct FbConnection, &fbconnection_data_type, fb_connection);
+		fb_connection_check(fb_connection);
+		for (j = 0; j < i; j++) {
+			if (teb[j].dbb_ptr == &fb_connection->db) {
+				rb_raise(rb_eArgError, "a connection can take part only once");
+			}
+		}
+		fb_connection_write_commit(fb_connection, 0);
+		opt = RB_TYPE_P(options, T_ARRAY) ? RARRAY_AREF(options, i) : options;
+		tpb = fb_connection_tpb(fb_connection, opt);
+		rb_ary_push(tpbs, tpb);
+		teb[i].dbb_ptr = &fb_connection->db;
+		teb[i].tpb_len = NIL_P(tpb) ? 0 : fb_transaction_options_get(tpb)->tpb_len;
+		teb[i].tpb_ptr = NIL_P(tpb) ? NULL : fb_transaction_options_get(tpb)->tpb;
+	}
+
+	isc_start_multiple(isc_status, &handle, (short)count, teb);
+	RB_GC_GUARD(tpbs);
+	fb_error_check(isc_status);
+
+	transactions = rb_ary_new2(count);
+	for (i = 0; i < count; i++) {
+		VALUE connection = RARRAY_AREF(connections, i);
+		struct FbConnection *fb_connection;
+		struct FbTransaction *fb_transaction;
+		VALUE transaction;
+
+		TypedData_Get_Struct(connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+		slots[i] = fb_connection_tr_slot(fb_connection);
+		slots[i]->handle = handle;
+		slots[i]->distributed = 1;
+		slots[i]->serial = ++fb_connection->tr_serial;
+		transaction = TypedData_Make_Struct(rb_cFbTransaction, struct FbTransaction, &fbtransaction_data_type, fb_transaction);
+		fb_transaction->connection = connection;
+		fb_transaction->slot = slots[i];
+		fb_transaction->serial = slots[i]->serial;
+		fb_transaction->cursors = rb_ary_new();
+		rb_ary_push(transactions, transaction);
+	}
+
+	result = rb_protect(rb_yield_splat, transactions, &state);
+
+	for (i = 0; i < count; i++) {
+		if (state) {
+			VALUE errinfo = rb_errinfo();
+			int ignored;
+			rb_protect(fb_transaction_close_cursors, RARRAY_AREF(transactions, i), &ignored);
+			rb_set_errinfo(errinfo);
+		} else {
+			rb_protect(fb_transaction_close_cursors, RARRAY_AREF(transactions, i), &state);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		slots[i]->handle = 0;
+		slots[i]->distributed = 0;
+	}
+	if (state) {
+		isc_rollback_transaction(quiet_status, &handle);
+		rb_jump_tag(state);
+	}
+
+	isc_prepare_transaction(isc_status, &handle);
+	if (isc_status[0] == 1 && isc_status[1]) {
+		isc_rollback_transaction(quiet_status, &handle);
+		fb_error_check(isc_status);
+	}
+	fb_commit_transaction(isc_status, &handle);
+	fb_error_check(isc_status);
+	return result;
+}
+
+/* call-seq:
+ *   info(*items) -> Hash
+ *
+ * Database counters and settings from isc_database_info, in one round
+ * trip. Without +items+, all of them:
+ *
+ * [:page_reads, :page_writes, :page_fetches, :page_marks]
+ *   pages read from and written to disk, and read from and changed in the
+ *   page cache, by this attachment
+ * [:page_size, :page_buffers]
+ *   page size in bytes and pages in the page cache
+ * [:current_memory, :max_memory]
+ *   bytes the server uses now and used at most
+ * [:oldest_transaction, :oldest_active, :oldest_snapshot, :next_transaction]
+ *   OIT, OAT, OST and the next transaction number
+ * [:ods_version, :ods_minor_version, :attachment_id, :sql_dialect]
+ *
+ * Items the server does not know are nil.
+ *
+ *   info = conn.info(:page_reads, :page_fetches)
+ *   hit_ratio = 1 - info[:page_reads].fdiv(info[:page_fetches])
+ */
+static VALUE connection_info(int argc, VALUE *argv, VALUE self)
+{
+	struct FbConnection *fb_connection;
+	char items[FB_INFO_ITEMS];
+	int index[FB_INFO_ITEMS];
+	LONG_LONG values[FB_INFO_ITEMS];
+	char answered[FB_INFO_ITEMS];
+	VALUE result;
+	int count = 0;
+	int i, j;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+
+	for (i = 0; i < (argc ? argc : FB_INFO_ITEMS); i++) {
+		if (argc) {
+			for (j = 0; j < FB_INFO_ITEMS; j++) {
+				if (SYMBOL_P(argv[i]) && !strcmp(rb_id2name(SYM2ID(argv[i])), fb_info_items[j].name)) break;
+			}
+			if (j == FB_INFO_ITEMS) {
+				rb_raise(rb_eArgError, "unknown info item %"PRIsVALUE, rb_inspect(argv[i]));
+			}
+		} else {
+			j = i;
+		}
+		if (count < FB_INFO_ITEMS && !memchr(items, fb_info_items[j].item, count)) {
+			index[count] = j;
+			items[count] = fb_info_items[j].item;
+			values[count] = 0;
+			answered[count] = 0;
+			count++;
+		}
+	}
+
+	fb_database_info_integers(fb_connection->isc_status, &fb_connection->db, items, count, values, answered);
+	fb_error_check(fb_connection->isc_status);
+
+	result = rb_hash_new();
+	for (i = 0; i < count; i++) {
+		rb_hash_aset(result, ID2SYM(rb_intern(fb_info_items[index[i]].name)),
+				answered[i] ? LL2NUM(values[i]) : Qnil);
+	}
+	return result;
+}
+
+/* call-seq:
+ *   limbo_transactions() -> Array
+ *
+ * Ids of transactions left in limbo in this database by an interrupted
+ * two-phase commit.
+ */
+static VALUE connection_limbo_transactions(VALUE self)
+{
+	struct FbConnection *fb_connection;
+	char item = isc_info_limbo;
+	char *buffer = NULL;
+	short buffer_length;
+	VALUE ids;
+	char *p;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+
+	for (buffer_length = 1024; ; buffer_length *= 2) {
+		REALLOC_N(buffer, char, buffer_length);
+		fb_database_info(fb_connection->isc_status, &fb_connection->db, 1, &item, buffer_length, buffer);
+		if (fb_connection->isc_status[0] == 1 && fb_connection->isc_status[1]) {
+			xfree(buffer);
+			fb_error_check(fb_connection->isc_status);
+		}
+		for (p = buffer; *p == isc_info_limbo; p += 3 + isc_vax_integer(p + 1, 2)) {
+			/* find the end of the answer */
+		}
+		if (*p != isc_info_truncated || buffer_length >= 16384) break;
+	}
+
+	ids = rb_ary_new();
+	for (p = buffer; *p == isc_info_limbo; ) {
+		short length = (short)isc_vax_integer(p + 1, 2);
+		rb_ary_push(ids, LL2NUM(fb_info_integer(p + 3, length)));
+		p += 3 + length;
+	}
+	xfree(buffer);
+	return ids;
+}
+
+/* call-seq:
+ *   resolve_limbo(id, action) -> nil
+ *
+ * Commits (+action+ :commit) or rolls back (:rollback) a transaction in
+ * limbo. Commit it if any other database taking part in the distributed
+ * transaction committed it, roll it back otherwise.
+ */
+static VALUE connection_resolve_limbo(VALUE self, VALUE id, VALUE action)
+{
+	struct FbConnection *fb_connection;
+	isc_tr_handle handle = 0;
+	LONG_LONG number = NUM2LL(id);
+	char buffer[8];
+	short length;
+	int commit;
+	int i;
+
+	if (action == ID2SYM(rb_intern("commit"))) {
+		commit = 1;
+	} else if (action == ID2SYM(rb_intern("rollback"))) {
+		commit = 0;
+	} else {
+		rb_raise(rb_eArgError, "action must be :commit or :rollback");
+	}
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+
+	/* little-endian; 64-bit ids only when they need it */
+	length = (number > 0x7fffffffLL) ? 8 : 4;
+	for (i = 0; i < length; i++) {
+		buffer[i] = (char)((number >> (8 * i)) & 0xff);
+	}
+	isc_reconnect_transaction(fb_connection->isc_status, &fb_connection->db, &handle, length, buffer);
+	fb_error_check(fb_connection->isc_status);
+	if (commit) {
+		fb_commit_transaction(fb_connection->isc_status, &handle);
+	} else {
+		isc_rollback_transaction(fb_connection->isc_status, &handle);
+	}
+	fb_error_check(fb_connection->isc_status);
+	return Qnil;
+}
+
+/* events */
+
+#ifdef FB_EVENTS
+
+#define	FB_EVENTS_MAX	15	/* names one event block can hold */
+
+struct fb_events {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fired;		/* the callback delivered new counts */
+	int lost;		/* the callback delivered nothing: cancelled or detached */
+	int interrupted;	/* woken up by Ruby */
+	int baseline;		/* the first delivery only reports the current counts */
+	int queued;		/* a request is outstanding; the callback may still come */
+	ISC_LONG event_id;
+	ISC_UCHAR *event_buffer;
+	ISC_UCHAR *result_buffer;
+	long length;
+};
+
+/*
+ * Runs on a client library thread; only hands the counts over. A delivery
+ * for a request cancelled in the meantime finds queued cleared, and maybe
+ * the buffers gone, and is dropped.
+ */
+static void fb_events_callback(void *arg, ISC_USHORT length, const ISC_UCHAR *updated)
+{
+	struct fb_events *events = (struct fb_events *)arg;
+
+	pthread_mutex_lock(&events->lock);
+	if (!events->queued || !events->result_buffer) {
+		pthread_mutex_unlock(&events->lock);
+		return;
+	}
+	if (length && updated) {
+		memcpy(events->result_buffer, updated, length < events->length ? length : events->length);
+		events->fired = 1;
+	} else {
+		events->lost = 1;
+	}
+	events->queued = 0;
+	pthread_cond_broadcast(&events->cond);
+	pthread_mutex_unlock(&events->lock);
+}
+
+/* Called with the lock held, so a delivery in flight cannot copy into them. */
+static void fb_events_release_buffers(struct fb_events *events)
+{
+	if (events->event_buffer) isc_free((char *)events->event_buffer);
+	if (events->result_buffer) isc_free((char *)events->result_buffer);
+	events->event_buffer = events->result_buffer = NULL;
+	events->length = 0;
+}
+
+/*
+ * The connection is detached, which makes the client library deliver an
+ * outstanding request empty. Waits a while for that delivery, and leaks
+ * the events rather than freeing them under a callback that never came.
+ */
+static void fb_events_free(struct fb_events *events)
+{
+	struct timespec deadline;
+
+	if (!events) return;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 1;
+	pthread_mutex_lock(&events->lock);
+	while (events->queued) {
+		if (pthread_cond_timedwait(&events->cond, &events->lock, &deadline) == ETIMEDOUT) break;
+	}
+	if (events->queued) {
+		pthread_mutex_unlock(&events->lock);
+		return;
+	}
+	fb_events_release_buffers(events);
+	pthread_mutex_unlock(&events->lock);
+	pthread_mutex_destroy(&events->lock);
+	pthread_cond_destroy(&events->cond);
+	xfree(events);
+}
+
+static void fb_events_cancel(struct FbConnection *fb_connection)
+{
+	struct fb_events *events = fb_connection->events;
+	ISC_STATUS isc_status[20];
+
+	if (!events) return;
+	/* not under the lock: the client library may wait for a callback in progress */
+	if (events->queued && fb_connection->db) {
+		isc_cancel_events(isc_status, &fb_connection->db, &events->event_id);
+	}
+	pthread_mutex_lock(&events->lock);
+	events->queued = 0;
+	events->fired = events->lost = 0;
+	fb_events_release_buffers(events);
+	pthread_mutex_unlock(&events->lock);
+}
+
+/* Asks the server for the next change of any of the counts. */
+static void fb_events_arm(struct FbConnection *fb_connection)
+{
+	struct fb_events *events = fb_connection->events;
+
+	pthread_mutex_lock(&events->lock);
+	events->queued = 1;
+	pthread_mutex_unlock(&events->lock);
+	isc_que_events(fb_connection->isc_status, &fb_connection->db, &events->event_id,
+			(short)events->length, events->event_buffer, fb_events_callback, events);
+	if (fb_connection->isc_status[0] == 1 && fb_connection->isc_status[1]) {
+		pthread_mutex_lock(&events->lock);
+		events->queued = 0;
+		pthread_mutex_unlock(&events->lock);
+		fb_error_check(fb_connection->isc_status);
+	}
+}
+
+/* (Re)builds the event block for all registered names and queues it. */
+static void fb_events_setup(struct FbConnection *fb_connection)
+{
+	struct fb_events *events;
+	VALUE names = rb_funcall(fb_connection->event_handlers, rb_intern("keys"), 0);
+	const char *n[FB_EVENTS_MAX];
+	long i, count = RARRAY_LEN(names);
+
+	if (!fb_connection->events) {
+		fb_connection->events = ALLOC(struct fb_events);
+		MEMZERO(fb_connection->events, struct fb_events, 1);
+		pthread_mutex_init(&fb_connection->events->lock, NULL);
+		pthread_cond_init(&fb_connection->events->cond, NULL);
+	}
+	events = fb_connection->events;
+	fb_events_cancel(fb_connection);
+	fb_connection->event_names = names;
+	if (count == 0) return;
+
+	for (i = 0; i < FB_EVENTS_MAX; i++) {
+		n[i] = i < count ? RSTRING_PTR(RARRAY_AREF(names, i)) : NULL;
+	}
+	events->length = isc_event_block((void *)&events->event_buffer, (void *)&events->result_buffer, (ISC_USHORT)count,
+			n[0], n[1], n[2], n[3], n[4], n[5], n[6], n[7], n[8], n[9], n[10], n[11], n[12], n[13], n[14]);
+	events->baseline = 1;
+	fb_events_arm(fb_connection);
+}
+
+struct fb_events_wait {
+	struct fb_events *events;
+	double timeout;		/* seconds, negative to wait for good */
+};
+
+static void *fb_events_wait_nogvl(void *arg)
+{
+	struct fb_events_wait *wait = (struct fb_events_wait *)arg;
+	struct fb_events *events = wait->events;
+	struct timespec deadline;
+
+	if (wait->timeout >= 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += (time_t)wait->timeout;
+		deadline.tv_nsec += (long)((wait->timeout - (time_t)wait->timeout) * 1e9);
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	pthread_mutex_lock(&events->lock);
+	while (!events->fired && !events->lost && !events->interrupted) {
+		if (wait->timeout < 0) {
+			pthread_cond_wait(&events->cond, &events->lock);
+		} else if (pthread_cond_timedwait(&events->cond, &events->lock, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	events->interrupted = 0;
+	pthread_mutex_unlock(&events->lock);
+	return NULL;
+}
+
+static void fb_events_wake(void *arg)
+{
+	struct fb_events *events = (struct fb_events *)arg;
+
+	pthread_mutex_lock(&events->lock);
+	events->interrupted = 1;
+	pthread_cond_broadcast(&events->cond);
+	pthread_mutex_unlock(&events->lock);
+}
+
+/*
+ * Takes the delivered counts, listens again and runs the handlers. Returns
+ * the counts by name, or nil when nothing was actually posted.
+ */
+static VALUE fb_events_process(struct FbConnection *fb_connection)
+{
+	struct fb_events *events = fb_connection->events;
+	ISC_ULONG counts[FB_EVENTS_MAX];
+	VALUE names = fb_connection->event_names;
+	VALUE result;
+	long i, j;
+
+	isc_event_counts(counts, (short)events->length, events->event_buffer, events->result_buffer);
+	fb_events_arm(fb_connection);
+	if (events->baseline) {
+		events->baseline = 0;
+		return Qnil;
+	}
+
+	result = rb_hash_new();
+	for (i = 0; i < RARRAY_LEN(names) && i < FB_EVENTS_MAX; i++) {
+		if (counts[i]) {
+			rb_hash_aset(result, RARRAY_AREF(names, i), ULONG2NUM(counts[i]));
+		}
+	}
+	if (RHASH_SIZE(result) == 0) {
+		return Qnil;
+	}
+	for (i = 0; i < RARRAY_LEN(names) && i < FB_EVENTS_MAX; i++) {
+		VALUE name = RARRAY_AREF(names, i);
+		VALUE handlers = rb_hash_lookup(fb_connection->event_handlers, name);
+		if (!counts[i]) continue;
+		if (fb_connection->cache_events) {
+			fb_cache_invalidate(fb_connection, name);
+		}
+		if (NIL_P(handlers)) continue;
+		for (j = 0; j < RARRAY_LEN(handlers); j++) {
+			VALUE handler = RARRAY_AREF(handlers, j);
+			if (rb_obj_is_proc(handler)) {
+				rb_funcall(handler, rb_intern("call"), 2, ULONG2NUM(counts[i]), name);
+			} else {
+				rb_funcall(handler, rb_intern("push"), 1, rb_assoc_new(name, ULONG2NUM(counts[i])));
+			}
+		}
+	}
+	return result;
+}
+
+/* Processes events delivered so far, without waiting. */
+static void fb_events_poll(struct FbConnection *fb_connection)
+{
+	struct fb_events *events = fb_connection->events;
+	int fired, lost;
+
+	if (!events || !events->length) return;
+	pthread_mutex_lock(&events->lock);
+	fired = events->fired;
+	events->fired = 0;
+	lost = events->lost;
+	pthread_mutex_unlock(&events->lock);
+	if (lost) {
+		/* nothing tells us about changes anymore; wait_for_events reports it */
+		fb_cache_invalidate(fb_connection, Qnil);
+	} else if (fired) {
+		fb_events_process(fb_connection);
+	}
+}
+
+/* call-seq:
+ *   on_event(name, ...) {|count, name| } -> nil
+ *   on_event(name, ..., queue: queue) -> nil
+ *
+ * Registers a handler for events posted with POST_EVENT. The block is
+ * called, or <tt>[name, count]</tt> is pushed onto +queue+, from
+ * wait_for_events whenever the events were posted and committed since the
+ * last delivery. A connection can listen for up to 15 names.
+ *
+ * Handlers run only on a thread inside wait_for_events: the client
+ * library's callback thread records the counts and never enters Ruby.
+ */
+static VALUE connection_on_event(int argc, VALUE *argv, VALUE self)
+{
+	struct FbConnection *fb_connection;
+	VALUE names, kw, block, handler = Qnil;
+	ID queue_id[1];
+	long i, added = 0;
+
+	rb_scan_args(argc, argv, "*:&", &names, &kw, &block);
+	if (!NIL_P(kw)) {
+		queue_id[0] = rb_intern("queue");
+		rb_get_kwargs(kw, queue_id, 0, 1, &handler);
+		if (handler == Qundef) handler = Qnil;
+	}
+	if (NIL_P(handler) == NIL_P(block)) {
+		rb_raise(rb_eArgError, "give either a block or queue:");
+	}
+	if (NIL_P(handler)) handler = block;
+	if (RARRAY_LEN(names) == 0) {
+		rb_raise(rb_eArgError, "at least one event name is required");
+	}
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+
+	for (i = 0; i < RARRAY_LEN(names); i++) {
+		VALUE name = RARRAY_AREF(names, i);
+		StringValue(name);
+		if (NIL_P(rb_hash_lookup(fb_connection->event_handlers, name))) added++;
+	}
+	if (RHASH_SIZE(fb_connection->event_handlers) + added > FB_EVENTS_MAX) {
+		rb_raise(rb_eFbError, "a connection can listen for at most %d events", FB_EVENTS_MAX);
+	}
+	for (i = 0; i < RARRAY_LEN(names); i++) {
+		VALUE name = rb_str_new_frozen(RARRAY_AREF(names, i));
+		VALUE handlers = rb_hash_lookup(fb_connection->event_handlers, name);
+		if (NIL_P(handlers)) {
+			handlers = rb_ary_new();
+			rb_hash_aset(fb_connection->event_handlers, name, handlers);
+		}
+		rb_ary_push(handlers, handler);
+	}
+	if (added) {
+		fb_events_setup(fb_connection);
+	}
+	return Qnil;
+}
+
+/* call-seq:
+ *   wait_for_events(timeout = nil) -> Hash
+ *
+ * Waits, without holding the GVL, until registered events are posted or
+ * +timeout+ seconds pass. Runs the handlers and returns the counts by name,
+ * or an empty Hash on timeout. Listening resumes by itself afterwards.
+ */
+static VALUE connection_wait_for_events(int argc, VALUE *argv, VALUE self)
+{
+	struct FbConnection *fb_connection;
+	struct fb_events *events;
+	struct fb_events_wait wait;
+	VALUE timeout = Qnil, result;
+	double deadline = 0;
+	int fired, lost;
+
+	rb_scan_args(argc, argv, "01", &timeout);
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+	events = fb_connection->events;
+	if (!events || !events->length) {
+		rb_raise(rb_eFbError, "no events registered; use on_event first");
+	}
+	if (!NIL_P(timeout)) {
+		deadline = fb_monotonic_time() + NUM2DBL(rb_Float(timeout));
+	}
+
+	for (;;) {
+		wait.events = events;
+		wait.timeout = -1;
+		if (!NIL_P(timeout)) {
+			wait.timeout = deadline - fb_monotonic_time();
+			if (wait.timeout < 0) wait.timeout = 0;
+		}
+		rb_thread_call_without_gvl(fb_events_wait_nogvl, &wait, fb_events_wake, events);
+		rb_thread_check_ints();
+
+		pthread_mutex_lock(&events->lock);
+		fired = events->fired;
+		lost = events->lost;
+		events->fired = events->lost = 0;
+		pthread_mutex_unlock(&events->lock);
+
+		if (lost) {
+			if (fb_connection->auto_reconnect && fb_connection->dpb &&
+					!fb_connection_ping(fb_connection) && fb_connection_reattach(fb_connection)) {
+				fb_events_setup(fb_connection);
+				continue;
+			}
+			rb_raise(rb_eFbError, "event delivery stopped");
+		}
+		if (!fired) {
+			if (!NIL_P(timeout) && fb_monotonic_time() >= deadline) {
+				return rb_hash_new();
+			}
+			continue;
+		}
+
+		result = fb_events_process(fb_connection);
+		if (!NIL_P(result)) {
+			return result;
+		}
+	}
+}
+
+/* call-seq:
+ *   cancel_events() -> nil
+ *
+ * Stops listening and forgets all event handlers.
+ */
+static VALUE connection_cancel_events(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_events_cancel(fb_connection);
+	rb_hash_clear(fb_connection->event_handlers);
+	fb_connection->event_names = Qnil;
+	if (fb_connection->cache_events) {
+		fb_cache_invalidate(fb_connection, Qnil);
+	}
+	return Qnil;
+}
+
+#else
+
+static void fb_events_free(struct fb_events *events)
+{
+}
+
+static void fb_events_cancel(struct FbConnection *fb_connection)
+{
+}
+
+static void fb_events_poll(struct FbConnection *fb_connection)
+{
+}
+
+static VALUE connection_on_event(int argc, VALUE *argv, VALUE self)
+{
+	rb_notimplement();
+	return Qnil;
+}
+
+static VALUE connection_wait_for_events(int argc, VALUE *argv, VALUE self)
+{
+	rb_notimplement();
+	return Qnil;
+}
+
+static VALUE connection_cancel_events(VALUE self)
+{
+	rb_notimplement();
+	return Qnil;
+}
+
+#endif
+
+/* query result cache */
+
+struct fb_cache_invalidation {
+	struct FbConnection *fb_connection;
+	VALUE table;
+};
+
+static long fb_cache_entry_rows(VALUE entry)
+{
+	VALUE rows = RARRAY_AREF(entry, 0);
+	return TYPE(rows) == T_ARRAY ? RARRAY_LEN(rows) : 1;
+}
+
+static int fb_cache_invalidate_i(VALUE key, VALUE entry, VALUE arg)
+{
+	struct fb_cache_invalidation *inv = (struct fb_cache_invalidation *)arg;
+	VALUE tables = RARRAY_AREF(entry, 1);
+
+	if (!NIL_P(inv->table) && !RTEST(rb_ary_includes(tables, inv->table))) {
+		return ST_CONTINUE;
+	}
+	inv->fb_connection->cache_rows -= fb_cache_entry_rows(entry);
+	inv->fb_connection->cache_invalidations++;
+	return ST_DELETE;
+}
+
+/* Drops the entries depending on +table+, or all of them for nil. */
+static void fb_cache_invalidate(struct FbConnection *fb_connection, VALUE table)
+{
+	struct fb_cache_invalidation inv;
+
+	if (NIL_P(fb_connection->cache)) return;
+	inv.fb_connection = fb_connection;
+	inv.table = table;
+	rb_hash_foreach(fb_connection->cache, fb_cache_invalidate_i, (VALUE)&inv);
+}
+
+static void fb_cache_evict(struct FbConnection *fb_connection)
+{
+	VALUE cache = fb_connection->cache;
+
+	while (RHASH_SIZE(cache) > (size_t)fb_connection->cache_max_entries ||
+			fb_connection->cache_rows > fb_connection->cache_max_rows) {
+		VALUE pair = rb_funcall(cache, rb_intern("shift"), 0);
+		if (NIL_P(pair)) break;
+		fb_connection->cache_rows -= fb_cache_entry_rows(RARRAY_AREF(pair, 1));
+		fb_connection->cache_evictions++;
+	}
+}
+
+static VALUE fb_deep_freeze(VALUE obj);
+
+static int fb_deep_freeze_i(VALUE key, VALUE val, VALUE arg)
+{
+	fb_deep_freeze(val);
+	return ST_CONTINUE;
+}
+
+static VALUE fb_deep_freeze(VALUE obj)
+{
+	long i;
+
+	if (TYPE(obj) == T_ARRAY) {
+		for (i = 0; i < RARRAY_LEN(obj); i++) {
+			fb_deep_freeze(RARRAY_AREF(obj, i));
+		}
+	} else if (TYPE(obj) == T_HASH) {
+		rb_hash_foreach(obj, fb_deep_freeze_i, Qnil);
+	}
+	return rb_obj_freeze(obj);
+}
+
+/* Registers the tables as events so POST_EVENT invalidates their entries. */
+static void fb_cache_listen(struct FbConnection *fb_connection, VALUE tables)
+{
+#ifdef FB_EVENTS
+	long i, added = 0;
+
+	for (i = 0; i < RARRAY_LEN(tables); i++) {
+		if (NIL_P(rb_hash_lookup(fb_connection->event_handlers, RARRAY_AREF(tables, i)))) added++;
+	}
+	if (!added) return;
+	if (RHASH_SIZE(fb_connection->event_handlers) + added > FB_EVENTS_MAX) {
+		rb_raise(rb_eFbError, "a connection can listen for at most %d events", FB_EVENTS_MAX);
+	}
+	for (i = 0; i < RARRAY_LEN(tables); i++) {
+		VALUE table = RARRAY_AREF(tables, i);
+		if (NIL_P(rb_hash_lookup(fb_connection->event_handlers, table))) {
+			rb_hash_aset(fb_connection->event_handlers, table, rb_ary_new());
+		}
+	}
+	fb_events_setup(fb_connection);
+#else
+	rb_notimplement();
+#endif
+}
+
+/* call-seq:
+ *   cached_query(:array, sql, *args, tables: [], ttl: nil) -> Array of Arrays or nil
+ *   cached_query(:hash, sql, *args, tables: [], ttl: nil) -> Array of Hashes or nil
+ *   cached_query(sql, *args, tables: [], ttl: nil) -> Array of Arrays or nil
+ *
+ * Like query, but answers repeated calls with the same SQL and parameters
+ * from the connection's query cache (see the +query_cache+ option). The
+ * result is frozen. Entries expire after +ttl+ seconds and are dropped when
+ * invalidate_cache is called for one of +tables+, or when one of them is
+ * posted as an event with <tt>events: true</tt>. Inside a transaction the
+ * cache is bypassed.
+ */
+static VALUE connection_cached_query(int argc, VALUE *argv, VALUE self)
+{
+	struct FbConnection *fb_connection;
+	VALUE args, kw, key, entry, result, tables = Qnil, expires = Qnil;
+	VALUE opts[2];
+	ID kw_ids[2];
+	double ttl;
+	long i;
+
+	rb_scan_args(argc, argv, "1*:", NULL, NULL, &kw);
+	args = rb_ary_new_from_values(argc - (NIL_P(kw) ? 0 : 1), argv);
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+	if (NIL_P(fb_connection->cache) || fb_connection->transact || fb_connection->write_pending) {
+		return connection_query(RARRAY_LENINT(args), (VALUE *)RARRAY_CONST_PTR(args), self);
+	}
+
+	opts[0] = opts[1] = Qundef;
+	if (!NIL_P(kw)) {
+		kw_ids[0] = rb_intern("tables");
+		kw_ids[1] = rb_intern("ttl");
+		rb_get_kwargs(kw, kw_ids, 0, 2, opts);
+	}
+	ttl = opts[1] == Qundef || NIL_P(opts[1]) ? fb_connection->cache_ttl : NUM2DBL(rb_Float(opts[1]));
+
+	fb_events_poll(fb_connection);
+	key = rb_ary_new_capa(RARRAY_LEN(args));
+	for (i = 0; i < RARRAY_LEN(args); i++) {
+		VALUE arg = RARRAY_AREF(args, i);
+		rb_ary_push(key, TYPE(arg) == T_STRING ? rb_str_new_frozen(arg) : arg);
+	}
+	rb_obj_freeze(key);
+	entry = rb_hash_lookup(fb_connection->cache, key);
+	if (!NIL_P(entry)) {
+		expires = RARRAY_AREF(entry, 2);
+		rb_hash_delete(fb_connection->cache, key);
+		if (NIL_P(expires) || fb_monotonic_time() < NUM2DBL(expires)) {
+			/* keep the cache in least recently used order */
+			rb_hash_aset(fb_connection->cache, key, entry);
+			fb_connection->cache_hits++;
+			return RARRAY_AREF(entry, 0);
+		}
+		fb_connection->cache_rows -= fb_cache_entry_rows(entry);
+		fb_connection->cache_evictions++;
+	}
+	fb_connection->cache_misses++;
+
+	tables = rb_ary_new();
+	if (opts[0] != Qundef && !NIL_P(opts[0])) {
+		VALUE list = rb_Array(opts[0]);
+		for (i = 0; i < RARRAY_LEN(list); i++) {
+			rb_ary_push(tables, rb_str_new_frozen(rb_obj_as_string(RARRAY_AREF(list, i))));
+		}
+	}
+	rb_obj_freeze(tables);
+	if (fb_connection->cache_events) {
+		/* listen before running the query, so no change can slip in between */
+		fb_cache_listen(fb_connection, tables);
+	}
+
+	result = connection_query(RARRAY_LENINT(args), (VALUE *)RARRAY_CONST_PTR(args), self);
+	fb_deep_freeze(result);
+	entry = rb_ary_new_from_args(3, result, tables, ttl < 0 ? Qnil : DBL2NUM(fb_monotonic_time() + ttl));
+	if (fb_cache_entry_rows(entry) <= fb_connection->cache_max_rows && !fb_connection->transact) {
+		rb_hash_aset(fb_connection->cache, key, rb_obj_freeze(entry));
+		fb_connection->cache_rows += fb_cache_entry_rows(entry);
+		fb_cache_evict(fb_connection);
+	}
+	return result;
+}
+
+/* call-seq:
+ *   invalidate_cache(*tables) -> nil
+ *
+ * Drops the cached results depending on any of +tables+, or all of them
+ * when called without arguments.
+ */
+static VALUE connection_invalidate_cache(int argc, VALUE *argv, VALUE self)
+{
+	struct FbConnection *fb_connection;
+	int i;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	if (argc == 0) {
+		fb_cache_invalidate(fb_connection, Qnil);
+	}
+	for (i = 0; i < argc; i++) {
+		fb_cache_invalidate(fb_connection, rb_obj_as_string(argv[i]));
+	}
+	return Qnil;
+}
+
+/* call-seq:
+ *   cache_stats() -> Hash
+ *
+ * Returns counters of the query cache: :hits, :misses, :evictions,
+ * :invalidations, :entries and :rows.
+ */
+static VALUE connection_cache_stats(VALUE self)
+{
+	struct FbConnection *fb_connection;
+	VALUE stats = rb_hash_new();
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	rb_hash_aset(stats, ID2SYM(rb_intern("hits")), LONG2NUM(fb_connection->cache_hits));
+	rb_hash_aset(stats, ID2SYM(rb_intern("misses")), LONG2NUM(fb_connection->cache_misses));
+	rb_hash_aset(stats, ID2SYM(rb_intern("evictions")), LONG2NUM(fb_connection->cache_evictions));
+	rb_hash_aset(stats, ID2SYM(rb_intern("invalidations")), LONG2NUM(fb_connection->cache_invalidations));
+	rb_hash_aset(stats, ID2SYM(rb_intern("entries")), LONG2NUM(NIL_P(fb_connection->cache) ? 0 : (long)RHASH_SIZE(fb_connection->cache)));
+	rb_hash_aset(stats, ID2SYM(rb_intern("rows")), LONG2NUM(fb_connection->cache_rows));
+	return stats;
+}
+
+/* call-seq:
+ *   stats() -> Stats or nil
+ *
+ * The Fb::Stats statements on this connection are counted in.
+ */
+static VALUE connection_stats(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	return fb_connection->stats;
+}
+
+/* call-seq:
+ *   stats = Stats or nil
+ *
+ * Starts counting statements in the given Fb::Stats, or stops with nil.
+ */
+static VALUE connection_set_stats(VALUE self, VALUE stats)
+{
+	struct FbConnection *fb_connection;
+
+	if (!NIL_P(stats)) {
+		fb_stats_get(stats);
+	}
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection->stats = stats;
+	return stats;
+}
+
+/* call-seq:
+ *   slow_query_threshold() -> Float or nil
+ */
+static VALUE connection_slow_query_threshold(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	return fb_connection->slow_threshold < 0 ? Qnil : DBL2NUM(fb_connection->slow_threshold);
+}
+
+/* call-seq:
+ *   slow_query_threshold = seconds or nil
+ *
+ * Statements taking at least +seconds+, from prepare to the last row
+ * fetched, are handed to the slow query log; nil turns the log off.
+ */
+static VALUE connection_set_slow_query_threshold(VALUE self, VALUE threshold)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection->slow_threshold = NIL_P(threshold) ? -1 : NUM2DBL(rb_Float(threshold));
+	return threshold;
+}
+
+/* call-seq:
+ *   slow_query_log = callable, IO or file name
+ *
+ * Where slow statements go: a Proc (or anything responding to +call+)
+ * receives each record as a Hash; an IO or a file name gets one JSON
+ * object per line.
+ */
+static VALUE connection_set_slow_query_log(VALUE self, VALUE log)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_close_slow_log(fb_connection);
+	fb_connection->slow_log = log;
+	return log;
+}
+
+/* call-seq:
+ *   io_stats? -> true or false
+ */
+static VALUE connection_is_io_stats(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	return fb_connection->io_stats ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+ *   io_stats = true or false
+ *
+ * Counts the table reads and writes of every statement from now on, at
+ * the cost of two isc_database_info round trips per statement.
+ */
+static VALUE connection_set_io_stats(VALUE self, VALUE on)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection->io_stats = RTEST(on);
+	return on;
+}
+
+/* call-seq:
+ *   last_io_stats() -> Hash or nil
+ *
+ * Cursor#io_stats of the last statement done on the connection; the only
+ * way to get at them for +execute+ of a DML statement, which returns no
+ * cursor.
+ */
+static VALUE connection_last_io_stats(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	return fb_connection->io_last;
+}
+
+/* call-seq:
+ *   close() -> nil
+ *
+ * Closes connection to database.
+ */
+static VALUE connection_close(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	if (fb_connection->dropped) return Qnil;
+
+	fb_connection_check(fb_connection);
+	fb_connection_disconnect(fb_connection);
+	fb_connection_drop_cursors(fb_connection);
+	fb_connection_close_slow_log(fb_connection);
+
+	return Qnil;
+}
+
+/* call-seq:
+ *   drop() -> nil
+ *
+ * Drops connected database.
+ */
+static VALUE connection_drop(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection->dropped = 1;
+	fb_connection_disconnect(fb_connection);
+	fb_connection_drop_cursors(fb_connection);
+	fb_connection_close_slow_log(fb_connection);
+
+	return Qnil;
+}
+
+/* call-seq:
+ *   dialect() -> int
+ *
+ * Returns dialect of connection.
+ */
+static VALUE connection_dialect(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+
+	return INT2FIX(fb_connection->dialect);
+}
+
+/* call-seq:
+ *   db_dialect() -> int
+ *
+ * Returns database dialect.
+ */
+static VALUE connection_db_dialect(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+
+	return INT2FIX(fb_connection->db_dialect);
+}
+
+static void fb_cursor_check(struct FbCursor *fb_cursor)
+{
+	if (fb_cursor->stmt == 0) {
+		rb_raise(rb_eFbError, "dropped db cursor");
+	}
+	if (!fb_cursor->open) {
+		rb_raise(rb_eFbError, "closed db cursor");
+	}
+}
+
+static void fb_cursor_drop(struct FbCursor *fb_cursor)
+{
+	ISC_STATUS isc_status[20];
+	if (fb_cursor->open) {
+		isc_dsql_free_statement(isc_status, &fb_cursor->stmt, DSQL_close);
+		fb_error_check(isc_status);
+	}
+	isc_dsql_free_statement(isc_status, &fb_cursor->stmt, DSQL_drop);
+	fb_error_check(isc_status);
+}
+
+static void fb_cursor_drop_warn(struct FbCursor *fb_cursor)
+{
+	ISC_STATUS isc_status[20];
+	if (fb_cursor->open) {
+		isc_dsql_free_statement(isc_status, &fb_cursor->stmt, DSQL_close);
+		fb_error_check_warn(isc_status);
+	}
+	isc_dsql_free_statement(isc_status, &fb_cursor->stmt, DSQL_drop);
+	fb_error_check_warn(isc_status);
+}
+
+static void fb_cursor_mark(struct FbCursor *fb_cursor)
+{
+	rb_gc_mark(fb_cursor->connection);
+	rb_gc_mark(fb_cursor->fields_ary);
+	rb_gc_mark(fb_cursor->fields_hash);
+	rb_gc_mark(fb_cursor->transaction);
+	rb_gc_mark(fb_cursor->stats);
+	rb_gc_mark(fb_cursor->timed_sql);
+	rb_gc_mark(fb_cursor->timed_params);
+	rb_gc_mark(fb_cursor->io_before);
+	rb_gc_mark(fb_cursor->io_stats);
+}
+
+static void fb_cursor_free(struct FbCursor *fb_cursor)
+{
+	if (fb_cursor->stmt) {
+		fb_cursor_drop_warn(fb_cursor);
+	}
+	xfree(fb_cursor->i_sqlda);
+	xfree(fb_cursor->o_sqlda);
+	xfree(fb_cursor->i_buffer);
+	xfree(fb_cursor->o_buffer);
+	xfree(fb_cursor);
+}
+
+static VALUE sql_decimal_to_bigdecimal(long long sql_data, int scale)
+{
+	char bigdecimal_buffer[128];
+	int is_negative = 0;
+	unsigned long long abs_data;
+	int len, decimal_places, dot_pos;
+
+	/* Handle negative numbers */
+	if (sql_data < 0) {
+		is_negative = 1;
+		abs_data = (unsigned long long)(-sql_data);
+	} else {
+		abs_data = (unsigned long long)sql_data;
+	}
+
+	/* Convert to string */
+	int wrote = snprintf(bigdecimal_buffer, sizeof(bigdecimal_buffer), "%llu", abs_data);
+	if (wrote < 0 || wrote >= (int)sizeof(bigdecimal_buffer)) {
+		rb_raise(rb_eRuntimeError, "Buffer overflow in decimal conversion");
+	}
+	len = wrote;
+
+	/* Add decimal point if scale != 0 */
+	if (scale != 0) {
+		decimal_places = (scale < 0) ? -scale : scale;
+		dot_pos = len - decimal_places;
+
+		if (dot_pos <= 0) {
+			int leading_zeros = 1 - dot_pos;
+
+			if (len + leading_zeros + 1 >= (int)sizeof(bigdecimal_buffer)) {
+				rb_raise(rb_eRuntimeError, "Buffer overflow in decimal conversion");
+			}
+
+			memmove(bigdecimal_buffer + leading_zeros, bigdecimal_buffer, len + 1);
+			memset(bigdecimal_buffer, '0', leading_zeros);
+
+			len += leading_zeros;
+			dot_pos = len - decimal_places;
+		}
+
+		if (len + 1 >= (int)sizeof(bigdecimal_buffer)) {
+			rb_raise(rb_eRuntimeError, "Buffer overflow in decimal conversion");
+		}
+
+		memmove(bigdecimal_buffer + dot_pos + 1, bigdecimal_buffer + dot_pos, len - dot_pos);
+		bigdecimal_buffer[dot_pos] = '.';
+		bigdecimal_buffer[len + 1] = '\0';
+	}
+
+	/* Add minus sign after decimal point placement */
+	if (is_negative) {
+		len = (int)strlen(bigdecimal_buffer);
+		memmove(bigdecimal_buffer + 1, bigdecimal_buffer, len + 1);
+		bigdecimal_buffer[0] = '-';
+		bigdecimal_buffer[len + 1] = '\0';
+	}
+
+	return rb_funcall(rb_cObject, rb_intern("BigDecimal"), 1, rb_str_new2(bigdecimal_buffer));
+}
+
+static VALUE object_to_unscaled_bigdecimal(VALUE object, int scale)
+{
+	int i;
+	long ratio = 1;
+	for (i = 0; i > scale; i--)
+		ratio *= 10;
+	if (TYPE(object) == T_FLOAT)
+		object = rb_funcall(object, rb_intern("to_s"), 0);
+	object = rb_funcall(rb_cObject, rb_intern("BigDecimal"), 1, object);
+	object = rb_funcall(object, rb_intern("*"), 1, LONG2NUM(ratio));
+	return rb_funcall(object, rb_intern("round"), 0);
+}
+
+static void fb_cursor_set_inputparams(struct FbCursor *fb_cursor, long argc, VALUE *argv)
+{
+	struct FbConnection *fb_connection;
+	long count;
+	long offset;
+	short dtp;
+	VALUE obj;
+	long lvalue;
+	ISC_INT64 llvalue;
+	long alignment;
+	double dvalue;
+	double dcheck;
+	VARY *vary;
+	XSQLVAR *var;
+
+	isc_blob_handle blob_handle;
+	ISC_QUAD blob_id;
+	double blob_started;
+	char *p;
+	long length;
+	struct tm tms;
+
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	/* Check the number of parameters */
+	if (fb_cursor->i_sqlda->sqld != argc) {
+		rb_raise(rb_eFbError, "statement requires %d items; %ld given", fb_cursor->i_sqlda->sqld, argc);
+	}
+
+	/* Get the parameters */
+	for (count = 0,offset = 0; count < argc; count++) {
+		obj = argv[count];
+
+		var = &fb_cursor->i_sqlda->sqlvar[count];
+		if (!NIL_P(obj)) {
+			dtp = var->sqltype & ~1;
+			alignment = var->sqllen;
+
+			switch (dtp) {
+				case SQL_TEXT :
+					alignment = 1;
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+					obj = rb_obj_as_string(obj);
+					if (RSTRING_LEN(obj) > var->sqllen) {
+						rb_raise(rb_eRangeError, "CHAR overflow: %ld bytes exceeds %d byte(s) allowed.",
+							RSTRING_LEN(obj), var->sqllen);
+					}
+					memcpy(var->sqldata, RSTRING_PTR(obj), RSTRING_LEN(obj));
+					var->sqllen = RSTRING_LEN(obj);
+					offset += var->sqllen + 1;
+					break;
+
+				case SQL_VARYING :
+					alignment = sizeof(short);
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+					vary = (VARY *)var->sqldata;
+					obj = rb_obj_as_string(obj);
+					if (RSTRING_LEN(obj) > var->sqllen) {
+						rb_raise(rb_eRangeError, "VARCHAR overflow: %ld bytes exceeds %d byte(s) allowed.",
+							RSTRING_LEN(obj), var->sqllen);
+					}
+					memcpy(vary->vary_string, RSTRING_PTR(obj), RSTRING_LEN(obj));
+					vary->vary_length = RSTRING_LEN(obj);
+					offset += vary->vary_length + sizeof(short);
+					break;
+
+				case SQL_SHORT :
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+					if (var->sqlscale < 0) {
+						lvalue = NUM2LONG(object_to_unscaled_bigdecimal(obj, var->sqlscale));
+					} else {
+						lvalue = NUM2LONG(object_to_fixnum(obj));
+					}
+					if (lvalue < -32768 || lvalue > 32767) {
+						rb_raise(rb_eRangeError, "short integer overflow");
+					}
+					*(short *)var->sqldata = lvalue;
+					offset += alignment;
+					break;
+
+				case SQL_LONG :
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+					if (var->sqlscale < 0) {
+						lvalue = NUM2LONG(object_to_unscaled_bigdecimal(obj, var->sqlscale));
+					} else {
+						lvalue = NUM2LONG(object_to_fixnum(obj));
+					}
+					if (lvalue < -2147483648LL || lvalue > 2147483647LL) {
+						rb_raise(rb_eRangeError, "integer overflow");
+					}
+					*(ISC_LONG *)var->sqldata = (ISC_LONG)lvalue;
+					offset += alignment;
+					break;
+
+				case SQL_FLOAT :
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+					obj = double_from_obj(obj);
+					dvalue = NUM2DBL(obj);
+					if (dvalue >= 0.0) {
+						dcheck = dvalue;
+					} else {
+						dcheck = dvalue * -1;
+					}
+					if (dcheck != 0.0 && (dcheck < FLT_MIN || dcheck > FLT_MAX)) {
+						rb_raise(rb_eRangeError, "float overflow");
+					}
+					*(float *)var->sqldata = (float)dvalue;
+					offset += alignment;
+					break;
+
+				case SQL_DOUBLE :
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+					obj = double_from_obj(obj);
+					dvalue = NUM2DBL(obj);
+					*(double *)var->sqldata = dvalue;
+					offset += alignment;
+					break;
+
+				case SQL_INT64 :
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+
+					if (var->sqlscale < 0) {
+						llvalue = NUM2LL(object_to_unscaled_bigdecimal(obj, var->sqlscale));
+					} else {
+						llvalue = NUM2LL(object_to_fixnum(obj));
+					}
+
+					*(ISC_INT64 *)var->sqldata = llvalue;
+					offset += alignment;
+					break;
+
+				case SQL_BLOB :
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+					obj = rb_obj_as_string(obj);
+
+					blob_handle = 0;
+					blob_started = fb_cursor->timed ? fb_monotonic_time() : 0;
+					isc_create_blob2(
+						fb_connection->isc_status,&fb_connection->db,fb_cursor_transact(fb_cursor, fb_connection),
+						&blob_handle,&blob_id,0,NULL);
+					fb_error_check(fb_connection->isc_status);
+					length = RSTRING_LEN(obj);
+					p = RSTRING_PTR(obj);
+					while (length >= 4096) {
+						isc_put_segment(fb_connection->isc_status,&blob_handle,4096,p);
+						fb_error_check(fb_connection->isc_status);
+						p += 4096;
+						length -= 4096;
+					}
+					if (length) {
+						isc_put_segment(fb_connection->isc_status,&blob_handle,length,p);
+						fb_error_check(fb_connection->isc_status);
+					}
+					isc_close_blob(fb_connection->isc_status,&blob_handle);
+					fb_error_check(fb_connection->isc_status);
+					if (fb_cursor->timed) {
+						fb_cursor->phase_time[FB_PHASE_BLOB] += fb_monotonic_time() - blob_started;
+						fb_cursor->phase_count[FB_PHASE_BLOB]++;
+						if (fb_cursor->stats_entry) {
+							fb_cursor->stats_entry->calls += 2 + (RSTRING_LEN(obj) + 4095) / 4096;
+						}
+					}
+
+					*(ISC_QUAD *)var->sqldata = blob_id;
+					offset += alignment;
+					break;
+
+				case SQL_TIMESTAMP :
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+					tm_from_timestamp(&tms, obj);
+					isc_encode_timestamp(&tms, (ISC_TIMESTAMP *)var->sqldata);
+					offset += alignment;
+					break;
+
+				case SQL_TYPE_TIME :
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+					tm_from_timestamp(&tms, obj);
+					isc_encode_sql_time(&tms, (ISC_TIME *)var->sqldata);
+					offset += alignment;
+					break;
+
+				case SQL_TYPE_DATE :
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+					tm_from_date(&tms, obj);
+					isc_encode_sql_date(&tms, (ISC_DATE *)var->sqldata);
+					offset += alignment;
+					break;
+
+#if (FB_API_VER >= 30)
+				case SQL_BOOLEAN:
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+					*(bool *)var->sqldata = RTEST(obj);
+					offset += alignment;
+					break;
+#endif
+
+#if (FB_API_VER >= 40)
+				case SQL_INT128:
+					offset = FB_ALIGN(offset, alignment);
+					var->sqldata = (char *)(fb_cursor->i_buffer + offset);
+#if defined(__SIZEOF_INT128__)
+					value_to_fb_int128(obj, var->sqlscale, var->sqldata);
+#else
+					rb_raise(rb_eFbError, "INT128 requires compiler support for __int128");
+#endif
+					offset += alignment;
+					break;
+#endif
+
+				default:
+					rb_raise(rb_eFbError, "Specified table includes unsupported datatype (%d)", dtp);
+			}
+
+			if (var->sqltype & 1) {
+				offset = FB_ALIGN(offset, sizeof(short));
+				var->sqlind = (short *)(fb_cursor->i_buffer + offset);
+				*var->sqlind = 0;
+				offset += sizeof(short);
+			}
+		} else if (var->sqltype & 1) {
+			var->sqldata = 0;
+			offset = FB_ALIGN(offset, sizeof(short));
+			var->sqlind = (short *)(fb_cursor->i_buffer + offset);
+			*var->sqlind = -1;
+			offset += sizeof(short);
+		} else {
+			rb_raise(rb_eFbError, "specified column is not permitted to be null");
+		}
+	}
+}
+
+/*
+ * Setup output SQLDA buffer pointers. Must be called after o_sqlda is populated
+ * and o_buffer is allocated/reallocated to sufficient size.
+ */
+static void fb_cursor_setup_output_buffer(struct FbCursor *fb_cursor)
+{
+	long cols = fb_cursor->o_sqlda->sqld;
+	long count;
+	long offset = 0;
+	long length;
+	long alignment;
+	XSQLVAR *var;
+	short dtp;
+
+	for (var = fb_cursor->o_sqlda->sqlvar, count = 0; count < cols; var++, count++) {
+		length = alignment = var->sqllen;
+		dtp = var->sqltype & ~1;
+
+		if (dtp == SQL_TEXT) {
+			alignment = 1;
+		} else if (dtp == SQL_VARYING) {
+			length += sizeof(short);
+			alignment = sizeof(short);
+		}
+
+		offset = FB_ALIGN(offset, alignment);
+		var->sqldata = (char*)(fb_cursor->o_buffer + offset);
+		offset += length;
+		offset = FB_ALIGN(offset, sizeof(short));
+		var->sqlind = (short*)(fb_cursor->o_buffer + offset);
+		offset += sizeof(short);
+	}
+}
+
+static VALUE precision_from_sqlvar(XSQLVAR *sqlvar)
+{
+	switch(sqlvar->sqltype & ~1) {
+		case SQL_TEXT:		return Qnil;
+		case SQL_VARYING:	return Qnil;
+		case SQL_SHORT:
+			switch (sqlvar->sqlsubtype) {
+				case 0:		return INT2FIX(0);
+				case 1:		return INT2FIX(4);
+				case 2:		return INT2FIX(4);
+			}
+			break;
+		case SQL_LONG:
+			switch (sqlvar->sqlsubtype) {
+				case 0:		return INT2FIX(0);
+				case 1:		return INT2FIX(9);
+				case 2:		return INT2FIX(9);
+			}
+			break;
+		case SQL_FLOAT:		return Qnil;
+		case SQL_DOUBLE:
+		case SQL_D_FLOAT:
+			switch (sqlvar->sqlsubtype) {
+				case 0:		return Qnil;
+				case 1:		return INT2FIX(15);
+				case 2:		return INT2FIX(15);
+			}
+			break;
+		case SQL_TIMESTAMP:	return Qnil;
+		case SQL_BLOB:		return Qnil;
+		case SQL_ARRAY:		return Qnil;
+#if (FB_API_VER >= 30)
+		case SQL_BOOLEAN: return Qnil;
+#endif
+		case SQL_QUAD:		return Qnil;
+		case SQL_TYPE_TIME:	return Qnil;
+		case SQL_TYPE_DATE:	return Qnil;
+		case SQL_INT64:
+			switch (sqlvar->sqlsubtype) {
+				case 0:		return INT2FIX(0);
+				case 1:		return INT2FIX(18);
+				case 2:		return INT2FIX(18);
+			}
+			break;
+#if (FB_API_VER >= 40)
+		case SQL_INT128:
+			switch (sqlvar->sqlsubtype) {
+				case 0:		return INT2FIX(0);
+				case 1:		return INT2FIX(38);
+				case 2:		return INT2FIX(38);
+			}
+			break;
+#endif
+	}
+	return Qnil;
+}
+
+/* Scans in C rather than matching a shared Regexp, so no mutable Ruby
+ * object is touched when names are fetched from several Ractors. */
+static int no_lowercase(VALUE value)
+{
+	VALUE local_value = StringValue(value);
+	rb_encoding *enc = rb_enc_get(local_value);
+	const char *p = RSTRING_PTR(local_value);
+	const char *e = RSTRING_END(local_value);
+	int len;
+
+	while (p < e) {
+		len = rb_enc_precise_mbclen(p, e, enc);
+		if (MBCLEN_CHARFOUND_P(len)) {
+			len = MBCLEN_CHARFOUND_LEN(len);
+			if (rb_enc_islower(rb_enc_mbc_to_codepoint(p, e, enc), enc)) {
+				return 0;
+			}
+		} else {
+			len = 1;
+		}
+		p += len;
+	}
+	return 1;
+}
+
+static VALUE fb_cursor_fields_ary(XSQLDA *sqlda, short downcase_names)
+{
+	long cols;
+	long count;
+	XSQLVAR *var;
+	short dtp;
+	VALUE ary;
+
+	cols = sqlda->sqld;
+	if (cols == 0) {
+		return Qnil;
+	}
+
+	ary = rb_ary_new();
+	for (count = 0; count < cols; count++) {
+		VALUE field;
+		VALUE name, type_code, sql_type, sql_subtype, display_size, internal_size, precision, scale, nullable;
+
+		var = &sqlda->sqlvar[count];
+		dtp = var->sqltype & ~1;
+
+		if (var->aliasname_length) {
+			name = rb_str_new(var->aliasname, var->aliasname_length);
+		} else {
+			name = rb_str_new(var->sqlname, var->sqlname_length);
+		}
+		if (downcase_names && no_lowercase(name)) {
+			rb_funcall(name, id_downcase_bang, 0);
+		}
+		rb_str_freeze(name);
+		type_code = INT2NUM((int)(var->sqltype & ~1));
+		sql_type = fb_sql_type_from_code(dtp, var->sqlsubtype);
+		sql_subtype = INT2FIX(var->sqlsubtype);
+		display_size = INT2NUM((int)var->sqllen);
+		if (dtp == SQL_VARYING) {
+			internal_size = INT2NUM((int)(var->sqllen + sizeof(short)));
+		} else {
+			internal_size = INT2NUM((int)var->sqllen);
+		}
+		precision = precision_from_sqlvar(var);
+		scale = INT2NUM((int)var->sqlscale);
+		nullable = (var->sqltype & 1) ? Qtrue : Qfalse;
+
+		field = rb_struct_new(rb_sFbField, name, sql_type, sql_subtype, display_size, internal_size, precision, scale, nullable, type_code);
+		rb_ary_push(ary, field);
+	}
+	rb_ary_freeze(ary);
+	return ary;
+}
+
+static VALUE fb_cursor_fields_hash(VALUE fields_ary)
+{
+	int i;
+	VALUE hash = rb_hash_new();
+
+	for (i = 0; i < RARRAY_LEN(fields_ary); i++) {
+		VALUE field = rb_ary_entry(fields_ary, i);
+		VALUE name = rb_struct_aref(field, LONG2NUM(0));
+		rb_hash_aset(hash, name, field);
+	}
+
+	return hash;
+}
+
+static void fb_cursor_fetch_prep(struct FbCursor *fb_cursor)
+{
+	struct FbConnection *fb_connection;
+	long cols;
+	long count;
+	XSQLVAR *var;
+	short dtp;
+	long length;
+	long alignment;
+	long offset;
+
+	fb_cursor_check(fb_cursor);
+
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+	if (fb_cursor->epoch != fb_connection->epoch) {
+		rb_raise(rb_eFbError, "cursor was invalidated by a reconnect");
+	}
+
+	/* Check if open cursor */
+	if (!fb_cursor->open) {
+		rb_raise(rb_eFbError, "The cursor has not been opened. Use execute(query)");
+	}
+	/* Describe output SQLDA */
+	isc_dsql_describe(fb_connection->isc_status, &fb_cursor->stmt, 1, fb_cursor->o_sqlda);
+	fb_error_check(fb_connection->isc_status);
+
+	/* Set the output SQLDA */
+	cols = fb_cursor->o_sqlda->sqld;
+	for (var = fb_cursor->o_sqlda->sqlvar, offset = 0, count = 0; count < cols; var++, count++) {
+		length = alignment = var->sqllen;
+		dtp = var->sqltype & ~1;
+
+		if (dtp == SQL_TEXT) {
+			alignment = 1;
+		} else if (dtp == SQL_VARYING) {
+			length += sizeof(short);
+			alignment = sizeof(short);
+		}
+		offset = FB_ALIGN(offset, alignment);
+		var->sqldata = (char*)(fb_cursor->o_buffer + offset);
+		offset += length;
+		offset = FB_ALIGN(offset, sizeof(short));
+		var->sqlind = (short*)(fb_cursor->o_buffer + offset);
+		offset += sizeof(short);
+	}
+}
+
+/*
+ * Fetch one row into +ary+, overwriting its previous contents.
+ * When +ary+ is nil a new Array is allocated for the row.
+ */
+static VALUE fb_cursor_fetch_into(struct FbCursor *fb_cursor, VALUE ary)
+{
+	struct FbConnection *fb_connection;
+	long cols;
+	long count;
+	XSQLVAR *var;
+	long dtp;
+	VALUE val;
+	VARY *vary;
+	struct tm tms;
+
+	isc_blob_handle blob_handle;
+	ISC_QUAD blob_id;
+	unsigned short actual_seg_len;
+	static char blob_items[] = {
+		isc_info_blob_max_segment,
+		isc_info_blob_num_segments,
+		isc_info_blob_total_length
+	};
+	char blob_info[32];
+	char *p, item;
+	short length;
+	unsigned short max_segment = 0;
+	ISC_LONG num_segments = 0;
+	ISC_LONG total_length = 0;
+	ISC_STATUS fetch_status;
+	double started = 0, fetched = 0, blob_started = 0, blob_time = 0;
+
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_check(fb_connection);
+
+	if (fb_cursor->eof) {
+		rb_raise(rb_eFbError, "Cursor is past end of data.");
+	}
+	/* Fetch one row */
+	if (fb_cursor->timed) {
+		started = fb_monotonic_time();
+	}
+	FB_PROBED(fetch_done, FB_PROBE2(fetch_start, fb_cursor, fb_cursor->o_sqlda->sqld),
+		fetch_status = fb_dsql_fetch(fb_connection->isc_status, &fb_cursor->stmt, fb_cursor->o_sqlda),
+		FB_PROBE4(fetch_done, fb_cursor, fetch_status == SQLCODE_NOMORE ? 0 : 1, fb_probe_us, fb_connection->isc_status[1]));
+	if (fb_cursor->timed) {
+		fetched = fb_monotonic_time();
+		fb_cursor->phase_time[FB_PHASE_FETCH] += fetched - started;
+		fb_cursor->phase_count[FB_PHASE_FETCH]++;
+		if (fb_cursor->stats_entry) fb_cursor->stats_entry->calls++;
+	}
+	if (fetch_status == SQLCODE_NOMORE) {
+		fb_cursor->eof = Qtrue;
+		fb_cursor_timing_flush(fb_cursor);
+		return Qnil;
+	}
+	fb_error_check(fb_connection->isc_status);
+
+	/* Create the result tuple object, unless the caller recycles one */
+	cols = fb_cursor->o_sqlda->sqld;
+	if (NIL_P(ary)) {
+		ary = rb_ary_new2(cols);
+	}
+
+	/* Create the result objects for each column */
+	for (count = 0; count < cols; count++) {
+		var = &fb_cursor->o_sqlda->sqlvar[count];
+		dtp = var->sqltype & ~1;
+
+		/* Check if column is null */
+		if ((var->sqltype & 1) && (*var->sqlind < 0)) {
+			val = Qnil;
+		} else {
+			switch (dtp) {
+				case SQL_TEXT:
+					val = rb_str_new(var->sqldata, var->sqllen);
+					break;
+
+				case SQL_VARYING:
+					vary = (VARY*)var->sqldata;
+					val = rb_str_new(vary->vary_string, vary->vary_length);
+					#if HAVE_RUBY_ENCODING_H
+					rb_funcall(val, id_force_encoding, 1, fb_connection->encoding);
+					#endif
+					break;
+
+				case SQL_SHORT:
+					if (var->sqlscale < 0) {
+						val = sql_decimal_to_bigdecimal((long long)*(ISC_SHORT*)var->sqldata, var->sqlscale);
+					} else {
+						val = INT2NUM((int)*(short*)var->sqldata);
+					}
+					break;
+
+				case SQL_LONG:
+					if (var->sqlscale < 0) {
+						val = sql_decimal_to_bigdecimal((long long)*(ISC_LONG*)var->sqldata, var->sqlscale);
+					} else {
+						val = INT2NUM(*(ISC_LONG*)var->sqldata);
+					}
+					break;
+
+				case SQL_FLOAT:
+					val = rb_float_new((double)*(float*)var->sqldata);
+					break;
+
+				case SQL_DOUBLE:
+					val = rb_float_new(*(double*)var->sqldata);
+					break;
+
+				case SQL_INT64:
+					if (var->sqlscale < 0) {
+						val = sql_decimal_to_bigdecimal(*(ISC_INT64*)var->sqldata, var->sqlscale);
+					} else {
+						val = LL2NUM(*(ISC_INT64*)var->sqldata);
+					}
+					break;
+
+				case SQL_TIMESTAMP:
+					isc_decode_timestamp((ISC_TIMESTAMP *)var->sqldata, &tms);
+					val = fb_mktime(&tms, "local");
+					break;
+
+				case SQL_TYPE_TIME:
+					isc_decode_sql_time((ISC_TIME *)var->sqldata, &tms);
+					tms.tm_year = 100;
+					tms.tm_mon = 0;
+					tms.tm_mday = 1;
+					val = fb_mktime(&tms, "utc");
+					break;
+
+				case SQL_TYPE_DATE:
+					isc_decode_sql_date((ISC_DATE *)var->sqldata, &tms);
+					val = fb_mkdate(&tms);
+					break;
+
+				case SQL_BLOB:
+					blob_handle = 0;
+					blob_id = *(ISC_QUAD *)var->sqldata;
+					if (fb_cursor->timed) {
+						blob_started = fb_monotonic_time();
+					}
+					FB_PROBED(blob_open, (void)0,
+						isc_open_blob2(fb_connection->isc_status, &fb_connection->db, fb_cursor_transact(fb_cursor, fb_connection), &blob_handle, &blob_id, 0, NULL),
+						FB_PROBE3(blob_open, fb_cursor, fb_probe_us, fb_connection->isc_status[1]));
+					fb_error_check(fb_connection->isc_status);
+					isc_blob_info(
+						fb_connection->isc_status, &blob_handle,
+						sizeof(blob_items), blob_items,
+						sizeof(blob_info), blob_info);
+					fb_error_check(fb_connection->isc_status);
+					for (p = blob_info; *p != isc_info_end; p += length) {
+						item = *p++;
+						length = (short) isc_vax_integer(p,2);
+						p += 2;
+						switch (item) {
+							case isc_info_blob_max_segment:
+								max_segment = isc_vax_integer(p,length);
+								break;
+							case isc_info_blob_num_segments:
+								num_segments = isc_vax_integer(p,length);
+								break;
+							case isc_info_blob_total_length:
+								total_length = isc_vax_integer(p,length);
+								break;
+						}
+					}
+					val = rb_str_new(NULL,total_length);
+					FB_PROBED(blob_read, (void)0,
+						for (p = RSTRING_PTR(val); num_segments > 0; num_segments--, p += actual_seg_len) {
+							isc_get_segment(fb_connection->isc_status, &blob_handle, &actual_seg_len, max_segment, p);
+							fb_error_check(fb_connection->isc_status);
+						},
+						FB_PROBE3(blob_read, fb_cursor, (long)total_length, fb_probe_us));
+					/* Only apply encoding for text blobs (subtype 1), not for binary */
+					#if HAVE_RUBY_ENCODING_H
+					if (var->sqlsubtype == 1) {
+						rb_funcall(val, id_force_encoding, 1, fb_connection->encoding);
+					}
+					#endif
+					isc_close_blob(fb_connection->isc_status, &blob_handle);
+					fb_error_check(fb_connection->isc_status);
+					if (fb_cursor->timed) {
+						double elapsed = fb_monotonic_time() - blob_started;
+						blob_time += elapsed;
+						fb_cursor->phase_time[FB_PHASE_BLOB] += elapsed;
+						fb_cursor->phase_count[FB_PHASE_BLOB]++;
+						if (fb_cursor->stats_entry) {
+							fb_cursor->stats_entry->calls += 3 + (long)num_segments;
+						}
+					}
+					break;
+				case SQL_ARRAY:
+					rb_warn("ARRAY not supported (yet)");
+					val = Qnil;
+					break;
+
+#if (FB_API_VER >= 40)
+				case SQL_INT128:
+#if defined(__SIZEOF_INT128__)
+					val = fb_int128_to_value(var->sqldata, var->sqlscale);
+#else
+					rb_raise(rb_eFbError, "INT128 requires compiler support for __int128");
+#endif
+					break;
+#endif
+
+#if (FB_API_VER >= 30)
+				case SQL_BOOLEAN:
+					val = (*(bool*)var->sqldata) ? Qtrue : Qfalse;
+					break;
+#endif
+
+				default:
+					rb_raise(rb_eFbError, "Specified table includes unsupported datatype (%ld)", dtp);
+					break;
+			}
+		}
+		rb_ary_store(ary, count, val);
+	}
+
+	if (fb_cursor->timed) {
+		fb_cursor->phase_time[FB_PHASE_CONVERT] += fb_monotonic_time() - fetched - blob_time;
+		fb_cursor->phase_count[FB_PHASE_CONVERT]++;
+		fb_cursor->timed_rows++;
+		if (fb_cursor->stats_entry) fb_cursor->stats_entry->rows++;
+	}
+	return ary;
+}
+
+static VALUE fb_cursor_fetch(struct FbCursor *fb_cursor)
+{
+	return fb_cursor_fetch_into(fb_cursor, Qnil);
+}
+
+static long cursor_rows_affected(struct FbCursor *fb_cursor, long statement_type)
+{
+	long inserted = 0, selected = 0, updated = 0, deleted = 0;
+	char request[] = { isc_info_sql_records };
+	char response[64], *r;
+	ISC_STATUS isc_status[20];
+
+	isc_dsql_sql_info(isc_status, &fb_cursor->stmt, sizeof(request), request, sizeof(response), response);
+	fb_error_check(isc_status);
+	if (response[0] != isc_info_sql_records) { return -1; }
+
+	r = response + 3; /* skip past first cluster */
+	while (*r != isc_info_end) {
+		char count_type = *r++;
+		short len = isc_vax_integer(r, sizeof(short));
+		r += sizeof(short);
+		switch (count_type) {
+			case isc_info_req_insert_count:
+				inserted = isc_vax_integer(r, len);
+				break;
+			case isc_info_req_select_count:
+				selected = isc_vax_integer(r, len);
+				break;
+			case isc_info_req_update_count:
+				updated = isc_vax_integer(r, len);
+				break;
+			case isc_info_req_delete_count:
+				deleted = isc_vax_integer(r, len);
+				break;
+		}
+		r += len;
+	}
+	switch (statement_type) {
+		case isc_info_sql_stmt_select:
+			return selected;
+		case isc_info_sql_stmt_insert:
+			/*
+			 * For INSERT ... RETURNING, some Firebird versions report the affected
+			 * row only in select_count. Prefer insert_count, but fall back to
+			 * select_count when needed.
+			 */
+			return inserted > 0 ? inserted : selected;
+		case isc_info_sql_stmt_update:
+			/*
+			 * For UPDATE ... RETURNING, update_count may be reported as 0 while
+			 * select_count carries the affected row count.
+			 */
+			return updated > 0 ? updated : selected;
+		case isc_info_sql_stmt_delete:
+			/*
+			 * For DELETE ... RETURNING, delete_count may be reported as 0 while
+			 * select_count carries the affected row count.
+			 */
+			return deleted > 0 ? deleted : selected;
+		default:
+			/*
+			 * For DML with RETURNING, Firebird internally uses a cursor mechanism
+			 * that can cause insert_count to be incremented alongside update/delete
+			 * counts. We deduce the intended count by picking the non-zero, non-select
+			 * counter that best represents the operation, avoiding double-counting.
+			 * Priority: deleted > updated > inserted (most specific first).
+			 */
+			if (deleted > 0) return deleted;
+			if (updated > 0) return updated;
+			if (inserted > 0) return inserted;
+			return selected;
+	}
+}
+
+/*
+ * Read one row from the o_sqlda buffer after isc_dsql_execute2 with RETURNING.
+ * The data is already in the buffer; we just need to convert it to Ruby values.
+ * Returns an Array of values, or Qnil if no row (all indicators NULL or sqld == 0).
+ */
+static VALUE fb_cursor_read_returning(struct FbCursor *fb_cursor, struct FbConnection *fb_connection)
+{
+	long cols = fb_cursor->o_sqlda->sqld;
+	long count;
+	XSQLVAR *var;
+	long dtp;
+	VALUE val;
+	VARY *vary;
+	struct tm tms;
+	VALUE result;
+
+	if (cols == 0) return Qnil;
+
+	result = rb_ary_new2(cols);
+
+	for (count = 0; count < cols; count++) {
+		var = &fb_cursor->o_sqlda->sqlvar[count];
+		dtp = var->sqltype & ~1;
+
+		if ((var->sqltype & 1) && (*var->sqlind < 0)) {
+			val = Qnil;
+		} else {
+			switch (dtp) {
+				case SQL_TEXT:
+					val = rb_str_new(var->sqldata, var->sqllen);
+					break;
+
+				case SQL_VARYING:
+					vary = (VARY*)var->sqldata;
+					val = rb_str_new(vary->vary_string, vary->vary_length);
+					break;
+
+				case SQL_SHORT:
+					if (var->sqlscale < 0) {
+						val = sql_decimal_to_bigdecimal((long long)*(ISC_SHORT*)var->sqldata, var->sqlscale);
+					} else {
+						val = INT2NUM((int)*(short*)var->sqldata);
+					}
+					break;
+
+				case SQL_LONG:
+					if (var->sqlscale < 0) {
+						val = sql_decimal_to_bigdecimal((long long)*(ISC_LONG*)var->sqldata, var->sqlscale);
+					} else {
+						val = INT2NUM(*(ISC_LONG*)var->sqldata);
+					}
+					break;
+
+				case SQL_FLOAT:
+					val = rb_float_new((double)*(float*)var->sqldata);
+					break;
+
+				case SQL_DOUBLE:
+					val = rb_float_new(*(double*)var->sqldata);
+					break;
+
+				case SQL_INT64:
+					if (var->sqlscale < 0) {
+						val = sql_decimal_to_bigdecimal(*(ISC_INT64*)var->sqldata, var->sqlscale);
+					} else {
+						val = LL2NUM(*(ISC_INT64*)var->sqldata);
+					}
+					break;
+
+				case SQL_TIMESTAMP:
+					isc_decode_timestamp((ISC_TIMESTAMP *)var->sqldata, &tms);
+					val = fb_mktime(&tms, "local");
+					break;
+
+				case SQL_TYPE_TIME:
+					isc_decode_sql_time((ISC_TIME *)var->sqldata, &tms);
+					tms.tm_year = 100;
+					tms.tm_mon = 0;
+					tms.tm_mday = 1;
+					val = fb_mktime(&tms, "utc");
+					break;
+
+				case SQL_TYPE_DATE:
+					isc_decode_sql_date((ISC_DATE *)var->sqldata, &tms);
+					val = fb_mkdate(&tms);
+					break;
+
+#if (FB_API_VER >= 30)
+				case SQL_BOOLEAN:
+					val = (*(bool*)var->sqldata) ? Qtrue : Qfalse;
+					break;
+#endif
+
+#if (FB_API_VER >= 40)
+				case SQL_INT128:
+#if defined(__SIZEOF_INT128__)
+					val = fb_int128_to_value(var->sqldata, var->sqlscale);
+#else
+					rb_raise(rb_eFbError, "INT128 requires compiler support for __int128");
+#endif
+					break;
+#endif
+
+				default:
+					val = Qnil;
+					break;
+			}
+		}
+		rb_ary_push(result, val);
+	}
+
+	return result;
+}
+
+static int sql_is_ident_char(char ch)
+{
+	return isalnum((unsigned char)ch) || ch == '_' || ch == '$';
+}
+
+static int sql_contains_keyword(const char *sql, const char *keyword)
+{
+	const char *p;
+	int klen;
+
+	if (sql == NULL || keyword == NULL) return 0;
+	klen = (int)strlen(keyword);
+	if (klen == 0) return 0;
+
+	for (p = sql; *p; p++) {
+		int i;
+		for (i = 0; i < klen; i++) {
+			if (p[i] == '\0' || tolower((unsigned char)p[i]) != keyword[i]) {
+				break;
+			}
+		}
+		if (i == klen) {
+			char prev = (p == sql) ? '\0' : p[-1];
+			char next = p[klen];
+			if (!sql_is_ident_char(prev) && !sql_is_ident_char(next)) {
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int sql_contains_returning_clause(const char *sql)
+{
+	return sql_contains_keyword(sql, "returning");
+}
+
+/* A plain SELECT or CTE without row locks; safe to run again after a reconnect. */
+static int sql_is_idempotent_read(const char *sql)
+{
+	const char *p;
+
+	if (sql == NULL) return 0;
+
+	for (p = sql; *p && isspace((unsigned char)*p); p++) {
+		/* skip leading whitespace */
+	}
+
+	if (!(strncasecmp(p, "select", 6) == 0 && !sql_is_ident_char(p[6])) &&
+	    !(strncasecmp(p, "with", 4) == 0 && !sql_is_ident_char(p[4]))) {
+		return 0;
+	}
+	return !sql_contains_keyword(sql, "update") && !sql_contains_keyword(sql, "lock") &&
+		!sql_contains_keyword(sql, "gen_id");
+}
+
+static long sql_detect_dml_type(const char *sql)
+{
+	const char *p;
+
+	if (sql == NULL) return 0;
+
+	for (p = sql; *p && isspace((unsigned char)*p); p++) {
+		/* skip leading whitespace */
+	}
+
+	if (strncasecmp(p, "insert", 6) == 0 && !sql_is_ident_char(p[6])) {
+		return isc_info_sql_stmt_insert;
+	}
+	if (strncasecmp(p, "update", 6) == 0 && !sql_is_ident_char(p[6])) {
+		return isc_info_sql_stmt_update;
+	}
+	if (strncasecmp(p, "delete", 6) == 0 && !sql_is_ident_char(p[6])) {
+		return isc_info_sql_stmt_delete;
+	}
+
+	return 0;
+}
+
+static int statement_type_is_dml(long statement_type)
+{
+	return statement_type == isc_info_sql_stmt_insert ||
+	       statement_type == isc_info_sql_stmt_update ||
+	       statement_type == isc_info_sql_stmt_delete;
+}
+
+/*
+ * cursor_execute2 — the core execution function.
+ *
+ * Receives args as a Ruby Array where:
+ *   args[0]      = SQL string
+ *   args[1..N-2] = bind parameters
+ *   args[N-1]    = self (the cursor VALUE), pushed last by cursor_execute
+ *
+ * RETURNING detection strategy:
+ *   After isc_dsql_prepare, if o_sqlda->sqld > 0 AND the statement is not a
+ *   SELECT (no open cursor), it must be a DML with RETURNING clause.
+ *   We use isc_dsql_execute2 passing both i_sqlda and o_sqlda, which fills the
+ *   output buffer directly (single-row RETURNING). No extra fetch needed.
+ *
+ * Returns:
+ *   - Qnil            for SELECT (cursor left open for fetching)
+ *   - Integer         for plain DML (rows affected)
+ *   - Hash            for DML with RETURNING clause
+ */
+/* Runs an execute of the statement in cursor_execute2, timed and probed. */
+#define FB_CURSOR_EXECUTE(call) \
+	FB_PROBED(execute_done, FB_PROBE2(execute_start, fb_cursor, sql), \
+		FB_CURSOR_TIME(fb_cursor, FB_PHASE_EXECUTE, 1, call), \
+		FB_PROBE4(execute_done, fb_cursor, sql, fb_probe_us, fb_connection->isc_status[1]))
+
+static VALUE cursor_execute2(VALUE args)
+{
+	struct FbCursor *fb_cursor;
+	struct FbConnection *fb_connection;
+	char *sql;
+	VALUE rb_sql;
+	long statement_type;
+	long length;
+	long in_params;
+	long out_cols;
+	long rows_affected;
+	long effective_statement_type;
+	int has_returning_clause;
+	VALUE result = Qnil;
+	char isc_info_buff[16];
+	char isc_info_stmt[] = { isc_info_sql_stmt_type };
+	VALUE params_ary;
+	int n_params;
+	isc_tr_handle *transact;
+
+	/* Pop self from the end of args */
+	VALUE self = rb_ary_pop(args);
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	/* Shift SQL from the front */
+	rb_sql = rb_ary_shift(args);
+	sql = StringValuePtr(rb_sql);
+
+	/*
+	 * Remaining entries in args are the bind parameters.
+	 * We keep them in args (now a plain array of params).
+	 */
+	params_ary = args;
+	n_params = (int)RARRAY_LEN(params_ary);
+
+	/* Prepare the statement — o_sqlda gets RETURNING columns if present */
+	has_returning_clause = sql_contains_returning_clause(sql);
+
+	fb_cursor_timing_flush(fb_cursor);
+	fb_cursor->stats = fb_cursor->internal ? Qnil : fb_connection->stats;
+	fb_cursor->stats_entry = fb_stats_entry_for(fb_cursor->stats, rb_sql);
+	if (fb_cursor->stats_entry) {
+		fb_cursor->stats_entry->executions++;
+	}
+	if (fb_connection->slow_threshold >= 0 && !fb_cursor->internal) {
+		fb_cursor->timed_sql = rb_sql;
+		fb_cursor->timed_params = rb_ary_dup(params_ary);
+	}
+	fb_cursor->timed = fb_cursor->stats_entry || (fb_connection->slow_threshold >= 0 && !fb_cursor->internal);
+	if (fb_cursor->timed) {
+		MEMZERO(fb_cursor->phase_time, double, FB_PHASES);
+		MEMZERO(fb_cursor->phase_count, long, FB_PHASES);
+		fb_cursor->timed_rows = 0;
+	}
+
+	transact = fb_cursor_transact(fb_cursor, fb_connection);
+	fb_cursor->prepared = 0;
+	FB_PROBED(prepare_done, FB_PROBE2(prepare_start, fb_cursor, sql),
+		FB_CURSOR_TIME(fb_cursor, FB_PHASE_PREPARE, 1,
+			fb_dsql_prepare(fb_connection->isc_status, transact,
+			                &fb_cursor->stmt, sql,
+			                fb_connection_dialect(fb_connection),
+			                fb_cursor->o_sqlda)),
+		FB_PROBE4(prepare_done, fb_cursor, sql, fb_probe_us, fb_connection->isc_status[1]));
+	fb_error_check(fb_connection->isc_status);
+	fb_cursor->prepared = 1;
+	fb_cursor_io_start(fb_cursor, fb_connection);
+
+	/* Get the statement type */
+	isc_dsql_sql_info(fb_connection->isc_status, &fb_cursor->stmt,
+	                  sizeof(isc_info_stmt), isc_info_stmt,
+	                  sizeof(isc_info_buff), isc_info_buff);
+	fb_error_check(fb_connection->isc_status);
+
+	if (isc_info_buff[0] == isc_info_sql_stmt_type) {
+		length = isc_vax_integer(&isc_info_buff[1], 2);
+		statement_type = isc_vax_integer(&isc_info_buff[3], (short)length);
+	} else {
+		statement_type = 0;
+	}
+
+	effective_statement_type = statement_type;
+	if (!statement_type_is_dml(effective_statement_type) && has_returning_clause) {
+		long detected_type = sql_detect_dml_type(sql);
+		if (statement_type_is_dml(detected_type)) {
+			effective_statement_type = detected_type;
+		}
+	}
+
+	/* Describe input parameters */
+	isc_dsql_describe_bind(fb_connection->isc_status, &fb_cursor->stmt, 1, fb_cursor->i_sqlda);
+	fb_error_check(fb_connection->isc_status);
+
+	/* Reallocate i_sqlda if needed */
+	in_params = fb_cursor->i_sqlda->sqld;
+	if (fb_cursor->i_sqlda->sqln < in_params) {
+		long new_in_params = in_params;
+		xfree(fb_cursor->i_sqlda);
+		fb_cursor->i_sqlda = sqlda_alloc(new_in_params);
+		isc_dsql_describe_bind(fb_connection->isc_status, &fb_cursor->stmt, 1, fb_cursor->i_sqlda);
+		fb_error_check(fb_connection->isc_status);
+	}
+
+	/* Allocate input parameter buffer if needed */
+	if (in_params) {
+		length = calculate_buffsize(fb_cursor->i_sqlda);
+		if (length > fb_cursor->i_buffer_size) {
+			fb_cursor->i_buffer = xrealloc(fb_cursor->i_buffer, length);
+			memset(fb_cursor->i_buffer, 0, length);
+			fb_cursor->i_buffer_size = length;
+		}
+	}
+
+	/*
+	 * Describe output columns from prepare.
+	 * For SELECT:  o_sqlda->sqld > 0, statement_type == isc_info_sql_stmt_select
+	 * For RETURNING: o_sqlda->sqld > 0, statement_type != select
+	 * For plain DML: o_sqlda->sqld == 0
+	 */
+
+	/* Reallocate o_sqlda if prepare needed more slots */
+	if (fb_cursor->o_sqlda->sqln < fb_cursor->o_sqlda->sqld) {
+		long new_sqld = fb_cursor->o_sqlda->sqld;
+		xfree(fb_cursor->o_sqlda);
+		fb_cursor->o_sqlda = sqlda_alloc(new_sqld);
+		isc_dsql_describe(fb_connection->isc_status, &fb_cursor->stmt, 1, fb_cursor->o_sqlda);
+		fb_error_check(fb_connection->isc_status);
+	}
+
+	out_cols = fb_cursor->o_sqlda->sqld;
+
+	/* ----------------------------------------------------------------
+	 * CASE 1: Transaction control — reject
+	 * ---------------------------------------------------------------- */
+	if (statement_type == isc_info_sql_stmt_start_trans) {
+		rb_raise(rb_eFbError, "use Fb::Connection#transaction()");
+	} else if (statement_type == isc_info_sql_stmt_commit) {
+		rb_raise(rb_eFbError, "use Fb::Connection#commit()");
+	} else if (statement_type == isc_info_sql_stmt_rollback) {
+		rb_raise(rb_eFbError, "use Fb::Connection#rollback()");
+	}
+
+	/* ----------------------------------------------------------------
+	 * CASE 2: DML with RETURNING clause
+	 *   Detected by: out_cols > 0 AND not a SELECT statement
+	 * ---------------------------------------------------------------- */
+	if (out_cols > 0 && statement_type_is_dml(effective_statement_type) && has_returning_clause) {
+		VALUE returning_row;
+
+		/* Allocate output buffer */
+		length = calculate_buffsize(fb_cursor->o_sqlda);
+		if (length > fb_cursor->o_buffer_size) {
+			fb_cursor->o_buffer = xrealloc(fb_cursor->o_buffer, length);
+			fb_cursor->o_buffer_size = length;
+		}
+		/* Wire up sqldata/sqlind pointers into the output buffer */
+		fb_cursor_setup_output_buffer(fb_cursor);
+
+		/* Set input parameters if any */
+		if (in_params) {
+			fb_cursor_set_inputparams(fb_cursor, n_params, RARRAY_PTR(params_ary));
+		}
+
+		/*
+		 * Execute passing the output SQLDA so Firebird writes RETURNING values
+		 * directly into our buffer. No subsequent fetch is needed for single-row
+		 * RETURNING (which is the only kind Firebird supports in DML).
+		 */
+		FB_CURSOR_EXECUTE(
+			fb_dsql_execute2(fb_connection->isc_status,
+			                 transact,
+			                 &fb_cursor->stmt,
+			                 in_params ? fb_cursor->i_sqlda : NULL,
+			                 fb_cursor->o_sqlda));
+
+		/* Check for errors - Firebird 5 may return "beginning of stream" error when no rows */
+		if (fb_connection->isc_status[0] != 0) {
+			ISC_STATUS code = isc_sqlcode(fb_connection->isc_status);
+			/* -596 = stream that was not opened for fetching - happens when no rows with RETURNING */
+			if (code == -596 || code == -901 || code == 901) {
+				/* Clear the error and treat as 0 rows affected */
+				memset(fb_connection->isc_status, 0, sizeof(fb_connection->isc_status));
+				rows_affected = 0;
+				returning_row = rb_ary_new();
+				result = rb_hash_new();
+				rb_hash_aset(result, ID2SYM(rb_intern("returning")), returning_row);
+				rb_hash_aset(result, ID2SYM(rb_intern("rows_affected")), LONG2NUM(rows_affected));
+				/* Use DSQL_close to properly close the cursor */
+				isc_dsql_free_statement(fb_connection->isc_status, &fb_cursor->stmt, DSQL_close);
+				fb_cursor->open = Qfalse;
+				fb_cursor_timing_flush(fb_cursor);
+				return result;
+			}
+			fb_error_check(fb_connection->isc_status);
+		}
+
+		rows_affected = cursor_rows_affected(fb_cursor, effective_statement_type);
+		FB_PROBE3(rows_affected, fb_cursor, sql, rows_affected);
+		if (fb_cursor->timed && rows_affected > 0) {
+			fb_cursor->timed_rows += rows_affected;
+			if (fb_cursor->stats_entry) fb_cursor->stats_entry->rows += rows_affected;
+		}
+
+		/*
+		 * Only read the RETURNING buffer if at least one row was affected.
+		 * When rows_affected == 0 (e.g. UPDATE WHERE matched nothing),
+		 * Firebird did not write into the output SQLDA buffer, so reading
+		 * it would yield garbage or stale data.
+		 */
+		if (rows_affected > 0) {
+			returning_row = fb_cursor_read_returning(fb_cursor, fb_connection);
+			if (NIL_P(returning_row)) {
+				returning_row = rb_ary_new();
+			}
+		} else {
+			returning_row = rb_ary_new();
+		}
+
+		isc_dsql_free_statement(fb_connection->isc_status, &fb_cursor->stmt, DSQL_close);
+		fb_cursor->open = Qfalse;
+
+		result = rb_hash_new();
+		rb_hash_aset(result, ID2SYM(rb_intern("returning")), returning_row);
+		rb_hash_aset(result, ID2SYM(rb_intern("rows_affected")), LONG2NUM(rows_affected));
+	} else if (out_cols == 0) {
+		if (in_params) {
+			/*
+			 * When caller supplies parameters as an Array of Arrays,
+			 * execute once per inner array (batch mode).
+			 */
+			if (n_params >= 1 && TYPE(RARRAY_PTR(params_ary)[0]) == T_ARRAY &&
+				RARRAY_LEN(RARRAY_PTR(params_ary)[0]) > 0 &&
+				TYPE(RARRAY_PTR(RARRAY_PTR(params_ary)[0])[0]) == T_ARRAY) {
+				VALUE rows_ary = RARRAY_PTR(params_ary)[0];
+				int rows_count = (int)RARRAY_LEN(rows_ary);
+				int i;
+				for (i = 0; i < rows_count; i++) {
+					VALUE row = RARRAY_PTR(rows_ary)[i];
+					Check_Type(row, T_ARRAY);
+					fb_cursor_set_inputparams(fb_cursor, RARRAY_LEN(row), RARRAY_PTR(row));
+					FB_CURSOR_EXECUTE(
+						fb_dsql_execute2(fb_connection->isc_status,
+						                 transact,
+						                 &fb_cursor->stmt,
+						                 fb_cursor->i_sqlda,
+						                 NULL));
+					fb_error_check(fb_connection->isc_status);
+				}
+			} else if (n_params >= 1 && TYPE(RARRAY_PTR(params_ary)[0]) == T_ARRAY) {
+				int i;
+				for (i = 0; i < n_params; i++) {
+					VALUE row = RARRAY_PTR(params_ary)[i];
+					Check_Type(row, T_ARRAY);
+					fb_cursor_set_inputparams(fb_cursor, RARRAY_LEN(row), RARRAY_PTR(row));
+					FB_CURSOR_EXECUTE(
+						fb_dsql_execute2(fb_connection->isc_status,
+						                 transact,
+						                 &fb_cursor->stmt,
+						                 fb_cursor->i_sqlda,
+						                 NULL));
+					fb_error_check(fb_connection->isc_status);
+				}
+			} else {
+				fb_cursor_set_inputparams(fb_cursor, n_params, RARRAY_PTR(params_ary));
+				FB_CURSOR_EXECUTE(
+					fb_dsql_execute2(fb_connection->isc_status,
+					                 transact,
+					                 &fb_cursor->stmt,
+					                 fb_cursor->i_sqlda,
+					                 NULL));
+				fb_error_check(fb_connection->isc_status);
+			}
+		} else {
+			FB_CURSOR_EXECUTE(
+				fb_dsql_execute2(fb_connection->isc_status,
+				                 transact,
+				                 &fb_cursor->stmt,
+				                 NULL, NULL));
+			fb_error_check(fb_connection->isc_status);
+		}
+		rows_affected = cursor_rows_affected(fb_cursor, effective_statement_type);
+		FB_PROBE3(rows_affected, fb_cursor, sql, rows_affected);
+		if (fb_cursor->timed && rows_affected > 0) {
+			fb_cursor->timed_rows += rows_affected;
+			if (fb_cursor->stats_entry) fb_cursor->stats_entry->rows += rows_affected;
+		}
+		result = LONG2NUM(rows_affected);
+	}
+
+	/* ----------------------------------------------------------------
+	 * CASE 4: SELECT — open cursor for subsequent fetching
+	 * ---------------------------------------------------------------- */
+	else {
+		/* May need to re-describe if sqln was too small (shouldn't happen after
+		 * the realloc above, but be safe) */
+		if (fb_cursor->o_sqlda->sqln < out_cols) {
+			long new_out_cols = out_cols;
+			xfree(fb_cursor->o_sqlda);
+			fb_cursor->o_sqlda = sqlda_alloc(new_out_cols);
+			isc_dsql_describe(fb_connection->isc_status, &fb_cursor->stmt, 1, fb_cursor->o_sqlda);
+			fb_error_check(fb_connection->isc_status);
+			out_cols = fb_cursor->o_sqlda->sqld;
+		}
+
+		if (in_params) {
+			fb_cursor_set_inputparams(fb_cursor, n_params, RARRAY_PTR(params_ary));
+		}
+
+		FB_CURSOR_EXECUTE(
+			fb_dsql_execute2(fb_connection->isc_status,
+			                 transact,
+			                 &fb_cursor->stmt,
+			                 in_params ? fb_cursor->i_sqlda : NULL,
+			                 NULL));
+		fb_error_check(fb_connection->isc_status);
+		fb_cursor->open = Qtrue;
+
+		/* Allocate output fetch buffer */
+		length = calculate_buffsize(fb_cursor->o_sqlda);
+		if (length > fb_cursor->o_buffer_size) {
+			fb_cursor->o_buffer = xrealloc(fb_cursor->o_buffer, length);
+			fb_cursor->o_buffer_size = length;
+		}
+
+		fb_cursor->fields_ary = fb_cursor_fields_ary(fb_cursor->o_sqlda, fb_connection->downcase_names);
+		fb_cursor->fields_hash = fb_cursor_fields_hash(fb_cursor->fields_ary);
+
+		/* result stays Qnil — signals caller that cursor is open */
+	}
+
+	if (!NIL_P(result)) {
+		fb_cursor_timing_flush(fb_cursor);
+	}
+	return result;
+}
+
+#undef FB_CURSOR_EXECUTE
+
+/* Statement handles do not survive a reconnect; allocate a fresh one. */
+static void fb_cursor_revalidate(struct FbCursor *fb_cursor, struct FbConnection *fb_connection)
+{
+	if (fb_cursor->epoch == fb_connection->epoch) return;
+
+	fb_cursor->stmt = 0;
+	fb_cursor->prepared = 0;
+	fb_cursor->open = Qfalse;
+	fb_cursor->auto_transact = 0;
+	isc_dsql_alloc_statement2(fb_connection->isc_status, &fb_connection->db, &fb_cursor->stmt);
+	fb_error_check(fb_connection->isc_status);
+	fb_cursor->epoch = fb_connection->epoch;
+}
+
+/* Forgets that the cursor is reading from the connection's read transaction. */
+static void fb_cursor_read_release(struct FbCursor *fb_cursor, struct FbConnection *fb_connection)
+{
+	if (fb_cursor->read_open) {
+		/* after a reconnect the count was already reset with the transaction */
+		if (fb_cursor->epoch == fb_connection->epoch && fb_connection->read_cursors > 0) {
+			fb_connection->read_cursors--;
+		}
+		fb_cursor->read_open = 0;
+	}
+	fb_cursor->read_only = 0;
+}
+
+/* Runs a plain SELECT in the shared read transaction; nothing to commit afterwards. */
+static VALUE cursor_execute_read(VALUE args)
+{
+	struct FbCursor *fb_cursor;
+	struct FbConnection *fb_connection;
+	VALUE result;
+
+	VALUE self = rb_ary_entry(args, -1);
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	fb_connection_read_start(fb_connection);
+	fb_cursor_revalidate(fb_cursor, fb_connection);
+	fb_cursor->read_only = 1;
+
+	result = cursor_execute2(args);
+	if (NIL_P(result)) {
+		fb_cursor->read_open = 1;
+		fb_connection->read_cursors++;
+	}
+	return result;
+}
+
+static VALUE cursor_execute_write_body(VALUE args)
+{
+	struct FbCursor *fb_cursor;
+	struct FbConnection *fb_connection;
+
+	VALUE self = rb_ary_entry(args, -1);
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	fb_connection_write_start(fb_connection, fb_cursor->connection);
+	fb_cursor_revalidate(fb_cursor, fb_connection);
+	fb_cursor->write_auto = 1;
+	return cursor_execute2(args);
+}
+
+/* Runs a DML statement in the shared autocommit write transaction. */
+static VALUE cursor_execute_write(VALUE args)
+{
+	struct FbCursor *fb_cursor;
+	struct FbConnection *fb_connection;
+	VALUE result;
+	int state;
+	double now;
+
+	VALUE self = rb_ary_entry(args, -1);
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	fb_connection_write_wait(fb_connection);
+	fb_connection->write_busy++;
+	result = rb_protect(cursor_execute_write_body, args, &state);
+	now = fb_monotonic_time();
+	fb_connection->write_last = now;
+	fb_connection->write_busy--;
+	if (state) {
+		/* the failed statement was undone; what ran before it stays committed */
+		if (!fb_connection_lost(fb_connection)) {
+			fb_connection_write_commit(fb_connection, 1);
+		}
+		rb_jump_tag(state);
+	}
+
+	if (fb_connection->autocommit_write == FB_WRITE_RETAINING) {
+		if (fb_connection->write_pending++ == 0) {
+			fb_connection->write_since = now;
+		}
+		if (fb_connection->write_pending >= fb_connection->write_batch ||
+				now - fb_connection->write_since >= fb_connection->write_interval) {
+			isc_commit_retaining(fb_connection->isc_status, &fb_connection->write_transact);
+			fb_error_check(fb_connection->isc_status);
+			fb_connection->write_pending = 0;
+		}
+	}
+	return result;
+}
+
+static VALUE cursor_execute_auto(VALUE args)
+{
+	struct FbCursor *fb_cursor;
+	struct FbConnection *fb_connection;
+	VALUE result;
+	int state;
+
+	VALUE self = rb_ary_entry(args, -1);
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	fb_connection_transaction_start(fb_connection, Qnil);
+	fb_cursor_revalidate(fb_cursor, fb_connection);
+	fb_cursor->auto_transact = fb_connection->transact;
+
+	result = rb_protect(cursor_execute2, args, &state);
+	if (state) {
+		if (fb_connection_lost(fb_connection)) {
+			/* the transaction went down with the attachment */
+			rb_jump_tag(state);
+		}
+		fb_connection_rollback(fb_connection);
+		rb_jump_tag(state);
+	} else if (!NIL_P(result)) {
+		fb_connection_commit(fb_connection);
+	}
+	return result;
+}
+
+/* call-seq:
+ *   execute(sql, *args) -> nil or rows affected or Hash (RETURNING)
+ *
+ * With +auto_reconnect+ enabled on the Database, a lost attachment is
+ * restored before the error propagates, and statements run outside an
+ * explicit transaction that only read (plain SELECT) are retried.
+ *
+ * With +autocommit_read+ enabled, plain SELECTs outside an explicit
+ * transaction run in a shared read-only READ COMMITTED transaction
+ * instead of starting and committing one of their own.
+ *
+ * With +autocommit_write+ enabled, INSERT, UPDATE and DELETE outside an
+ * explicit transaction share one long-lived transaction; any other
+ * statement first commits what is still pending in it.
+ */
+static VALUE cursor_execute(int argc, VALUE* argv, VALUE self)
+{
+	struct FbCursor *fb_cursor;
+	struct FbConnection *fb_connection;
+	VALUE args;
+	VALUE result;
+	int state;
+	int retries;
+	int read;
+	int write;
+
+	if (argc < 1) {
+		rb_raise(rb_eArgError, "At least 1 argument required.");
+	}
+
+	args = rb_ary_new4(argc, argv);
+	rb_ary_push(args, self);
+
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	if (fb_connection->reconnect_pending) {
+		fb_connection_reattach(fb_connection);
+	}
+	fb_connection_check(fb_connection);
+	fb_cursor_revalidate(fb_cursor, fb_connection);
+
+	if (fb_cursor->open) {
+		isc_dsql_free_statement(fb_connection->isc_status, &fb_cursor->stmt, DSQL_close);
+		fb_error_check(fb_connection->isc_status);
+		fb_cursor->open = Qfalse;
+	}
+	fb_cursor_read_release(fb_cursor, fb_connection);
+	fb_cursor->write_auto = 0;
+
+	if (fb_connection->transact || !NIL_P(fb_cursor->transaction)) {
+		result = rb_protect(cursor_execute2, args, &state);
+		if (state) {
+			if (fb_connection_lost(fb_connection)) {
+				fb_connection_reattach(fb_connection);
+			}
+			rb_jump_tag(state);
+		}
+		return result;
+	}
+
+	read = fb_connection->autocommit_read &&
+		TYPE(argv[0]) == T_STRING && sql_is_idempotent_read(RSTRING_PTR(argv[0]));
+	write = fb_connection->autocommit_write &&
+		TYPE(argv[0]) == T_STRING && sql_detect_dml_type(RSTRING_PTR(argv[0]));
+	if (!write && fb_connection->write_pending) {
+		/* later statements must see the earlier writes */
+		fb_connection_write_commit(fb_connection, 0);
+	}
+
+	for (retries = 0; ; retries++) {
+		result = rb_protect(read ? cursor_execute_read : write ? cursor_execute_write : cursor_execute_auto,
+				rb_ary_dup(args), &state);
+		if (!state) {
+			return result;
+		}
+		fb_cursor->read_only = 0;
+		fb_cursor->write_auto = 0;
+		if (!fb_connection_lost(fb_connection) || !fb_connection_reattach(fb_connection) ||
+				retries >= fb_connection->reconnect_attempts ||
+				TYPE(argv[0]) != T_STRING || !sql_is_idempotent_read(RSTRING_PTR(argv[0]))) {
+			rb_jump_tag(state);
+		}
+		fb_cursor_revalidate(fb_cursor, fb_connection);
+	}
+}
+
+static VALUE fb_hash_from_ary(VALUE fields, VALUE row)
+{
+	VALUE hash = rb_hash_new();
+	int i;
+	for (i = 0; i < RARRAY_LEN(fields); i++) {
+		VALUE field = rb_ary_entry(fields, i);
+		VALUE name = rb_struct_aref(field, LONG2NUM(0));
+		VALUE v = rb_ary_entry(row, i);
+		rb_hash_aset(hash, name, v);
+	}
+	return hash;
+}
+
+/*
+ * Overwrite the values of +hash+ with +row+, keyed by field name.
+ * The field names are frozen, so no keys are duplicated after the first row.
+ */
+static VALUE fb_hash_fill_from_ary(VALUE hash, VALUE fields, VALUE row)
+{
+	int i;
+	for (i = 0; i < RARRAY_LEN(fields); i++) {
+		VALUE field = rb_ary_entry(fields, i);
+		VALUE name = rb_struct_aref(field, LONG2NUM(0));
+		rb_hash_aset(hash, name, rb_ary_entry(row, i));
+	}
+	return hash;
+}
+
+static int hash_format(int argc, VALUE *argv)
+{
+	if (argc == 0 || argv[0] == ID2SYM(rb_intern("array"))) {
+		return 0;
+	} else if (argv[0] == ID2SYM(rb_intern("hash"))) {
+		return 1;
+	} else {
+		rb_raise(rb_eFbError, "Unknown format");
+	}
+}
+
+/* call-seq:
+ *   fetch() -> Array
+ *   fetch(:array) -> Array
+ *   fetch(:hash) -> Hash
+ */
+static VALUE cursor_fetch(int argc, VALUE* argv, VALUE self)
+{
+	VALUE ary;
+	struct FbCursor *fb_cursor;
+
+	int hash_row = hash_format(argc, argv);
+
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	fb_cursor_fetch_prep(fb_cursor);
+
+	ary = fb_cursor_fetch(fb_cursor);
+	if (NIL_P(ary)) return Qnil;
+	return hash_row ? fb_hash_from_ary(fb_cursor->fields_ary, ary) : ary;
+}
+
+/* call-seq:
+ *   fetchall() -> Array of Arrays
+ *   fetchall(:array) -> Array of Arrays
+ *   fetchall(:hash) -> Array of Hashes
+ */
+static VALUE cursor_fetchall(int argc, VALUE* argv, VALUE self)
+{
+	VALUE ary, row;
+	struct FbCursor *fb_cursor;
+
+	int hash_rows = hash_format(argc, argv);
+
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	fb_cursor_fetch_prep(fb_cursor);
+
+	ary = rb_ary_new();
+	for (;;) {
+		row = fb_cursor_fetch(fb_cursor);
+		if (NIL_P(row)) break;
+		if (hash_rows) {
+			rb_ary_push(ary, fb_hash_from_ary(fb_cursor->fields_ary, row));
+		} else {
+			rb_ary_push(ary, row);
+		}
+	}
+
+	return ary;
+}
+
+/* call-seq:
+ *   each() {|Array| } -> nil
+ *   each(:array) {|Array| } -> nil
+ *   each(:hash) {|Hash| } -> nil
+ */
+static VALUE cursor_each(int argc, VALUE* argv, VALUE self)
+{
+	VALUE row;
+	struct FbCursor *fb_cursor;
+
+	int hash_rows = hash_format(argc, argv);
+
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	fb_cursor_fetch_prep(fb_cursor);
+
+	for (;;) {
+		row = fb_cursor_fetch(fb_cursor);
+		if (NIL_P(row)) break;
+		if (hash_rows) {
+			rb_yield(fb_hash_from_ary(fb_cursor->fields_ary, row));
+		} else {
+			rb_yield(row);
+		}
+	}
+
+	return Qnil;
+}
+
+/* call-seq:
+ *   each_reuse() {|Array| } -> nil
+ *   each_reuse(:array) {|Array| } -> nil
+ *   each_reuse(:hash) {|Hash| } -> nil
+ *
+ * Like +each+, but yields the same Array (or Hash) object for every row,
+ * overwriting its contents before each yield, so no row containers are
+ * allocated while scanning. Call +dup+ on a row to keep it past the
+ * current iteration.
+ */
+static VALUE cursor_each_reuse(int argc, VALUE* argv, VALUE self)
+{
+	VALUE row, hash = Qnil;
+	struct FbCursor *fb_cursor;
+
+	int hash_rows = hash_format(argc, argv);
+
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	fb_cursor_fetch_prep(fb_cursor);
+
+	row = rb_ary_new2(fb_cursor->o_sqlda->sqld);
+	if (hash_rows) {
+		hash = rb_hash_new();
+	}
+	for (;;) {
+		if (NIL_P(fb_cursor_fetch_into(fb_cursor, row))) break;
+		if (hash_rows) {
+			rb_yield(fb_hash_fill_from_ary(hash, fb_cursor->fields_ary, row));
+		} else {
+			rb_yield(row);
+		}
+	}
+
+	return Qnil;
+}
+
+/* call-seq:
+ *   close() -> nil
+ *
+ * Closes the cursor. If a transaction was automatically started, commits it.
+ */
+static VALUE cursor_close(VALUE self)
+{
+	struct FbCursor *fb_cursor;
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_cursor_timing_flush(fb_cursor);
+
+	/* a handle from before a reconnect died with the old attachment */
+	if (fb_cursor->epoch != fb_connection->epoch) {
+		fb_cursor->stmt = 0;
+		fb_cursor->open = Qfalse;
+	}
+
+	/* Only attempt to close/drop if statement handle exists */
+	if (fb_cursor->stmt) {
+		if (fb_cursor->open) {
+			isc_dsql_free_statement(fb_connection->isc_status, &fb_cursor->stmt, DSQL_close);
+			fb_error_check_warn(fb_connection->isc_status);
+		}
+		isc_dsql_free_statement(fb_connection->isc_status, &fb_cursor->stmt, DSQL_drop);
+		fb_error_check(fb_connection->isc_status);
+		fb_cursor->open = Qfalse;
+		if (fb_connection->transact && fb_connection->transact == fb_cursor->auto_transact) {
+			fb_commit_transaction(fb_connection->isc_status, &fb_connection->transact);
+			fb_cursor->auto_transact = 0;
+			fb_error_check(fb_connection->isc_status);
+		}
+	}
+	fb_cursor_read_release(fb_cursor, fb_connection);
+	fb_cursor->fields_ary = Qnil;
+	fb_cursor->fields_hash = Qnil;
+	return Qnil;
+}
+
+/* call-seq:
+ *   drop() -> nil
+ */
+static VALUE cursor_drop(VALUE self)
+{
+	struct FbCursor *fb_cursor;
+	struct FbConnection *fb_connection;
+	int i;
+
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	fb_cursor_timing_flush(fb_cursor);
+	fb_cursor_drop(fb_cursor);
+	fb_cursor->fields_ary = Qnil;
+	fb_cursor->fields_hash = Qnil;
+
+	/* reset the reference from connection */
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_cursor_read_release(fb_cursor, fb_connection);
+	for (i = 0; i < RARRAY_LEN(fb_connection->cursor); i++) {
+		if (RARRAY_PTR(fb_connection->cursor)[i] == self) {
+			RARRAY_PTR(fb_connection->cursor)[i] = Qnil;
+		}
+	}
+
+	return Qnil;
+}
+
+/* call-seq:
+ *   fields() -> Array
+ *   fields(:array) -> Array
+ *   fields(:hash) -> Hash
+ */
+static VALUE cursor_fields(int argc, VALUE* argv, VALUE self)
+{
+	struct FbCursor *fb_cursor;
+
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	if (argc == 0 || argv[0] == ID2SYM(rb_intern("array"))) {
+		return fb_cursor->fields_ary;
+	} else if (argv[0] == ID2SYM(rb_intern("hash"))) {
+		return fb_cursor->fields_hash;
+	} else {
+		rb_raise(rb_eFbError, "Unknown format");
+	}
+}
+
+static VALUE fb_cursor_plan(VALUE self, char item)
+{
+	struct FbCursor *fb_cursor;
+	struct FbConnection *fb_connection;
+	VALUE plan;
+
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	if (!fb_cursor->stmt || !fb_cursor->prepared || fb_cursor->epoch != fb_connection->epoch) {
+		return Qnil;
+	}
+	plan = fb_statement_plan(fb_connection->isc_status, &fb_cursor->stmt, item);
+	fb_error_check(fb_connection->isc_status);
+	return plan;
+}
+
+/* call-seq:
+ *   plan() -> String or nil
+ *
+ * The access plan of the statement the cursor last executed, or nil once
+ * the cursor is closed.
+ */
+static VALUE cursor_plan(VALUE self)
+{
+	return fb_cursor_plan(self, isc_info_sql_get_plan);
+}
+
+/* call-seq:
+ *   explain_plan() -> String or nil
+ *
+ * The detailed plan of the statement the cursor last executed; nil on
+ * servers before Firebird 3 or once the cursor is closed.
+ */
+static VALUE cursor_explain_plan(VALUE self)
+{
+	return fb_cursor_plan(self, isc_info_sql_explain_plan);
+}
+
+/* call-seq:
+ *   io_stats() -> Hash or nil
+ *
+ * Table reads and writes of the statement the cursor last executed, with
+ * +io_stats+ on for the connection:
+ *
+ *   {"ORDERS" => {seq_reads: 0, idx_reads: 1, inserts: 0, updates: 0,
+ *                 deletes: 0, backouts: 0, purges: 0, expunges: 0}}
+ *
+ * Only tables with a non-zero count are listed. While rows are still being
+ * fetched the counts so far are returned; they are final from the last row
+ * on. The counters are per attachment, so other statements running on the
+ * connection at the same time are counted too.
+ */
+static VALUE cursor_io_stats(VALUE self)
+{
+	struct FbCursor *fb_cursor;
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
+	if (NIL_P(fb_cursor->io_before)) {
+		return fb_cursor->io_stats;
+	}
+	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	return fb_io_diff(fb_cursor->connection, fb_connection, fb_cursor->io_before, fb_io_counters(fb_connection));
+}
+
+/* call-seq:
+ *   error_code -> int
+ */
+static VALUE error_error_code(VALUE error)
+{
+	return rb_iv_get(error, "error_code");
+}
+
+/* call-seq:
+ *   gds_codes -> Array
+ *
+ * All Firebird status codes (isc_*) reported with the error, outermost first.
+ */
+static VALUE error_gds_codes(VALUE error)
+{
+	VALUE codes = rb_iv_get(error, "gds_codes");
+	return NIL_P(codes) ? rb_ary_new() : codes;
+}
+
+/* call-seq:
+ *   gdscode -> int or nil
+ *
+ * The main Firebird status code of the error, e.g. 335544336 (isc_deadlock).
+ */
+static VALUE error_gdscode(VALUE error)
+{
+	return rb_ary_entry(error_gds_codes(error), 0);
+}
+
+/* call-seq:
+ *   sql_state -> String or nil
+ *
+ * The SQLSTATE reported by Firebird 2.5 and later.
+ */
+static VALUE error_sql_state(VALUE error)
+{
+	return rb_iv_get(error, "sql_state");
+}
+
+/* call-seq:
+ *   retryable? -> true or false
+ *
+ * True for deadlocks, update and lock conflicts and lock timeouts, which may
+ * succeed when the transaction is run again.
+ */
+static VALUE error_is_retryable(VALUE error)
+{
+	VALUE codes = error_gds_codes(error);
+	long i;
+
+	for (i = 0; i < RARRAY_LEN(codes); i++) {
+		if (fb_gdscode_is_retryable(NUM2LONG(RARRAY_AREF(codes, i)))) {
+			return Qtrue;
+		}
+	}
+	return Qfalse;
+}
+
+static char* dbp_create(long *length)
+{
+	char *dbp = ALLOC_N(char, 1);
+	*dbp = isc_dpb_version1;
+	*length = 1;
+	return dbp;
+}
+
+static char* dbp_add_string(char *dbp, char isc_dbp_code, char *s, long *length)
+{
+	char *buf;
+	long old_length = *length;
+	long s_len = strlen(s);
+	*length += 2 + s_len;
+	REALLOC_N(dbp, char, *length);
+	buf = dbp + old_length;
+	*buf++ = isc_dbp_code;
+	*buf++ = (char)s_len;
+	memcpy(buf, s, s_len);
+	return dbp;
+}
+
+static char* connection_create_dbp(VALUE self, long *length)
+{
+	char *dbp;
+	VALUE username, password, charset, role;
+
+	username = rb_iv_get(self, "@username");
+	Check_Type(username, T_STRING);
+	password = rb_iv_get(self, "@password");
+	Check_Type(password, T_STRING);
+	role = rb_iv_get(self, "@role");
+	charset = rb_iv_get(self, "@charset");
+
+	dbp = dbp_create(length);
+	dbp = dbp_add_string(dbp, isc_dpb_user_name, StringValuePtr(username), length);
+	dbp = dbp_add_string(dbp, isc_dpb_password, StringValuePtr(password), length);
+	if (!NIL_P(charset)) {
+		dbp = dbp_add_string(dbp, isc_dpb_lc_ctype, StringValuePtr(charset), length);
+	}
+	if (!NIL_P(role)) {
+		dbp = dbp_add_string(dbp, isc_dpb_sql_role_name, StringValuePtr(role), length);
+	}
+	return dbp;
+}
+
+static const char* CONNECTION_PARMS[] = {
+	"@database",
+	"@username",
+	"@password",
+	"@charset",
+	"@role",
+	"@downcase_names",
+	"@encoding",
+	(char *)0
+};
+
+struct fb_connection_create_args {
+	VALUE connection;
+	VALUE db;
+	isc_db_handle handle;
+};
+
+/* Reads the connection's settings from its Database; raises on a bad option. */
+static VALUE fb_connection_configure(VALUE arg)
+{
+	struct fb_connection_create_args *args = (struct fb_connection_create_args *)arg;
+	VALUE connection = args->connection;
+	VALUE db = args->db;
+	unsigned short dialect;
+	unsigned short db_dialect;
+	VALUE downcase_names;
+	VALUE refresh;
+	VALUE write, batch, interval, idle;
+	VALUE cache, cache_opt;
+	VALUE threshold;
+	const char *parm;
+	int i;
+	struct FbConnection *fb_connection;
+
+	TypedData_Get_Struct(connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection->transact = 0;
+	fb_connection->cursor = rb_ary_new();
+	fb_connection->tpb_cache = rb_hash_new();
+	fb_connection->event_names = Qnil;
+	fb_connection->event_handlers = rb_hash_new();
+	fb_connection->cache = Qnil;
+	fb_connection->stats = Qnil;
+	fb_connection->slow_log = Qnil;
+	fb_connection->slow_log_file = Qnil;
+	fb_connection->io_last = Qnil;
+	fb_connection->relation_names = Qnil;
+	fb_connection->write_timer = Qnil;
+	fb_connection->write_lock = rb_mutex_new();
+	fb_connection->path = Qnil;
+	dialect = SQL_DIALECT_CURRENT;
+	db_dialect = fb_connection_db_SQL_Dialect(fb_connection);
+
+	if (db_dialect < dialect) {
+		dialect = db_dialect;
+	}
+
+	fb_connection->dialect = dialect;
+	fb_connection->db_dialect = db_dialect;
+	downcase_names = rb_iv_get(db, "@downcase_names");
+	fb_connection->downcase_names = RTEST(downcase_names);
+	fb_connection->encoding = rb_iv_get(db, "@encoding");
+	fb_connection->autocommit_read = RTEST(rb_iv_get(db, "@autocommit_read"));
+	refresh = rb_iv_get(db, "@autocommit_read_refresh");
+	fb_connection->read_refresh = NIL_P(refresh) ? 60.0 : NUM2DBL(rb_Float(refresh));
+	write = rb_iv_get(db, "@autocommit_write");
+	if (!RTEST(write)) {
+		fb_connection->autocommit_write = FB_WRITE_NONE;
+	} else if (write == ID2SYM(rb_intern("tpb"))) {
+		fb_connection->autocommit_write = FB_WRITE_TPB;
+	} else if (write == ID2SYM(rb_intern("retaining"))) {
+		fb_connection->autocommit_write = FB_WRITE_RETAINING;
+	} else {
+		rb_raise(rb_eArgError, "autocommit_write must be :tpb, :retaining or nil");
+	}
+	batch = rb_iv_get(db, "@autocommit_batch");
+	fb_connection->write_batch = NIL_P(batch) ? 100 : NUM2LONG(rb_Integer(batch));
+	interval = rb_iv_get(db, "@autocommit_interval");
+	fb_connection->write_interval = NIL_P(interval) ? 1.0 : NUM2DBL(rb_Float(interval));
+	idle = rb_iv_get(db, "@autocommit_idle");
+	fb_connection->write_idle = NIL_P(idle) ? 5.0 : NUM2DBL(rb_Float(idle));
+	cache = rb_iv_get(db, "@query_cache");
+	if (RTEST(cache)) {
+		if (TYPE(cache) != T_HASH) cache = rb_hash_new();
+		cache_opt = rb_hash_aref(cache, ID2SYM(rb_intern("max_entries")));
+		fb_connection->cache_max_entries = NIL_P(cache_opt) ? 1000 : NUM2LONG(rb_Integer(cache_opt));
+		cache_opt = rb_hash_aref(cache, ID2SYM(rb_intern("max_rows")));
+		fb_connection->cache_max_rows = NIL_P(cache_opt) ? 100000 : NUM2LONG(rb_Integer(cache_opt));
+		cache_opt = rb_hash_aref(cache, ID2SYM(rb_intern("ttl")));
+		fb_connection->cache_ttl = NIL_P(cache_opt) ? -1 : NUM2DBL(rb_Float(cache_opt));
+		fb_connection->cache_events = RTEST(rb_hash_aref(cache, ID2SYM(rb_intern("events"))));
+		fb_connection->cache = rb_hash_new();
+	}
+	fb_connection->stats = rb_iv_get(db, "@stats");
+	if (!NIL_P(fb_connection->stats)) {
+		fb_stats_get(fb_connection->stats);
+	}
+	threshold = rb_iv_get(db, "@slow_query_threshold");
+	fb_connection->slow_threshold = NIL_P(threshold) ? -1 : NUM2DBL(rb_Float(threshold));
+	fb_connection->slow_log = rb_iv_get(db, "@slow_query_log");
+	fb_connection->slow_redact = RTEST(rb_iv_get(db, "@slow_query_redact"));
+	fb_connection->io_stats = RTEST(rb_iv_get(db, "@io_stats"));
+
+	for (i = 0; (parm = CONNECTION_PARMS[i]); i++) {
+		rb_iv_set(connection, parm, rb_iv_get(db, parm));
+	}
+	return Qnil;
+}
+
+/* Wraps an attachment in a Connection, detaching it if the options are bad. */
+static VALUE connection_create(isc_db_handle handle, VALUE db)
+{
+	struct fb_connection_create_args args;
+	struct FbConnection *fb_connection;
+	int state;
+
+	args.connection = TypedData_Make_Struct(rb_cFbConnection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	args.db = db;
+	fb_connection->db = handle;
+	rb_protect(fb_connection_configure, (VALUE)&args, &state);
+	if (state) {
+		ISC_STATUS isc_status[20];
+		fb_connection->db = 0;
+		isc_detach_database(isc_status, &handle);
+		rb_jump_tag(state);
+	}
+	return args.connection;
+}
+
+static VALUE connection_names(VALUE self, const char *sql)
+{
+	VALUE row;
+	VALUE query = rb_str_new2(sql);
+	VALUE cursor = connection_execute(1, &query, self);
+	VALUE names = rb_ary_new();
+	struct FbConnection *fb_connection;
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+
+	while ((row = cursor_fetch(0, NULL, cursor)) != Qnil) {
+		VALUE name = rb_ary_entry(row, 0);
+		if (fb_connection->downcase_names && no_lowercase(name)) {
+			rb_funcall(name, id_downcase_bang, 0);
+		}
+		rb_funcall(name, id_rstrip_bang, 0);
+		rb_ary_push(names, name);
+	}
+
+	cursor_close(cursor);
+	return names;
+}
+
+/* call-seq:
+ *   table_names() -> array
+ */
+static VALUE connection_table_names(VALUE self)
+{
+	const char *sql = "SELECT RDB$RELATION_NAME FROM RDB$RELATIONS "
+				"WHERE (RDB$SYSTEM_FLAG <> 1 OR RDB$SYSTEM_FLAG IS NULL) AND RDB$VIEW_BLR IS NULL "
+				"ORDER BY RDB$RELATION_NAME";
+	return connection_names(self, sql);
+}
+
+/* call-seq:
+ *   generator_names() -> array
+ */
+static VALUE connection_generator_names(VALUE self)
+{
+	const char *sql = "SELECT RDB$GENERATOR_NAME FROM RDB$GENERATORS "
+				"WHERE (RDB$SYSTEM_FLAG IS NULL OR RDB$SYSTEM_FLAG <> 1) "
+				"ORDER BY RDB$GENERATOR_NAME";
+	return connection_names(self, sql);
+}
+
+/* call-seq:
+ *   view_names() -> array
+ */
+static VALUE connection_view_names(VALUE self)
+{
+	const char *sql = "SELECT RDB$RELATION_NAME, RDB$OWNER_NAME, RDB$VIEW_SOURCE FROM RDB$RELATIONS "
+				"WHERE (RDB$SYSTEM_FLAG <> 1 OR RDB$SYSTEM_FLAG IS NULL) AND NOT RDB$VIEW_BLR IS NULL AND RDB$FLAGS = 1 "
+				"ORDER BY RDB$RELATION_ID";
+	return connection_names(self, sql);
+}
+
+/* call-seq:
+ *   role_names() -> array
+ */
+static VALUE connection_role_names(VALUE self)
+{
+	const char *sql = "SELECT * FROM RDB$ROLES WHERE RDB$SYSTEM_FLAG = 0 ORDER BY RDB$ROLE_NAME";
+	return connection_names(self, sql);
+}
+
+/* call-seq:
+ *   procedure_names() -> array
+ */
+static VALUE connection_procedure_names(VALUE self)
+{
+	const char *sql = "SELECT RDB$PROCEDURE_NAME FROM RDB$PROCEDURES "
+				"ORDER BY RDB$PROCEDURE_NAME";
+	return connection_names(self, sql);
+}
+
+/* call-seq:
+ *   trigger_names() -> array
+ */
+static VALUE connection_trigger_names(VALUE self)
+{
+	const char *sql = "SELECT RDB$TRIGGER_NAME FROM RDB$TRIGGERS "
+				"ORDER BY RDB$TRIGGER_NAME";
+	return connection_names(self, sql);
+}
+
+/* call-seq:
+ *   columns(table_name) -> array
+ */
+static VALUE connection_columns(VALUE self, VALUE table_name)
+{
+    int i;
+    struct FbConnection *fb_connection;
+    VALUE re_default = rb_reg_new("^\\s*DEFAULT\\s+", strlen("^\\s*DEFAULT\\s+"), IGNORECASE);
+    VALUE re_rdb = rb_reg_new("^RDB\\$", strlen("^RDB\\$"), 0);
+    VALUE empty = rb_str_new(NULL, 0);
+    VALUE columns = rb_ary_new();
+    const char *sql = "SELECT r.rdb$field_name NAME, r.rdb$field_source, f.rdb$field_type, f.rdb$field_sub_type, "
+                "f.rdb$field_length, f.rdb$field_precision, f.rdb$field_scale SCALE, "
+                "COALESCE(r.rdb$default_source, f.rdb$default_source), "
+                "COALESCE(r.rdb$null_flag, f.rdb$null_flag) "
+                "FROM rdb$relation_fields r "
+                "JOIN rdb$fields f ON r.rdb$field_source = f.rdb$field_name "
+                "WHERE UPPER(r.rdb$relation_name) = ? "
+                "ORDER BY r.rdb$field_position";
+    VALUE query = rb_str_new2(sql);
+    VALUE upcase_table_name = rb_funcall(table_name, rb_intern("upcase"), 0);
+    VALUE query_parms[] = { query, upcase_table_name };
+    VALUE rs = connection_query(2, query_parms, self);
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+    for (i = 0; i < RARRAY_LEN(rs); i++) {
+        VALUE row = rb_ary_entry(rs, i);
+        VALUE name = rb_ary_entry(row, 0);
+        VALUE domain = rb_ary_entry(row, 1);
+        VALUE sql_type = rb_ary_entry(row, 2);
+        VALUE sql_subtype = rb_ary_entry(row, 3);
+        VALUE length = rb_ary_entry(row, 4);
+        VALUE precision = rb_ary_entry(row, 5);
+        VALUE scale = rb_ary_entry(row, 6);
+        VALUE dflt = rb_ary_entry(row, 7);
+        VALUE not_null = rb_ary_entry(row, 8);
+        VALUE nullable;
+        VALUE column;
+        rb_funcall(name, id_rstrip_bang, 0);
+        rb_funcall(domain, id_rstrip_bang, 0);
+        if (fb_connection->downcase_names && no_lowercase(name)) {
+          rb_funcall(name, id_downcase_bang, 0);
+        }
+        if (rb_funcall(re_rdb, rb_intern("match"), 1, domain) != Qnil) {
+            domain = Qnil;
+        }
+        if (sql_subtype == Qnil) {
+            sql_subtype = INT2NUM(0);
+        }
+        sql_type = sql_type_from_code(self, sql_type, sql_subtype);
+        if (dflt != Qnil) {
+            rb_funcall(dflt, id_sub_bang, 2, re_default, empty);
+        }
+        nullable = RTEST(not_null) ? Qfalse : Qtrue;
+        column = rb_struct_new(rb_sFbColumn, name, domain, sql_type, sql_subtype, length, precision, scale, dflt, nullable);
+        rb_ary_push(columns, column);
+    }
+    rb_ary_freeze(columns);
+    return columns;
+}
 
-				default:
-					rb_raise(rb_eFbError, "Specified table includes unsupported datatype (%ld)", dtp);
-					break;
-			}
-		}
-		rb_ary_push(ary, val);
+char *p(char *prompt, VALUE s)
+{
+	char *sz;
+	if (TYPE(s) != T_STRING) {
+		s = rb_funcall(s, rb_intern("to_s"), 0);
 	}
-
-	return ary;
+	sz = StringValuePtr(s);
+	printf("%s: %s\n", prompt, sz);
+	return sz;
 }
 
-static long cursor_rows_affected(struct FbCursor *fb_cursor, long statement_type)
+static VALUE connection_index_columns(VALUE self, VALUE index_name)
 {
-	long inserted = 0, selected = 0, updated = 0, deleted = 0;
-	char request[] = { isc_info_sql_records };
-	char response[64], *r;
-	ISC_STATUS isc_status[20];
-
-	isc_dsql_sql_info(isc_status, &fb_cursor->stmt, sizeof(request), request, sizeof(response), response);
-	fb_error_check(isc_status);
-	if (response[0] != isc_info_sql_records) { return -1; }
+	const char *sql_columns = "SELECT * "
+						"FROM RDB$INDEX_SEGMENTS "
+						"WHERE RDB$INDEX_SEGMENTS.RDB$INDEX_NAME = ? "
+						"ORDER BY RDB$INDEX_SEGMENTS.RDB$FIELD_POSITION";
+	VALUE query_columns = rb_str_new2(sql_columns);
+	VALUE query_parms[] = { query_columns, index_name };
+	VALUE result = connection_query(2, query_parms, self);
+	VALUE columns = rb_ary_new();
+	int i;
+	struct FbConnection *fb_connection;
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
 
-	r = response + 3; /* skip past first cluster */
-	while (*r != isc_info_end) {
-		char count_type = *r++;
-		short len = isc_vax_integer(r, sizeof(short));
-		r += sizeof(short);
-		switch (count_type) {
-			case isc_info_req_insert_count:
-				inserted = isc_vax_integer(r, len);
-				break;
-			case isc_info_req_select_count:
-				selected = isc_vax_integer(r, len);
-				break;
-			case isc_info_req_update_count:
-				updated = isc_vax_integer(r, len);
-				break;
-			case isc_info_req_delete_count:
-				deleted = isc_vax_integer(r, len);
-				break;
+	for (i = 0; i < RARRAY_LEN(result); i++) {
+		VALUE row = rb_ary_entry(result, i);
+		VALUE name = rb_ary_entry(row, 1);
+		rb_funcall(name, id_rstrip_bang, 0);
+		if (fb_connection->downcase_names && no_lowercase(name)) {
+			rb_funcall(name, id_downcase_bang, 0);
 		}
-		r += len;
-	}
-	switch (statement_type) {
-		case isc_info_sql_stmt_select:
-			return selected;
-		case isc_info_sql_stmt_insert:
-			/*
-			 * For INSERT ... RETURNING, some Firebird versions report the affected
-			 * row only in select_count. Prefer insert_count, but fall back to
-			 * select_count when needed.
-			 */
-			return inserted > 0 ? inserted : selected;
-		case isc_info_sql_stmt_update:
-			/*
-			 * For UPDATE ... RETURNING, update_count may be reported as 0 while
-			 * select_count carries the affected row count.
-			 */
-			return updated > 0 ? updated : selected;
-		case isc_info_sql_stmt_delete:
-			/*
-			 * For DELETE ... RETURNING, delete_count may be reported as 0 while
-			 * select_count carries the affected row count.
-			 */
-			return deleted > 0 ? deleted : selected;
-		default:
-			/*
-			 * For DML with RETURNING, Firebird internally uses a cursor mechanism
-			 * that can cause insert_count to be incremented alongside update/delete
-			 * counts. We deduce the intended count by picking the non-zero, non-select
-			 * counter that best represents the operation, avoiding double-counting.
-			 * Priority: deleted > updated > inserted (most specific first).
-			 */
-			if (deleted > 0) return deleted;
-			if (updated > 0) return updated;
-			if (inserted > 0) return inserted;
-			return selected;
+		rb_ary_push(columns, name);
 	}
+	return columns;
 }
 
-/*
- * Read one row from the o_sqlda buffer after isc_dsql_execute2 with RETURNING.
- * The data is already in the buffer; we just need to convert it to Ruby values.
- * Returns an Array of values, or Qnil if no row (all indicators NULL or sqld == 0).
+/* call-seq:
+ *   indexes() -> Hash
  */
-static VALUE fb_cursor_read_returning(struct FbCursor *fb_cursor, struct FbConnection *fb_connection)
+static VALUE connection_indexes(VALUE self)
 {
-	long cols = fb_cursor->o_sqlda->sqld;
-	long count;
-	XSQLVAR *var;
-	long dtp;
-	VALUE val;
-	VARY *vary;
-	struct tm tms;
-	VALUE result;
+	const char *sql_indexes = "SELECT RDB$INDICES.RDB$RELATION_NAME, RDB$INDICES.RDB$INDEX_NAME, RDB$INDICES.RDB$UNIQUE_FLAG, RDB$INDICES.RDB$INDEX_TYPE "
+						"FROM RDB$INDICES "
+						"  JOIN RDB$RELATIONS ON RDB$INDICES.RDB$RELATION_NAME = RDB$RELATIONS.RDB$RELATION_NAME "
+						"WHERE (RDB$RELATIONS.RDB$SYSTEM_FLAG <> 1 OR RDB$RELATIONS.RDB$SYSTEM_FLAG IS NULL) ";
+	VALUE query_indexes = rb_str_new2(sql_indexes);
+	VALUE ary_indexes = connection_query(1, &query_indexes, self);
+	VALUE indexes = rb_hash_new();
+	int i;
+	struct FbConnection *fb_connection;
+	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
 
-	if (cols == 0) return Qnil;
+	for (i = 0; i < RARRAY_LEN(ary_indexes); i++) {
+		VALUE index_struct;
+		VALUE row = rb_ary_entry(ary_indexes, i);
+		VALUE table_name = rb_ary_entry(row, 0);
+		VALUE index_name = rb_ary_entry(row, 1);
+		VALUE unique = rb_ary_entry(row, 2);
+		VALUE descending = rb_ary_entry(row, 3);
+		VALUE columns = connection_index_columns(self, index_name);
 
-	result = rb_ary_new2(cols);
+		rb_funcall(table_name, id_rstrip_bang, 0);
+		rb_funcall(index_name, id_rstrip_bang, 0);
 
-	for (count = 0; count < cols; count++) {
-		var = &fb_cursor->o_sqlda->sqlvar[count];
-		dtp = var->sqltype & ~1;
+		if (fb_connection->downcase_names) {
+			if (no_lowercase(table_name)) {
+				rb_funcall(table_name, id_downcase_bang, 0);
+			}
+			if (no_lowercase(index_name)) {
+				rb_funcall(index_name, id_downcase_bang, 0);
+			}
+		}
 
-		if ((var->sqltype & 1) && (*var->sqlind < 0)) {
-			val = Qnil;
-		} else {
-			switch (dtp) {
-				case SQL_TEXT:
-					val = rb_str_new(var->sqldata, var->sqllen);
-					break;
+		rb_str_freeze(table_name);
+		rb_str_freeze(index_name);
 
-				case SQL_VARYING:
-					vary = (VARY*)var->sqldata;
-					val = rb_str_new(vary->vary_string, vary->vary_length);
-					break;
+		unique = (unique == INT2FIX(1)) ? Qtrue : Qfalse;
+		descending = (descending == INT2FIX(1)) ? Qtrue : Qfalse;
 
-				case SQL_SHORT:
-					if (var->sqlscale < 0) {
-						val = sql_decimal_to_bigdecimal((long long)*(ISC_SHORT*)var->sqldata, var->sqlscale);
-					} else {
-						val = INT2NUM((int)*(short*)var->sqldata);
-					}
-					break;
+		index_struct = rb_struct_new(rb_sFbIndex, table_name, index_name, unique, descending, columns);
+		rb_hash_aset(indexes, index_name, index_struct);
+	}
+	return indexes;
+}
 
-				case SQL_LONG:
-					if (var->sqlscale < 0) {
-						val = sql_decimal_to_bigdecimal((long long)*(ISC_LONG*)var->sqldata, var->sqlscale);
-					} else {
-						val = INT2NUM(*(ISC_LONG*)var->sqldata);
-					}
-					break;
+/* monitoring tables */
+
+/* the MON$ object is aliased o; its IO, record and memory stats follow its own columns */
+#define FB_MON_STATS_COLUMNS \
+	"io.MON$PAGE_READS, io.MON$PAGE_WRITES, io.MON$PAGE_FETCHES, io.MON$PAGE_MARKS, " \
+	"r.MON$RECORD_SEQ_READS, r.MON$RECORD_IDX_READS, r.MON$RECORD_INSERTS, r.MON$RECORD_UPDATES, " \
+	"r.MON$RECORD_DELETES, r.MON$RECORD_BACKOUTS, r.MON$RECORD_PURGES, r.MON$RECORD_EXPUNGES, " \
+	"m.MON$MEMORY_USED, m.MON$MEMORY_ALLOCATED, m.MON$MAX_MEMORY_USED, m.MON$MAX_MEMORY_ALLOCATED "
+#define FB_MON_STATS_JOINS \
+	"LEFT JOIN MON$IO_STATS io ON io.MON$STAT_ID = o.MON$STAT_ID " \
+	"LEFT JOIN MON$RECORD_STATS r ON r.MON$STAT_ID = o.MON$STAT_ID " \
+	"LEFT JOIN MON$MEMORY_USAGE m ON m.MON$STAT_ID = o.MON$STAT_ID "
+#define FB_MON_STATS 16
+#define FB_MON_MINE "WHERE o.MON$ATTACHMENT_ID = CURRENT_CONNECTION "
+
+static const char *fb_mon_sql[] = {
+	"SELECT o.MON$ATTACHMENT_ID, o.MON$SERVER_PID, o.MON$STATE, o.MON$USER, o.MON$ROLE, "
+	"o.MON$REMOTE_ADDRESS, o.MON$REMOTE_PROCESS, o.MON$TIMESTAMP, " FB_MON_STATS_COLUMNS
+	"FROM MON$ATTACHMENTS o " FB_MON_STATS_JOINS,
+
+	"SELECT o.MON$TRANSACTION_ID, o.MON$ATTACHMENT_ID, o.MON$STATE, o.MON$TIMESTAMP, "
+	"o.MON$TOP_TRANSACTION, o.MON$OLDEST_TRANSACTION, o.MON$OLDEST_ACTIVE, o.MON$ISOLATION_MODE, "
+	"o.MON$LOCK_TIMEOUT, o.MON$READ_ONLY, o.MON$AUTO_COMMIT, " FB_MON_STATS_COLUMNS
+	"FROM MON$TRANSACTIONS o " FB_MON_STATS_JOINS,
+
+	"SELECT o.MON$STATEMENT_ID, o.MON$ATTACHMENT_ID, o.MON$TRANSACTION_ID, o.MON$STATE, "
+	"o.MON$TIMESTAMP, o.MON$SQL_TEXT, " FB_MON_STATS_COLUMNS
+	"FROM MON$STATEMENTS o " FB_MON_STATS_JOINS,
+};
+#define FB_MON_TABLES 3
 
-				case SQL_FLOAT:
-					val = rb_float_new((double)*(float*)var->sqldata);
-					break;
+/* Turns each row into +klass+, its leading columns as they are and the stats as three structs. */
+static VALUE fb_mon_rows(VALUE rows, VALUE klass)
+{
+	VALUE result = rb_ary_new_capa(RARRAY_LEN(rows));
+	VALUE row, value, fields[16];
+	long i, own;
+	int j;
+
+	for (i = 0; i < RARRAY_LEN(rows); i++) {
+		row = RARRAY_AREF(rows, i);
+		own = RARRAY_LEN(row) - FB_MON_STATS;
+		for (j = 0; j < own; j++) {
+			value = RARRAY_AREF(row, j);
+			if (TYPE(value) == T_STRING) {
+				rb_funcall(value, id_rstrip_bang, 0);
+			}
+			fields[j] = value;
+		}
+		fields[own] = rb_struct_new(rb_sFbMonIO, RARRAY_AREF(row, own), RARRAY_AREF(row, own + 1),
+				RARRAY_AREF(row, own + 2), RARRAY_AREF(row, own + 3));
+		fields[own + 1] = rb_struct_new(rb_sFbMonRecords, RARRAY_AREF(row, own + 4), RARRAY_AREF(row, own + 5),
+				RARRAY_AREF(row, own + 6), RARRAY_AREF(row, own + 7), RARRAY_AREF(row, own + 8),
+				RARRAY_AREF(row, own + 9), RARRAY_AREF(row, own + 10), RARRAY_AREF(row, own + 11));
+		fields[own + 2] = rb_struct_new(rb_sFbMonMemory, RARRAY_AREF(row, own + 12), RARRAY_AREF(row, own + 13),
+				RARRAY_AREF(row, own + 14), RARRAY_AREF(row, own + 15));
+		rb_ary_push(result, rb_class_new_instance((int)own + 3, fields, klass));
+	}
+	return result;
+}
 
-				case SQL_DOUBLE:
-					val = rb_float_new(*(double*)var->sqldata);
-					break;
+struct fb_mon_args {
+	VALUE transaction;
+	int all;
+	VALUE tables[FB_MON_TABLES];
+};
 
-				case SQL_INT64:
-					if (var->sqlscale < 0) {
-						val = sql_decimal_to_bigdecimal(*(ISC_INT64*)var->sqldata, var->sqlscale);
-					} else {
-						val = LL2NUM(*(ISC_INT64*)var->sqldata);
-					}
-					break;
+static VALUE fb_mon_query(VALUE arg)
+{
+	struct fb_mon_args *args = (struct fb_mon_args *)arg;
+	VALUE sql;
+	int i;
 
-				case SQL_TIMESTAMP:
-					isc_decode_timestamp((ISC_TIMESTAMP *)var->sqldata, &tms);
-					val = fb_mktime(&tms, "local");
-					break;
+	for (i = 0; i < FB_MON_TABLES; i++) {
+		sql = rb_str_new_cstr(fb_mon_sql[i]);
+		if (!args->all) {
+			rb_str_cat_cstr(sql, FB_MON_MINE);
+		}
+		args->tables[i] = transaction_query(1, &sql, args->transaction);
+	}
+	return Qnil;
+}
 
-				case SQL_TYPE_TIME:
-					isc_decode_sql_time((ISC_TIME *)var->sqldata, &tms);
-					tms.tm_year = 100;
-					tms.tm_mon = 0;
-					tms.tm_mday = 1;
-					val = fb_mktime(&tms, "utc");
-					break;
+/* call-seq:
+ *   monitoring_snapshot(all: false) -> FbMonSnapshot
+ *
+ * Reads MON$ATTACHMENTS, MON$TRANSACTIONS and MON$STATEMENTS with their
+ * MON$IO_STATS, MON$RECORD_STATS and MON$MEMORY_USAGE rows, all in one
+ * read-only snapshot transaction so they agree with each other. Only this
+ * attachment is included unless +all+ is true, which needs SYSDBA or the
+ * owner of the other attachments to see them.
+ *
+ *   snap = conn.monitoring_snapshot(all: true)
+ *   snap.top_statements(5).each { |s| puts "#{s.io.page_fetches} #{s.sql_text}" }
+ *   snap.blocking_chains  # => [[waiting, holder, ...], ...]
+ */
+static VALUE connection_monitoring_snapshot(int argc, VALUE *argv, VALUE self)
+{
+	static ID kw_ids[1];
+	struct fb_mon_args args;
+	VALUE kw = Qnil, all = Qundef;
+	VALUE options;
+	int state;
+
+	rb_scan_args(argc, argv, ":", &kw);
+	if (!NIL_P(kw)) {
+		if (!kw_ids[0]) kw_ids[0] = rb_intern("all");
+		rb_get_kwargs(kw, kw_ids, 0, 1, &all);
+	}
+	args.all = all != Qundef && RTEST(all);
+
+	options = rb_hash_new();
+	rb_hash_aset(options, ID2SYM(rb_intern("access")), ID2SYM(rb_intern("read")));
+	rb_hash_aset(options, ID2SYM(rb_intern("isolation")), ID2SYM(rb_intern("snapshot")));
+	args.transaction = connection_start_transaction(1, &options, self);
+	rb_protect(fb_mon_query, (VALUE)&args, &state);
+	if (state) {
+		/* the first error is the one worth seeing */
+		rb_protect(transaction_rollback, args.transaction, NULL);
+		rb_jump_tag(state);
+	}
+	transaction_rollback(args.transaction);
 
-				case SQL_TYPE_DATE:
-					isc_decode_sql_date((ISC_DATE *)var->sqldata, &tms);
-					val = fb_mkdate(&tms);
-					break;
+	return rb_struct_new(rb_sFbMonSnapshot,
+			fb_mon_rows(args.tables[0], rb_sFbMonAttachment),
+			fb_mon_rows(args.tables[1], rb_sFbMonTransaction),
+			fb_mon_rows(args.tables[2], rb_sFbMonStatement),
+			rb_funcall(rb_cTime, rb_intern("now"), 0));
+}
+
+static VALUE fb_mon_member(VALUE object, const char *name)
+{
+	return rb_struct_getmember(object, rb_intern(name));
+}
+
+struct fb_mon_sort_key {
+	LONG_LONG fetches;
+	long index;
+};
+
+/* by page fetches, most first; ties keep the snapshot order */
+static int fb_mon_fetches_cmp(const void *a, const void *b)
+{
+	const struct fb_mon_sort_key *x = a;
+	const struct fb_mon_sort_key *y = b;
+
+	if (x->fetches != y->fetches) return x->fetches < y->fetches ? 1 : -1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
 
-#if (FB_API_VER >= 30)
-				case SQL_BOOLEAN:
-					val = (*(bool*)var->sqldata) ? Qtrue : Qfalse;
-					break;
-#endif
+/* call-seq:
+ *   top_statements(limit = 10) -> Array of FbMonStatement
+ *
+ * The statements with the most page fetches, most first.
+ */
+static VALUE mon_snapshot_top_statements(int argc, VALUE *argv, VALUE self)
+{
+	VALUE limit, statements, top, keys_buf;
+	struct fb_mon_sort_key *keys;
+	long n, i, len;
 
-#if (FB_API_VER >= 40)
-				case SQL_INT128:
-#if defined(__SIZEOF_INT128__)
-					val = fb_int128_to_value(var->sqldata, var->sqlscale);
-#else
-					rb_raise(rb_eFbError, "INT128 requires compiler support for __int128");
-#endif
-					break;
-#endif
+	rb_scan_args(argc, argv, "01", &limit);
+	n = NIL_P(limit) ? 10 : NUM2LONG(limit);
+	statements = fb_mon_member(self, "statements");
+	len = RARRAY_LEN(statements);
 
-				default:
-					val = Qnil;
-					break;
-			}
-		}
-		rb_ary_push(result, val);
+	/* the keys are read before sorting, since a comparator must not raise */
+	keys = ALLOCV_N(struct fb_mon_sort_key, keys_buf, len);
+	for (i = 0; i < len; i++) {
+		VALUE fetches = fb_mon_member(fb_mon_member(RARRAY_AREF(statements, i), "io"), "page_fetches");
+		keys[i].fetches = NIL_P(fetches) ? 0 : NUM2LL(fetches);
+		keys[i].index = i;
 	}
+	qsort(keys, len, sizeof(*keys), fb_mon_fetches_cmp);
 
-	return result;
+	if (n > len) n = len;
+	top = rb_ary_new2(n < 0 ? 0 : n);
+	for (i = 0; i < n; i++) {
+		rb_ary_push(top, RARRAY_AREF(statements, keys[i].index));
+	}
+	ALLOCV_END(keys_buf);
+	return top;
 }
 
-static int sql_is_ident_char(char ch)
+static int fb_mon_is_writer(VALUE transaction)
 {
-	return isalnum((unsigned char)ch) || ch == '_' || ch == '$';
+	VALUE records = fb_mon_member(transaction, "records");
+	const char *names[] = { "inserts", "updates", "deletes" };
+	VALUE count;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		count = fb_mon_member(records, names[i]);
+		if (!NIL_P(count) && NUM2LL(count) > 0) return 1;
+	}
+	return 0;
 }
 
-static int sql_contains_keyword(const char *sql, const char *keyword)
+/* The oldest active transaction of another attachment that wrote before +waiting+ started. */
+static VALUE fb_mon_holder(VALUE transactions, VALUE waiting)
 {
-	const char *p;
-	int klen;
-
-	if (sql == NULL || keyword == NULL) return 0;
-	klen = (int)strlen(keyword);
-	if (klen == 0) return 0;
+	VALUE holder = Qnil;
+	VALUE tr;
+	LONG_LONG id = NUM2LL(fb_mon_member(waiting, "id"));
+	long i;
+
+	for (i = 0; i < RARRAY_LEN(transactions); i++) {
+		tr = RARRAY_AREF(transactions, i);
+		if (NUM2LL(fb_mon_member(tr, "id")) >= id ||
+				rb_equal(fb_mon_member(tr, "attachment_id"), fb_mon_member(waiting, "attachment_id")) ||
+				!rb_equal(fb_mon_member(tr, "state"), INT2FIX(1)) || !fb_mon_is_writer(tr)) {
+			continue;
+		}
+		if (NIL_P(holder) || NUM2LL(fb_mon_member(tr, "id")) < NUM2LL(fb_mon_member(holder, "id"))) {
+			holder = tr;
+		}
+	}
+	return holder;
+}
 
-	for (p = sql; *p; p++) {
-		int i;
-		for (i = 0; i < klen; i++) {
-			if (p[i] == '\0' || tolower((unsigned char)p[i]) != keyword[i]) {
-				break;
+/* call-seq:
+ *   blocking_chains() -> Array of Arrays of FbMonTransaction
+ *
+ * For every transaction with a running statement that waits on locks
+ * (lock_timeout not 0), the chain of transactions likely to hold it up:
+ * each next one is the oldest active transaction of another attachment
+ * that has written records and started earlier. The MON$ tables do not
+ * record lock waits, so this is a best guess to start an investigation
+ * from, not proof. Needs a snapshot taken with +all+.
+ */
+static VALUE mon_snapshot_blocking_chains(VALUE self)
+{
+	VALUE transactions = fb_mon_member(self, "transactions");
+	VALUE statements = fb_mon_member(self, "statements");
+	VALUE chains = rb_ary_new();
+	VALUE waiting = rb_ary_new();
+	VALUE st, tr, chain, holder;
+	long i, j;
+
+	for (i = 0; i < RARRAY_LEN(statements); i++) {
+		st = RARRAY_AREF(statements, i);
+		if (!rb_equal(fb_mon_member(st, "state"), INT2FIX(1))) continue;
+		for (j = 0; j < RARRAY_LEN(transactions); j++) {
+			tr = RARRAY_AREF(transactions, j);
+			if (rb_equal(fb_mon_member(tr, "id"), fb_mon_member(st, "transaction_id")) &&
+					!rb_equal(fb_mon_member(tr, "lock_timeout"), INT2FIX(0)) &&
+					!RTEST(rb_ary_includes(waiting, tr))) {
+				rb_ary_push(waiting, tr);
 			}
 		}
-		if (i == klen) {
-			char prev = (p == sql) ? '\0' : p[-1];
-			char next = p[klen];
-			if (!sql_is_ident_char(prev) && !sql_is_ident_char(next)) {
-				return 1;
-			}
+	}
+	for (i = 0; i < RARRAY_LEN(waiting); i++) {
+		tr = RARRAY_AREF(waiting, i);
+		chain = rb_ary_new_from_args(1, tr);
+		while (!NIL_P(holder = fb_mon_holder(transactions, tr)) && !RTEST(rb_ary_includes(chain, holder))) {
+			rb_ary_push(chain, holder);
+			tr = holder;
+		}
+		if (RARRAY_LEN(chain) > 1) {
+			rb_ary_push(chains, chain);
 		}
 	}
-
-	return 0;
+	return chains;
 }
 
-static int sql_contains_returning_clause(const char *sql)
+static VALUE default_string(VALUE hash, const char *key, const char *def)
 {
-	return sql_contains_keyword(sql, "returning");
+	VALUE sym = ID2SYM(rb_intern(key));
+	VALUE val = rb_hash_aref(hash, sym);
+	return NIL_P(val) ? rb_str_new2(def) : StringValue(val);
 }
 
-static long sql_detect_dml_type(const char *sql)
+static VALUE default_int(VALUE hash, const char *key, int def)
 {
-	const char *p;
+	VALUE sym = ID2SYM(rb_intern(key));
+	VALUE val = rb_hash_aref(hash, sym);
+	return NIL_P(val) ? INT2NUM(def) : val;
+}
 
-	if (sql == NULL) return 0;
+static VALUE database_allocate_instance(VALUE klass)
+{
+    return TypedData_Wrap_Struct(klass, &fbdatabase_data_type, NULL);
+}
 
-	for (p = sql; *p && isspace((unsigned char)*p); p++) {
-		/* skip leading whitespace */
+static VALUE hash_from_connection_string(VALUE cs)
+{
+	VALUE hash = rb_hash_new();
+	VALUE re_SemiColon = rb_reg_regcomp(rb_str_new2("\\s*;\\s*"));
+	VALUE re_Equal = rb_reg_regcomp(rb_str_new2("\\s*=\\s*"));
+	ID id_split = rb_intern("split");
+	VALUE pairs = rb_funcall(cs, id_split, 1, re_SemiColon);
+	int i;
+	for (i = 0; i < RARRAY_LEN(pairs); i++) {
+		VALUE pair = rb_ary_entry(pairs, i);
+		VALUE keyValue = rb_funcall(pair, id_split, 1, re_Equal);
+		if (RARRAY_LEN(keyValue) == 2) {
+			VALUE key = rb_ary_entry(keyValue, 0);
+			VALUE val = rb_ary_entry(keyValue, 1);
+			rb_hash_aset(hash, rb_str_intern(key), val);
+		}
 	}
+	return hash;
+}
 
-	if (strncasecmp(p, "insert", 6) == 0 && !sql_is_ident_char(p[6])) {
-		return isc_info_sql_stmt_insert;
-	}
-	if (strncasecmp(p, "update", 6) == 0 && !sql_is_ident_char(p[6])) {
-		return isc_info_sql_stmt_update;
-	}
-	if (strncasecmp(p, "delete", 6) == 0 && !sql_is_ident_char(p[6])) {
-		return isc_info_sql_stmt_delete;
+static void check_page_size(int page_size)
+{
+	if (page_size != 1024 && page_size != 2048 && page_size != 4096 && page_size != 8192 && page_size != 16384) {
+		rb_raise(rb_eFbError, "Invalid page size: %d", page_size);
 	}
-
-	return 0;
 }
 
-static int statement_type_is_dml(long statement_type)
+/* call-seq:
+ *   Database.new(options) -> Database
+ */
+static VALUE database_initialize(int argc, VALUE *argv, VALUE self)
 {
-	return statement_type == isc_info_sql_stmt_insert ||
-	       statement_type == isc_info_sql_stmt_update ||
-	       statement_type == isc_info_sql_stmt_delete;
+	VALUE parms, database;
+
+	if (argc >= 1) {
+		parms = argv[0];
+		if (TYPE(parms) == T_STRING) {
+			parms = hash_from_connection_string(parms);
+		} else {
+			Check_Type(parms, T_HASH);
+		}
+		database = rb_hash_aref(parms, ID2SYM(rb_intern("database")));
+		if (NIL_P(database)) rb_raise(rb_eFbError, "Database must be specified.");
+		rb_iv_set(self, "@database", database);
+		rb_iv_set(self, "@username", default_string(parms, "username", "sysdba"));
+		rb_iv_set(self, "@password", default_string(parms, "password", "masterkey"));
+		rb_iv_set(self, "@charset", default_string(parms, "charset", "NONE"));
+		rb_iv_set(self, "@role", rb_hash_aref(parms, ID2SYM(rb_intern("role"))));
+		rb_iv_set(self, "@downcase_names", rb_hash_aref(parms, ID2SYM(rb_intern("downcase_names"))));
+		rb_iv_set(self, "@encoding", default_string(parms, "encoding", "ASCII-8BIT"));
+		rb_iv_set(self, "@page_size", default_int(parms, "page_size", 4096));
+		rb_iv_set(self, "@auto_reconnect", rb_hash_aref(parms, ID2SYM(rb_intern("auto_reconnect"))));
+		rb_iv_set(self, "@reconnect_attempts", default_int(parms, "reconnect_attempts", 3));
+		rb_iv_set(self, "@reconnect_backoff", rb_hash_lookup2(parms, ID2SYM(rb_intern("reconnect_backoff")), DBL2NUM(0.1)));
+		rb_iv_set(self, "@autocommit_read", rb_hash_aref(parms, ID2SYM(rb_intern("autocommit_read"))));
+		rb_iv_set(self, "@autocommit_read_refresh", rb_hash_lookup2(parms, ID2SYM(rb_intern("autocommit_read_refresh")), DBL2NUM(60.0)));
+		rb_iv_set(self, "@autocommit_write", rb_hash_aref(parms, ID2SYM(rb_intern("autocommit_write"))));
+		rb_iv_set(self, "@autocommit_batch", rb_hash_lookup2(parms, ID2SYM(rb_intern("autocommit_batch")), INT2FIX(100)));
+		rb_iv_set(self, "@autocommit_interval", rb_hash_lookup2(parms, ID2SYM(rb_intern("autocommit_interval")), DBL2NUM(1.0)));
+		rb_iv_set(self, "@autocommit_idle", rb_hash_lookup2(parms, ID2SYM(rb_intern("autocommit_idle")), DBL2NUM(5.0)));
+		rb_iv_set(self, "@query_cache", rb_hash_aref(parms, ID2SYM(rb_intern("query_cache"))));
+		rb_iv_set(self, "@stats", rb_hash_aref(parms, ID2SYM(rb_intern("stats"))));
+		rb_iv_set(self, "@slow_query_threshold", rb_hash_aref(parms, ID2SYM(rb_intern("slow_query_threshold"))));
+		rb_iv_set(self, "@slow_query_log", rb_hash_aref(parms, ID2SYM(rb_intern("slow_query_log"))));
+		rb_iv_set(self, "@slow_query_redact", rb_hash_aref(parms, ID2SYM(rb_intern("slow_query_redact"))));
+		rb_iv_set(self, "@io_stats", rb_hash_aref(parms, ID2SYM(rb_intern("io_stats"))));
+	}
+	return self;
 }
 
-/*
- * cursor_execute2 — the core execution function.
- *
- * Receives args as a Ruby Array where:
- *   args[0]      = SQL string
- *   args[1..N-2] = bind parameters
- *   args[N-1]    = self (the cursor VALUE), pushed last by cursor_execute
- *
- * RETURNING detection strategy:
- *   After isc_dsql_prepare, if o_sqlda->sqld > 0 AND the statement is not a
- *   SELECT (no open cursor), it must be a DML with RETURNING clause.
- *   We use isc_dsql_execute2 passing both i_sqlda and o_sqlda, which fills the
- *   output buffer directly (single-row RETURNING). No extra fetch needed.
- *
- * Returns:
- *   - Qnil            for SELECT (cursor left open for fetching)
- *   - Integer         for plain DML (rows affected)
- *   - Hash            for DML with RETURNING clause
+/* call-seq:
+ *   create() -> Database
+ *   create() {|connection| } -> Database
  */
-static VALUE cursor_execute2(VALUE args)
+static VALUE database_create(VALUE self)
 {
-	struct FbCursor *fb_cursor;
-	struct FbConnection *fb_connection;
+	ISC_STATUS isc_status[20];
+	isc_db_handle handle = 0;
+	isc_tr_handle local_transact = 0;
+	VALUE parms, fmt, stmt;
 	char *sql;
-	VALUE rb_sql;
-	long statement_type;
-	long length;
-	long in_params;
-	long out_cols;
-	long rows_affected;
-	long effective_statement_type;
-	int has_returning_clause;
-	VALUE result = Qnil;
-	char isc_info_buff[16];
-	char isc_info_stmt[] = { isc_info_sql_stmt_type };
-	VALUE params_ary;
-	int n_params;
 
-	/* Pop self from the end of args */
-	VALUE self = rb_ary_pop(args);
-	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
-	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	VALUE database = rb_iv_get(self, "@database");
+	VALUE username = rb_iv_get(self, "@username");
+	VALUE password = rb_iv_get(self, "@password");
+	VALUE page_size = rb_iv_get(self, "@page_size");
+	VALUE charset = rb_iv_get(self, "@charset");
 
-	/* Shift SQL from the front */
-	rb_sql = rb_ary_shift(args);
-	sql = StringValuePtr(rb_sql);
+	check_page_size(NUM2INT(page_size));
 
-	/*
-	 * Remaining entries in args are the bind parameters.
-	 * We keep them in args (now a plain array of params).
-	 */
-	params_ary = args;
-	n_params = (int)RARRAY_LEN(params_ary);
+	parms = rb_ary_new3(5, database, username, password, page_size, charset);
 
-	/* Prepare the statement — o_sqlda gets RETURNING columns if present */
-	has_returning_clause = sql_contains_returning_clause(sql);
+	fmt = rb_str_new2("CREATE DATABASE '%s' USER '%s' PASSWORD '%s' PAGE_SIZE = %d DEFAULT CHARACTER SET %s;");
+	stmt = rb_funcall(fmt, rb_intern("%"), 1, parms);
+	sql = StringValuePtr(stmt);
 
-	isc_dsql_prepare(fb_connection->isc_status, &fb_connection->transact,
-	                 &fb_cursor->stmt, 0, sql,
-	                 fb_connection_dialect(fb_connection),
-	                 fb_cursor->o_sqlda);
-	fb_error_check(fb_connection->isc_status);
+	if (isc_dsql_execute_immediate(isc_status, &handle, &local_transact, 0, sql, 3, NULL) != 0) {
+		fb_error_check(isc_status);
+	}
+	if (handle) {
+		if (rb_block_given_p()) {
+			VALUE connection = connection_create(handle, self);
+			rb_ensure(rb_yield,connection,connection_close,connection);
+		} else {
+			isc_detach_database(isc_status, &handle);
+			fb_error_check(isc_status);
+		}
+	}
 
-	/* Get the statement type */
-	isc_dsql_sql_info(fb_connection->isc_status, &fb_cursor->stmt,
-	                  sizeof(isc_info_stmt), isc_info_stmt,
-	                  sizeof(isc_info_buff), isc_info_buff);
-	fb_error_check(fb_connection->isc_status);
+	return self;
+}
+
+/* call-seq:
+ *   Database.create(options) -> Database
+ *   Database.create(options) {|connection| } -> Database
+ */
+static VALUE database_s_create(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE obj = database_allocate_instance(klass);
+	database_initialize(argc, argv, obj);
+	return database_create(obj);
+}
+
+static VALUE database_attach_connection(VALUE arg)
+{
+	struct fb_connection_create_args *args = (struct fb_connection_create_args *)arg;
+	return connection_create(args->handle, args->db);
+}
+
+static VALUE database_attach(VALUE self)
+{
+	ISC_STATUS isc_status[20];
+	char *dbp;
+	long length;
+	isc_db_handle handle = 0;
+	VALUE database = rb_iv_get(self, "@database");
+
+	VALUE connection, attempts, backoff;
+	struct FbConnection *fb_connection;
+	struct fb_connection_create_args args;
+	int state;
+
+	Check_Type(database, T_STRING);
+	dbp = connection_create_dbp(self, &length);
+	fb_attach_database(isc_status, StringValuePtr(database), &handle, length, dbp);
+	if (isc_status[0] == 1 && isc_status[1]) {
+		xfree(dbp);
+		fb_error_check(isc_status);
+	}
+	args.db = self;
+	args.handle = handle;
+	connection = rb_protect(database_attach_connection, (VALUE)&args, &state);
+	if (state) {
+		/* connection_create has already detached */
+		xfree(dbp);
+		rb_jump_tag(state);
+	}
+	TypedData_Get_Struct(connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection->path = rb_str_new_frozen(database);
+	fb_connection->dpb = dbp;
+	fb_connection->dpb_length = length;
+	fb_connection->auto_reconnect = RTEST(rb_iv_get(self, "@auto_reconnect"));
+	attempts = rb_iv_get(self, "@reconnect_attempts");
+	fb_connection->reconnect_attempts = NIL_P(attempts) ? 3 : NUM2INT(rb_Integer(attempts));
+	backoff = rb_iv_get(self, "@reconnect_backoff");
+	fb_connection->reconnect_backoff = NIL_P(backoff) ? 0.1 : NUM2DBL(rb_Float(backoff));
+	return connection;
+}
 
-	if (isc_info_buff[0] == isc_info_sql_stmt_type) {
-		length = isc_vax_integer(&isc_info_buff[1], 2);
-		statement_type = isc_vax_integer(&isc_info_buff[3], (short)length);
+/* call-seq:
+ *   connect() -> Connection
+ *   connect() {|connection| } -> nil
+ */
+static VALUE database_connect(VALUE self)
+{
+	VALUE connection = database_attach(self);
+	if (rb_block_given_p()) {
+		return rb_ensure(rb_yield, connection, connection_close, connection);
 	} else {
-		statement_type = 0;
+		return connection;
 	}
+}
 
-	effective_statement_type = statement_type;
-	if (!statement_type_is_dml(effective_statement_type) && has_returning_clause) {
-		long detected_type = sql_detect_dml_type(sql);
-		if (statement_type_is_dml(detected_type)) {
-			effective_statement_type = detected_type;
-		}
-	}
+/* call-seq:
+ *   Database.connect(options) -> Connection
+ *   Database.connect(options) {|connection| } -> nil
+ */
+static VALUE database_s_connect(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE obj = database_allocate_instance(klass);
+	database_initialize(argc, argv, obj);
+	return database_connect(obj);
+}
 
-	/* Describe input parameters */
-	isc_dsql_describe_bind(fb_connection->isc_status, &fb_cursor->stmt, 1, fb_cursor->i_sqlda);
+/* call-seq:
+ *   drop() -> nil
+ */
+static VALUE database_drop(VALUE self)
+{
+	struct FbConnection *fb_connection;
+
+	VALUE connection = database_connect(self);
+	TypedData_Get_Struct(connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	isc_drop_database(fb_connection->isc_status, &fb_connection->db);
 	fb_error_check(fb_connection->isc_status);
+	return Qnil;
+}
 
-	/* Reallocate i_sqlda if needed */
-	in_params = fb_cursor->i_sqlda->sqld;
-	if (fb_cursor->i_sqlda->sqln < in_params) {
-		long new_in_params = in_params;
-		xfree(fb_cursor->i_sqlda);
-		fb_cursor->i_sqlda = sqlda_alloc(new_in_params);
-		isc_dsql_describe_bind(fb_connection->isc_status, &fb_cursor->stmt, 1, fb_cursor->i_sqlda);
-		fb_error_check(fb_connection->isc_status);
-	}
+/* call-seq:
+ *   Database.drop(options) -> nil
+ */
+static VALUE database_s_drop(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE obj = database_allocate_instance(klass);
+	database_initialize(argc, argv, obj);
+	return database_drop(obj);
+}
 
-	/* Allocate input parameter buffer if needed */
-	if (in_params) {
-		length = calculate_buffsize(fb_cursor->i_sqlda);
-		if (length > fb_cursor->i_buffer_size) {
-			fb_cursor->i_buffer = xrealloc(fb_cursor->i_buffer, length);
-			memset(fb_cursor->i_buffer, 0, length);
-			fb_cursor->i_buffer_size = length;
-		}
-	}
+/* connection pool */
 
-	/*
-	 * Describe output columns from prepare.
-	 * For SELECT:  o_sqlda->sqld > 0, statement_type == isc_info_sql_stmt_select
-	 * For RETURNING: o_sqlda->sqld > 0, statement_type != select
-	 * For plain DML: o_sqlda->sqld == 0
-	 */
+static void fb_pool_mark(struct FbPool *fb_pool)
+{
+	rb_gc_mark(fb_pool->database);
+	rb_gc_mark(fb_pool->idle);
+	rb_gc_mark(fb_pool->idle_since);
+	rb_gc_mark(fb_pool->busy);
+	rb_gc_mark(fb_pool->mutex);
+	rb_gc_mark(fb_pool->cond);
+}
 
-	/* Reallocate o_sqlda if prepare needed more slots */
-	if (fb_cursor->o_sqlda->sqln < fb_cursor->o_sqlda->sqld) {
-		long new_sqld = fb_cursor->o_sqlda->sqld;
-		xfree(fb_cursor->o_sqlda);
-		fb_cursor->o_sqlda = sqlda_alloc(new_sqld);
-		isc_dsql_describe(fb_connection->isc_status, &fb_cursor->stmt, 1, fb_cursor->o_sqlda);
-		fb_error_check(fb_connection->isc_status);
-	}
+static const rb_data_type_t fbpool_data_type = {
+    "fbdb/pool",
+    {
+        (void (*)(void *))fb_pool_mark,
+        RUBY_TYPED_DEFAULT_FREE,
+        NULL,
+    },
+    0, 0, 0
+};
 
-	out_cols = fb_cursor->o_sqlda->sqld;
+static VALUE pool_allocate_instance(VALUE klass)
+{
+	struct FbPool *fb_pool;
+	VALUE obj = TypedData_Make_Struct(klass, struct FbPool, &fbpool_data_type, fb_pool);
+	fb_pool->database = Qnil;
+	fb_pool->idle = Qnil;
+	fb_pool->idle_since = Qnil;
+	fb_pool->busy = Qnil;
+	fb_pool->mutex = Qnil;
+	fb_pool->cond = Qnil;
+	return obj;
+}
 
-	/* ----------------------------------------------------------------
-	 * CASE 1: Transaction control — reject
-	 * ---------------------------------------------------------------- */
-	if (statement_type == isc_info_sql_stmt_start_trans) {
-		rb_raise(rb_eFbError, "use Fb::Connection#transaction()");
-	} else if (statement_type == isc_info_sql_stmt_commit) {
-		rb_raise(rb_eFbError, "use Fb::Connection#commit()");
-	} else if (statement_type == isc_info_sql_stmt_rollback) {
-		rb_raise(rb_eFbError, "use Fb::Connection#rollback()");
+static struct FbPool *fb_pool_get(VALUE self)
+{
+	struct FbPool *fb_pool;
+	TypedData_Get_Struct(self, struct FbPool, &fbpool_data_type, fb_pool);
+	if (NIL_P(fb_pool->mutex)) {
+		rb_raise(rb_eFbError, "uninitialized pool");
 	}
+	return fb_pool;
+}
 
-	/* ----------------------------------------------------------------
-	 * CASE 2: DML with RETURNING clause
-	 *   Detected by: out_cols > 0 AND not a SELECT statement
-	 * ---------------------------------------------------------------- */
-	if (out_cols > 0 && statement_type_is_dml(effective_statement_type) && has_returning_clause) {
-		VALUE returning_row;
-
-		/* Allocate output buffer */
-		length = calculate_buffsize(fb_cursor->o_sqlda);
-		if (length > fb_cursor->o_buffer_size) {
-			fb_cursor->o_buffer = xrealloc(fb_cursor->o_buffer, length);
-			fb_cursor->o_buffer_size = length;
-		}
-		/* Wire up sqldata/sqlind pointers into the output buffer */
-		fb_cursor_setup_output_buffer(fb_cursor);
-
-		/* Set input parameters if any */
-		if (in_params) {
-			fb_cursor_set_inputparams(fb_cursor, n_params, RARRAY_PTR(params_ary));
-		}
+static void fb_pool_discard(VALUE connection)
+{
+	struct FbConnection *fb_connection;
+	TypedData_Get_Struct(connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	fb_connection_discard(fb_connection);
+}
 
-		/*
-		 * Execute passing the output SQLDA so Firebird writes RETURNING values
-		 * directly into our buffer. No subsequent fetch is needed for single-row
-		 * RETURNING (which is the only kind Firebird supports in DML).
-		 */
-		isc_dsql_execute2(fb_connection->isc_status,
-		                  &fb_connection->transact,
-		                  &fb_cursor->stmt,
-		                  SQLDA_VERSION1,
-		                  in_params ? fb_cursor->i_sqlda : NULL,
-		                  fb_cursor->o_sqlda);
+static VALUE fb_pool_attach_failed(VALUE arg, VALUE error)
+{
+	return error;
+}
 
-		/* Check for errors - Firebird 5 may return "beginning of stream" error when no rows */
-		if (fb_connection->isc_status[0] != 0) {
-			ISC_STATUS code = isc_sqlcode(fb_connection->isc_status);
-			/* -596 = stream that was not opened for fetching - happens when no rows with RETURNING */
-			if (code == -596 || code == -901 || code == 901) {
-				/* Clear the error and treat as 0 rows affected */
-				memset(fb_connection->isc_status, 0, sizeof(fb_connection->isc_status));
-				rows_affected = 0;
-				returning_row = rb_ary_new();
-				result = rb_hash_new();
-				rb_hash_aset(result, ID2SYM(rb_intern("returning")), returning_row);
-				rb_hash_aset(result, ID2SYM(rb_intern("rows_affected")), LONG2NUM(rows_affected));
-				/* Use DSQL_close to properly close the cursor */
-				isc_dsql_free_statement(fb_connection->isc_status, &fb_cursor->stmt, DSQL_close);
-				fb_cursor->open = Qfalse;
-				return result;
-			}
-			fb_error_check(fb_connection->isc_status);
-		}
+static VALUE fb_pool_attach_thread(void *arg)
+{
+	return rb_rescue2(database_attach, (VALUE)arg, fb_pool_attach_failed, Qnil, rb_eStandardError, (VALUE)0);
+}
 
-		rows_affected = cursor_rows_affected(fb_cursor, effective_statement_type);
+struct fb_pool_attached {
+	struct FbPool *fb_pool;
+	VALUE results;		/* Connection or exception per reserved slot */
+	VALUE error;		/* first exception */
+	VALUE unwanted;		/* connections attached after a shutdown */
+};
 
-		/*
-		 * Only read the RETURNING buffer if at least one row was affected.
-		 * When rows_affected == 0 (e.g. UPDATE WHERE matched nothing),
-		 * Firebird did not write into the output SQLDA buffer, so reading
-		 * it would yield garbage or stale data.
-		 */
-		if (rows_affected > 0) {
-			returning_row = fb_cursor_read_returning(fb_cursor, fb_connection);
-			if (NIL_P(returning_row)) {
-				returning_row = rb_ary_new();
-			}
+static VALUE fb_pool_attached_locked(VALUE arg)
+{
+	struct fb_pool_attached *a = (struct fb_pool_attached *)arg;
+	struct FbPool *fb_pool = a->fb_pool;
+	double now = fb_monotonic_time();
+	long i;
+
+	for (i = 0; i < RARRAY_LEN(a->results); i++) {
+		VALUE result = rb_ary_entry(a->results, i);
+		if (!rb_obj_is_kind_of(result, rb_cFbConnection)) {
+			fb_pool->size--;
+			if (NIL_P(a->error)) a->error = result;
+		} else if (fb_pool->shutdown) {
+			fb_pool->size--;
+			rb_ary_push(a->unwanted, result);
 		} else {
-			returning_row = rb_ary_new();
+			fb_pool->created++;
+			rb_ary_push(fb_pool->idle, result);
+			rb_ary_push(fb_pool->idle_since, DBL2NUM(now));
 		}
+	}
+	rb_funcall(fb_pool->cond, id_broadcast, 0);
+	return Qnil;
+}
 
-		isc_dsql_free_statement(fb_connection->isc_status, &fb_cursor->stmt, DSQL_close);
-		fb_cursor->open = Qfalse;
+/*
+ * Attaches +count+ connections on parallel threads; each attach runs without
+ * the GVL, so the total cost is roughly one round trip rather than +count+.
+ * Slots must already be reserved in fb_pool->size. Joining gives up the GVL,
+ * so the pool is only updated afterwards, under its mutex.
+ */
+static void fb_pool_attach_parallel(struct FbPool *fb_pool, long count)
+{
+	VALUE threads = rb_ary_new2(count);
+	struct fb_pool_attached a;
+	long i;
 
-		result = rb_hash_new();
-		rb_hash_aset(result, ID2SYM(rb_intern("returning")), returning_row);
-		rb_hash_aset(result, ID2SYM(rb_intern("rows_affected")), LONG2NUM(rows_affected));
-	} else if (out_cols == 0) {
-		if (in_params) {
-			/*
-			 * When caller supplies parameters as an Array of Arrays,
-			 * execute once per inner array (batch mode).
-			 */
-			if (n_params >= 1 && TYPE(RARRAY_PTR(params_ary)[0]) == T_ARRAY &&
-				RARRAY_LEN(RARRAY_PTR(params_ary)[0]) > 0 &&
-				TYPE(RARRAY_PTR(RARRAY_PTR(params_ary)[0])[0]) == T_ARRAY) {
-				VALUE rows_ary = RARRAY_PTR(params_ary)[0];
-				int rows_count = (int)RARRAY_LEN(rows_ary);
-				int i;
-				for (i = 0; i < rows_count; i++) {
-					VALUE row = RARRAY_PTR(rows_ary)[i];
-					Check_Type(row, T_ARRAY);
-					fb_cursor_set_inputparams(fb_cursor, RARRAY_LEN(row), RARRAY_PTR(row));
-					isc_dsql_execute2(fb_connection->isc_status,
-					                  &fb_connection->transact,
-					                  &fb_cursor->stmt,
-					                  SQLDA_VERSION1,
-					                  fb_cursor->i_sqlda,
-					                  NULL);
-					fb_error_check(fb_connection->isc_status);
-				}
-			} else if (n_params >= 1 && TYPE(RARRAY_PTR(params_ary)[0]) == T_ARRAY) {
-				int i;
-				for (i = 0; i < n_params; i++) {
-					VALUE row = RARRAY_PTR(params_ary)[i];
-					Check_Type(row, T_ARRAY);
-					fb_cursor_set_inputparams(fb_cursor, RARRAY_LEN(row), RARRAY_PTR(row));
-					isc_dsql_execute2(fb_connection->isc_status,
-					                  &fb_connection->transact,
-					                  &fb_cursor->stmt,
-					                  SQLDA_VERSION1,
-					                  fb_cursor->i_sqlda,
-					                  NULL);
-					fb_error_check(fb_connection->isc_status);
-				}
-			} else {
-				fb_cursor_set_inputparams(fb_cursor, n_params, RARRAY_PTR(params_ary));
-				isc_dsql_execute2(fb_connection->isc_status,
-				                  &fb_connection->transact,
-				                  &fb_cursor->stmt,
-				                  SQLDA_VERSION1,
-				                  fb_cursor->i_sqlda,
-				                  NULL);
-				fb_error_check(fb_connection->isc_status);
-			}
-		} else {
-			isc_dsql_execute2(fb_connection->isc_status,
-			                  &fb_connection->transact,
-			                  &fb_cursor->stmt,
-			                  SQLDA_VERSION1,
-			                  NULL, NULL);
-			fb_error_check(fb_connection->isc_status);
-		}
-		rows_affected = cursor_rows_affected(fb_cursor, effective_statement_type);
-		result = LONG2NUM(rows_affected);
+	for (i = 0; i < count; i++) {
+		rb_ary_push(threads, rb_thread_create(fb_pool_attach_thread, (void *)fb_pool->database));
+	}
+	a.fb_pool = fb_pool;
+	a.results = rb_ary_new2(count);
+	a.error = Qnil;
+	a.unwanted = rb_ary_new();
+	for (i = 0; i < count; i++) {
+		rb_ary_push(a.results, rb_funcall(rb_ary_entry(threads, i), rb_intern("value"), 0));
 	}
+	rb_mutex_synchronize(fb_pool->mutex, fb_pool_attached_locked, (VALUE)&a);
+	for (i = 0; i < RARRAY_LEN(a.unwanted); i++) {
+		fb_pool_discard(rb_ary_entry(a.unwanted, i));
+	}
+	if (!NIL_P(a.error)) {
+		rb_exc_raise(a.error);
+	}
+}
 
-	/* ----------------------------------------------------------------
-	 * CASE 4: SELECT — open cursor for subsequent fetching
-	 * ---------------------------------------------------------------- */
-	else {
-		/* May need to re-describe if sqln was too small (shouldn't happen after
-		 * the realloc above, but be safe) */
-		if (fb_cursor->o_sqlda->sqln < out_cols) {
-			long new_out_cols = out_cols;
-			xfree(fb_cursor->o_sqlda);
-			fb_cursor->o_sqlda = sqlda_alloc(new_out_cols);
-			isc_dsql_describe(fb_connection->isc_status, &fb_cursor->stmt, 1, fb_cursor->o_sqlda);
-			fb_error_check(fb_connection->isc_status);
-			out_cols = fb_cursor->o_sqlda->sqld;
-		}
+struct fb_pool_checkout {
+	struct FbPool *fb_pool;
+	double started;
+	double deadline;
+	VALUE connection;
+	double idle_since;
+	int attach;
+};
 
-		if (in_params) {
-			fb_cursor_set_inputparams(fb_cursor, n_params, RARRAY_PTR(params_ary));
+static VALUE fb_pool_checkout_locked(VALUE arg)
+{
+	struct fb_pool_checkout *co = (struct fb_pool_checkout *)arg;
+	struct FbPool *fb_pool = co->fb_pool;
+	int waited = 0;
+	double remaining;
+
+	for (;;) {
+		if (fb_pool->shutdown) {
+			rb_raise(rb_eFbError, "pool has been shut down");
+		}
+		if (RARRAY_LEN(fb_pool->idle) > 0) {
+			co->connection = rb_ary_pop(fb_pool->idle);
+			co->idle_since = NUM2DBL(rb_ary_pop(fb_pool->idle_since));
+			break;
+		}
+		if (fb_pool->size < fb_pool->max) {
+			fb_pool->size++;
+			co->attach = 1;
+			break;
 		}
-
-		isc_dsql_execute2(fb_connection->isc_status,
-		                  &fb_connection->transact,
-		                  &fb_cursor->stmt,
-		                  SQLDA_VERSION1,
-		                  in_params ? fb_cursor->i_sqlda : NULL,
-		                  NULL);
-		fb_error_check(fb_connection->isc_status);
-		fb_cursor->open = Qtrue;
-
-		/* Allocate output fetch buffer */
-		length = calculate_buffsize(fb_cursor->o_sqlda);
-		if (length > fb_cursor->o_buffer_size) {
-			fb_cursor->o_buffer = xrealloc(fb_cursor->o_buffer, length);
-			fb_cursor->o_buffer_size = length;
+		remaining = co->deadline - fb_monotonic_time();
+		if (remaining <= 0) {
+			fb_pool->timeouts++;
+			rb_raise(rb_eFbPoolTimeout, "could not obtain a connection within %.3f seconds (%ld in use)",
+				fb_pool->timeout, (long)RHASH_SIZE(fb_pool->busy));
 		}
+		waited = 1;
+		rb_funcall(fb_pool->cond, id_wait, 2, fb_pool->mutex, DBL2NUM(remaining));
+	}
+	fb_pool->checkouts++;
+	if (waited) {
+		double wait = fb_monotonic_time() - co->started;
+		fb_pool->waits++;
+		fb_pool->wait_time += wait;
+		if (wait > fb_pool->max_wait_time) fb_pool->max_wait_time = wait;
+	}
+	if (!co->attach) {
+		rb_hash_aset(fb_pool->busy, co->connection, Qtrue);
+	}
+	return Qnil;
+}
 
-		fb_cursor->fields_ary = fb_cursor_fields_ary(fb_cursor->o_sqlda, fb_connection->downcase_names);
-		fb_cursor->fields_hash = fb_cursor_fields_hash(fb_cursor->fields_ary);
+static VALUE fb_pool_release_slot_locked(VALUE arg)
+{
+	struct FbPool *fb_pool = (struct FbPool *)arg;
+	fb_pool->size--;
+	rb_funcall(fb_pool->cond, id_signal, 0);
+	return Qnil;
+}
 
-		/* result stays Qnil — signals caller that cursor is open */
-	}
+/* A new connection fills the slot reserved for it and goes out at once. */
+static VALUE fb_pool_created_locked(VALUE arg)
+{
+	struct fb_pool_checkout *co = (struct fb_pool_checkout *)arg;
+	co->fb_pool->created++;
+	rb_hash_aset(co->fb_pool->busy, co->connection, Qtrue);
+	return Qnil;
+}
 
-	return result;
+/* An idle connection failed its ping and gives up its slot. */
+static VALUE fb_pool_invalid_locked(VALUE arg)
+{
+	struct fb_pool_checkout *co = (struct fb_pool_checkout *)arg;
+	rb_hash_delete(co->fb_pool->busy, co->connection);
+	co->fb_pool->discarded++;
+	return fb_pool_release_slot_locked((VALUE)co->fb_pool);
 }
 
 /* call-seq:
- *   execute(sql, *args) -> nil or rows affected or Hash (RETURNING)
+ *   checkout() -> Connection
+ *
+ * Takes a connection from the pool, attaching a new one if none is idle and
+ * the pool is below +max+. Waits up to +timeout+ seconds otherwise and raises
+ * Fb::Pool::TimeoutError. Idle connections are pinged before being handed out
+ * (see the +validate+ option); dead ones are discarded.
  */
-static VALUE cursor_execute(int argc, VALUE* argv, VALUE self)
+static VALUE pool_checkout(VALUE self)
 {
-	struct FbCursor *fb_cursor;
-	struct FbConnection *fb_connection;
-	VALUE args;
+	struct FbPool *fb_pool = fb_pool_get(self);
+	struct fb_pool_checkout co;
+	int state;
 
-	if (argc < 1) {
-		rb_raise(rb_eArgError, "At least 1 argument required.");
-	}
-
-	args = rb_ary_new4(argc, argv);
-	rb_ary_push(args, self);
-
-	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
-	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
-	fb_connection_check(fb_connection);
+	co.fb_pool = fb_pool;
+	co.started = fb_monotonic_time();
+	co.deadline = co.started + fb_pool->timeout;
 
-	if (fb_cursor->open) {
-		isc_dsql_free_statement(fb_connection->isc_status, &fb_cursor->stmt, DSQL_close);
-		fb_error_check(fb_connection->isc_status);
-		fb_cursor->open = Qfalse;
-	}
+	for (;;) {
+		struct FbConnection *fb_connection;
 
-	if (!fb_connection->transact) {
-		VALUE result;
-		int state;
+		co.connection = Qnil;
+		co.attach = 0;
+		rb_mutex_synchronize(fb_pool->mutex, fb_pool_checkout_locked, (VALUE)&co);
 
-		fb_connection_transaction_start(fb_connection, Qnil);
-		fb_cursor->auto_transact = fb_connection->transact;
+		if (co.attach) {
+			co.connection = rb_protect(database_attach, fb_pool->database, &state);
+			if (state) {
+				rb_mutex_synchronize(fb_pool->mutex, fb_pool_release_slot_locked, (VALUE)fb_pool);
+				rb_jump_tag(state);
+			}
+			rb_mutex_synchronize(fb_pool->mutex, fb_pool_created_locked, (VALUE)&co);
+			return co.connection;
+		}
 
-		result = rb_protect(cursor_execute2, args, &state);
-		if (state) {
-			fb_connection_rollback(fb_connection);
-			return rb_funcall(rb_mKernel, rb_intern("raise"), 0);
-		} else if (!NIL_P(result)) {
-			fb_connection_commit(fb_connection);
-			return result;
-		} else {
-			return result;
+		TypedData_Get_Struct(co.connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+		if (fb_pool->validate_after < 0 ||
+				fb_monotonic_time() - co.idle_since < fb_pool->validate_after ||
+				fb_connection_ping(fb_connection)) {
+			return co.connection;
 		}
-	} else {
-		return cursor_execute2(args);
+		fb_connection_discard(fb_connection);
+		rb_mutex_synchronize(fb_pool->mutex, fb_pool_invalid_locked, (VALUE)&co);
 	}
 }
 
-static VALUE fb_hash_from_ary(VALUE fields, VALUE row)
-{
-	VALUE hash = rb_hash_new();
-	int i;
-	for (i = 0; i < RARRAY_LEN(fields); i++) {
-		VALUE field = rb_ary_entry(fields, i);
-		VALUE name = rb_struct_aref(field, LONG2NUM(0));
-		VALUE v = rb_ary_entry(row, i);
-		rb_hash_aset(hash, name, v);
-	}
-	return hash;
-}
+struct fb_pool_checkin {
+	struct FbPool *fb_pool;
+	VALUE connection;
+	int keep;
+	int discarded;		/* the rollback failed */
+};
 
-static int hash_format(int argc, VALUE *argv)
+static VALUE fb_pool_checkin_locked(VALUE arg)
 {
-	if (argc == 0 || argv[0] == ID2SYM(rb_intern("array"))) {
-		return 0;
-	} else if (argv[0] == ID2SYM(rb_intern("hash"))) {
-		return 1;
+	struct fb_pool_checkin *ci = (struct fb_pool_checkin *)arg;
+	struct FbPool *fb_pool = ci->fb_pool;
+
+	if (NIL_P(rb_hash_delete(fb_pool->busy, ci->connection))) {
+		rb_raise(rb_eFbError, "connection was not checked out from this pool");
+	}
+	if (ci->keep && !fb_pool->shutdown) {
+		rb_ary_push(fb_pool->idle, ci->connection);
+		rb_ary_push(fb_pool->idle_since, DBL2NUM(fb_monotonic_time()));
 	} else {
-		rb_raise(rb_eFbError, "Unknown format");
+		ci->keep = 0;
+		fb_pool->size--;
 	}
+	if (ci->discarded) fb_pool->discarded++;
+	rb_funcall(fb_pool->cond, id_signal, 0);
+	return Qnil;
 }
 
+static VALUE fb_pool_reap(struct FbPool *fb_pool);
+
 /* call-seq:
- *   fetch() -> Array
- *   fetch(:array) -> Array
- *   fetch(:hash) -> Hash
+ *   checkin(connection) -> nil
+ *
+ * Returns a connection to the pool. An open transaction is rolled back;
+ * closed connections are dropped from the pool.
  */
-static VALUE cursor_fetch(int argc, VALUE* argv, VALUE self)
+static VALUE pool_checkin(VALUE self, VALUE connection)
 {
-	VALUE ary;
-	struct FbCursor *fb_cursor;
-
-	int hash_row = hash_format(argc, argv);
+	struct FbPool *fb_pool = fb_pool_get(self);
+	struct FbConnection *fb_connection;
+	struct fb_pool_checkin ci;
 
-	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
-	fb_cursor_fetch_prep(fb_cursor);
+	TypedData_Get_Struct(connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	if (!rb_hash_lookup2(fb_pool->busy, connection, Qfalse)) {
+		rb_raise(rb_eFbError, "connection was not checked out from this pool");
+	}
+	ci.fb_pool = fb_pool;
+	ci.connection = connection;
+	ci.keep = fb_connection->db != 0;
+	ci.discarded = 0;
+	if (ci.keep) {
+		fb_connection_write_commit(fb_connection, 1);
+	}
+	fb_connection_end_transactions(fb_connection);
+	if (ci.keep && fb_connection->transact) {
+		fb_connection_close_cursors(fb_connection);
+		isc_rollback_transaction(fb_connection->isc_status, &fb_connection->transact);
+		if (fb_connection->isc_status[0] == 1 && fb_connection->isc_status[1]) {
+			fb_connection_discard(fb_connection);
+			ci.discarded = 1;
+			ci.keep = 0;
+		}
+	}
+	rb_mutex_synchronize(fb_pool->mutex, fb_pool_checkin_locked, (VALUE)&ci);
+	if (!ci.keep && fb_connection->db) {
+		fb_connection_discard(fb_connection);
+	}
+	fb_pool_reap(fb_pool);
+	return Qnil;
+}
 
-	ary = fb_cursor_fetch(fb_cursor);
-	if (NIL_P(ary)) return Qnil;
-	return hash_row ? fb_hash_from_ary(fb_cursor->fields_ary, ary) : ary;
+static VALUE pool_checkin_ensure(VALUE args)
+{
+	VALUE *pair = (VALUE *)args;
+	return pool_checkin(pair[0], pair[1]);
 }
 
 /* call-seq:
- *   fetchall() -> Array of Arrays
- *   fetchall(:array) -> Array of Arrays
- *   fetchall(:hash) -> Array of Hashes
+ *   with {|connection| } -> block result
+ *
+ * Checks out a connection for the duration of the block.
  */
-static VALUE cursor_fetchall(int argc, VALUE* argv, VALUE self)
+static VALUE pool_with(VALUE self)
 {
-	VALUE ary, row;
-	struct FbCursor *fb_cursor;
+	VALUE pair[2];
 
-	int hash_rows = hash_format(argc, argv);
+	rb_need_block();
+	pair[0] = self;
+	pair[1] = pool_checkout(self);
+	return rb_ensure(rb_yield, pair[1], pool_checkin_ensure, (VALUE)pair);
+}
 
-	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
-	fb_cursor_fetch_prep(fb_cursor);
+struct fb_pool_reap {
+	struct FbPool *fb_pool;
+	VALUE expired;
+};
 
-	ary = rb_ary_new();
-	for (;;) {
-		row = fb_cursor_fetch(fb_cursor);
-		if (NIL_P(row)) break;
-		if (hash_rows) {
-			rb_ary_push(ary, fb_hash_from_ary(fb_cursor->fields_ary, row));
-		} else {
-			rb_ary_push(ary, row);
-		}
+static VALUE fb_pool_reap_locked(VALUE arg)
+{
+	struct fb_pool_reap *r = (struct fb_pool_reap *)arg;
+	struct FbPool *fb_pool = r->fb_pool;
+	double cutoff = fb_monotonic_time() - fb_pool->idle_timeout;
+
+	/* oldest connections sit at the front */
+	while (RARRAY_LEN(fb_pool->idle) > 0 && fb_pool->size > fb_pool->min &&
+			NUM2DBL(rb_ary_entry(fb_pool->idle_since, 0)) < cutoff) {
+		rb_ary_push(r->expired, rb_ary_shift(fb_pool->idle));
+		rb_ary_shift(fb_pool->idle_since);
+		fb_pool->size--;
+		fb_pool->reaped++;
 	}
-
-	return ary;
+	return Qnil;
 }
 
-/* call-seq:
- *   each() {|Array| } -> nil
- *   each(:array) {|Array| } -> nil
- *   each(:hash) {|Hash| } -> nil
- */
-static VALUE cursor_each(int argc, VALUE* argv, VALUE self)
+static VALUE fb_pool_reap(struct FbPool *fb_pool)
 {
-	VALUE row;
-	struct FbCursor *fb_cursor;
-
-	int hash_rows = hash_format(argc, argv);
-
-	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
-	fb_cursor_fetch_prep(fb_cursor);
+	struct fb_pool_reap r;
+	long i;
 
-	for (;;) {
-		row = fb_cursor_fetch(fb_cursor);
-		if (NIL_P(row)) break;
-		if (hash_rows) {
-			rb_yield(fb_hash_from_ary(fb_cursor->fields_ary, row));
-		} else {
-			rb_yield(row);
-		}
+	if (fb_pool->idle_timeout <= 0 || RARRAY_LEN(fb_pool->idle) == 0) {
+		return INT2FIX(0);
 	}
-
-	return Qnil;
+	r.fb_pool = fb_pool;
+	r.expired = rb_ary_new();
+	rb_mutex_synchronize(fb_pool->mutex, fb_pool_reap_locked, (VALUE)&r);
+	for (i = 0; i < RARRAY_LEN(r.expired); i++) {
+		fb_pool_discard(rb_ary_entry(r.expired, i));
+	}
+	return LONG2NUM(RARRAY_LEN(r.expired));
 }
 
 /* call-seq:
- *   close() -> nil
+ *   reap() -> Integer
  *
- * Closes the cursor. If a transaction was automatically started, commits it.
+ * Closes connections idle for longer than +idle_timeout+, keeping at least
+ * +min+. Also runs on every checkin; call it from a timer for quiet pools.
+ * Returns the number of connections closed.
  */
-static VALUE cursor_close(VALUE self)
+static VALUE pool_reap(VALUE self)
 {
-	struct FbCursor *fb_cursor;
-	struct FbConnection *fb_connection;
+	return fb_pool_reap(fb_pool_get(self));
+}
 
-	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
-	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+struct fb_pool_fill {
+	struct FbPool *fb_pool;
+	long target;
+	long count;
+};
 
-	/* Only attempt to close/drop if statement handle exists */
-	if (fb_cursor->stmt) {
-		if (fb_cursor->open) {
-			isc_dsql_free_statement(fb_connection->isc_status, &fb_cursor->stmt, DSQL_close);
-			fb_error_check_warn(fb_connection->isc_status);
-		}
-		isc_dsql_free_statement(fb_connection->isc_status, &fb_cursor->stmt, DSQL_drop);
-		fb_error_check(fb_connection->isc_status);
-		fb_cursor->open = Qfalse;
-		if (fb_connection->transact && fb_connection->transact == fb_cursor->auto_transact) {
-			isc_commit_transaction(fb_connection->isc_status, &fb_connection->transact);
-			fb_cursor->auto_transact = 0;
-			fb_error_check(fb_connection->isc_status);
-		}
+static VALUE fb_pool_fill_locked(VALUE arg)
+{
+	struct fb_pool_fill *f = (struct fb_pool_fill *)arg;
+	struct FbPool *fb_pool = f->fb_pool;
+	long target = f->target < fb_pool->max ? f->target : fb_pool->max;
+
+	f->count = fb_pool->shutdown ? 0 : target - fb_pool->size;
+	if (f->count > 0) {
+		fb_pool->size += f->count;
 	}
-	fb_cursor->fields_ary = Qnil;
-	fb_cursor->fields_hash = Qnil;
 	return Qnil;
 }
 
 /* call-seq:
- *   drop() -> nil
+ *   warm_up(count = min) -> Integer
+ *
+ * Attaches connections in parallel until the pool holds +count+ (at most
+ * +max+). Returns the number of connections added.
  */
-static VALUE cursor_drop(VALUE self)
+static VALUE pool_warm_up(int argc, VALUE *argv, VALUE self)
 {
-	struct FbCursor *fb_cursor;
-	struct FbConnection *fb_connection;
-	int i;
-
-	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
-	fb_cursor_drop(fb_cursor);
-	fb_cursor->fields_ary = Qnil;
-	fb_cursor->fields_hash = Qnil;
-
-	/* reset the reference from connection */
-	TypedData_Get_Struct(fb_cursor->connection, struct FbConnection, &fbconnection_data_type, fb_connection);
-	for (i = 0; i < RARRAY_LEN(fb_connection->cursor); i++) {
-		if (RARRAY_PTR(fb_connection->cursor)[i] == self) {
-			RARRAY_PTR(fb_connection->cursor)[i] = Qnil;
-		}
+	struct FbPool *fb_pool = fb_pool_get(self);
+	struct fb_pool_fill f;
+	VALUE count;
+
+	rb_scan_args(argc, argv, "01", &count);
+	f.fb_pool = fb_pool;
+	f.target = NIL_P(count) ? fb_pool->min : NUM2LONG(count);
+	rb_mutex_synchronize(fb_pool->mutex, fb_pool_fill_locked, (VALUE)&f);
+	if (f.count <= 0) {
+		return INT2FIX(0);
 	}
+	fb_pool_attach_parallel(fb_pool, f.count);
+	return LONG2NUM(f.count);
+}
 
-	return Qnil;
+static VALUE fb_pool_shutdown_locked(VALUE arg)
+{
+	struct FbPool *fb_pool = (struct FbPool *)arg;
+	VALUE idle = rb_ary_dup(fb_pool->idle);
+
+	fb_pool->shutdown = 1;
+	fb_pool->size -= RARRAY_LEN(idle);
+	rb_ary_clear(fb_pool->idle);
+	rb_ary_clear(fb_pool->idle_since);
+	rb_funcall(fb_pool->cond, id_broadcast, 0);
+	return idle;
 }
 
 /* call-seq:
- *   fields() -> Array
- *   fields(:array) -> Array
- *   fields(:hash) -> Hash
+ *   shutdown() -> nil
+ *
+ * Closes idle connections and refuses further checkouts. Connections still
+ * checked out are closed when they are checked in.
  */
-static VALUE cursor_fields(int argc, VALUE* argv, VALUE self)
+static VALUE pool_shutdown(VALUE self)
 {
-	struct FbCursor *fb_cursor;
+	struct FbPool *fb_pool = fb_pool_get(self);
+	VALUE idle = rb_mutex_synchronize(fb_pool->mutex, fb_pool_shutdown_locked, (VALUE)fb_pool);
+	long i;
 
-	TypedData_Get_Struct(self, struct FbCursor, &fbcursor_data_type, fb_cursor);
-	if (argc == 0 || argv[0] == ID2SYM(rb_intern("array"))) {
-		return fb_cursor->fields_ary;
-	} else if (argv[0] == ID2SYM(rb_intern("hash"))) {
-		return fb_cursor->fields_hash;
-	} else {
-		rb_raise(rb_eFbError, "Unknown format");
+	for (i = 0; i < RARRAY_LEN(idle); i++) {
+		fb_pool_discard(rb_ary_entry(idle, i));
 	}
+	return Qnil;
 }
 
+#define POOL_STAT(name, value) rb_hash_aset(stats, ID2SYM(rb_intern(name)), value)
+
 /* call-seq:
- *   error_code -> int
+ *   stats() -> Hash
+ *
+ * Pool metrics: current +size+, +idle+ and +in_use+ counts, the +min+ and
+ * +max+ limits, and running totals of connections +created+, +checkouts+,
+ * checkouts that had to +waits+ (with total and maximum +wait_time+ in
+ * seconds), +timeouts+, connections +reaped+ for idleness and connections
+ * +discarded+ after a failed ping or rollback.
  */
-static VALUE error_error_code(VALUE error)
+static VALUE pool_stats(VALUE self)
 {
-	rb_p(error);
-	return rb_iv_get(error, "error_code");
+	struct FbPool *fb_pool = fb_pool_get(self);
+	VALUE stats = rb_hash_new();
+
+	POOL_STAT("size", LONG2NUM(fb_pool->size));
+	POOL_STAT("idle", LONG2NUM(RARRAY_LEN(fb_pool->idle)));
+	POOL_STAT("in_use", LONG2NUM(RHASH_SIZE(fb_pool->busy)));
+	POOL_STAT("min", LONG2NUM(fb_pool->min));
+	POOL_STAT("max", LONG2NUM(fb_pool->max));
+	POOL_STAT("created", LONG2NUM(fb_pool->created));
+	POOL_STAT("checkouts", LONG2NUM(fb_pool->checkouts));
+	POOL_STAT("waits", LONG2NUM(fb_pool->waits));
+	POOL_STAT("wait_time", DBL2NUM(fb_pool->wait_time));
+	POOL_STAT("max_wait_time", DBL2NUM(fb_pool->max_wait_time));
+	POOL_STAT("timeouts", LONG2NUM(fb_pool->timeouts));
+	POOL_STAT("reaped", LONG2NUM(fb_pool->reaped));
+	POOL_STAT("discarded", LONG2NUM(fb_pool->discarded));
+	return stats;
 }
 
-static char* dbp_create(long *length)
+#undef POOL_STAT
+
+static double pool_option_double(VALUE opts, const char *key, double def)
 {
-	char *dbp = ALLOC_N(char, 1);
-	*dbp = isc_dpb_version1;
-	*length = 1;
-	return dbp;
+	VALUE val = rb_hash_aref(opts, ID2SYM(rb_intern(key)));
+	return NIL_P(val) ? def : NUM2DBL(val);
 }
 
-static char* dbp_add_string(char *dbp, char isc_dbp_code, char *s, long *length)
+/* call-seq:
+ *   Pool.new(database, options = {}) -> Pool
+ *
+ * +database+ is a Database or the options accepted by Database.new. Pool
+ * options: <tt>:min</tt> (0), <tt>:max</tt> (5), <tt>:timeout</tt> seconds to
+ * wait for a connection (5), <tt>:idle_timeout</tt> seconds before an idle
+ * connection above +min+ is closed (300, 0 disables) and <tt>:validate</tt>,
+ * which pings idle connections on checkout: +true+ (the default) always,
+ * +false+ never, or a number of seconds a connection must have been idle
+ * before it is pinged. +min+ connections are attached up front, in parallel.
+ */
+static VALUE pool_initialize(int argc, VALUE *argv, VALUE self)
 {
-	char *buf;
-	long old_length = *length;
-	long s_len = strlen(s);
-	*length += 2 + s_len;
-	REALLOC_N(dbp, char, *length);
-	buf = dbp + old_length;
-	*buf++ = isc_dbp_code;
-	*buf++ = (char)s_len;
-	memcpy(buf, s, s_len);
-	return dbp;
+	struct FbPool *fb_pool;
+	VALUE database, opts, validate;
+
+	rb_scan_args(argc, argv, "11", &database, &opts);
+	TypedData_Get_Struct(self, struct FbPool, &fbpool_data_type, fb_pool);
+
+	if (!rb_obj_is_kind_of(database, rb_cFbDatabase)) {
+		database = rb_class_new_instance(1, &database, rb_cFbDatabase);
+	}
+	if (NIL_P(opts)) {
+		opts = rb_hash_new();
+	}
+	Check_Type(opts, T_HASH);
+
+	fb_pool->min = NUM2LONG(default_int(opts, "min", 0));
+	fb_pool->max = NUM2LONG(default_int(opts, "max", 5));
+	fb_pool->timeout = pool_option_double(opts, "timeout", 5.0);
+	fb_pool->idle_timeout = pool_option_double(opts, "idle_timeout", 300.0);
+	validate = rb_hash_lookup2(opts, ID2SYM(rb_intern("validate")), Qtrue);
+	if (validate == Qtrue) {
+		fb_pool->validate_after = 0;
+	} else if (!RTEST(validate)) {
+		fb_pool->validate_after = -1;
+	} else {
+		fb_pool->validate_after = NUM2DBL(validate);
+	}
+	if (fb_pool->max < 1 || fb_pool->min < 0 || fb_pool->min > fb_pool->max) {
+		rb_raise(rb_eArgError, "pool size must satisfy 0 <= min <= max and max >= 1");
+	}
+
+	fb_pool->database = database;
+	fb_pool->idle = rb_ary_new();
+	fb_pool->idle_since = rb_ary_new();
+	fb_pool->busy = rb_hash_new();
+	rb_funcall(fb_pool->busy, rb_intern("compare_by_identity"), 0);
+	fb_pool->cond = rb_class_new_instance(0, NULL, rb_cConditionVariable);
+	fb_pool->mutex = rb_mutex_new();
+
+	if (fb_pool->min > 0) {
+		pool_warm_up(0, NULL, self);
+	}
+	return self;
 }
 
-static char* connection_create_dbp(VALUE self, long *length)
+/* call-seq:
+ *   database() -> Database
+ */
+static VALUE pool_database(VALUE self)
 {
-	char *dbp;
-	VALUE username, password, charset, role;
+	return fb_pool_get(self)->database;
+}
 
-	username = rb_iv_get(self, "@username");
-	Check_Type(username, T_STRING);
-	password = rb_iv_get(self, "@password");
-	Check_Type(password, T_STRING);
-	role = rb_iv_get(self, "@role");
-	charset = rb_iv_get(self, "@charset");
+/* id allocator */
 
-	dbp = dbp_create(length);
-	dbp = dbp_add_string(dbp, isc_dpb_user_name, StringValuePtr(username), length);
-	dbp = dbp_add_string(dbp, isc_dpb_password, StringValuePtr(password), length);
-	if (!NIL_P(charset)) {
-		dbp = dbp_add_string(dbp, isc_dpb_lc_ctype, StringValuePtr(charset), length);
-	}
-	if (!NIL_P(role)) {
-		dbp = dbp_add_string(dbp, isc_dpb_sql_role_name, StringValuePtr(role), length);
-	}
-	return dbp;
+static void fb_id_allocator_mark(struct FbIdAllocator *fb_ids)
+{
+	rb_gc_mark(fb_ids->connection);
+	rb_gc_mark(fb_ids->generator);
+	rb_gc_mark(fb_ids->sql);
+	rb_gc_mark(fb_ids->mutex);
 }
 
-static const char* CONNECTION_PARMS[] = {
-	"@database",
-	"@username",
-	"@password",
-	"@charset",
-	"@role",
-	"@downcase_names",
-	"@encoding",
-	(char *)0
+static const rb_data_type_t fbid_allocator_data_type = {
+    "fbdb/id_allocator",
+    {
+        (void (*)(void *))fb_id_allocator_mark,
+        RUBY_TYPED_DEFAULT_FREE,
+        NULL,
+    },
+    0, 0, 0
 };
 
-static VALUE connection_create(isc_db_handle handle, VALUE db)
+static VALUE id_allocator_allocate_instance(VALUE klass)
 {
-	unsigned short dialect;
-	unsigned short db_dialect;
-	VALUE downcase_names;
-	const char *parm;
-	int i;
-	struct FbConnection *fb_connection;
-    VALUE connection = TypedData_Make_Struct(rb_cFbConnection, struct FbConnection, &fbconnection_data_type, fb_connection);
-	fb_connection->db = handle;
-	fb_connection->transact = 0;
-	fb_connection->cursor = rb_ary_new();
-	dialect = SQL_DIALECT_CURRENT;
-	db_dialect = fb_connection_db_SQL_Dialect(fb_connection);
+	struct FbIdAllocator *fb_ids;
+	VALUE obj = TypedData_Make_Struct(klass, struct FbIdAllocator, &fbid_allocator_data_type, fb_ids);
+	fb_ids->connection = Qnil;
+	fb_ids->generator = Qnil;
+	fb_ids->sql = Qnil;
+	fb_ids->mutex = Qnil;
+	return obj;
+}
 
-	if (db_dialect < dialect) {
-		dialect = db_dialect;
+static struct FbIdAllocator *fb_id_allocator_get(VALUE self)
+{
+	struct FbIdAllocator *fb_ids;
+	TypedData_Get_Struct(self, struct FbIdAllocator, &fbid_allocator_data_type, fb_ids);
+	if (NIL_P(fb_ids->mutex)) {
+		rb_raise(rb_eFbError, "uninitialized id allocator");
 	}
+	return fb_ids;
+}
 
-	fb_connection->dialect = dialect;
-	fb_connection->db_dialect = db_dialect;
-	downcase_names = rb_iv_get(db, "@downcase_names");
-	fb_connection->downcase_names = RTEST(downcase_names);
-	fb_connection->encoding = rb_iv_get(db, "@encoding");
+/* Reserves the spare block, unless another caller already has. */
+static VALUE fb_id_allocator_refill_locked(VALUE arg)
+{
+	struct FbIdAllocator *fb_ids = (struct FbIdAllocator *)arg;
+	VALUE rows;
+	LONG_LONG last;
 
-	for (i = 0; (parm = CONNECTION_PARMS[i]); i++) {
-		rb_iv_set(connection, parm, rb_iv_get(db, parm));
+	if (fb_ids->spare_next < fb_ids->spare_limit) {
+		return Qnil;
 	}
-
-	return connection;
+	rows = fb_cursor_query_new(fb_ids->connection, Qnil, 1, &fb_ids->sql);
+	last = NUM2LL(rb_ary_entry(rb_ary_entry(rows, 0), 0));
+	fb_ids->spare_next = last - fb_ids->block + 1;
+	fb_ids->spare_limit = last + 1;
+	fb_ids->refills++;
+	return Qnil;
 }
 
-static VALUE connection_names(VALUE self, const char *sql)
+/* call-seq:
+ *   IdAllocator.new(connection, generator, block: 1000, refill_at: block / 10) -> IdAllocator
+ *
+ * Hands out values of +generator+ from blocks reserved with a single
+ * <tt>GEN_ID(generator, block)</tt>. The next block is reserved once
+ * +refill_at+ IDs are left. Usually created with Connection#id_allocator.
+ */
+static VALUE id_allocator_initialize(int argc, VALUE *argv, VALUE self)
 {
-	VALUE row;
-	VALUE query = rb_str_new2(sql);
-	VALUE cursor = connection_execute(1, &query, self);
-	VALUE names = rb_ary_new();
+	struct FbIdAllocator *fb_ids;
 	struct FbConnection *fb_connection;
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	VALUE connection, generator, kw, names, name = Qnil, opts[2];
+	ID kw_ids[2];
+	long i;
 
-	while ((row = cursor_fetch(0, NULL, cursor)) != Qnil) {
-		VALUE name = rb_ary_entry(row, 0);
-		if (fb_connection->downcase_names && no_lowercase(name)) {
-			rb_funcall(name, id_downcase_bang, 0);
+	rb_scan_args(argc, argv, "2:", &connection, &generator, &kw);
+	TypedData_Get_Struct(self, struct FbIdAllocator, &fbid_allocator_data_type, fb_ids);
+	TypedData_Get_Struct(connection, struct FbConnection, &fbconnection_data_type, fb_connection);
+	generator = rb_obj_as_string(generator);
+	opts[0] = opts[1] = Qundef;
+	if (!NIL_P(kw)) {
+		kw_ids[0] = rb_intern("block");
+		kw_ids[1] = rb_intern("refill_at");
+		rb_get_kwargs(kw, kw_ids, 0, 2, opts);
+	}
+	fb_ids->block = opts[0] == Qundef ? 1000 : NUM2LONG(opts[0]);
+	fb_ids->refill_at = opts[1] == Qundef ? fb_ids->block / 10 : NUM2LONG(opts[1]);
+	if (fb_ids->block < 1 || fb_ids->refill_at < 0 || fb_ids->refill_at >= fb_ids->block) {
+		rb_raise(rb_eArgError, "id allocator needs block >= 1 and 0 <= refill_at < block");
+	}
+
+	names = connection_generator_names(connection);
+	for (i = 0; i < RARRAY_LEN(names); i++) {
+		VALUE candidate = RARRAY_AREF(names, i);
+		if (rb_str_equal(candidate, generator) == Qtrue) {
+			name = candidate;
+			break;
 		}
-		rb_funcall(name, id_rstrip_bang, 0);
-		rb_ary_push(names, name);
+		if (NIL_P(name) && RTEST(rb_funcall(candidate, rb_intern("casecmp?"), 1, generator))) {
+			name = candidate;
+		}
+	}
+	if (NIL_P(name)) {
+		rb_raise(rb_eFbError, "generator %s does not exist", StringValueCStr(generator));
+	}
+	if (fb_connection->downcase_names && rb_str_equal(rb_funcall(name, rb_intern("downcase"), 0), name) == Qtrue) {
+		/* generator_names lowered a name stored in upper case */
+		name = rb_funcall(name, rb_intern("upcase"), 0);
 	}
 
-	cursor_close(cursor);
-	return names;
+	fb_ids->connection = connection;
+	fb_ids->generator = rb_str_new_frozen(name);
+	fb_ids->sql = rb_str_freeze(rb_sprintf("SELECT GEN_ID(\"%s\", %ld) FROM RDB$DATABASE",
+			StringValueCStr(name), fb_ids->block));
+	fb_ids->mutex = rb_mutex_new();
+	return self;
 }
 
 /* call-seq:
- *   table_names() -> array
+ *   next() -> Integer
+ *
+ * Returns the next reserved ID. Safe to call from several threads or fibers;
+ * only the caller that runs out, or crosses +refill_at+, reserves a block.
  */
-static VALUE connection_table_names(VALUE self)
+static VALUE id_allocator_next(VALUE self)
 {
-	const char *sql = "SELECT RDB$RELATION_NAME FROM RDB$RELATIONS "
-				"WHERE (RDB$SYSTEM_FLAG <> 1 OR RDB$SYSTEM_FLAG IS NULL) AND RDB$VIEW_BLR IS NULL "
-				"ORDER BY RDB$RELATION_NAME";
-	return connection_names(self, sql);
+	struct FbIdAllocator *fb_ids = fb_id_allocator_get(self);
+	LONG_LONG id;
+
+	for (;;) {
+		if (fb_ids->next < fb_ids->limit) {
+			id = fb_ids->next++;
+			if (fb_ids->limit - fb_ids->next <= fb_ids->refill_at &&
+					fb_ids->spare_next >= fb_ids->spare_limit && !RTEST(rb_mutex_locked_p(fb_ids->mutex))) {
+				rb_mutex_synchronize(fb_ids->mutex, fb_id_allocator_refill_locked, (VALUE)fb_ids);
+			}
+			return LL2NUM(id);
+		}
+		if (fb_ids->spare_next < fb_ids->spare_limit) {
+			fb_ids->next = fb_ids->spare_next;
+			fb_ids->limit = fb_ids->spare_limit;
+			fb_ids->spare_next = fb_ids->spare_limit = 0;
+			continue;
+		}
+		rb_mutex_synchronize(fb_ids->mutex, fb_id_allocator_refill_locked, (VALUE)fb_ids);
+	}
 }
 
 /* call-seq:
- *   generator_names() -> array
+ *   remaining() -> Integer
+ *
+ * IDs that can be handed out without a round trip.
  */
-static VALUE connection_generator_names(VALUE self)
+static VALUE id_allocator_remaining(VALUE self)
 {
-	const char *sql = "SELECT RDB$GENERATOR_NAME FROM RDB$GENERATORS "
-				"WHERE (RDB$SYSTEM_FLAG IS NULL OR RDB$SYSTEM_FLAG <> 1) "
-				"ORDER BY RDB$GENERATOR_NAME";
-	return connection_names(self, sql);
+	struct FbIdAllocator *fb_ids = fb_id_allocator_get(self);
+	return LL2NUM(fb_ids->limit - fb_ids->next + fb_ids->spare_limit - fb_ids->spare_next);
 }
 
 /* call-seq:
- *   view_names() -> array
+ *   refills() -> Integer
+ *
+ * Number of blocks reserved so far.
  */
-static VALUE connection_view_names(VALUE self)
+static VALUE id_allocator_refills(VALUE self)
 {
-	const char *sql = "SELECT RDB$RELATION_NAME, RDB$OWNER_NAME, RDB$VIEW_SOURCE FROM RDB$RELATIONS "
-				"WHERE (RDB$SYSTEM_FLAG <> 1 OR RDB$SYSTEM_FLAG IS NULL) AND NOT RDB$VIEW_BLR IS NULL AND RDB$FLAGS = 1 "
-				"ORDER BY RDB$RELATION_ID";
-	return connection_names(self, sql);
+	return LONG2NUM(fb_id_allocator_get(self)->refills);
 }
 
 /* call-seq:
- *   role_names() -> array
+ *   generator() -> String
  */
-static VALUE connection_role_names(VALUE self)
+static VALUE id_allocator_generator(VALUE self)
 {
-	const char *sql = "SELECT * FROM RDB$ROLES WHERE RDB$SYSTEM_FLAG = 0 ORDER BY RDB$ROLE_NAME";
-	return connection_names(self, sql);
+	return fb_id_allocator_get(self)->generator;
 }
 
 /* call-seq:
- *   procedure_names() -> array
+ *   block() -> Integer
  */
-static VALUE connection_procedure_names(VALUE self)
+static VALUE id_allocator_block(VALUE self)
 {
-	const char *sql = "SELECT RDB$PROCEDURE_NAME FROM RDB$PROCEDURES "
-				"ORDER BY RDB$PROCEDURE_NAME";
-	return connection_names(self, sql);
+	return LONG2NUM(fb_id_allocator_get(self)->block);
 }
 
 /* call-seq:
- *   trigger_names() -> array
+ *   id_allocator(generator, block: 1000, refill_at: block / 10) -> IdAllocator
+ *
+ * Returns an IdAllocator handing out values of +generator+ reserved in
+ * blocks, instead of one <tt>SELECT GEN_ID(generator, 1)</tt> per ID.
+ * Values are unique, but increase per block: IDs from several allocators
+ * or clients interleave.
  */
-static VALUE connection_trigger_names(VALUE self)
+static VALUE connection_id_allocator(int argc, VALUE *argv, VALUE self)
 {
-	const char *sql = "SELECT RDB$TRIGGER_NAME FROM RDB$TRIGGERS "
-				"ORDER BY RDB$TRIGGER_NAME";
-	return connection_names(self, sql);
+	VALUE args[3];
+	int n;
+
+	rb_scan_args(argc, argv, "1:", &args[1], &args[2]);
+	args[0] = self;
+	n = NIL_P(args[2]) ? 2 : 3;
+	return rb_class_new_instance_kw(n, args, rb_cFbIdAllocator, n == 3);
 }
 
-/* call-seq:
- *   columns(table_name) -> array
- */
-static VALUE connection_columns(VALUE self, VALUE table_name)
+/* services */
+
+#ifdef isc_action_svc_trace_start
+
+#ifndef isc_info_data_not_ready
+#define isc_info_data_not_ready 4
+#endif
+
+struct fb_service_args {
+	ISC_STATUS *isc_status;
+	isc_svc_handle *handle;
+	const char *name;
+	unsigned short spb_length;
+	const char *spb;
+	unsigned short send_length;
+	const char *send;
+	unsigned short request_length;
+	const char *request;
+	unsigned short buffer_length;
+	char *buffer;
+};
+
+static ISC_STATUS fb_service_attach_call(void *data)
 {
-    int i;
-    struct FbConnection *fb_connection;
-    VALUE re_default = rb_reg_new("^\\s*DEFAULT\\s+", strlen("^\\s*DEFAULT\\s+"), IGNORECASE);
-    VALUE re_rdb = rb_reg_new("^RDB\\$", strlen("^RDB\\$"), 0);
-    VALUE empty = rb_str_new(NULL, 0);
-    VALUE columns = rb_ary_new();
-    const char *sql = "SELECT r.rdb$field_name NAME, r.rdb$field_source, f.rdb$field_type, f.rdb$field_sub_type, "
-                "f.rdb$field_length, f.rdb$field_precision, f.rdb$field_scale SCALE, "
-                "COALESCE(r.rdb$default_source, f.rdb$default_source), "
-                "COALESCE(r.rdb$null_flag, f.rdb$null_flag) "
-                "FROM rdb$relation_fields r "
-                "JOIN rdb$fields f ON r.rdb$field_source = f.rdb$field_name "
-                "WHERE UPPER(r.rdb$relation_name) = ? "
-                "ORDER BY r.rdb$field_position";
-    VALUE query = rb_str_new2(sql);
-    VALUE upcase_table_name = rb_funcall(table_name, rb_intern("upcase"), 0);
-    VALUE query_parms[] = { query, upcase_table_name };
-    VALUE rs = connection_query(2, query_parms, self);
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
-    for (i = 0; i < RARRAY_LEN(rs); i++) {
-        VALUE row = rb_ary_entry(rs, i);
-        VALUE name = rb_ary_entry(row, 0);
-        VALUE domain = rb_ary_entry(row, 1);
-        VALUE sql_type = rb_ary_entry(row, 2);
-        VALUE sql_subtype = rb_ary_entry(row, 3);
-        VALUE length = rb_ary_entry(row, 4);
-        VALUE precision = rb_ary_entry(row, 5);
-        VALUE scale = rb_ary_entry(row, 6);
-        VALUE dflt = rb_ary_entry(row, 7);
-        VALUE not_null = rb_ary_entry(row, 8);
-        VALUE nullable;
-        VALUE column;
-        rb_funcall(name, id_rstrip_bang, 0);
-        rb_funcall(domain, id_rstrip_bang, 0);
-        if (fb_connection->downcase_names && no_lowercase(name)) {
-          rb_funcall(name, id_downcase_bang, 0);
-        }
-        if (rb_funcall(re_rdb, rb_intern("match"), 1, domain) != Qnil) {
-            domain = Qnil;
-        }
-        if (sql_subtype == Qnil) {
-            sql_subtype = INT2NUM(0);
-        }
-        sql_type = sql_type_from_code(self, sql_type, sql_subtype);
-        if (dflt != Qnil) {
-            rb_funcall(dflt, id_sub_bang, 2, re_default, empty);
-        }
-        nullable = RTEST(not_null) ? Qfalse : Qtrue;
-        column = rb_struct_new(rb_sFbColumn, name, domain, sql_type, sql_subtype, length, precision, scale, dflt, nullable);
-        rb_ary_push(columns, column);
-    }
-    rb_ary_freeze(columns);
-    return columns;
+	struct fb_service_args *a = data;
+	return isc_service_attach(a->isc_status, 0, a->name, a->handle, a->spb_length, a->spb);
 }
 
-char *p(char *prompt, VALUE s)
+static ISC_STATUS fb_service_start_call(void *data)
 {
-	char *sz;
-	if (TYPE(s) != T_STRING) {
-		s = rb_funcall(s, rb_intern("to_s"), 0);
+	struct fb_service_args *a = data;
+	return isc_service_start(a->isc_status, a->handle, NULL, a->spb_length, a->spb);
+}
+
+static ISC_STATUS fb_service_query_call(void *data)
+{
+	struct fb_service_args *a = data;
+	return isc_service_query(a->isc_status, a->handle, NULL, a->send_length, a->send,
+		a->request_length, a->request, a->buffer_length, a->buffer);
+}
+
+#endif
+
+static void fb_services_detach(struct FbServices *fb_services)
+{
+	ISC_STATUS isc_status[20];
+
+	if (fb_services->handle) {
+		isc_service_detach(isc_status, &fb_services->handle);
+		fb_services->handle = 0;
 	}
-	sz = StringValuePtr(s);
-	printf("%s: %s\n", prompt, sz);
-	return sz;
 }
 
-static VALUE connection_index_columns(VALUE self, VALUE index_name)
+static void fb_services_mark(struct FbServices *fb_services)
 {
-	const char *sql_columns = "SELECT * "
-						"FROM RDB$INDEX_SEGMENTS "
-						"WHERE RDB$INDEX_SEGMENTS.RDB$INDEX_NAME = ? "
-						"ORDER BY RDB$INDEX_SEGMENTS.RDB$FIELD_POSITION";
-	VALUE query_columns = rb_str_new2(sql_columns);
-	VALUE query_parms[] = { query_columns, index_name };
-	VALUE result = connection_query(2, query_parms, self);
-	VALUE columns = rb_ary_new();
-	int i;
-	struct FbConnection *fb_connection;
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
+	rb_gc_mark(fb_services->service);
+	rb_gc_mark(fb_services->spb);
+}
 
-	for (i = 0; i < RARRAY_LEN(result); i++) {
-		VALUE row = rb_ary_entry(result, i);
-		VALUE name = rb_ary_entry(row, 1);
-		rb_funcall(name, id_rstrip_bang, 0);
-		if (fb_connection->downcase_names && no_lowercase(name)) {
-			rb_funcall(name, id_downcase_bang, 0);
-		}
-		rb_ary_push(columns, name);
+static void fb_services_free(struct FbServices *fb_services)
+{
+	fb_services_detach(fb_services);
+	xfree(fb_services);
+}
+
+static const rb_data_type_t fbservices_data_type = {
+    "fbdb/services",
+    {
+        (void (*)(void *))fb_services_mark,
+        (void (*)(void *))fb_services_free,
+        NULL,
+    },
+    0, 0, 0
+};
+
+static VALUE services_allocate_instance(VALUE klass)
+{
+	struct FbServices *fb_services;
+	VALUE obj = TypedData_Make_Struct(klass, struct FbServices, &fbservices_data_type, fb_services);
+	fb_services->service = Qnil;
+	fb_services->spb = Qnil;
+	return obj;
+}
+
+/* Appends +tag+ and +str+ with a one byte length, or a two byte one if +wide+. */
+static void fb_spb_string(VALUE spb, char tag, VALUE str, int wide)
+{
+	long len = RSTRING_LEN(str);
+	char head[3];
+
+	if (len > (wide ? 0xffff : 0xff)) {
+		rb_raise(rb_eArgError, "service parameter too long");
+	}
+	head[0] = tag;
+	head[1] = (char)(len & 0xff);
+	head[2] = (char)((len >> 8) & 0xff);
+	rb_str_cat(spb, head, wide ? 3 : 2);
+	rb_str_cat(spb, RSTRING_PTR(str), len);
+}
+
+/* call-seq:
+ *   Services.new(host: "localhost", username: "sysdba", password: "masterkey") -> Services
+ *
+ * Attaches to the service manager of the server at +host+, which may carry a
+ * port as in <tt>"db.example.com/3051"</tt>.
+ */
+static VALUE services_initialize(int argc, VALUE *argv, VALUE self)
+{
+#ifdef isc_action_svc_trace_start
+	struct FbServices *fb_services;
+	ISC_STATUS isc_status[20];
+	struct fb_service_args args;
+	VALUE kw, opts[3], spb;
+	ID kw_ids[3];
+
+	rb_scan_args(argc, argv, "0:", &kw);
+	TypedData_Get_Struct(self, struct FbServices, &fbservices_data_type, fb_services);
+	opts[0] = opts[1] = opts[2] = Qundef;
+	if (!NIL_P(kw)) {
+		kw_ids[0] = rb_intern("host");
+		kw_ids[1] = rb_intern("username");
+		kw_ids[2] = rb_intern("password");
+		rb_get_kwargs(kw, kw_ids, 0, 3, opts);
 	}
-	return columns;
+	opts[0] = (opts[0] == Qundef || NIL_P(opts[0])) ? rb_str_new_cstr("localhost") : rb_obj_as_string(opts[0]);
+	opts[1] = (opts[1] == Qundef || NIL_P(opts[1])) ? rb_str_new_cstr("sysdba") : rb_obj_as_string(opts[1]);
+	opts[2] = (opts[2] == Qundef || NIL_P(opts[2])) ? rb_str_new_cstr("masterkey") : rb_obj_as_string(opts[2]);
+
+	spb = rb_str_buf_new(64);
+	rb_str_cat(spb, (const char[]){ isc_spb_version, isc_spb_current_version }, 2);
+	fb_spb_string(spb, isc_spb_user_name, opts[1], 0);
+	fb_spb_string(spb, isc_spb_password, opts[2], 0);
+
+	fb_services_detach(fb_services);
+	fb_services->service = rb_str_freeze(rb_sprintf("%"PRIsVALUE":service_mgr", opts[0]));
+	fb_services->spb = rb_str_freeze(spb);
+
+	memset(&args, 0, sizeof(args));
+	args.isc_status = isc_status;
+	args.handle = &fb_services->handle;
+	args.name = StringValueCStr(fb_services->service);
+	args.spb_length = (unsigned short)RSTRING_LEN(spb);
+	args.spb = RSTRING_PTR(spb);
+	fb_blocking_call_nogvl(args.isc_status, fb_service_attach_call, &args);
+	fb_error_check(isc_status);
+	return self;
+#else
+	rb_notimplement();
+#endif
 }
 
 /* call-seq:
- *   indexes() -> Hash
+ *   close() -> nil
+ *
+ * Detaches from the service manager. The next call attaches again.
  */
-static VALUE connection_indexes(VALUE self)
+static VALUE services_close(VALUE self)
 {
-	const char *sql_indexes = "SELECT RDB$INDICES.RDB$RELATION_NAME, RDB$INDICES.RDB$INDEX_NAME, RDB$INDICES.RDB$UNIQUE_FLAG, RDB$INDICES.RDB$INDEX_TYPE "
-						"FROM RDB$INDICES "
-						"  JOIN RDB$RELATIONS ON RDB$INDICES.RDB$RELATION_NAME = RDB$RELATIONS.RDB$RELATION_NAME "
-						"WHERE (RDB$RELATIONS.RDB$SYSTEM_FLAG <> 1 OR RDB$RELATIONS.RDB$SYSTEM_FLAG IS NULL) ";
-	VALUE query_indexes = rb_str_new2(sql_indexes);
-	VALUE ary_indexes = connection_query(1, &query_indexes, self);
-	VALUE indexes = rb_hash_new();
-	int i;
-	struct FbConnection *fb_connection;
-	TypedData_Get_Struct(self, struct FbConnection, &fbconnection_data_type, fb_connection);
-
-	for (i = 0; i < RARRAY_LEN(ary_indexes); i++) {
-		VALUE index_struct;
-		VALUE row = rb_ary_entry(ary_indexes, i);
-		VALUE table_name = rb_ary_entry(row, 0);
-		VALUE index_name = rb_ary_entry(row, 1);
-		VALUE unique = rb_ary_entry(row, 2);
-		VALUE descending = rb_ary_entry(row, 3);
-		VALUE columns = connection_index_columns(self, index_name);
+	struct FbServices *fb_services;
+	TypedData_Get_Struct(self, struct FbServices, &fbservices_data_type, fb_services);
+	fb_services_detach(fb_services);
+	return Qnil;
+}
 
-		rb_funcall(table_name, id_rstrip_bang, 0);
-		rb_funcall(index_name, id_rstrip_bang, 0);
+#ifdef isc_action_svc_trace_start
 
-		if (fb_connection->downcase_names) {
-			if (no_lowercase(table_name)) {
-				rb_funcall(table_name, id_downcase_bang, 0);
-			}
-			if (no_lowercase(index_name)) {
-				rb_funcall(index_name, id_downcase_bang, 0);
-			}
-		}
+/* trace output */
 
-		rb_str_freeze(table_name);
-		rb_str_freeze(index_name);
+struct fb_trace {
+	struct FbServices *fb_services;
+	ISC_STATUS isc_status[20];
+	double deadline;	/* 0 runs until the server ends the session */
+	long session_id;	/* from "Trace session ID n started" */
+	int eof;
+	VALUE pending;		/* output after the last newline */
+	VALUE event;		/* lines of the event being read */
+};
 
-		unique = (unique == INT2FIX(1)) ? Qtrue : Qfalse;
-		descending = (descending == INT2FIX(1)) ? Qtrue : Qfalse;
+/*
+ * Waits up to a second for more output of the running service. Sets +eof+
+ * once the service has nothing more to say.
+ */
+static void fb_service_read(ISC_STATUS *isc_status, isc_svc_handle *handle, VALUE out, int *eof)
+{
+	static const char send[] = { isc_info_svc_timeout, 4, 0, 1, 0, 0, 0 };
+	static const char request[] = { isc_info_svc_stdout };
+	char buffer[16384];
+	struct fb_service_args args;
+	const char *p = buffer, *end = buffer + sizeof(buffer);
+	long length = -1;
+	int waiting = 0;
+
+	memset(&args, 0, sizeof(args));
+	args.isc_status = isc_status;
+	args.handle = handle;
+	args.send_length = sizeof(send);
+	args.send = send;
+	args.request_length = sizeof(request);
+	args.request = request;
+	args.buffer_length = sizeof(buffer);
+	args.buffer = buffer;
+	fb_blocking_call_nogvl(args.isc_status, fb_service_query_call, &args);
+	fb_error_check(isc_status);
 
-		index_struct = rb_struct_new(rb_sFbIndex, table_name, index_name, unique, descending, columns);
-		rb_hash_aset(indexes, index_name, index_struct);
+	while (p < end && *p != isc_info_end) {
+		switch (*p++) {
+		case isc_info_svc_stdout:
+			length = isc_vax_integer(p, 2);
+			p += 2;
+			if (length > end - p) {
+				length = end - p;
+			}
+			rb_str_cat(out, p, length);
+			p += length;
+			break;
+		case isc_info_svc_timeout:
+		case isc_info_data_not_ready:
+			waiting = 1;
+			break;
+		case isc_info_truncated:
+			break;
+		default:
+			p = end;
+		}
 	}
-	return indexes;
+	*eof = length == 0 && !waiting;
 }
 
-static VALUE default_string(VALUE hash, const char *key, const char *def)
-{
-	VALUE sym = ID2SYM(rb_intern(key));
-	VALUE val = rb_hash_aref(hash, sym);
-	return NIL_P(val) ? rb_str_new2(def) : StringValue(val);
-}
+enum { FB_TRACE_NONE, FB_TRACE_SQL, FB_TRACE_PLAN, FB_TRACE_TABLES };
 
-static VALUE default_int(VALUE hash, const char *key, int def)
+/* "2024-05-02T09:14:03.5120 (4176:0x7f3a1c0) EXECUTE_STATEMENT_FINISH" */
+static int fb_trace_header(const char *line, long len)
 {
-	VALUE sym = ID2SYM(rb_intern(key));
-	VALUE val = rb_hash_aref(hash, sym);
-	return NIL_P(val) ? INT2NUM(def) : val;
+	return len > 26 && isdigit((unsigned char)line[0]) && line[4] == '-' && line[7] == '-' &&
+		line[10] == 'T' && memchr(line, '(', len) != NULL;
 }
 
-static VALUE database_allocate_instance(VALUE klass)
+static long fb_trace_id(const char *line, const char *tag)
 {
-    return TypedData_Wrap_Struct(klass, &fbdatabase_data_type, NULL);
+	const char *p = strstr(line, tag);
+	return p ? strtol(p + strlen(tag), NULL, 10) : 0;
 }
 
-static VALUE hash_from_connection_string(VALUE cs)
+/* "      3 ms, 2 read(s), 4 fetch(es), 1 mark(s)"; +perf+ is elapsed, reads, writes, fetches, marks */
+static void fb_trace_perf(const char *p, VALUE *perf)
 {
-	VALUE hash = rb_hash_new();
-	VALUE re_SemiColon = rb_reg_regcomp(rb_str_new2("\\s*;\\s*"));
-	VALUE re_Equal = rb_reg_regcomp(rb_str_new2("\\s*=\\s*"));
-	ID id_split = rb_intern("split");
-	VALUE pairs = rb_funcall(cs, id_split, 1, re_SemiColon);
+	static const char *units[] = { "ms", "read", "write", "fetch", "mark" };
+	char *end;
+	long n;
 	int i;
-	for (i = 0; i < RARRAY_LEN(pairs); i++) {
-		VALUE pair = rb_ary_entry(pairs, i);
-		VALUE keyValue = rb_funcall(pair, id_split, 1, re_Equal);
-		if (RARRAY_LEN(keyValue) == 2) {
-			VALUE key = rb_ary_entry(keyValue, 0);
-			VALUE val = rb_ary_entry(keyValue, 1);
-			rb_hash_aset(hash, rb_str_intern(key), val);
+
+	for (;;) {
+		while (*p == ' ' || *p == '\t' || *p == ',') p++;
+		if (!isdigit((unsigned char)*p)) {
+			return;
+		}
+		n = strtol(p, &end, 10);
+		for (p = end; *p == ' '; p++);
+		for (i = 0; i < 5; i++) {
+			if (!strncmp(p, units[i], strlen(units[i]))) {
+				perf[i] = i == 0 ? DBL2NUM(n / 1000.0) : LONG2NUM(n);
+				break;
+			}
 		}
+		while (*p && *p != ',') p++;
 	}
-	return hash;
 }
 
-static void check_page_size(int page_size)
+/* Trace table columns, in fb_io_names order. */
+static const char *fb_trace_columns[] = {
+	"Natural", "Index", "Insert", "Update", "Delete", "Backout", "Purge", "Expunge"
+};
+
+/* Right edge of each counter column in the "Table  Natural  Index ..." header; -1 if absent. */
+static void fb_trace_table_header(const char *line, long *ends)
 {
-	if (page_size != 1024 && page_size != 2048 && page_size != 4096 && page_size != 8192 && page_size != 16384) {
-		rb_raise(rb_eFbError, "Invalid page size: %d", page_size);
+	const char *p;
+	int i;
+
+	for (i = 0; i < FB_IO_COUNTERS; i++) {
+		p = strstr(line, fb_trace_columns[i]);
+		ends[i] = p ? (p - line) + (long)strlen(fb_trace_columns[i]) : -1;
 	}
 }
 
-/* call-seq:
- *   Database.new(options) -> Database
+/*
+ * Counters are right aligned under their header, blank when zero. Names
+ * longer than the name column push the counters right by the same amount.
  */
-static VALUE database_initialize(int argc, VALUE *argv, VALUE self)
+static void fb_trace_table_row(const char *line, long len, const long *ends, VALUE tables)
 {
-	VALUE parms, database;
+	long last = 0, first = len, shift, start, stop, name_len;
+	VALUE counts;
+	int i;
 
-	if (argc >= 1) {
-		parms = argv[0];
-		if (TYPE(parms) == T_STRING) {
-			parms = hash_from_connection_string(parms);
-		} else {
-			Check_Type(parms, T_HASH);
+	for (i = 0; i < FB_IO_COUNTERS; i++) {
+		if (ends[i] > last) last = ends[i];
+		if (ends[i] >= 0 && ends[i] < first) first = ends[i];
+	}
+	shift = len > last ? len - last : 0;
+	name_len = first - 10 + shift;
+	if (name_len <= 0 || name_len > len) {
+		return;
+	}
+	while (name_len > 0 && isspace((unsigned char)line[name_len - 1])) name_len--;
+	if (name_len == 0) {
+		return;
+	}
+
+	counts = rb_hash_new();
+	for (i = 0; i < FB_IO_COUNTERS; i++) {
+		long n = 0;
+		if (ends[i] >= 0) {
+			stop = ends[i] + shift;
+			start = stop - 10;
+			if (stop > len) stop = len;
+			for (; start < stop; start++) {
+				if (isdigit((unsigned char)line[start])) {
+					n = strtol(line + start, NULL, 10);
+					break;
+				}
+			}
 		}
-		database = rb_hash_aref(parms, ID2SYM(rb_intern("database")));
-		if (NIL_P(database)) rb_raise(rb_eFbError, "Database must be specified.");
-		rb_iv_set(self, "@database", database);
-		rb_iv_set(self, "@username", default_string(parms, "username", "sysdba"));
-		rb_iv_set(self, "@password", default_string(parms, "password", "masterkey"));
-		rb_iv_set(self, "@charset", default_string(parms, "charset", "NONE"));
-		rb_iv_set(self, "@role", rb_hash_aref(parms, ID2SYM(rb_intern("role"))));
-		rb_iv_set(self, "@downcase_names", rb_hash_aref(parms, ID2SYM(rb_intern("downcase_names"))));
-		rb_iv_set(self, "@encoding", default_string(parms, "encoding", "ASCII-8BIT"));
-		rb_iv_set(self, "@page_size", default_int(parms, "page_size", 4096));
+		rb_hash_aset(counts, ID2SYM(rb_intern(fb_io_names[i])), LONG2NUM(n));
 	}
-	return self;
+	rb_hash_aset(tables, rb_utf8_str_new(line, name_len), counts);
 }
 
-/* call-seq:
- *   create() -> Database
- *   create() {|connection| } -> Database
- */
-static VALUE database_create(VALUE self)
+static void fb_trace_append(VALUE *str, const char *line, long len)
 {
-	ISC_STATUS isc_status[20];
-	isc_db_handle handle = 0;
-	isc_tr_handle local_transact = 0;
-	VALUE parms, fmt, stmt;
-	char *sql;
-
-	VALUE database = rb_iv_get(self, "@database");
-	VALUE username = rb_iv_get(self, "@username");
-	VALUE password = rb_iv_get(self, "@password");
-	VALUE page_size = rb_iv_get(self, "@page_size");
-	VALUE charset = rb_iv_get(self, "@charset");
-
-	check_page_size(NUM2INT(page_size));
-
-	parms = rb_ary_new3(5, database, username, password, page_size, charset);
+	if (NIL_P(*str)) {
+		*str = rb_utf8_str_new(line, len);
+	} else {
+		rb_str_cat(*str, "\n", 1);
+		rb_str_cat(*str, line, len);
+	}
+}
 
-	fmt = rb_str_new2("CREATE DATABASE '%s' USER '%s' PASSWORD '%s' PAGE_SIZE = %d DEFAULT CHARACTER SET %s;");
-	stmt = rb_funcall(fmt, rb_intern("%"), 1, parms);
-	sql = StringValuePtr(stmt);
+/* Turns the text of one trace event into a Struct::FbTraceEvent. */
+static VALUE fb_trace_event(VALUE text)
+{
+	VALUE type = Qnil, timestamp = Qnil, sql = Qnil, plan = Qnil;
+	VALUE params = rb_ary_new(), tables = rb_hash_new(), records = Qnil;
+	VALUE perf[5] = { Qnil, Qnil, Qnil, Qnil, Qnil };
+	long attachment_id = 0, transaction_id = 0, statement_id = 0, ends[FB_IO_COUNTERS];
+	long i, offset, len;
+	int state = FB_TRACE_NONE, has_plan;
+	const char *start = RSTRING_PTR(text), *nl, *line, *p;
+
+	has_plan = rb_memsearch("\n^", 2, start, RSTRING_LEN(text), rb_enc_get(text)) >= 0;
+	for (i = 0, offset = 0; offset < RSTRING_LEN(text); i++, offset += len + 1) {
+		VALUE str;
+		start = RSTRING_PTR(text) + offset;
+		nl = memchr(start, '\n', RSTRING_LEN(text) - offset);
+		len = nl ? nl - start : RSTRING_LEN(text) - offset;
+		str = rb_utf8_str_new(start, len);
+		line = StringValueCStr(str);
+
+		if (i == 0) {
+			p = strchr(line, ' ');
+			timestamp = rb_funcall(rb_cTime, rb_intern("parse"), 1, rb_str_new(line, p ? p - line : len));
+			p = strrchr(line, ')');
+			if (p) {
+				for (p++; *p == ' '; p++);
+				type = rb_str_new_cstr(p);
+			}
+			continue;
+		}
+		switch (state) {
+		case FB_TRACE_SQL:
+			if (line[0] == '^') {
+				state = FB_TRACE_PLAN;
+			} else if (len == 0 && !has_plan) {
+				state = FB_TRACE_NONE;
+			} else {
+				fb_trace_append(&sql, line, len);
+			}
+			continue;
+		case FB_TRACE_PLAN:
+			if (len == 0) {
+				state = FB_TRACE_NONE;
+			} else {
+				fb_trace_append(&plan, line, len);
+			}
+			continue;
+		case FB_TRACE_TABLES:
+			if (len == 0) {
+				state = FB_TRACE_NONE;
+			} else if (line[0] != '*') {
+				fb_trace_table_row(line, len, ends, tables);
+			}
+			continue;
+		}
 
-	if (isc_dsql_execute_immediate(isc_status, &handle, &local_transact, 0, sql, 3, NULL) != 0) {
-		fb_error_check(isc_status);
-	}
-	if (handle) {
-		if (rb_block_given_p()) {
-			VALUE connection = connection_create(handle, self);
-			rb_ensure(rb_yield,connection,connection_close,connection);
+		if (len >= 10 && strspn(line, "-") >= 10) {
+			state = FB_TRACE_SQL;
+			sql = Qnil;
+		} else if (!strncmp(line, "Table", 5) && strstr(line, "Natural")) {
+			fb_trace_table_header(line, ends);
+			state = FB_TRACE_TABLES;
+		} else if (!strncmp(line, "param", 5) && (p = strstr(line, " = "))) {
+			rb_ary_push(params, rb_utf8_str_new_cstr(p + 3));
+		} else if (!strncmp(line, "Statement ", 10)) {
+			statement_id = strtol(line + 10, NULL, 10);
+		} else if (strstr(line, " records fetched")) {
+			records = LONG2NUM(strtol(line, NULL, 10));
+		} else if (isdigit((unsigned char)line[strspn(line, " \t")]) && strstr(line, " ms")) {
+			fb_trace_perf(line, perf);
 		} else {
-			isc_detach_database(isc_status, &handle);
-			fb_error_check(isc_status);
+			if (!attachment_id) attachment_id = fb_trace_id(line, "(ATT_");
+			if (!transaction_id) transaction_id = fb_trace_id(line, "(TRA_");
 		}
 	}
 
-	return self;
+	return rb_struct_new(rb_sFbTraceEvent, type, timestamp,
+		attachment_id ? LONG2NUM(attachment_id) : Qnil,
+		transaction_id ? LONG2NUM(transaction_id) : Qnil,
+		statement_id ? LONG2NUM(statement_id) : Qnil,
+		sql, plan, params, records, perf[0], perf[1], perf[2], perf[3], perf[4],
+		tables, text);
 }
 
-/* call-seq:
- *   Database.create(options) -> Database
- *   Database.create(options) {|connection| } -> Database
- */
-static VALUE database_s_create(int argc, VALUE *argv, VALUE klass)
+static void fb_trace_flush(struct fb_trace *trace)
 {
-	VALUE obj = database_allocate_instance(klass);
-	database_initialize(argc, argv, obj);
-	return database_create(obj);
+	VALUE event = trace->event;
+
+	if (!NIL_P(event)) {
+		trace->event = Qnil;
+		rb_yield(fb_trace_event(rb_str_freeze(event)));
+	}
 }
 
-/* call-seq:
- *   connect() -> Connection
- *   connect() {|connection| } -> nil
- */
-static VALUE database_connect(VALUE self)
+/* Splits complete lines off the pending output; a header line starts a new event. */
+static void fb_trace_lines(struct fb_trace *trace)
 {
-	ISC_STATUS isc_status[20];
-	char *dbp;
-	long length;
-	isc_db_handle handle = 0;
-	VALUE database = rb_iv_get(self, "@database");
+	const char *start, *nl;
+	long offset = 0, len;
+	VALUE line;
 
-	Check_Type(database, T_STRING);
-	dbp = connection_create_dbp(self, &length);
-	isc_attach_database(isc_status, 0, StringValuePtr(database), &handle, length, dbp);
-	xfree(dbp);
-	fb_error_check(isc_status);
-	{
-		VALUE connection = connection_create(handle, self);
-		if (rb_block_given_p()) {
-			return rb_ensure(rb_yield, connection, connection_close, connection);
-		} else {
-			return connection;
+	for (;;) {
+		start = RSTRING_PTR(trace->pending) + offset;
+		nl = memchr(start, '\n', RSTRING_LEN(trace->pending) - offset);
+		if (!nl) {
+			break;
+		}
+		len = nl - start;
+		offset += len + 1;
+		if (len > 0 && start[len - 1] == '\r') {
+			len--;
+		}
+		line = rb_utf8_str_new(start, len);
+		if (!trace->session_id && sscanf(StringValueCStr(line), "Trace session ID %ld started", &trace->session_id) == 1) {
+			continue;
+		}
+		if (fb_trace_header(RSTRING_PTR(line), len)) {
+			fb_trace_flush(trace);
+			trace->event = line;
+		} else if (!NIL_P(trace->event)) {
+			rb_str_cat(trace->event, "\n", 1);
+			rb_str_append(trace->event, line);
 		}
 	}
+	trace->pending = rb_utf8_str_new(RSTRING_PTR(trace->pending) + offset, RSTRING_LEN(trace->pending) - offset);
 }
 
-/* call-seq:
- *   Database.connect(options) -> Connection
- *   Database.connect(options) {|connection| } -> nil
- */
-static VALUE database_s_connect(int argc, VALUE *argv, VALUE klass)
+static VALUE fb_trace_run(VALUE arg)
 {
-	VALUE obj = database_allocate_instance(klass);
-	database_initialize(argc, argv, obj);
-	return database_connect(obj);
+	struct fb_trace *trace = (struct fb_trace *)arg;
+
+	while (!trace->eof && (trace->deadline == 0 || fb_monotonic_time() < trace->deadline)) {
+		fb_service_read(trace->isc_status, &trace->fb_services->handle, trace->pending, &trace->eof);
+		fb_trace_lines(trace);
+		rb_thread_check_ints();
+	}
+	if (trace->eof && RSTRING_LEN(trace->pending) > 0) {
+		rb_str_cat(trace->pending, "\n", 1);
+		fb_trace_lines(trace);
+	}
+	fb_trace_flush(trace);
+	return Qnil;
 }
 
-/* call-seq:
- *   drop() -> nil
+/*
+ * Stops the session over a second attachment, since the first one is busy
+ * with it. Errors are ignored: this runs while an exception may be on its
+ * way out. Detaching the streaming attachment ends the session regardless.
  */
-static VALUE database_drop(VALUE self)
+static VALUE fb_trace_stop(VALUE arg)
 {
-	struct FbConnection *fb_connection;
+	struct fb_trace *trace = (struct fb_trace *)arg;
+	struct FbServices *fb_services = trace->fb_services;
+	ISC_STATUS isc_status[20];
+	struct fb_service_args args;
+	isc_svc_handle handle = 0;
+	char spb[6];
+	long id = trace->session_id;
 
-	VALUE connection = database_connect(self);
-	TypedData_Get_Struct(connection, struct FbConnection, &fbconnection_data_type, fb_connection);
-	isc_drop_database(fb_connection->isc_status, &fb_connection->db);
-	fb_error_check(fb_connection->isc_status);
+	if (trace->eof) {
+		return Qnil;
+	}
+	if (id) {
+		memset(&args, 0, sizeof(args));
+		args.isc_status = isc_status;
+		args.handle = &handle;
+		args.name = RSTRING_PTR(fb_services->service);
+		args.spb_length = (unsigned short)RSTRING_LEN(fb_services->spb);
+		args.spb = RSTRING_PTR(fb_services->spb);
+		if (!fb_blocking_call_nogvl(args.isc_status, fb_service_attach_call, &args)) {
+			spb[0] = isc_action_svc_trace_stop;
+			spb[1] = isc_spb_trc_id;
+			spb[2] = (char)(id & 0xff);
+			spb[3] = (char)((id >> 8) & 0xff);
+			spb[4] = (char)((id >> 16) & 0xff);
+			spb[5] = (char)((id >> 24) & 0xff);
+			args.spb_length = sizeof(spb);
+			args.spb = spb;
+			fb_blocking_call_nogvl(args.isc_status, fb_service_start_call, &args);
+			isc_service_detach(isc_status, &handle);
+		}
+	}
+	fb_services_detach(fb_services);
 	return Qnil;
 }
 
+#endif
+
 /* call-seq:
- *   Database.drop(options) -> nil
+ *   trace(config, name: nil, duration: nil) { |event| ... } -> Integer
+ *
+ * Starts a user trace session with the trace +config+ text and yields each
+ * event the server reports as a Struct::FbTraceEvent, until +duration+
+ * seconds have passed, the block breaks or the server ends the session. The
+ * session is stopped on the way out, whatever the reason. Output is read
+ * without holding the GVL. Returns the session ID.
+ *
+ * Statement finish events carry the +sql+, +plan+, +params+, +records+
+ * fetched, +elapsed+ seconds, page +reads+, +writes+, +fetches+ and +marks+,
+ * and per-table +tables+ counters keyed like Cursor#io_stats. Other events
+ * fill in what they report; +text+ is the event as the server wrote it.
  */
-static VALUE database_s_drop(int argc, VALUE *argv, VALUE klass)
+static VALUE services_trace(int argc, VALUE *argv, VALUE self)
 {
-	VALUE obj = database_allocate_instance(klass);
-	database_initialize(argc, argv, obj);
-	return database_drop(obj);
+#ifdef isc_action_svc_trace_start
+	struct FbServices *fb_services;
+	struct fb_trace trace;
+	struct fb_service_args args;
+	VALUE config, kw, opts[2], spb;
+	ID kw_ids[2];
+
+	rb_scan_args(argc, argv, "1:", &config, &kw);
+	TypedData_Get_Struct(self, struct FbServices, &fbservices_data_type, fb_services);
+	if (NIL_P(fb_services->service)) {
+		rb_raise(rb_eFbError, "uninitialized services");
+	}
+	if (!rb_block_given_p()) {
+		rb_raise(rb_eArgError, "trace needs a block");
+	}
+	opts[0] = opts[1] = Qundef;
+	if (!NIL_P(kw)) {
+		kw_ids[0] = rb_intern("name");
+		kw_ids[1] = rb_intern("duration");
+		rb_get_kwargs(kw, kw_ids, 0, 2, opts);
+	}
+
+	spb = rb_str_buf_new(RSTRING_LEN(StringValue(config)) + 64);
+	rb_str_cat(spb, (const char[]){ isc_action_svc_trace_start }, 1);
+	if (opts[0] != Qundef && !NIL_P(opts[0])) {
+		fb_spb_string(spb, isc_spb_trc_name, rb_obj_as_string(opts[0]), 1);
+	}
+	fb_spb_string(spb, isc_spb_trc_cfg, config, 1);
+	if (RSTRING_LEN(spb) > 0xffff) {
+		rb_raise(rb_eArgError, "trace config too long");
+	}
+
+	memset(&trace, 0, sizeof(trace));
+	trace.fb_services = fb_services;
+	trace.deadline = (opts[1] == Qundef || NIL_P(opts[1])) ? 0 : fb_monotonic_time() + NUM2DBL(opts[1]);
+	trace.pending = rb_utf8_str_new(0, 0);
+	trace.event = Qnil;
+
+	memset(&args, 0, sizeof(args));
+	args.isc_status = trace.isc_status;
+	args.handle = &fb_services->handle;
+	if (!fb_services->handle) {
+		args.name = StringValueCStr(fb_services->service);
+		args.spb_length = (unsigned short)RSTRING_LEN(fb_services->spb);
+		args.spb = RSTRING_PTR(fb_services->spb);
+		fb_blocking_call_nogvl(args.isc_status, fb_service_attach_call, &args);
+		fb_error_check(trace.isc_status);
+	}
+	args.spb_length = (unsigned short)RSTRING_LEN(spb);
+	args.spb = RSTRING_PTR(spb);
+	fb_blocking_call_nogvl(args.isc_status, fb_service_start_call, &args);
+	fb_error_check(trace.isc_status);
+
+	rb_ensure(fb_trace_run, (VALUE)&trace, fb_trace_stop, (VALUE)&trace);
+	RB_GC_GUARD(trace.pending);
+	RB_GC_GUARD(trace.event);
+	RB_GC_GUARD(spb);
+	return trace.session_id ? LONG2NUM(trace.session_id) : Qnil;
+#else
+	rb_notimplement();
+#endif
 }
 
 void Init_fb()
 {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+	/* No per-process Ruby state is mutated after Init_fb; connections and
+	 * cursors belong to the Ractor that created them. */
+	rb_ext_ractor_safe(true);
+#endif
+
 	rb_funcall(rb_mKernel, rb_intern("require"), 1, rb_str_new2("bigdecimal"));
 
 	rb_mFb = rb_define_module("Fb");
+#ifdef FB_FIBER_OFFLOAD
+	fb_offload_key = rb_ractor_local_storage_ptr_newkey(&fb_offload_local_type);
+#endif
+	rb_define_singleton_method(rb_mFb, "worker_threads", fb_s_worker_threads, 0);
+	rb_define_singleton_method(rb_mFb, "worker_threads=", fb_s_set_worker_threads, 1);
+	rb_define_singleton_method(rb_mFb, "distributed_transaction", fb_s_distributed_transaction, -1);
 
 	rb_cFbDatabase = rb_define_class_under(rb_mFb, "Database", rb_cObject);
 	rb_undef_alloc_func(rb_cFbDatabase);
@@ -3435,6 +9661,21 @@ void Init_fb()
 	rb_define_attr(rb_cFbDatabase, "downcase_names", 1, 1);
 	rb_define_attr(rb_cFbDatabase, "encoding", 1, 1);
 	rb_define_attr(rb_cFbDatabase, "page_size", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "auto_reconnect", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "reconnect_attempts", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "reconnect_backoff", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "autocommit_read", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "autocommit_read_refresh", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "autocommit_write", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "autocommit_batch", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "autocommit_interval", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "autocommit_idle", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "query_cache", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "stats", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "slow_query_threshold", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "slow_query_log", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "slow_query_redact", 1, 1);
+	rb_define_attr(rb_cFbDatabase, "io_stats", 1, 1);
     rb_define_method(rb_cFbDatabase, "create", database_create, 0);
 	rb_define_singleton_method(rb_cFbDatabase, "create", database_s_create, -1);
 	rb_define_method(rb_cFbDatabase, "connect", database_connect, 0);
@@ -3455,13 +9696,39 @@ void Init_fb()
 	rb_define_method(rb_cFbConnection, "to_s", connection_to_s, 0);
 	rb_define_method(rb_cFbConnection, "execute", connection_execute, -1);
 	rb_define_method(rb_cFbConnection, "query", connection_query, -1);
+	rb_define_method(rb_cFbConnection, "plan", connection_plan, 1);
+	rb_define_method(rb_cFbConnection, "explain_plan", connection_explain_plan, 1);
 	rb_define_method(rb_cFbConnection, "transaction", connection_transaction, -1);
 	rb_define_method(rb_cFbConnection, "transaction_started", connection_transaction_started, 0);
+	rb_define_method(rb_cFbConnection, "start_transaction", connection_start_transaction, -1);
 	rb_define_method(rb_cFbConnection, "commit", connection_commit, 0);
+	rb_define_method(rb_cFbConnection, "flush", connection_flush, 0);
+	rb_define_method(rb_cFbConnection, "savepoint", connection_savepoint, 0);
+	rb_define_method(rb_cFbConnection, "limbo_transactions", connection_limbo_transactions, 0);
+	rb_define_method(rb_cFbConnection, "resolve_limbo", connection_resolve_limbo, 2);
+	rb_define_method(rb_cFbConnection, "on_event", connection_on_event, -1);
+	rb_define_method(rb_cFbConnection, "wait_for_events", connection_wait_for_events, -1);
+	rb_define_method(rb_cFbConnection, "cancel_events", connection_cancel_events, 0);
+	rb_define_method(rb_cFbConnection, "cached_query", connection_cached_query, -1);
+	rb_define_method(rb_cFbConnection, "invalidate_cache", connection_invalidate_cache, -1);
+	rb_define_method(rb_cFbConnection, "cache_stats", connection_cache_stats, 0);
+	rb_define_method(rb_cFbConnection, "id_allocator", connection_id_allocator, -1);
+	rb_define_method(rb_cFbConnection, "stats", connection_stats, 0);
+	rb_define_method(rb_cFbConnection, "stats=", connection_set_stats, 1);
+	rb_define_method(rb_cFbConnection, "slow_query_threshold", connection_slow_query_threshold, 0);
+	rb_define_method(rb_cFbConnection, "slow_query_threshold=", connection_set_slow_query_threshold, 1);
+	rb_define_method(rb_cFbConnection, "slow_query_log=", connection_set_slow_query_log, 1);
+	rb_define_method(rb_cFbConnection, "info", connection_info, -1);
+	rb_define_method(rb_cFbConnection, "monitoring_snapshot", connection_monitoring_snapshot, -1);
+	rb_define_method(rb_cFbConnection, "io_stats?", connection_is_io_stats, 0);
+	rb_define_method(rb_cFbConnection, "io_stats=", connection_set_io_stats, 1);
+	rb_define_method(rb_cFbConnection, "last_io_stats", connection_last_io_stats, 0);
 	rb_define_method(rb_cFbConnection, "rollback", connection_rollback, 0);
 	rb_define_method(rb_cFbConnection, "close", connection_close, 0);
 	rb_define_method(rb_cFbConnection, "drop", connection_drop, 0);
 	rb_define_method(rb_cFbConnection, "open?", connection_is_open, 0);
+	rb_define_method(rb_cFbConnection, "ping", connection_ping, 0);
+	rb_define_method(rb_cFbConnection, "reconnect", connection_reconnect, 0);
 	rb_define_method(rb_cFbConnection, "dialect", connection_dialect, 0);
 	rb_define_method(rb_cFbConnection, "db_dialect", connection_db_dialect, 0);
 	rb_define_method(rb_cFbConnection, "table_names", connection_table_names, 0);
@@ -3473,6 +9740,22 @@ void Init_fb()
 	rb_define_method(rb_cFbConnection, "indexes", connection_indexes, 0);
 	rb_define_method(rb_cFbConnection, "columns", connection_columns, 1);
 
+	rb_cFbTransactionOptions = rb_define_class_under(rb_mFb, "TransactionOptions", rb_cObject);
+	rb_define_alloc_func(rb_cFbTransactionOptions, transaction_options_allocate_instance);
+	rb_define_method(rb_cFbTransactionOptions, "initialize", transaction_options_initialize, 1);
+	rb_define_method(rb_cFbTransactionOptions, "to_s", transaction_options_to_s, 0);
+	rb_define_method(rb_cFbTransactionOptions, "tpb", transaction_options_tpb, 0);
+
+	rb_cFbTransaction = rb_define_class_under(rb_mFb, "Transaction", rb_cObject);
+	rb_undef_alloc_func(rb_cFbTransaction);
+	rb_undef_method(CLASS_OF(rb_cFbTransaction), "new");
+	rb_define_method(rb_cFbTransaction, "connection", transaction_connection, 0);
+	rb_define_method(rb_cFbTransaction, "execute", transaction_execute, -1);
+	rb_define_method(rb_cFbTransaction, "query", transaction_query, -1);
+	rb_define_method(rb_cFbTransaction, "commit", transaction_commit, 0);
+	rb_define_method(rb_cFbTransaction, "rollback", transaction_rollback, 0);
+	rb_define_method(rb_cFbTransaction, "active?", transaction_is_active, 0);
+
 	rb_cFbCursor = rb_define_class_under(rb_mFb, "Cursor", rb_cObject);
 	rb_undef_alloc_func(rb_cFbCursor);
 	rb_undef_method(CLASS_OF(rb_cFbCursor), "new");
@@ -3480,8 +9763,49 @@ void Init_fb()
 	rb_define_method(rb_cFbCursor, "fetch", cursor_fetch, -1);
 	rb_define_method(rb_cFbCursor, "fetchall", cursor_fetchall, -1);
 	rb_define_method(rb_cFbCursor, "each", cursor_each, -1);
+	rb_define_method(rb_cFbCursor, "each_reuse", cursor_each_reuse, -1);
 	rb_define_method(rb_cFbCursor, "close", cursor_close, 0);
 	rb_define_method(rb_cFbCursor, "drop", cursor_drop, 0);
+	rb_define_method(rb_cFbCursor, "plan", cursor_plan, 0);
+	rb_define_method(rb_cFbCursor, "explain_plan", cursor_explain_plan, 0);
+	rb_define_method(rb_cFbCursor, "io_stats", cursor_io_stats, 0);
+
+	rb_cFbPool = rb_define_class_under(rb_mFb, "Pool", rb_cObject);
+	rb_define_alloc_func(rb_cFbPool, pool_allocate_instance);
+	rb_define_method(rb_cFbPool, "initialize", pool_initialize, -1);
+	rb_define_method(rb_cFbPool, "database", pool_database, 0);
+	rb_define_method(rb_cFbPool, "checkout", pool_checkout, 0);
+	rb_define_method(rb_cFbPool, "checkin", pool_checkin, 1);
+	rb_define_method(rb_cFbPool, "with", pool_with, 0);
+	rb_define_method(rb_cFbPool, "warm_up", pool_warm_up, -1);
+	rb_define_method(rb_cFbPool, "reap", pool_reap, 0);
+	rb_define_method(rb_cFbPool, "stats", pool_stats, 0);
+	rb_define_method(rb_cFbPool, "shutdown", pool_shutdown, 0);
+
+	rb_cFbIdAllocator = rb_define_class_under(rb_mFb, "IdAllocator", rb_cObject);
+	rb_define_alloc_func(rb_cFbIdAllocator, id_allocator_allocate_instance);
+	rb_define_method(rb_cFbIdAllocator, "initialize", id_allocator_initialize, -1);
+	rb_define_method(rb_cFbIdAllocator, "next", id_allocator_next, 0);
+	rb_define_method(rb_cFbIdAllocator, "remaining", id_allocator_remaining, 0);
+	rb_define_method(rb_cFbIdAllocator, "refills", id_allocator_refills, 0);
+	rb_define_method(rb_cFbIdAllocator, "generator", id_allocator_generator, 0);
+	rb_define_method(rb_cFbIdAllocator, "block", id_allocator_block, 0);
+
+	rb_cFbServices = rb_define_class_under(rb_mFb, "Services", rb_cObject);
+	rb_define_alloc_func(rb_cFbServices, services_allocate_instance);
+	rb_define_method(rb_cFbServices, "initialize", services_initialize, -1);
+	rb_define_method(rb_cFbServices, "trace", services_trace, -1);
+	rb_define_method(rb_cFbServices, "close", services_close, 0);
+
+	rb_cFbStats = rb_define_class_under(rb_mFb, "Stats", rb_cObject);
+	rb_define_alloc_func(rb_cFbStats, stats_allocate_instance);
+	rb_define_singleton_method(rb_cFbStats, "fingerprint", stats_s_fingerprint, 1);
+	rb_define_method(rb_cFbStats, "initialize", stats_initialize, -1);
+	rb_define_method(rb_cFbStats, "enabled=", stats_set_enabled, 1);
+	rb_define_method(rb_cFbStats, "enabled?", stats_is_enabled, 0);
+	rb_define_method(rb_cFbStats, "reset", stats_reset, 0);
+	rb_define_method(rb_cFbStats, "to_h", stats_to_h, 0);
+	rb_define_method(rb_cFbStats, "to_prometheus", stats_to_prometheus, -1);
 
 	rb_cFbSqlType = rb_define_class_under(rb_mFb, "SqlType", rb_cObject);
 	rb_undef_alloc_func(rb_cFbSqlType);
@@ -3490,22 +9814,46 @@ void Init_fb()
 
 	rb_eFbError = rb_define_class_under(rb_mFb, "Error", rb_eStandardError);
 	rb_define_method(rb_eFbError, "error_code", error_error_code, 0);
+	rb_define_method(rb_eFbError, "sqlcode", error_error_code, 0);
+	rb_define_method(rb_eFbError, "gdscode", error_gdscode, 0);
+	rb_define_method(rb_eFbError, "gds_codes", error_gds_codes, 0);
+	rb_define_method(rb_eFbError, "sql_state", error_sql_state, 0);
+	rb_define_method(rb_eFbError, "retryable?", error_is_retryable, 0);
+	rb_eFbPoolTimeout = rb_define_class_under(rb_cFbPool, "TimeoutError", rb_eFbError);
 
 	rb_sFbField = rb_struct_define("FbField", "name", "sql_type", "sql_subtype", "display_size", "internal_size", "precision", "scale", "nullable", "type_code", NULL);
 	rb_sFbIndex = rb_struct_define("FbIndex", "table_name", "index_name", "unique", "descending", "columns", NULL);
 	rb_sFbColumn = rb_struct_define("FbColumn", "name", "domain", "sql_type", "sql_subtype", "length", "precision", "scale", "default", "nullable", NULL);
+	rb_sFbMonSnapshot = rb_struct_define("FbMonSnapshot", "attachments", "transactions", "statements", "taken_at", NULL);
+	rb_define_method(rb_sFbMonSnapshot, "top_statements", mon_snapshot_top_statements, -1);
+	rb_define_method(rb_sFbMonSnapshot, "blocking_chains", mon_snapshot_blocking_chains, 0);
+	rb_sFbMonAttachment = rb_struct_define("FbMonAttachment", "id", "server_pid", "state", "user", "role",
+			"remote_address", "remote_process", "timestamp", "io", "records", "memory", NULL);
+	rb_sFbMonTransaction = rb_struct_define("FbMonTransaction", "id", "attachment_id", "state", "timestamp",
+			"top", "oldest", "oldest_active", "isolation_mode", "lock_timeout", "read_only", "auto_commit",
+			"io", "records", "memory", NULL);
+	rb_sFbMonStatement = rb_struct_define("FbMonStatement", "id", "attachment_id", "transaction_id", "state",
+			"timestamp", "sql_text", "io", "records", "memory", NULL);
+	rb_sFbMonIO = rb_struct_define("FbMonIO", "page_reads", "page_writes", "page_fetches", "page_marks", NULL);
+	rb_sFbMonRecords = rb_struct_define("FbMonRecords", "seq_reads", "idx_reads", "inserts", "updates",
+			"deletes", "backouts", "purges", "expunges", NULL);
+	rb_sFbMonMemory = rb_struct_define("FbMonMemory", "used", "allocated", "max_used", "max_allocated", NULL);
+	rb_sFbTraceEvent = rb_struct_define("FbTraceEvent", "type", "timestamp", "attachment_id", "transaction_id",
+			"statement_id", "sql", "plan", "params", "records", "elapsed", "reads", "writes", "fetches", "marks",
+			"tables", "text", NULL);
 
 	rb_require("date");
 	rb_require("time");
 	rb_cDate = rb_const_get(rb_cObject, rb_intern("Date"));
+	rb_cConditionVariable = rb_const_get(rb_cThread, rb_intern("ConditionVariable"));
 
-	id_matches = rb_intern("=~");
 	id_downcase_bang = rb_intern("downcase!");
-	re_lowercase = rb_reg_regcomp(rb_str_new2("[[:lower:]]"));
-	rb_global_variable(&re_lowercase);
 	id_rstrip_bang = rb_intern("rstrip!");
     id_sub_bang = rb_intern("sub!");
     id_force_encoding = rb_intern("force_encoding");
 	id_mul = rb_intern("*");
 	id_div = rb_intern("/");
+	id_wait = rb_intern("wait");
+	id_signal = rb_intern("signal");
+	id_broadcast = rb_intern("broadcast");
 }
@@ -1,4 +1,6 @@
 require 'test/FbTestCases'
+require 'json'
+require 'stringio'
 
 class ConnectionTestCases < FbTestCase
   include FbTestCases
@@ -293,6 +295,22 @@ class ConnectionTestCases < FbTestCase
     end
   end
 
+  def test_id_allocator
+    Database.create(@parms) do |connection|
+      connection.execute("create generator test_ids")
+      ids = connection.id_allocator("test_ids", block: 10)
+      assert_equal "TEST_IDS", ids.generator
+      assert_equal (1..25).to_a, 25.times.map { ids.next }
+      assert_equal 3, ids.refills
+      assert_equal 30, connection.query("select gen_id(test_ids, 0) from rdb$database")[0][0]
+      threads = 4.times.map { Thread.new { 50.times.map { ids.next } } }
+      assert_equal 200, threads.flat_map(&:value).uniq.size
+      assert_raises(Error) { connection.id_allocator("no_such_seq") }
+      assert_raises(ArgumentError) { connection.id_allocator("test_ids", block: 0) }
+      connection.drop
+    end
+  end
+
   def test_view_names
     sql_schema = <<-END
       CREATE TABLE TEST1 (ID INT, NAME1 VARCHAR(10));
@@ -537,4 +555,255 @@ class ConnectionTestCases < FbTestCase
       end
     end
   end
+
+  def test_connect_in_ractor
+    skip 'Ractor not available' unless defined?(Ractor)
+    Database.create(@parms) do |connection|
+      connection.execute("CREATE TABLE TEST (ID INT, \"Name\" VARCHAR(20))")
+      connection.execute("INSERT INTO TEST VALUES (1, 'one')")
+      connection.execute("INSERT INTO TEST VALUES (2, 'two')")
+      parms = @parms.merge(downcase_names: true)
+      ractors = 2.times.map do
+        Ractor.new(parms) do |p|
+          Fb::Database.connect(p) { |conn| conn.query(:hash, "SELECT * FROM TEST ORDER BY ID") }
+        end
+      end
+      ractors.each do |ractor|
+        rows = ractor.respond_to?(:value) ? ractor.value : ractor.take
+        assert_equal [{ 'id' => 1, 'Name' => 'one' }, { 'id' => 2, 'Name' => 'two' }], rows
+      end
+      connection.drop
+    end
+  end
+
+  def test_reconnect
+    Database.create(@parms) do |connection|
+      connection.execute("CREATE TABLE TEST (ID INT)")
+      connection.execute("INSERT INTO TEST VALUES (1)")
+      assert_raises(Fb::Error) { connection.reconnect }
+      db = Database.new(@parms.merge(auto_reconnect: true, reconnect_attempts: 2))
+      assert db.auto_reconnect
+      assert_equal 2, db.reconnect_attempts
+      db.connect do |conn|
+        cursor = conn.execute("SELECT * FROM TEST")
+        assert conn.transaction_started
+        assert_same conn, conn.reconnect
+        assert !conn.transaction_started
+        assert_raises(Fb::Error) { cursor.fetch }
+        assert_equal [[1]], conn.query("SELECT * FROM TEST")
+      end
+      connection.drop
+    end
+  end
+
+  def test_events
+    Database.create(@parms) do |connection|
+      counts = []
+      queue = Queue.new
+      connection.on_event("fb_test_event") { |count| counts << count }
+      connection.on_event("fb_test_event", "fb_test_other", queue: queue)
+      assert_equal({}, connection.wait_for_events(0.2))
+      Database.connect(@parms) do |poster|
+        poster.execute("EXECUTE BLOCK AS BEGIN POST_EVENT 'fb_test_event'; POST_EVENT 'fb_test_event'; END")
+      end
+      assert_equal({ "fb_test_event" => 2 }, connection.wait_for_events(5))
+      assert_equal [2], counts
+      assert_equal ["fb_test_event", 2], queue.pop
+      assert_equal({}, connection.wait_for_events(0.1))
+      connection.cancel_events
+      assert_raises(Fb::Error) { connection.wait_for_events(0) }
+      connection.drop
+    end
+  end
+
+  def test_cached_query
+    Database.create(@parms.merge(query_cache: { max_entries: 2, events: true })) do |connection|
+      connection.execute("create table fb_cache (id int, name varchar(20))")
+      connection.execute("insert into fb_cache values (1, 'one')")
+      sql = "select name from fb_cache where id = ?"
+      first = connection.cached_query(sql, 1, tables: "FB_CACHE")
+      assert_equal [["one"]], first
+      assert first.frozen?
+      assert_same first, connection.cached_query(sql, 1, tables: "FB_CACHE")
+      stats = connection.cache_stats
+      assert_equal 1, stats[:hits]
+      assert_equal 1, stats[:misses]
+      connection.cached_query(sql, 2, tables: "FB_CACHE")
+      connection.cached_query(:hash, sql, 1, tables: "FB_CACHE")
+      assert_equal 1, connection.cache_stats[:evictions]
+      assert_equal 2, connection.cache_stats[:entries]
+      connection.invalidate_cache("FB_CACHE")
+      assert_equal 0, connection.cache_stats[:entries]
+      connection.cached_query(sql, 1, tables: "FB_CACHE")
+      Database.connect(@parms) do |poster|
+        poster.execute("EXECUTE BLOCK AS BEGIN POST_EVENT 'FB_CACHE'; END")
+      end
+      50.times do
+        break if connection.cache_stats[:invalidations] == 3
+        sleep 0.1
+        connection.cached_query("select 1 from rdb$database")
+      end
+      assert_equal 3, connection.cache_stats[:invalidations]
+      entries = connection.cache_stats[:entries]
+      connection.transaction { connection.cached_query(sql, 1) }
+      assert_equal entries, connection.cache_stats[:entries]
+      connection.drop
+    end
+  end
+
+  def test_stats_fingerprint_literals
+    assert_equal "SELECT ?", Stats.fingerprint("select 1e5")
+    assert_equal "SELECT ?", Stats.fingerprint("select 1.5e-3")
+    assert_equal Stats.fingerprint("SELECT 0 FROM T0"), Stats.fingerprint("SELECT 1 FROM T0")
+    assert_equal "SELECT FIRST ? * FROM T", Stats.fingerprint("select first 10 * from t")
+    assert_equal "SELECT * FROM T ROWS ?", Stats.fingerprint("select * from t rows 5")
+    assert_equal "SELECT * FROM T WHERE A BETWEEN ? AND ?", Stats.fingerprint("select * from t where a between 1 and 5")
+    assert_equal "SELECT A1 FROM T2", Stats.fingerprint("select a1 from t2")
+  end
+
+  def test_stats_survives_compaction
+    skip "GC.compact is not available" unless GC.respond_to?(:compact)
+    stats = Stats.new
+    Database.create(@parms.merge(stats: stats)) do |connection|
+      connection.execute("create table fb_stats (id int)")
+      connection.query("select * from fb_stats where id > 1")
+      500.times { |i| "junk#{i}" }
+      GC.compact
+      assert_equal ["CREATE TABLE FB_STATS (ID INT)", "SELECT * FROM FB_STATS WHERE ID > ?"], stats.to_h.keys.sort
+      assert_match(/SELECT \* FROM FB_STATS WHERE ID > \?/, stats.to_prometheus)
+      connection.drop
+    end
+  end
+
+  def test_stats
+    stats = Stats.new
+    Database.create(@parms.merge(stats: stats)) do |connection|
+      assert_same stats, connection.stats
+      connection.execute("create table fb_stats (id int, memo blob sub_type text)")
+      connection.execute("insert into fb_stats values (?, ?)", 1, "one")
+      connection.execute("insert into fb_stats values (?, ?)", 2, "two")
+      2.times { |i| connection.query("select * from fb_stats where id > #{i}") }
+      assert_equal "SELECT * FROM FB_STATS WHERE ID > ?", Stats.fingerprint("select *  from fb_stats\nwhere id > 1")
+      select = stats.to_h["SELECT * FROM FB_STATS WHERE ID > ?"]
+      assert_equal 2, select[:executions]
+      assert_equal 3, select[:rows]
+      [:prepare, :execute, :fetch, :convert, :blob].each do |phase|
+        assert_equal 2, select[phase][:count]
+        assert select[phase][:p50] <= select[phase][:max]
+      end
+      assert_equal 2, stats.to_h["INSERT INTO FB_STATS VALUES (?)"][:rows]
+      text = stats.to_prometheus
+      assert_match(/^fb_statement_seconds_count\{fingerprint="SELECT \* FROM FB_STATS WHERE ID > \?",phase="fetch"\} 2$/, text)
+      assert_match(/^fb_statement_executions_total\{fingerprint="INSERT INTO FB_STATS VALUES \(\?\)"\} 2$/, text)
+      stats.enabled = false
+      connection.query("select * from fb_stats")
+      assert_nil stats.to_h["SELECT * FROM FB_STATS"]
+      stats.reset
+      assert_equal({}, stats.to_h)
+      connection.drop
+    end
+  end
+
+  def test_slow_query_log
+    records = []
+    Database.create(@parms.merge(slow_query_threshold: 0, slow_query_log: ->(r) { records << r })) do |connection|
+      connection.execute("create table fb_slow (id int)")
+      connection.execute("insert into fb_slow values (?)", 7)
+      connection.query("select * from fb_slow where id = ?", 7)
+      record = records.last
+      assert_equal "select * from fb_slow where id = ?", record[:sql]
+      assert_equal [7], record[:params]
+      assert_equal 1, record[:rows]
+      assert_equal [:prepare, :execute, :fetch, :convert], record[:phases].keys
+      assert_in_delta record[:phases].values.sum, record[:elapsed], 1e-9
+      assert_match(/^PLAN/, record[:plan])
+      connection.slow_query_threshold = 3600
+      count = records.size
+      connection.query("select * from fb_slow")
+      assert_equal count, records.size
+      log = StringIO.new
+      connection.slow_query_log = log
+      connection.slow_query_threshold = 0
+      connection.execute("update fb_slow set id = ?", 8)
+      assert_equal [8], JSON.parse(log.string)["params"]
+      connection.slow_query_log = ->(r) { raise "log failed" }
+      stderr, $stderr = $stderr, StringIO.new
+      begin
+        assert_equal 1, connection.execute("update fb_slow set id = ?", 9)
+        assert_match(/log failed/, $stderr.string)
+      ensure
+        $stderr = stderr
+      end
+      connection.slow_query_log = ->(r) { records << r }
+      sql = "update fb_slow set id = ? where id = ? returning id"
+      connection.execute(sql, 1, -1)
+      assert_equal sql, records.last[:sql]
+      assert_equal 0, records.last[:rows]
+      connection.drop
+    end
+  end
+
+  def test_info
+    Database.create(@parms) do |connection|
+      info = connection.info
+      assert_equal 3, info[:sql_dialect]
+      assert info[:page_size] >= 4096
+      assert info[:page_buffers] > 0
+      assert info[:ods_version] >= 11
+      assert info[:next_transaction] >= info[:oldest_active]
+      assert info[:oldest_active] >= info[:oldest_transaction]
+      before = connection.info(:page_fetches)
+      assert_equal [:page_fetches], before.keys
+      connection.query("select * from rdb$relations")
+      assert connection.info(:page_fetches)[:page_fetches] > before[:page_fetches]
+      assert_raises(ArgumentError) { connection.info(:no_such_item) }
+      connection.drop
+    end
+  end
+
+  def test_monitoring_snapshot
+    Database.create(@parms) do |connection|
+      snapshot = connection.monitoring_snapshot
+      assert_equal 1, snapshot.attachments.size
+      attachment = snapshot.attachments.first
+      assert_equal connection.info(:attachment_id)[:attachment_id], attachment.id
+      assert_kind_of Integer, attachment.io.page_fetches
+      assert_kind_of Integer, attachment.records.seq_reads
+      assert_kind_of Integer, attachment.memory.used
+      assert snapshot.transactions.all? { |t| t.attachment_id == attachment.id }
+      assert snapshot.statements.any? { |s| s.sql_text =~ /MON\$STATEMENTS/ }
+      top = snapshot.top_statements(2)
+      assert top.size <= 2
+      assert_equal top, top.sort_by { |s| -s.io.page_fetches.to_i }
+      assert_equal [], snapshot.blocking_chains
+      assert_kind_of Time, snapshot.taken_at
+      connection.drop
+    end
+  end
+
+  def test_services_trace
+    return if @fb_version < 3
+    config = "database\n{\n  enabled = true\n  log_statement_finish = true\n" \
+             "  print_plan = true\n  print_perf = true\n  include_filter = %TRACE_MARKER%\n}\n"
+    Database.create(@parms) do |connection|
+      services = Fb::Services.new(host: @db_host, username: @username, password: @password)
+      events = []
+      tracer = Thread.new do
+        services.trace(config, name: 'test', duration: 3) { |event| events << event }
+      end
+      sleep 1
+      connection.query("SELECT 1 AS trace_marker FROM RDB$DATABASE")
+      assert_kind_of Integer, tracer.value
+      finish = events.find { |e| e.type =~ /EXECUTE_STATEMENT_FINISH/ }
+      assert finish
+      assert_match(/TRACE_MARKER/i, finish.sql)
+      assert_equal 1, finish.records
+      assert_kind_of Float, finish.elapsed
+      assert_equal connection.info(:attachment_id)[:attachment_id], finish.attachment_id
+      assert_kind_of Time, finish.timestamp
+      assert_raises(ArgumentError) { services.trace(config) }
+      services.close
+      connection.drop
+    end
+  end
 end
@@ -161,6 +161,48 @@ class CursorTestCases < FbTestCase
     end
   end
 
+  def test_each_reuse_array
+    Database.create(@parms) do |connection|
+      connection.execute("CREATE TABLE TEST (ID INT, NAME VARCHAR(20))")
+      connection.transaction do
+        3.times { |i| connection.execute("INSERT INTO TEST (ID, NAME) VALUES (?, ?)", i, "name_#{i}") }
+      end
+      connection.execute("SELECT ID, NAME FROM TEST ORDER BY ID") do |cursor|
+        rows = []
+        kept = []
+        cursor.each_reuse do |row|
+          rows << row
+          kept << row.dup
+        end
+        assert_equal 3, rows.size
+        assert rows.all? { |row| row.equal?(rows.first) }
+        assert_equal [[0, "name_0"], [1, "name_1"], [2, "name_2"]], kept
+      end
+      connection.drop
+    end
+  end
+
+  def test_each_reuse_hash
+    Database.create(@parms) do |connection|
+      connection.execute("CREATE TABLE TEST (ID INT, NAME VARCHAR(20))")
+      connection.transaction do
+        3.times { |i| connection.execute("INSERT INTO TEST (ID, NAME) VALUES (?, ?)", i, "name_#{i}") }
+      end
+      connection.execute("SELECT ID, NAME FROM TEST ORDER BY ID") do |cursor|
+        rows = []
+        ids = []
+        cursor.each_reuse :hash do |row|
+          rows << row
+          ids << row["ID"]
+          assert_equal "name_#{row['ID']}", row["NAME"]
+        end
+        assert_equal [0, 1, 2], ids
+        assert rows.all? { |row| row.equal?(rows.first) }
+      end
+      connection.drop
+    end
+  end
+
   def test_fetch_after_nil
     Database.create(@parms) do |connection|
       connection.execute("create generator test_seq");
@@ -245,4 +287,62 @@ class CursorTestCases < FbTestCase
       end
     end
   end
+
+  def test_plan
+    sql_schema = <<-END
+      CREATE TABLE ORDERS (ID INT NOT NULL PRIMARY KEY, CUSTOMER INT);
+      CREATE INDEX IX_ORDERS_CUSTOMER ON ORDERS (CUSTOMER);
+    END
+    Database.create(@parms) do |connection|
+      connection.execute_script(sql_schema)
+      assert_match(/INDEX \(IX_ORDERS_CUSTOMER\)/, connection.plan("SELECT * FROM ORDERS WHERE CUSTOMER = ?"))
+      assert_match(/ORDERS NATURAL/, connection.plan("SELECT * FROM ORDERS"))
+      detailed = connection.explain_plan("SELECT * FROM ORDERS WHERE CUSTOMER = ?")
+      assert_match(/IX_ORDERS_CUSTOMER/, detailed) if detailed
+      assert_raises(Error) { connection.plan("SELECT * FROM NO_SUCH_TABLE") }
+      connection.transaction do
+        assert_match(/PLAN \(ORDERS INDEX/, connection.plan("SELECT * FROM ORDERS WHERE ID = 1"))
+      end
+      cursor = connection.execute("SELECT * FROM ORDERS WHERE ID = ?", 1)
+      assert_match(/PLAN \(ORDERS INDEX/, cursor.plan)
+      cursor.fetchall
+      assert_match(/PLAN/, cursor.plan)
+      cursor.close
+      assert_nil cursor.plan
+      connection.drop
+    end
+  end
+
+  def test_io_stats
+    sql_schema = <<-END
+      CREATE TABLE ORDERS (ID INT NOT NULL PRIMARY KEY, NOTE VARCHAR(20));
+    END
+    Database.create(@parms) do |connection|
+      connection.execute_script(sql_schema)
+      connection.transaction do
+        10.times { |i| connection.execute("INSERT INTO ORDERS (ID, NOTE) VALUES (?, ?)", i, "note #{i}") }
+      end
+      assert !connection.io_stats?
+      connection.execute("SELECT * FROM ORDERS") do |cursor|
+        cursor.fetchall
+        assert_nil cursor.io_stats
+      end
+      connection.io_stats = true
+      connection.execute("SELECT * FROM ORDERS") do |cursor|
+        cursor.fetchall
+        assert_equal 10, cursor.io_stats["ORDERS"][:seq_reads]
+        assert_equal 0, cursor.io_stats["ORDERS"][:idx_reads]
+      end
+      connection.execute("SELECT * FROM ORDERS WHERE ID = ?", 3) do |cursor|
+        cursor.fetchall
+        assert_equal 0, cursor.io_stats["ORDERS"][:seq_reads]
+        assert_equal 1, cursor.io_stats["ORDERS"][:idx_reads]
+      end
+      connection.execute("UPDATE ORDERS SET NOTE = 'x' WHERE ID = ?", 3)
+      assert_equal 1, connection.last_io_stats["ORDERS"][:updates]
+      connection.execute("INSERT INTO ORDERS (ID, NOTE) VALUES (?, ?)", 10, "new")
+      assert_equal 1, connection.last_io_stats["ORDERS"][:inserts]
+      connection.drop
+    end
+  end
 end
@@ -7,6 +7,8 @@ require 'CursorTestCases'
 require 'DataTypesTestCases'
 require 'NumericDataTypesTestCases'
 require 'TransactionTestCases'
+require 'PoolTestCases'
 require 'ReturningTestCases' # RETURNING feature enabled
 require 'EncodingTestCases' if RUBY_VERSION.match?(/^1.9/)
+require 'FiberSchedulerTestCases' if defined?(Fiber.set_scheduler)
 require 'bigdecimal'
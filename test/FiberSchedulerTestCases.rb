@@ -0,0 +1,110 @@
+require 'test/FbTestCases'
+
+# A minimal Fiber scheduler, enough to drive the driver's offloaded calls.
+class FbTestScheduler
+  def initialize
+    @readable = {}
+    @waiting = {}
+    @ready = []
+    @blocked = 0
+    @urgent = IO.pipe
+  end
+
+  def run
+    until @readable.empty? && @waiting.empty? && @ready.empty? && @blocked.zero?
+      timeout = @waiting.values.min&.-(now)
+      timeout = 0 if timeout&.negative? || !@ready.empty?
+      readers, = IO.select(@readable.keys + [@urgent.first], nil, nil, timeout)
+      readers&.each do |io|
+        next @urgent.first.read_nonblock(1024, exception: false) if io == @urgent.first
+        @readable.delete(io)&.resume
+      end
+      @waiting.select { |_, t| t <= now }.each_key { |fiber| @waiting.delete(fiber); fiber.resume }
+      ready, @ready = @ready, []
+      ready.each { |fiber| fiber.resume if fiber.alive? }
+    end
+  end
+
+  def io_wait(io, events, timeout)
+    @readable[io] = Fiber.current
+    Fiber.yield
+    events
+  end
+
+  def kernel_sleep(duration = nil)
+    @waiting[Fiber.current] = now + (duration || 0)
+    Fiber.yield
+  end
+
+  def block(blocker, timeout = nil)
+    @blocked += 1
+    Fiber.yield
+  ensure
+    @blocked -= 1
+  end
+
+  def unblock(blocker, fiber)
+    @ready << fiber
+    @urgent.last.write_nonblock('.', exception: false)
+  end
+
+  def fiber(&block)
+    Fiber.new(blocking: false, &block).tap(&:resume)
+  end
+
+  def close
+    run
+  end
+
+  private
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+end
+
+class FiberSchedulerTestCases < FbTestCase
+  include FbTestCases
+
+  def with_scheduler(&block)
+    Thread.new do
+      Fiber.set_scheduler(FbTestScheduler.new)
+      block.call
+    end.join
+  end
+
+  def test_worker_threads
+    assert_kind_of Integer, Fb.worker_threads
+    saved = Fb.worker_threads
+    Fb.worker_threads = 2
+    assert_equal 2, Fb.worker_threads if saved > 0
+    assert_raises(ArgumentError) { Fb.worker_threads = 0 }
+  ensure
+    Fb.worker_threads = saved if saved && saved > 0
+  end
+
+  def test_concurrent_fibers
+    Database.create(@parms) do |connection|
+      connection.execute("CREATE TABLE TEST (ID INT, NAME VARCHAR(20))")
+    end
+    results = {}
+    with_scheduler do
+      4.times do |i|
+        Fiber.schedule do
+          Database.connect(@parms) do |connection|
+            connection.transaction do
+              connection.execute("INSERT INTO TEST (ID, NAME) VALUES (?, ?)", i, "fiber_#{i}")
+            end
+            results[i] = connection.query("SELECT NAME FROM TEST WHERE ID = ?", i).first
+          end
+        end
+      end
+    end
+    assert_equal 4, results.size
+    4.times { |i| assert_equal ["fiber_#{i}"], results[i] }
+    Database.connect(@parms) do |connection|
+      assert_equal 4, connection.query("SELECT COUNT(*) FROM TEST").first[0]
+      connection.drop
+    end
+  end
+end
@@ -0,0 +1,97 @@
+require 'test/FbTestCases'
+
+class PoolTestCases < FbTestCase
+  include FbTestCases
+
+  def test_warm_up_and_stats
+    Database.create(@parms) do |connection|
+      pool = Pool.new(@parms, min: 2, max: 3)
+      stats = pool.stats
+      assert_equal 2, stats[:size]
+      assert_equal 2, stats[:idle]
+      assert_equal 0, stats[:in_use]
+      assert_equal 2, stats[:created]
+      pool.shutdown
+      assert_equal 0, pool.stats[:size]
+      connection.drop
+    end
+  end
+
+  def test_with
+    Database.create(@parms) do |connection|
+      pool = Pool.new(@parms, max: 2)
+      result = pool.with do |conn|
+        assert conn.ping
+        assert_equal 1, pool.stats[:in_use]
+        conn.query("SELECT 1 FROM RDB$DATABASE").first[0]
+      end
+      assert_equal 1, result
+      assert_equal 0, pool.stats[:in_use]
+      assert_equal 1, pool.stats[:idle]
+      first = pool.checkout
+      pool.checkin(first)
+      assert_raises(Fb::Error) { pool.checkin(first) }
+      pool.shutdown
+      assert_raises(Fb::Error) { pool.checkout }
+      connection.drop
+    end
+  end
+
+  def test_checkout_timeout
+    Database.create(@parms) do |connection|
+      pool = Pool.new(@parms, max: 1, timeout: 0.1)
+      conn = pool.checkout
+      assert_raises(Pool::TimeoutError) { pool.checkout }
+      assert_equal 1, pool.stats[:timeouts]
+      waiter = Thread.new { pool.with { |c| c.equal?(conn) } }
+      sleep 0.05
+      pool.checkin(conn)
+      assert waiter.value
+      assert_equal 1, pool.stats[:waits]
+      pool.shutdown
+      connection.drop
+    end
+  end
+
+  def test_checkin_rolls_back
+    Database.create(@parms) do |connection|
+      connection.execute("CREATE TABLE TEST (ID INT)")
+      pool = Pool.new(@parms, max: 1)
+      conn = pool.checkout
+      conn.transaction
+      conn.execute("INSERT INTO TEST VALUES (1)")
+      pool.checkin(conn)
+      assert !conn.transaction_started
+      pool.with { |c| assert_equal 0, c.query("SELECT COUNT(*) FROM TEST").first[0] }
+      pool.shutdown
+      connection.drop
+    end
+  end
+
+  def test_closed_connection_leaves_pool
+    Database.create(@parms) do |connection|
+      pool = Pool.new(@parms, max: 2)
+      conn = pool.checkout
+      conn.close
+      pool.checkin(conn)
+      assert_equal 0, pool.stats[:size]
+      pool.shutdown
+      connection.drop
+    end
+  end
+
+  def test_reap
+    Database.create(@parms) do |connection|
+      pool = Pool.new(@parms, min: 1, max: 3, idle_timeout: 0.05)
+      a = pool.checkout
+      b = pool.checkout
+      pool.checkin(a)
+      pool.checkin(b)
+      sleep 0.1
+      assert_equal 1, pool.reap
+      assert_equal 1, pool.stats[:size]
+      pool.shutdown
+      connection.drop
+    end
+  end
+end
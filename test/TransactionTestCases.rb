@@ -254,6 +254,36 @@ class TransactionTestCases < FbTestCase
     end
   end
 
+  def test_transaction_options_compiled
+    options = TransactionOptions.new(:isolation => :read_committed, :rec_version => true,
+                                     :lock_timeout => 1, :no_auto_undo => true)
+    assert options.frozen?
+    assert_equal "READ COMMITTED RECORD_VERSION LOCK TIMEOUT 1 NO AUTO UNDO", options.to_s
+    assert_equal options.tpb, TransactionOptions.new(options.to_s).tpb
+    assert_raises(Error) { TransactionOptions.new("NO WAIT LOCK TIMEOUT 1") }
+    assert_raises(ArgumentError) { TransactionOptions.new(:bogus => true) }
+    begin
+      snapshot = TransactionOptions.new(:isolation => :snapshot, :snapshot_number => 5)
+    rescue Error
+      snapshot = nil  # client library older than Firebird 4
+    end
+    if snapshot
+      assert_equal "SNAPSHOT AT NUMBER 5", snapshot.to_s
+      assert_equal snapshot.tpb, TransactionOptions.new("SNAPSHOT AT NUMBER 5").tpb
+      assert_equal snapshot.tpb, TransactionOptions.new("SNAPSHOT AT SNAPSHOT NUMBER 5").tpb
+    end
+    Database.create(@parms) do |conn|
+      conn.execute("CREATE TABLE TEST (ID INT)")
+      conn.transaction(options) { conn.execute("INSERT INTO TEST VALUES (1)") }
+      conn.transaction(:access => :read, :wait => false) do
+        assert_equal [[1]], conn.query("SELECT COUNT(*) FROM TEST")
+      end
+      conn.transaction("AUTO COMMIT") { conn.execute("INSERT INTO TEST VALUES (2)") }
+      assert_equal [[2]], conn.query("SELECT COUNT(*) FROM TEST")
+      conn.drop
+    end
+  end
+
   def test_auto_and_explicit_transactions
     sql_schema = "CREATE TABLE TEST (ID INT, NAME VARCHAR(20))"
     sql_insert = "INSERT INTO TEST (ID, NAME) VALUES (?, ?)"
@@ -271,4 +301,188 @@ class TransactionTestCases < FbTestCase
       assert !conn.transaction_started
     end
   end
+
+  def test_savepoint
+    Database.create(@parms) do |conn|
+      conn.execute("CREATE TABLE TEST (ID INT)")
+      assert_raises(Error) { conn.savepoint { } }
+      conn.transaction do
+        conn.execute("INSERT INTO TEST VALUES (1)")
+        assert_raises RuntimeError do
+          conn.savepoint do
+            conn.execute("INSERT INTO TEST VALUES (2)")
+            assert_equal :inner, conn.savepoint { conn.execute("INSERT INTO TEST VALUES (3)"); :inner }
+            raise "undo"
+          end
+        end
+        assert_equal [[1]], conn.query("SELECT COUNT(*) FROM TEST")
+        conn.savepoint { conn.execute("INSERT INTO TEST VALUES (4)") }
+      end
+      assert_equal [[1], [4]], conn.query("SELECT ID FROM TEST ORDER BY ID")
+      conn.drop
+    end
+  end
+
+  def test_distributed_transaction
+    parms2 = @parms.merge(:database => @parms[:database].sub(/\.fdb\z/, '_2.fdb'))
+    Database.create(@parms) do |conn1|
+      Database.create(parms2) do |conn2|
+        [conn1, conn2].each { |conn| conn.execute("CREATE TABLE TEST (ID INT)") }
+        result = Fb.distributed_transaction(conn1, conn2) do |tr1, tr2|
+          assert_raises(Error) { tr1.commit }
+          tr1.execute("INSERT INTO TEST VALUES (1)")
+          tr2.execute("INSERT INTO TEST VALUES (2)")
+          :done
+        end
+        assert_equal :done, result
+        assert_raises RuntimeError do
+          Fb.distributed_transaction(conn1, conn2, :options => "READ COMMITTED") do |tr1, tr2|
+            tr1.execute("INSERT INTO TEST VALUES (3)")
+            raise "abort"
+          end
+        end
+        assert_equal [[1]], conn1.query("SELECT ID FROM TEST")
+        assert_equal [[2]], conn2.query("SELECT ID FROM TEST")
+        assert_equal [], conn1.limbo_transactions
+        conn2.drop
+      end
+      conn1.drop
+    end
+  end
+
+  def test_transaction_retry
+    Database.create(@parms) do |conn1|
+      conn1.execute("CREATE TABLE TEST (ID INT, N INT)")
+      conn1.execute("INSERT INTO TEST VALUES (1, 0)")
+      Database.connect(@parms) do |conn2|
+        conn2.transaction
+        conn2.execute("UPDATE TEST SET N = N + 1 WHERE ID = 1")
+        error = assert_raises(Error) do
+          conn1.transaction("NO WAIT") { conn1.execute("UPDATE TEST SET N = N + 1 WHERE ID = 1") }
+        end
+        assert error.retryable?
+        assert_includes error.gds_codes, error.gdscode
+        assert_equal error.error_code, error.sqlcode
+        attempts = []
+        # read committed, so the retry sees conn2's commit made during attempt 1
+        conn1.transaction("READ COMMITTED NO WAIT", :retry => 2, :backoff => 0.01) do |attempt|
+          attempts << attempt
+          conn2.commit if attempt == 1
+          conn1.execute("UPDATE TEST SET N = N + 1 WHERE ID = 1")
+        end
+        assert_equal [0, 1], attempts
+        assert_equal [[2]], conn1.query("SELECT N FROM TEST")
+      end
+      conn1.drop
+    end
+  end
+
+  def test_transaction_objects
+    Database.create(@parms) do |conn|
+      conn.execute("CREATE TABLE TEST (ID INT)")
+      writer = conn.start_transaction
+      reader = conn.start_transaction("READ ONLY SNAPSHOT")
+      assert !conn.transaction_started
+      writer.execute("INSERT INTO TEST VALUES (1)")
+      assert_equal [[0]], reader.query("SELECT COUNT(*) FROM TEST")
+      writer.commit
+      assert !writer.active?
+      assert_raises(Fb::Error) { writer.query("SELECT COUNT(*) FROM TEST") }
+      assert_equal [[0]], reader.query("SELECT COUNT(*) FROM TEST")
+      reader.rollback
+      assert_equal [[1]], conn.query("SELECT COUNT(*) FROM TEST")
+      conn.drop
+    end
+  end
+
+  def test_transaction_object_closes_cursors
+    Database.create(@parms) do |conn|
+      conn.execute("CREATE TABLE TEST (ID INT)")
+      conn.execute("INSERT INTO TEST VALUES (1)")
+      tr = conn.start_transaction
+      cursor = tr.execute("SELECT ID FROM TEST")
+      tr.commit
+      assert_raises(Fb::Error) { cursor.fetch }
+      tr = conn.start_transaction
+      cursor = tr.execute("SELECT ID FROM TEST")
+      tr.rollback
+      assert_raises(Fb::Error) { cursor.fetch }
+      conn.drop
+    end
+  end
+
+  def test_transaction_object_block
+    Database.create(@parms) do |conn|
+      conn.execute("CREATE TABLE TEST (ID INT)")
+      result = conn.start_transaction do |tr|
+        assert_same conn, tr.connection
+        tr.execute("INSERT INTO TEST VALUES (1)")
+        tr.query("SELECT COUNT(*) FROM TEST")
+      end
+      assert_equal [[1]], result
+      assert_raises RuntimeError do
+        conn.start_transaction do |tr|
+          tr.execute("INSERT INTO TEST VALUES (2)")
+          raise "abort"
+        end
+      end
+      assert_equal [[1]], conn.query("SELECT COUNT(*) FROM TEST")
+      conn.drop
+    end
+  end
+
+  def test_autocommit_read
+    Database.create(@parms.merge(:autocommit_read => true)) do |conn|
+      conn.execute("CREATE TABLE TEST (ID INT)")
+      assert_equal [[0]], conn.query("SELECT COUNT(*) FROM TEST")
+      conn.execute("INSERT INTO TEST VALUES (1)")
+      assert_equal [[1]], conn.query("SELECT COUNT(*) FROM TEST")
+      cursor = conn.execute("SELECT ID FROM TEST")
+      assert !conn.transaction_started
+      conn.execute("INSERT INTO TEST VALUES (2)")
+      assert_equal [1], cursor.fetch
+      cursor.close
+      assert_equal [[2]], conn.query("SELECT COUNT(*) FROM TEST")
+      conn.transaction
+      conn.execute("INSERT INTO TEST VALUES (3)")
+      assert_equal [[3]], conn.query("SELECT COUNT(*) FROM TEST")
+      conn.rollback
+      assert_equal [[2]], conn.query("SELECT COUNT(*) FROM TEST")
+      conn.drop
+    end
+  end
+
+  def test_autocommit_write
+    [:tpb, :retaining].each do |mode|
+      Database.create(@parms.merge(:autocommit_write => mode, :autocommit_batch => 3)) do |conn|
+        conn.execute("CREATE TABLE TEST (ID INT)")
+        5.times { |i| conn.execute("INSERT INTO TEST VALUES (?)", i) }
+        assert !conn.transaction_started
+        assert_equal [[5]], conn.query("SELECT COUNT(*) FROM TEST")
+        conn.execute("DELETE FROM TEST WHERE ID = 0")
+        conn.flush
+        Database.connect(@parms) do |other|
+          assert_equal [[4]], other.query("SELECT COUNT(*) FROM TEST")
+        end
+        conn.transaction do
+          conn.execute("DELETE FROM TEST")
+        end
+        assert_equal [[0]], conn.query("SELECT COUNT(*) FROM TEST")
+        conn.drop
+      end
+    end
+  end
+
+  def test_autocommit_write_idle
+    Database.create(@parms.merge(:autocommit_write => :retaining, :autocommit_idle => 0.2)) do |conn|
+      conn.execute("CREATE TABLE TEST (ID INT)")
+      conn.execute("INSERT INTO TEST VALUES (1)")
+      Database.connect(@parms) do |other|
+        assert_equal [[0]], other.query("SELECT COUNT(*) FROM TEST")
+        sleep 1
+        assert_equal [[1]], other.query("SELECT COUNT(*) FROM TEST")
+      end
+      conn.drop
+    end
+  end
 end